@@ -1,11 +1,16 @@
 /*
  * Timer Subsystem
- * Full implementation with PIT, TSC, and callback support
+ * PIT tick counter, TSC timestamps, and callbacks on kernel hrtimers
  */
 
 #define ARCH_X86_64
 
 #include "hal.h"
+#include "spinlock.h"
+#include "hrtimer.h"
+
+extern void* kmalloc(size_t size);
+extern void kfree(void* ptr);
 
 /* PIT (Programmable Interval Timer) constants */
 #define PIT_FREQUENCY 1193182
@@ -21,26 +26,27 @@
 #define PIT_CMD_RW_BOTH 0x30  /* Read/Write LSB then MSB */
 #define PIT_CMD_CHANNEL0 0x00
 
-/* Maximum timers */
-#define MAX_TIMERS 64
-
-/* Timer entry */
-typedef struct timer_entry {
-    bool active;
+/*
+ * Callback timer. Each one is its own hrtimer, so arming and firing cost
+ * O(log n) in the per-CPU tree and nothing is scanned on the tick. The
+ * list only exists for hal_timer_cancel_all().
+ */
+typedef struct hal_timer {
+    struct hrtimer timer;           /* First, see hal_timer_fire() */
+    struct hal_timer* next;
+    struct hal_timer** pprev;       /* NULL once off the list */
     bool periodic;
     uint64_t interval_ns;
-    uint64_t next_fire_tick;
     timer_callback_t callback;
     void* context;
-} timer_entry_t;
+} hal_timer_t;
 
 static uint64_t timer_ticks = 0;
 static uint64_t timer_frequency = 1000;  // 1000 Hz = 1ms resolution
 static bool timer_initialized = false;
 
-/* Timer callback table */
-static timer_entry_t timers[MAX_TIMERS];
-static uint32_t timer_count = 0;
+static hal_timer_t* hal_timers = NULL;
+static spinlock_t hal_timers_lock = SPINLOCK_INIT;
 
 /* I/O port access - use HAL functions from header */
 
@@ -60,13 +66,6 @@ static void pit_set_frequency(uint32_t hz) {
     outb(PIT_CHANNEL0, (uint8_t)((divisor >> 8) & 0xFF));
 }
 
-/* Read TSC (Time Stamp Counter) */
-static inline uint64_t read_tsc(void) {
-    uint32_t lo, hi;
-    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
-    return ((uint64_t)hi << 32) | lo;
-}
-
 /* Initialize timer subsystem */
 status_t hal_timer_init(void) {
     if (timer_initialized) {
@@ -76,11 +75,6 @@ status_t hal_timer_init(void) {
     /* Initialize timer state */
     timer_ticks = 0;
     timer_frequency = 1000;  /* 1000 Hz = 1ms per tick */
-    timer_count = 0;
-
-    for (uint32_t i = 0; i < MAX_TIMERS; i++) {
-        timers[i].active = false;
-    }
 
     /* Configure PIT to desired frequency */
     pit_set_frequency(1000);  /* 1000 Hz */
@@ -90,34 +84,9 @@ status_t hal_timer_init(void) {
     return STATUS_OK;
 }
 
-/* Timer interrupt handler (called by IRQ handler) */
+/* Timer interrupt handler (called by IRQ handler); callbacks run from hrtimers */
 void hal_timer_tick(void) {
     timer_ticks++;
-
-    /* Process timers */
-    for (uint32_t i = 0; i < MAX_TIMERS; i++) {
-        timer_entry_t* timer = &timers[i];
-
-        if (!timer->active) {
-            continue;
-        }
-
-        if (timer_ticks >= timer->next_fire_tick) {
-            /* Timer fired - call callback */
-            if (timer->callback) {
-                timer->callback(timer->context);
-            }
-
-            if (timer->periodic) {
-                /* Reschedule periodic timer */
-                uint64_t interval_ticks = hal_timer_ns_to_ticks(timer->interval_ns);
-                timer->next_fire_tick = timer_ticks + interval_ticks;
-            } else {
-                /* One-shot timer - deactivate */
-                timer->active = false;
-            }
-        }
-    }
 }
 
 /* Get current tick count */
@@ -140,83 +109,91 @@ uint64_t hal_timer_ns_to_ticks(uint64_t ns) {
     return (ns * timer_frequency) / 1000000000ULL;
 }
 
-/* Find free timer slot */
-static int32_t find_free_timer(void) {
-    for (uint32_t i = 0; i < MAX_TIMERS; i++) {
-        if (!timers[i].active) {
-            return (int32_t)i;
-        }
+static void hal_timer_unlink(hal_timer_t* t) {
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
     }
-    return -1;
+    t->pprev = NULL;
 }
 
-/* Setup one-shot timer */
-status_t hal_timer_oneshot(uint64_t ns, timer_callback_t callback, void* context) {
-    if (!callback) {
-        return STATUS_INVALID;
-    }
+static enum hrtimer_restart hal_timer_fire(struct hrtimer* timer) {
+    hal_timer_t* t = (hal_timer_t*)timer;
+    unsigned long flags;
+    bool owned;
 
-    int32_t slot = find_free_timer();
-    if (slot < 0) {
-        return STATUS_NOMEM;
-    }
+    t->callback(t->context);
 
-    timer_entry_t* timer = &timers[slot];
-    timer->active = true;
-    timer->periodic = false;
-    timer->interval_ns = ns;
-    timer->callback = callback;
-    timer->context = context;
+    if (t->periodic) {
+        hrtimer_forward(timer, ktime_get_ns(), t->interval_ns);
+        return HRTIMER_RESTART;
+    }
 
-    /* Calculate when timer should fire */
-    uint64_t interval_ticks = hal_timer_ns_to_ticks(ns);
-    timer->next_fire_tick = timer_ticks + interval_ticks;
+    /* hal_timer_cancel_all() frees the entries it took off the list */
+    spin_lock_irqsave(&hal_timers_lock, &flags);
+    owned = t->pprev != NULL;
+    if (owned) {
+        hal_timer_unlink(t);
+    }
+    spin_unlock_irqrestore(&hal_timers_lock, flags);
 
-    return STATUS_OK;
+    if (owned) {
+        kfree(t);
+    }
+    return HRTIMER_NORESTART;
 }
 
-/* Setup periodic timer */
-status_t hal_timer_periodic(uint64_t ns, timer_callback_t callback, void* context) {
-    if (!callback) {
+static status_t hal_timer_arm(uint64_t ns, bool periodic, timer_callback_t callback, void* context) {
+    unsigned long flags;
+
+    if (!callback || (periodic && ns == 0)) {
         return STATUS_INVALID;
     }
 
-    int32_t slot = find_free_timer();
-    if (slot < 0) {
+    hal_timer_t* t = (hal_timer_t*)kmalloc(sizeof(*t));
+    if (!t) {
         return STATUS_NOMEM;
     }
 
-    timer_entry_t* timer = &timers[slot];
-    timer->active = true;
-    timer->periodic = true;
-    timer->interval_ns = ns;
-    timer->callback = callback;
-    timer->context = context;
+    hrtimer_init(&t->timer, hal_timer_fire);
+    t->periodic = periodic;
+    t->interval_ns = ns;
+    t->callback = callback;
+    t->context = context;
 
-    /* Calculate when timer should fire */
-    uint64_t interval_ticks = hal_timer_ns_to_ticks(ns);
-    timer->next_fire_tick = timer_ticks + interval_ticks;
+    spin_lock_irqsave(&hal_timers_lock, &flags);
+    t->next = hal_timers;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    hal_timers = t;
+    t->pprev = &hal_timers;
+    spin_unlock_irqrestore(&hal_timers_lock, flags);
 
+    hrtimer_start(&t->timer, ns, HRTIMER_MODE_REL);
     return STATUS_OK;
 }
 
+/* Setup one-shot timer */
+status_t hal_timer_oneshot(uint64_t ns, timer_callback_t callback, void* context) {
+    return hal_timer_arm(ns, false, callback, context);
+}
+
+/* Setup periodic timer */
+status_t hal_timer_periodic(uint64_t ns, timer_callback_t callback, void* context) {
+    return hal_timer_arm(ns, true, callback, context);
+}
+
 /* Sleep for nanoseconds (busy wait using TSC) */
 void hal_timer_sleep_ns(uint64_t ns) {
     if (ns == 0) {
         return;
     }
 
-    /* Use TSC for high-resolution timing */
-    uint64_t start = read_tsc();
-
-    /* Estimate TSC frequency (assumes 2.4 GHz CPU) */
-    /* In production, would calibrate TSC frequency */
-    uint64_t tsc_frequency = 2400000000ULL;  /* 2.4 GHz */
+    /* TSC deadline on the calibrated clock */
+    uint64_t target = ktime_to_tsc(ktime_get_ns() + ns);
 
-    uint64_t tsc_delta = (ns * tsc_frequency) / 1000000000ULL;
-    uint64_t target = start + tsc_delta;
-
-    while (read_tsc() < target) {
+    while (rdtsc_ordered() < target) {
         __asm__ volatile("pause");  /* Hint to CPU that we're spinning */
     }
 }
@@ -233,17 +210,26 @@ void hal_timer_sleep_ms(uint64_t ms) {
 
 /* Get high-resolution timestamp */
 uint64_t hal_timer_get_timestamp_ns(void) {
-    /* Use TSC for high-resolution timing */
-    uint64_t tsc = read_tsc();
-
-    /* Convert TSC to nanoseconds (assumes 2.4 GHz) */
-    /* In production, would use calibrated TSC frequency */
-    return (tsc * 1000) / 2400;
+    return ktime_get_ns();
 }
 
 /* Cancel all timers */
 void hal_timer_cancel_all(void) {
-    for (uint32_t i = 0; i < MAX_TIMERS; i++) {
-        timers[i].active = false;
+    unsigned long flags;
+
+    spin_lock_irqsave(&hal_timers_lock, &flags);
+    hal_timer_t* list = hal_timers;
+    for (hal_timer_t* t = list; t; t = t->next) {
+        t->pprev = NULL;
+    }
+    hal_timers = NULL;
+    spin_unlock_irqrestore(&hal_timers_lock, flags);
+
+    /* Waits out callbacks still running on other CPUs */
+    while (list) {
+        hal_timer_t* next = list->next;
+        hrtimer_cancel(&list->timer);
+        kfree(list);
+        list = next;
     }
 }
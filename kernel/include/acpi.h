@@ -15,13 +15,20 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include "../include/list.h"
-#include "../include/mutex.h"
-#include "../include/timer.h"
-#include "../include/workqueue.h"
+#include "linux/list.h"
+#include "timer.h"
 
-// Maximum number of CPUs supported for power management
+// Maximum number of CPUs supported for power management; smp.h's wins
+#ifndef MAX_CPUS
 #define MAX_CPUS                64
+#endif
+
+#ifndef asmlinkage
+#define asmlinkage
+#endif
+#ifndef __user
+#define __user
+#endif
 
 // Power management system calls
 #define __NR_acpi_sleep         400
@@ -39,6 +46,8 @@
 #define ACPI_SIG_SSDT   "SSDT"
 #define ACPI_SIG_HPET   "HPET"
 #define ACPI_SIG_MCFG   "MCFG"
+#define ACPI_SIG_SRAT   "SRAT"
+#define ACPI_SIG_SLIT   "SLIT"
 
 /* RSDP (Root System Description Pointer) */
 typedef struct acpi_rsdp {
@@ -142,6 +151,64 @@ typedef struct acpi_madt_lx2apic {
     uint32_t processor_uid;
 } __attribute__((packed)) acpi_madt_lx2apic_t;
 
+/* SRAT (System Resource Affinity Table) */
+typedef struct acpi_srat {
+    acpi_table_header_t header;
+    uint32_t table_revision;
+    uint64_t reserved;
+    uint8_t entries[];
+} __attribute__((packed)) acpi_srat_t;
+
+/* SRAT Entry Types */
+#define ACPI_SRAT_CPU_AFFINITY      0   /* Processor Local APIC Affinity */
+#define ACPI_SRAT_MEM_AFFINITY      1   /* Memory Affinity */
+#define ACPI_SRAT_X2APIC_AFFINITY   2   /* Processor Local x2APIC Affinity */
+
+/* SRAT Entry Flags */
+#define ACPI_SRAT_ENABLED           (1 << 0)
+#define ACPI_SRAT_HOTPLUGGABLE      (1 << 1)
+
+/* Processor Local APIC Affinity Entry */
+typedef struct acpi_srat_cpu_affinity {
+    acpi_madt_entry_header_t header;
+    uint8_t proximity_domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t local_sapic_eid;
+    uint8_t proximity_domain_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed)) acpi_srat_cpu_affinity_t;
+
+/* Memory Affinity Entry */
+typedef struct acpi_srat_mem_affinity {
+    acpi_madt_entry_header_t header;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) acpi_srat_mem_affinity_t;
+
+/* Processor Local x2APIC Affinity Entry */
+typedef struct acpi_srat_x2apic_affinity {
+    acpi_madt_entry_header_t header;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_affinity_t;
+
+/* SLIT (System Locality Information Table) */
+typedef struct acpi_slit {
+    acpi_table_header_t header;
+    uint64_t locality_count;
+    uint8_t entry[];            /* locality_count x locality_count matrix */
+} __attribute__((packed)) acpi_slit_t;
+
 /* FADT (Fixed ACPI Description Table) */
 typedef struct acpi_fadt {
     acpi_table_header_t header;
@@ -258,6 +325,15 @@ uint32_t acpi_get_irq_override_count(void);
 acpi_irq_override_t *acpi_get_irq_override(uint32_t index);
 uint32_t acpi_map_irq_to_gsi(uint8_t irq);
 
+/* NUMA Topology (SRAT/SLIT); the node interface is in acpi_numa.h */
+#include "acpi_numa.h"
+
+extern acpi_srat_t *acpi_srat;
+extern acpi_slit_t *acpi_slit;
+
+int acpi_parse_srat(void);
+int acpi_parse_slit(void);
+
 /* Memory Mapping */
 void *acpi_map_physical(uint64_t phys_addr, size_t size);
 void acpi_unmap_physical(void *virt_addr, size_t size);
@@ -0,0 +1,35 @@
+/**
+ * ACPI NUMA topology (SRAT/SLIT) for LimitlessOS
+ *
+ * Kept apart from acpi.h so that the memory manager can use the node
+ * layout without the rest of the ACPI interface. acpi.h includes it.
+ *
+ * Copyright (c) 2024 LimitlessOS Project
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ACPI_MAX_NUMA_NODES         16
+#define ACPI_MAX_NUMA_MEMBLKS       32
+#define ACPI_NUMA_LOCAL_DISTANCE    10
+#define ACPI_NUMA_REMOTE_DISTANCE   20
+
+/* A physical memory range and the node (not proximity domain) owning it */
+typedef struct acpi_numa_memblk {
+    uint64_t start;
+    uint64_t end;               /* Exclusive */
+    uint32_t node;
+    bool hotpluggable;
+} acpi_numa_memblk_t;
+
+int acpi_numa_init(void);
+uint32_t acpi_numa_node_count(void);
+uint32_t acpi_numa_memblk_count(void);
+const acpi_numa_memblk_t *acpi_numa_get_memblk(uint32_t index);
+int acpi_numa_cpu_to_node(uint32_t cpu_index);
+uint32_t acpi_numa_distance(uint32_t from, uint32_t to);
+uint64_t acpi_numa_node_memory(uint32_t node);
+uint64_t acpi_numa_node_cpus(uint32_t node);
@@ -89,6 +89,7 @@
 
 /* APIC MSR Addresses */
 #define MSR_APIC_BASE           0x1B
+#define MSR_IA32_TSC_DEADLINE   0x6E0
 #define MSR_X2APIC_APICID       0x802
 #define MSR_X2APIC_VERSION      0x803
 #define MSR_X2APIC_TPR          0x808
@@ -167,6 +168,9 @@ void apic_timer_start(uint32_t initial_count);
 void apic_timer_stop(void);
 uint32_t apic_timer_get_count(void);
 void apic_calibrate_timer(void);
+bool cpu_has_tsc_deadline(void);
+void apic_timer_set_deadline(uint64_t tsc);    /* 0 disarms */
+void apic_timer_interrupt(void);               /* APIC_VECTOR_TIMER handler */
 static inline void apic_timer_set_periodic(uint32_t ticks) { apic_timer_start(ticks); }
 
 /* IPI (Inter-Processor Interrupt) Functions */
@@ -0,0 +1,129 @@
+/*
+ * LimitlessOS - High-Resolution Timers and the Tick
+ *
+ * Time is kept in nanoseconds since boot, read from the TSC. hrtimers
+ * fire at an absolute time on that clock: each CPU keeps its pending
+ * hrtimers in an rbtree ordered by expiry and programs its local APIC
+ * timer for the leftmost one, in TSC-deadline mode where the CPU has it
+ * and as a one-shot count otherwise. There is no periodic interrupt.
+ *
+ * The scheduler tick is itself an hrtimer (tick_sched_timer), firing
+ * every TICK_NSEC to advance jiffies, run the timer wheel and call
+ * scheduler_tick(). On an idle CPU, tick_nohz_idle_enter() pushes it
+ * out to the next timer that is actually due, or cancels it outright,
+ * so an idle CPU sleeps until there is work instead of waking HZ times
+ * a second (dynticks).
+ */
+
+#ifndef KERNEL_HRTIMER_H
+#define KERNEL_HRTIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "rbtree.h"
+
+#define NSEC_PER_USEC   1000ULL
+#define NSEC_PER_MSEC   1000000ULL
+#define NSEC_PER_SEC    1000000000ULL
+#define KTIME_MAX       UINT64_MAX
+
+/* ==================== Clock ==================== */
+
+/* TSC frequency, measured against the PIT at boot */
+extern uint32_t tsc_khz;
+
+static inline uint64_t rdtsc_ordered(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Nanoseconds since clocksource_init() */
+uint64_t ktime_get_ns(void);
+
+/* TSC value at which the clock reads ns */
+uint64_t ktime_to_tsc(uint64_t ns);
+
+void clocksource_init(void);
+
+/* ==================== hrtimers ==================== */
+
+enum hrtimer_restart {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART,        /* Requeue at timer->expires, see hrtimer_forward() */
+};
+
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS,       /* expires is a ktime_get_ns() value */
+    HRTIMER_MODE_REL,       /* expires is relative to now */
+};
+
+struct hrtimer_cpu_base;
+
+struct hrtimer {
+    struct rb_node node;
+    uint64_t expires;
+    enum hrtimer_restart (*function)(struct hrtimer *timer);
+    struct hrtimer_cpu_base *base;  /* Base it is (or was last) queued on */
+    bool queued;
+};
+
+/*
+ * Callbacks run from the APIC timer interrupt with interrupts off. A
+ * callback may re-arm its own timer with hrtimer_start() or by moving
+ * expires and returning HRTIMER_RESTART.
+ */
+void hrtimer_init(struct hrtimer *timer, enum hrtimer_restart (*function)(struct hrtimer *));
+void hrtimer_start(struct hrtimer *timer, uint64_t expires, enum hrtimer_mode mode);
+
+/*
+ * hrtimer_try_to_cancel() returns 1 if the timer was queued, 0 if it was
+ * not, and -1 if its callback is running on another CPU right now.
+ * hrtimer_cancel() waits that callback out and returns whether the
+ * timer was queued.
+ */
+int hrtimer_try_to_cancel(struct hrtimer *timer);
+int hrtimer_cancel(struct hrtimer *timer);
+
+/* Move expires past now in steps of interval; returns the steps taken */
+uint64_t hrtimer_forward(struct hrtimer *timer, uint64_t now, uint64_t interval);
+
+static inline bool hrtimer_is_queued(const struct hrtimer *timer) {
+    return timer->queued;
+}
+
+/* APIC timer interrupt handler, after the EOI */
+void hrtimer_interrupt(void);
+
+/* Set up this CPU's base and its APIC timer */
+void hrtimers_init_cpu(uint32_t cpu);
+
+/* ==================== Tick ==================== */
+
+/* Start the tick on this CPU; the boot CPU calls it after clocksource_init() */
+void tick_setup_cpu(uint32_t cpu);
+
+/*
+ * Idle loop hooks, called with interrupts off. Enter may stop the tick
+ * and puts RCU into its extended quiescent state; exit undoes both.
+ * The common hardware interrupt exit (isr.c) calls tick_nohz_irq_exit()
+ * so a stopped tick is re-aimed after any handler that queued a timer.
+ */
+void tick_nohz_idle_enter(void);
+void tick_nohz_idle_exit(void);
+void tick_nohz_irq_exit(void);
+
+/* Dynticks can be switched off for debugging ("nohz=off") */
+extern bool tick_nohz_enabled;
+
+typedef struct tick_stats {
+    uint64_t idle_calls;        /* Passes through tick_nohz_idle_enter() */
+    uint64_t idle_sleeps;       /* ...that stopped the tick */
+    uint64_t idle_sleeptime_ns;
+    uint64_t ticks;             /* tick_sched_timer() runs */
+} tick_stats_t;
+
+void tick_get_stats(uint32_t cpu, tick_stats_t *stats);
+
+#endif /* KERNEL_HRTIMER_H */
@@ -23,4 +23,7 @@ struct idt_ptr {
 // Initializes the Interrupt Descriptor Table.
 void idt_init();
 
+// Loads the same table on an application processor.
+void idt_load(void);
+
 #endif // IDT_H
@@ -2,6 +2,7 @@
 #define ISR_H
 
 #include <common.h>
+#include <percpu.h>
 
 // A struct describing a processor state pushed to the stack by an ISR.
 // This is what the interrupt handler receives as an argument.
@@ -19,4 +20,13 @@ typedef void (*isr_t)(registers_t*);
 // Allows us to register a custom interrupt handler for a given interrupt.
 void register_interrupt_handler(uint8_t n, isr_t handler);
 
+// Hardware interrupt nesting depth of this CPU. Exceptions and system
+// calls run in the context of the task that raised them and don't count.
+DECLARE_PER_CPU(uint32_t, hardirq_count);
+
+static inline bool in_interrupt(void)
+{
+    return this_cpu_read(hardirq_count) != 0;
+}
+
 #endif // ISR_H
@@ -177,7 +177,7 @@ u64 kaslr_get_slide(void);
 void vmm_init(const boot_info_t* bi);
 void interrupts_init(void);
 void timer_init(void);
-void acpi_init(const boot_info_t* bi);
+int acpi_init(void);
 void pci_init(void);
 void storage_init(void);
 void vfs_init(void);
@@ -257,7 +257,6 @@ static inline const char* k_strstr(const char* h, const char* n){ if(!h||!n||!*n
 /* Signal constants */
 #define SIGTERM 15
 #define SIGKILL 9
-#define SPINLOCK_INIT 0
 
 /* Standard library functions */
 int snprintf(char* buffer, size_t size, const char* format, ...);
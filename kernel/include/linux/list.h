@@ -33,6 +33,11 @@ static inline void list_add(struct list_head *new, struct list_head *head)
     __list_add(new, head, head->next);
 }
 
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head->prev, head);
+}
+
 static inline void __list_del(struct list_head * prev, struct list_head * next)
 {
     next->prev = prev;
@@ -52,4 +57,12 @@ static inline int list_empty(const struct list_head *head)
 #define list_entry(ptr, type, member) \
     ((type *)((char *)(ptr)-(unsigned long)(&((type *)0)->member)))
 
+#define list_first_entry(ptr, type, member) \
+    list_entry((ptr)->next, type, member)
+
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = list_first_entry(&pos->member, __typeof__(*pos), member))
+
 #endif
\ No newline at end of file
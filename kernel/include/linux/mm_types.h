@@ -7,6 +7,7 @@
 
 // From page-flags.h
 #define PG_locked 0
+#define PG_buddy  1   /* Heads a free block, order in 'private' */
 
 /*
  * A page descriptor.
@@ -17,6 +18,7 @@ typedef struct page {
     struct list_head lru;       /* List of free pages */
     atomic_t _refcount;
     void *virtual;              /* Kernel virtual address (for highmem) */
+    unsigned long private;      /* Buddy order while PG_buddy is set */
 } page_t;
 
 #endif
\ No newline at end of file
@@ -6,21 +6,59 @@
 
 #define MAX_ORDER 11
 
+#ifndef MAX_NUMNODES
+#define NODES_SHIFT     4
+#define MAX_NUMNODES    (1 << NODES_SHIFT)
+#endif
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE    -1
+#endif
+
+#define LOCAL_DISTANCE  10
+#define REMOTE_DISTANCE 20
+
 struct free_area {
     struct list_head    free_list;
     unsigned long       nr_free;
 };
 
+#define PCP_MAX_CPUS 64
+
+/*
+ * Per-CPU cache of free order-0 pages. Hot pages are added/taken at the
+ * head of the list, cold pages at the tail.
+ */
+struct per_cpu_pages {
+    struct list_head    list;
+    int                 count;      /* Pages on the list */
+    int                 low;        /* Refill when count <= low */
+    int                 high;       /* Drain a batch when count > high */
+    int                 batch;      /* Pages moved per refill/drain */
+    unsigned long       hits;
+    unsigned long       misses;
+} __attribute__((aligned(64)));
+
 typedef struct zone {
     spinlock_t      lock;
     const char      *name;
+    int             node;           /* Owning NUMA node */
     unsigned long   zone_start_pfn;
     unsigned long   spanned_pages;
     unsigned long   present_pages;
     unsigned long   managed_pages;
+    unsigned long   free_pages;
     struct free_area free_area[MAX_ORDER];
+    struct per_cpu_pages pageset[PCP_MAX_CPUS];
 } zone_t;
 
+/*
+ * Fallback order for allocations that start on a node: its own zone, then
+ * the other nodes' zones by increasing SLIT distance. NULL terminated.
+ */
+typedef struct zonelist {
+    zone_t *_zones[MAX_NUMNODES + 1];
+} zonelist_t;
+
 typedef struct pglist_data {
     zone_t node_zones[1]; // Simplified: one zone per node
     int nr_zones;
@@ -28,6 +66,12 @@ typedef struct pglist_data {
     unsigned long node_start_pfn;
     unsigned long node_spanned_pages;
     unsigned long node_present_pages;
+    zonelist_t node_zonelist;
+    /* Allocation counters, updated without locking */
+    unsigned long numa_hit;         /* Intended for this node, got it */
+    unsigned long numa_miss;        /* Intended elsewhere, got this node */
+    unsigned long numa_foreign;     /* Intended for this node, got another */
+    unsigned long interleave_hit;   /* Interleave policy got this node */
 } pglist_data_t;
 
 typedef pglist_data_t pg_data_t;
@@ -0,0 +1,60 @@
+/*
+ * LimitlessOS - Transparent Huge Pages
+ *
+ * Anonymous regions are faulted in as 2 MiB page-directory mappings when
+ * the aligned 2 MiB range lies inside the region and nothing is mapped
+ * there yet. khugepaged later collapses ranges that were populated with
+ * 4 KiB pages, and partial munmap/mprotect split huge mappings back into
+ * 4 KiB entries.
+ */
+
+#ifndef KERNEL_MM_HUGE_MEMORY_H
+#define KERNEL_MM_HUGE_MEMORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmm.h"
+
+#define THP_NEVER   0
+#define THP_ALWAYS  1
+
+typedef struct thp_stats {
+    uint64_t fault_alloc;       // Huge pages mapped at fault time
+    uint64_t fault_fallback;    // Eligible faults that fell back to 4 KiB
+    uint64_t collapse_alloc;    // Huge pages built by khugepaged
+    uint64_t collapse_failed;   // Collapse attempts abandoned
+    uint64_t split;             // Huge mappings broken into 4 KiB entries
+    uint64_t cow_copy;          // Shared huge pages copied on a write fault
+    uint64_t pages_scanned;     // Page-table entries examined by khugepaged
+} thp_stats_t;
+
+// Starts khugepaged; call once the scheduler is up
+void thp_init(void);
+void thp_set_mode(int mode);
+int thp_get_mode(void);
+// Most unpopulated entries khugepaged accepts in a range it collapses
+void thp_set_max_ptes_none(unsigned int max_ptes_none);
+void thp_get_stats(thp_stats_t* stats);
+
+// Fault path: 0 if a huge page now maps vaddr, -1 to fall back to 4 KiB
+int thp_handle_fault(vmm_aspace_t* space, vmm_region_t* region, vaddr_t vaddr);
+
+// Write fault on a huge page shared copy-on-write since a fork: 0 once
+// vaddr is mapped writable, -1 if the write must fail
+int thp_handle_cow_fault(vmm_aspace_t* space, vaddr_t vaddr);
+
+// Replace the huge mapping covering vaddr with 512 4 KiB entries; a
+// huge page still shared after a fork is copied first
+int thp_split_huge_pmd(vmm_aspace_t* space, vaddr_t vaddr);
+// Unmap and free the whole huge page covering vaddr
+int thp_zap_huge_pmd(vmm_aspace_t* space, vaddr_t vaddr);
+// Copy a 4 KiB-mapped 2 MiB range into a huge page (haddr 2 MiB aligned)
+int thp_collapse(vmm_aspace_t* space, vaddr_t haddr);
+
+// Address spaces khugepaged walks
+void khugepaged_add(vmm_aspace_t* space);
+void khugepaged_remove(vmm_aspace_t* space);
+// Scan up to 'pages' page-table entries; returns how many were scanned
+unsigned int khugepaged_scan(unsigned int pages);
+
+#endif // KERNEL_MM_HUGE_MEMORY_H
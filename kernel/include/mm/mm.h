@@ -26,6 +26,40 @@ void pmm_free_page(paddr_t paddr);
 paddr_t pmm_alloc_pages(size_t pages);
 void pmm_free_pages(paddr_t paddr, size_t pages);
 
+// --- NUMA ---
+
+// Node topology comes from ACPI SRAT/SLIT; without them there is one node.
+int pmm_nr_nodes(void);
+int pmm_node_of_cpu(unsigned int cpu);
+int pmm_page_to_nid(paddr_t paddr);
+int pmm_node_distance(int from, int to);
+paddr_t pmm_alloc_pages_node(int nid, size_t pages);
+int pmm_get_node_stats(int nid, unsigned long* free_pages,
+                       unsigned long* numa_hit, unsigned long* numa_miss);
+// Node-local placement and buddy split/merge; 0 on success, <0 on failure
+int pmm_numa_selftest(void);
+
+// Per-task memory policies. Values match MPOL_* in mm/advanced.h.
+#define MPOL_DEFAULT    0   // Local node first, then nearest nodes
+#define MPOL_PREFERRED  1   // Lowest node in the mask first, then nearest
+#define MPOL_BIND       2   // Only nodes in the mask, nearest to the CPU first
+#define MPOL_INTERLEAVE 3   // Round-robin over the nodes in the mask
+#define MPOL_MAX        4
+#define MPOL_LOCAL      MPOL_DEFAULT
+
+typedef uint64_t nodemask_t;
+
+struct mempolicy {
+    uint16_t mode;
+    uint16_t il_next;       // Last node handed out by MPOL_INTERLEAVE
+    nodemask_t nodes;
+};
+
+// Policy of the running task, NULL before the scheduler is up
+struct mempolicy* get_task_mempolicy(void);
+int set_mempolicy(int mode, nodemask_t nodes);
+int get_mempolicy(int* mode, nodemask_t* nodes);
+
 
 // --- Virtual Memory Manager (VMM) ---
 
@@ -44,29 +78,30 @@ uint64_t* vmm_get_kernel_pml4();
 
 // --- Slab Allocator ---
 
-typedef struct slab_s {
-    struct slab_s* next;
-    void* free_list;
-    size_t inuse;
-    size_t capacity;
-} slab_t;
-
-typedef struct {
-    const char* name;
-    size_t object_size;
-    size_t object_align;
-    slab_t* slabs_full;
-    slab_t* slabs_partial;
-    slab_t* slabs_free;
-} kmem_cache_t;
+// Caches are opaque; the layout (per-CPU magazines, depot, slab lists)
+// is private to mm/slab.c.
+typedef struct kmem_cache kmem_cache_t;
+
+typedef struct kmem_cache_stats {
+    uint64_t magazine_allocs;   // Allocations served from a CPU magazine
+    uint64_t magazine_frees;    // Frees absorbed by a CPU magazine
+    uint64_t depot_exchanges;   // Magazine swaps with the depot
+    uint64_t slab_allocs;       // Allocations that reached the slab layer
+    uint64_t slab_frees;        // Frees that reached the slab layer
+    size_t nr_slabs;            // Slabs currently owned by the cache
+    size_t objs_per_slab;
+} kmem_cache_stats_t;
 
 void slab_init(void);
 kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align);
 void* kmem_cache_alloc(kmem_cache_t* cache);
 void kmem_cache_free(kmem_cache_t* cache, void* obj);
+void kmem_cache_shrink(kmem_cache_t* cache);
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
 
 // General purpose kernel allocation functions
 void* kmalloc(size_t size);
 void kfree(void* ptr);
+size_t ksize(const void* ptr);
 
 #endif // KERNEL_MM_H
\ No newline at end of file
@@ -10,13 +10,50 @@
 /* Initialize PMM with memory region */
 void pmm_init(uint64_t mem_start, uint64_t mem_size);
 
+/* Largest block order handed out by the buddy allocator (2^10 pages = 4MB) */
+#define PMM_MAX_ORDER 10
+
 /* Allocate/free pages (returns physical address) */
 uint64_t pmm_alloc_page(void);
 void pmm_free_page(uint64_t addr);
 uint64_t pmm_alloc_pages(uint32_t order);
 void pmm_free_pages(uint64_t addr, uint32_t order);
 
+/* Turn an allocated 2^order block into 2^order pages that can be freed
+ * one at a time (e.g. after splitting a huge mapping) */
+void pmm_split_pages(uint64_t addr, uint32_t order);
+
+/* Page reference counts for frames mapped by several address spaces
+ * (copy-on-write). Freeing drops one reference; the last one frees. */
+void pmm_page_ref(uint64_t addr);
+uint32_t pmm_page_refcount(uint64_t addr);
+
+/* Cache-cold variants: pages are taken from / returned to the cold end
+ * of the per-CPU page list */
+uint64_t pmm_alloc_page_cold(void);
+void pmm_free_page_cold(uint64_t addr);
+
+/* Per-CPU page lists (pcp) in front of the buddy allocator */
+typedef struct pmm_pcp_stats {
+    uint32_t count;     /* Pages currently on the list */
+    uint64_t hits;      /* Order-0 allocations served without the zone lock */
+    uint64_t misses;    /* Allocations that had to refill first */
+    uint64_t refills;
+    uint64_t drains;
+} pmm_pcp_stats_t;
+
+int pmm_pcp_set_watermarks(uint32_t low, uint32_t high, uint32_t batch);
+void pmm_pcp_drain_local(void);
+void pmm_pcp_drain_all(void);
+void pmm_pcp_get_stats(uint32_t cpu, pmm_pcp_stats_t *stats);
+
+/* Page descriptor back-pointers (slab allocator object lookup) */
+void pmm_set_page_owner(uint64_t addr, uint32_t order, void *owner);
+void *pmm_get_page_owner(uint64_t addr);
+int pmm_get_block_order(uint64_t addr);
+
 /* Get statistics */
 void pmm_get_stats(uint64_t *total, uint64_t *free);
+uint32_t pmm_get_free_blocks(uint32_t order);
 
 #endif /* PMM_SIMPLE_H */
@@ -129,26 +129,68 @@ typedef enum {
     RX_HANDLER_PASS        /* Pass to network stack */
 } rx_handler_result_t;
 
-/* NAPI structure for efficient interrupt handling */
+/*
+ * NAPI structure for efficient interrupt handling
+ *
+ * The driver's RX interrupt masks itself and calls napi_schedule(). The
+ * per-CPU softirq thread then calls poll() with a budget of up to weight
+ * packets. A poll that finishes under budget calls napi_complete(), which
+ * re-enables the interrupt through irq_enable. One that uses the whole
+ * budget stays scheduled and is polled again, so under load the device
+ * runs polled with its interrupt off.
+ */
 typedef struct napi_struct {
-    struct napi_struct* next;
+    struct napi_struct* next;      /* Device's NAPI instances */
+    struct napi_struct* poll_next; /* Per-CPU poll list */
     struct net_device* dev;
     int (*poll)(struct napi_struct* napi, int budget);
+    void (*irq_enable)(struct napi_struct* napi);  /* Unmask RX interrupt */
     int weight;
     int quota;
-    uint32_t state;
+    uint32_t state;                /* NAPI_STATE_* */
     uint32_t gro_count;
     sk_buff_head_t gro_list;       /* GRO packet list */
 } napi_struct_t;
 
-/* Network device transmit queue */
+#define NAPI_STATE_SCHED    0x1    /* Scheduled or being polled */
+#define NAPI_STATE_DISABLE  0x2    /* napi_disable() waiting */
+
+#define NAPI_POLL_WEIGHT    64     /* Default packets per poll */
+
+/* Per-CPU receive processing counters */
+typedef struct softnet_stat {
+    uint64_t processed;            /* Packets handed up by polls */
+    uint64_t dropped;              /* Backlog full */
+    uint64_t time_squeeze;         /* Rounds ended with work left */
+} softnet_stat_t;
+
+/* Per-queue counters, kept apart from the device totals so CPUs on
+ * different queues do not share a cache line */
+typedef struct netdev_queue_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t errors;
+} netdev_queue_stats_t;
+
+/* Network device transmit or receive queue */
 typedef struct netdev_queue {
     struct net_device* dev;
     sk_buff_head_t queue;          /* Pending packets */
+    uint32_t qlen;
+    uint16_t index;                /* Position in the device's array */
+    uint8_t stopped;               /* TX: driver ring full */
     uint32_t state;                /* Queue state */
     uint64_t trans_start;          /* Last transmission time */
     uint64_t trans_timeout;        /* Transmission timeout */
-} netdev_queue_t;
+    netdev_queue_stats_t stats;
+} __attribute__((aligned(64))) netdev_queue_t;
+
+/* RSS indirection table entries: hash -> RX queue */
+#define NETDEV_RSS_INDIR_SIZE   128
+
+/* RFS flow table entries, shared by all devices; a power of two */
+#define NETDEV_RFS_FLOWS        4096
 
 /* Network device operations - driver must implement these */
 typedef struct net_device_ops {
@@ -241,6 +283,11 @@ typedef struct net_device {
     
     uint16_t num_rx_queues;        /* Number of RX queues */
     uint16_t real_num_rx_queues;   /* Currently active RX queues */
+    netdev_queue_t* rx_queue;      /* RX queue array */
+    
+    /* Flow steering */
+    uint16_t* xps_map;             /* Per CPU: TX queue it sends on */
+    uint16_t rss_indir[NETDEV_RSS_INDIR_SIZE];  /* Programmed into RSS NICs */
     
     /* NAPI */
     napi_struct_t* napi_list;      /* NAPI instances */
@@ -311,15 +358,35 @@ void netdev_tx_completed_queue(netdev_queue_t* queue, uint32_t pkts, uint32_t by
 int netif_rx(sk_buff_t* skb);
 int netif_receive_skb(sk_buff_t* skb);
 void netif_rx_schedule(net_device_t* dev);
+void netdev_deliver_skb(sk_buff_t* skb);    /* To the protocol, no queueing */
 
 /* NAPI functions */
+void netif_napi_add(net_device_t* dev, napi_struct_t* napi,
+                    int (*poll)(napi_struct_t* napi, int budget), int weight);
 void napi_enable(napi_struct_t* napi);
 void napi_disable(napi_struct_t* napi);
 void napi_schedule(napi_struct_t* napi);
 int napi_poll(napi_struct_t* napi, int budget);
 void napi_complete(napi_struct_t* napi);
 void napi_gro_receive(napi_struct_t* napi, sk_buff_t* skb);
+void napi_gro_flush(napi_struct_t* napi);
 sk_buff_t* napi_gro_frags(napi_struct_t* napi);
+void netdev_softnet_stats(softnet_stat_t* out);  /* Summed over CPUs */
+
+/* Flow steering. XPS maps each CPU to a TX queue; the RSS indirection
+ * table maps flow hashes to RX queues for drivers to program. RFS steers
+ * a flow's receive processing to the CPU last seen consuming it, which
+ * the socket layer records with netdev_rfs_record(). */
+int netdev_set_xps(net_device_t* dev, uint32_t cpu, uint16_t queue);
+uint16_t netdev_rss_queue(const net_device_t* dev, uint32_t hash);
+void netdev_rfs_record(uint32_t hash);
+void netdev_rfs_forget(uint32_t hash);
+
+/* Offloads. GRO merges a flow's in-order TCP segments during a NAPI poll;
+ * napi_gro_flush() delivers whatever is held. skb_gso_segment() cuts a
+ * TCP super-segment (shinfo->gso_size set) into a list of gso_size
+ * packets for devices without TSO. */
+sk_buff_t* skb_gso_segment(sk_buff_t* skb);
 
 /* Device state management */
 void netif_start_queue(net_device_t* dev);
@@ -29,6 +29,9 @@ extern "C" {
 struct sk_buff;
 struct net_device;
 struct socket;
+struct kmem_cache;
+struct skb_pool;
+struct page_cache_page;
 
 /* sk_buff flags */
 #define SKB_FLAG_CLONED         (1 << 0)  /* Buffer is cloned */
@@ -39,6 +42,7 @@ struct socket;
 #define SKB_FLAG_GSO            (1 << 5)  /* Generic segmentation offload */
 #define SKB_FLAG_TSO            (1 << 6)  /* TCP segmentation offload */
 #define SKB_FLAG_URGENT         (1 << 7)  /* Urgent data */
+#define SKB_FLAG_HASH           (1 << 8)  /* hash holds the flow hash */
 
 /* sk_buff priority levels */
 #define SKB_PRIORITY_CONTROL    0    /* Control packets (highest) */
@@ -76,21 +80,35 @@ struct socket;
 #define SKB_MIN_HEADROOM   64                  /* Minimum headroom */
 #define SKB_MIN_TAILROOM   32                  /* Minimum tailroom */
 
-/* Scatter-gather list entry */
+/* Per-CPU pool caches */
+#define SKB_CACHE_SIZE     64    /* Free skbs a CPU keeps per pool */
+#define SKB_CACHE_BATCH    16    /* skbs moved per refill or drain */
+#define SKB_NR_POOLS       3     /* Default pools: small, MTU, jumbo */
+
+#define MAX_SKB_FRAGS      17    /* 64KB of payload in 4KB pages, plus one */
+
+#define SKB_RSS_KEY_LEN    40    /* Toeplitz key, as RSS NICs take it */
+
+/* shinfo->gso_type */
+#define SKB_GSO_TCPV4      (1 << 0)  /* TCP over IPv4, cut at gso_size */
+
+/* Scatter-gather list entry. The skb holds a reference on the page,
+ * dropped when the buffer is freed. */
 typedef struct skb_frag {
-    void* page;           /* Page pointer */
+    struct page_cache_page* page;   /* Page-cache page */
     uint32_t offset;      /* Offset in page */
     uint32_t size;        /* Fragment size */
 } skb_frag_t;
 
-/* Shared info structure (for scatter-gather, GSO, etc.) */
+/* Shared info structure (for scatter-gather, GSO, etc.). It sits right
+ * after the linear data, and clones share it with the original. */
 typedef struct skb_shared_info {
     uint32_t nr_frags;                  /* Number of fragments */
     uint32_t gso_size;                  /* GSO segment size */
     uint16_t gso_segs;                  /* Number of GSO segments */
     uint16_t gso_type;                  /* GSO type */
-    skb_frag_t frags[17];               /* Fragment array (17 = MAX_SKB_FRAGS) */
-    struct sk_buff* frag_list;          /* Linked list of fragments */
+    skb_frag_t frags[MAX_SKB_FRAGS];    /* Paged data, after the linear part */
+    struct sk_buff* frag_list;          /* Buffers whose data follows the frags */
 } skb_shared_info_t;
 
 /* Socket buffer structure - the heart of network packet management */
@@ -130,7 +148,8 @@ typedef struct sk_buff {
     
     /* Packet information */
     uint16_t protocol;                  /* Ethernet protocol type */
-    uint16_t queue_mapping;             /* TX queue to use */
+    uint16_t queue_mapping;             /* TX queue to use, or RX queue it came in on */
+    uint32_t hash;                      /* Flow hash, see skb_get_hash() */
     uint8_t pkt_type;                   /* Packet classification */
     uint8_t ip_summed;                  /* Checksum status */
     uint8_t priority;                   /* QoS priority */
@@ -157,17 +176,20 @@ typedef struct sk_buff {
     /* Shared info (for frags) */
     skb_shared_info_t* shinfo;
     
+    /* Allocation origin */
+    struct skb_pool* pool;              /* Owning pool, NULL if kmalloc'd */
+    struct sk_buff* orig;               /* Clones: buffer whose data is shared */
+    
 } sk_buff_t;
 
-/* sk_buff memory pool for fast allocation */
+/* sk_buff memory pool for fast allocation. Each object is the sk_buff
+ * header followed by its data, as one cache-aligned slab object. The
+ * default pools also keep up to SKB_CACHE_SIZE free skbs per CPU, which
+ * alloc and free reach with local interrupts masked and no lock. */
 typedef struct skb_pool {
-    sk_buff_t* free_list;               /* Free buffer list */
-    uint32_t total;                     /* Total buffers in pool */
-    uint32_t free;                      /* Free buffers */
-    uint32_t size;                      /* Buffer size */
-    uint32_t allocated;                 /* Total allocated */
-    uint32_t freed;                     /* Total freed */
-    uint32_t failed;                    /* Failed allocations */
+    struct kmem_cache* cache;           /* Backing slab cache */
+    uint32_t size;                      /* Data bytes per buffer */
+    uint32_t id;                        /* Per-CPU cache slot; SKB_NR_POOLS if none */
 } skb_pool_t;
 
 /* Global sk_buff statistics */
@@ -179,6 +201,8 @@ typedef struct skb_stats {
     uint64_t pool_hits;                 /* Pool allocation hits */
     uint64_t pool_misses;               /* Pool allocation misses */
     uint64_t oom_count;                 /* Out of memory errors */
+    uint64_t cache_refills;             /* Per-CPU cache refills from the slab */
+    uint64_t cache_drains;              /* Per-CPU cache drains to the slab */
 } skb_stats_t;
 
 /* ==================== Core sk_buff Functions ==================== */
@@ -189,7 +213,16 @@ sk_buff_t* alloc_skb_with_headroom(uint32_t size, uint32_t headroom, uint32_t pr
 void free_skb(sk_buff_t* skb);
 void kfree_skb(sk_buff_t* skb);  /* Kernel free wrapper */
 
-/* Reference counting */
+/* Bulk allocation and deallocation, for driver RX refill and TX completion.
+ * skb_alloc_batch() fills skbs[] with up to n buffers of at least size bytes
+ * after SKB_MIN_HEADROOM and returns how many it got. kfree_skb_list()
+ * drops a reference on every skb of a ->next chain. */
+uint32_t skb_alloc_batch(uint32_t size, sk_buff_t** skbs, uint32_t n);
+void kfree_skb_list(sk_buff_t* list);
+
+/* Reference counting. free_skb() and kfree_skb() drop a reference; the
+ * buffer goes when the last one does. A clone holds a reference on the
+ * buffer it shares. */
 sk_buff_t* skb_get(sk_buff_t* skb);      /* Increment refcount */
 void skb_put_ref(sk_buff_t* skb);        /* Decrement refcount */
 int skb_shared(const sk_buff_t* skb);    /* Check if shared */
@@ -239,15 +272,57 @@ static inline int skb_is_nonlinear(const sk_buff_t* skb) {
     return skb->data_len != 0;
 }
 
-/* Checksum functions */
+/* Bytes in the linear part; the other data_len bytes are in frags */
+static inline uint32_t skb_headlen(const sk_buff_t* skb) {
+    return skb->len - skb->data_len;
+}
+
+static inline skb_shared_info_t* skb_shinfo(const sk_buff_t* skb) {
+    return skb->shinfo;
+}
+
+/* A TCP super-segment, built by TCP or merged by GRO, that is cut into
+ * gso_size segments on the way to a device without TSO */
+static inline int skb_is_gso(const sk_buff_t* skb) {
+    return skb->shinfo && skb->shinfo->gso_size != 0;
+}
+
+static inline int skb_has_frag_list(const sk_buff_t* skb) {
+    return skb->shinfo && skb->shinfo->frag_list != NULL;
+}
+
+/* Flow hash from the NIC's RSS, or 0 to have skb_get_hash() compute it */
+static inline void skb_set_hash(sk_buff_t* skb, uint32_t hash) {
+    skb->hash = hash;
+    if (hash) {
+        skb->flags |= SKB_FLAG_HASH;
+    } else {
+        skb->flags &= ~SKB_FLAG_HASH;
+    }
+}
+
+/* Flow hashing. skb_get_hash() returns the Toeplitz hash of the IPv4
+ * addresses and TCP/UDP ports under skb_rss_key, the same value an RSS
+ * NIC programmed with that key reports; 0 if the packet is not IPv4. */
+extern const uint8_t skb_rss_key[SKB_RSS_KEY_LEN];
+uint32_t skb_get_hash(sk_buff_t* skb);
+uint32_t skb_toeplitz_hash(const uint8_t* key, const uint8_t* data, uint32_t len);
+
+/* Checksum functions. skb_checksum() adds len bytes from offset, frags
+ * included, to csum and returns the 16-bit folded, uncomplemented sum;
+ * csum_partial() does the same for a flat buffer. */
 void skb_checksum_complete(sk_buff_t* skb);
 uint32_t skb_checksum(const sk_buff_t* skb, int offset, int len, uint32_t csum);
+uint32_t csum_partial(const void* buf, uint32_t len, uint32_t csum);
 void skb_copy_and_checksum_bits(const sk_buff_t* skb, int offset, uint8_t* to, int len, uint32_t csum);
 
-/* Fragment handling */
-int skb_add_frag(sk_buff_t* skb, void* page, uint32_t offset, uint32_t size);
+/* Fragment handling. skb_add_frag() appends size bytes at offset in page
+ * and takes over the caller's page reference. */
+int skb_add_frag(sk_buff_t* skb, struct page_cache_page* page, uint32_t offset, uint32_t size);
 void skb_coalesce_frags(sk_buff_t* skb);
 int skb_linearize(sk_buff_t* skb);  /* Convert nonlinear to linear */
+int skb_copy_bits(const sk_buff_t* skb, uint32_t offset, void* to, uint32_t len);
+void skb_frag_list_append(sk_buff_t* skb, sk_buff_t* frag, sk_buff_t** last);
 
 /* Queue management */
 typedef struct sk_buff_head {
@@ -166,6 +166,7 @@ int close(int sockfd);
 
 /* Data transmission */
 ssize_t send(int sockfd, const void* buf, size_t len, int flags);
+ssize_t sendfile(int out_fd, int in_fd, uint64_t* offset, size_t count);
 ssize_t recv(int sockfd, void* buf, size_t len, int flags);
 ssize_t sendto(int sockfd, const void* buf, size_t len, int flags,
                const struct sockaddr* dest_addr, uint32_t addrlen);
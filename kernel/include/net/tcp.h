@@ -10,5 +10,7 @@ int  tcp_bind(sock_t s, const void* addr, u32 addrlen);
 int  tcp_listen(sock_t s, int backlog);
 int  tcp_connect(sock_t s, const void* addr, u32 addrlen);
 int  tcp_send(sock_t s, const void* buf, u32 len);
+struct vnode;
+long tcp_sendfile(sock_t s, struct vnode* vn, u64* pos, u32 count);  /* Zero-copy from the page cache */
 int  tcp_recv(sock_t s, void* buf, u32 len);
 int  tcp_close(sock_t s);
\ No newline at end of file
@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include "net/skbuff.h"
 #include "net/ip.h"
+#include "rcu.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -253,9 +254,18 @@ typedef struct tcp_sock {
     /* Back-pointer to parent socket structure */
     void* sock;
     
-    /* Hash table linkage */
+    /* Flow hash of received segments; RFS steers them to the reader */
+    uint32_t rxhash;
+    
+    /* Hash table linkage. Lookups walk hash_next under RCU; hash_prev
+     * is for writers only. */
     struct tcp_sock* hash_next;
     struct tcp_sock* hash_prev;
+    struct rcu_head rcu;    /* Deferred free after unhashing */
+    
+    /* The owner's reference plus one per lookup in progress; the socket
+     * is freed, after a grace period, once this drops to zero */
+    uint32_t refcnt;
     
 } tcp_sock_t;
 
@@ -279,6 +289,7 @@ typedef struct tcp_stats {
 /* Socket operations */
 tcp_sock_t* tcp_socket_create(void);
 void tcp_socket_destroy(tcp_sock_t* sk);
+void tcp_sock_put(tcp_sock_t* sk);
 int tcp_bind(tcp_sock_t* sk, ipv4_addr_t addr, uint16_t port);
 int tcp_listen(tcp_sock_t* sk, int backlog);
 int tcp_connect(tcp_sock_t* sk, ipv4_addr_t addr, uint16_t port);
@@ -291,6 +302,14 @@ int tcp_recv(tcp_sock_t* sk, void* data, size_t len, int flags);
 int tcp_sendmsg(tcp_sock_t* sk, sk_buff_t* skb);
 int tcp_recvmsg(tcp_sock_t* sk, void* buf, size_t len);
 
+/* Zero-copy transmit: segments carry page-cache pages as frags. Both
+ * return bytes sent, which the send window may cut short. */
+struct page_cache_page;
+struct vnode;
+int tcp_sendpages(tcp_sock_t* sk, struct page_cache_page** pages, uint32_t offset,
+                  uint32_t len, uint16_t flags);
+long tcp_sendfile(tcp_sock_t* sk, struct vnode* vn, uint64_t* pos, uint32_t count);
+
 /* Packet processing */
 int tcp_rcv(sk_buff_t* skb);
 int tcp_process(tcp_sock_t* sk, sk_buff_t* skb);
@@ -346,7 +365,7 @@ void tcp_keepalive_timer(tcp_sock_t* sk);
 void tcp_delack_timer(tcp_sock_t* sk);
 void tcp_timewait_timer(tcp_sock_t* sk);
 
-/* Socket lookup */
+/* Socket lookup; a socket found comes with a reference for tcp_sock_put() */
 tcp_sock_t* tcp_lookup(ipv4_addr_t saddr, uint16_t sport, ipv4_addr_t daddr, uint16_t dport);
 tcp_sock_t* tcp_lookup_listen(ipv4_addr_t daddr, uint16_t dport);
 void tcp_hash(tcp_sock_t* sk);
@@ -3,171 +3,152 @@
 #include "vfs.h"
 #include "vmm.h"
 /*
- * Page Cache Subsystem (Phase 1)
+ * Page Cache
  * =============================================================
  * Overview
  * --------
- * A minimal file page cache providing:
- *   - O(1) (expected) lookup via hash table keyed by (vnode*, page_index)
- *   - Global LRU list for eviction ordering
- *   - Explicit dirty tracking; write-back occurs only on:
- *       * page_cache_flush_vnode(vn)
- *       * page_cache_sync_all()
- *       * sys_munmap() of a file-backed region (best-effort whole-vnode flush)
- *   - Integration paths:
- *       * VFS read/write: page-oriented buffering to reduce storage IO
- *       * mmap + demand fault: pages mapped RO first; write fault triggers
- *         page_cache_remap_writable() which marks DIRTY
+ * File pages cached in memory, shared by VFS I/O and mmap:
+ *   - One page_cache_mapping per cached vnode. Its pages live in a 64-way
+ *     radix tree indexed by page number in the file, so lookups cost a few
+ *     pointer hops regardless of file size.
+ *   - Lookups are lock-free (see Concurrency).
+ *   - Every tree node keeps DIRTY and WRITEBACK tag bitmaps that summarise
+ *     its subtree; writeback walks only the tagged paths.
+ *   - Reclaim uses two LRU lists. Pages enter the inactive list; a second
+ *     access promotes them to the active list. When the inactive list is
+ *     shorter than the active one, the oldest active pages are aged back.
+ *     Insertions and promotions are collected in small per-CPU batches and
+ *     applied under the LRU lock one batch at a time.
  *
- * Not (yet) implemented:
- *   - Readahead / prefetch
- *   - Background write-back daemon or throttling
- *   - Range-based flush (flushes are vnode-wide or triggered by unmap)
- *   - Memory pressure driven shrinker beyond simple target eviction calls
- *   - Concurrency safety (callers currently serialized by higher layers)
+ * Concurrency
+ * -----------
+ *   - Readers walk the tree without locks. Tree nodes and page descriptors
+ *     come from type-stable pools (a released node is only ever reused as
+ *     another node, emptied first), so a walk through a tree being torn
+ *     down reads stale but well-formed memory.
+ *     A reader takes a reference only if the count is non-zero, then checks
+ *     the descriptor still describes (mapping, index); otherwise it retries.
+ *   - Insert/remove and tag updates serialize on the mapping's tree lock.
+ *     Removal first freezes the count from 1 (tree only) to 0, so pinned
+ *     pages are never removed.
+ *   - LRU lists are protected by one global lock, taken once per batch.
  *
- * Design & Invariants
- * -------------------
- *   - Each cached page record (page_cache_page) represents exactly one file page.
- *   - refcnt > 0 while mapped or held by callers after page_cache_get(); caller
- *     must invoke page_cache_release() exactly once per successful get.
- *   - LRU ordering: pages move to tail when looked up (unless LOCKED); on load
- *     they enter tail; eviction scans from head skipping refcnt>0 or DIRTY pages.
- *   - DIRTY flag set via:
- *       * page_cache_mark_dirty()
- *       * page_cache_remap_writable() (write-fault path for mmap)
- *       * VFS write path (after modifying in-memory contents, caller may mark)
- *   - LOCKED flag transient during initial load/population to prevent concurrent
- *     consumers from racing onto an incompletely loaded page (Phase 1: minimal usage).
- *   - Physical page memory is assumed directly accessible via a direct kernel map.
- *
- * Eviction Policy
- * ---------------
- * Simple LRU: page_cache_evict_some(target) walks from list head removing clean,
- * unreferenced (refcnt==0, !DIRTY) pages until either target reached or none eligible.
- * DIRTY pages are skipped (must be flushed first) and referenced pages are skipped.
- * A future enhancement could incorporate a two-handed clock or active/inactive lists.
- *
- * Dirty Handling
- * --------------
- *   - Write faults: mmap maps pages read-only initially (even if PROT_WRITE requested).
- *     On first write attempt, fault handler calls page_cache_remap_writable(), which:
- *       1. Ensures the page is present (loads if needed)
- *       2. Remaps with PTE_WRITABLE
- *       3. Sets DIRTY flag.
- *   - VFS writes (buffered): calling code updates the page contents and invokes
- *     page_cache_mark_dirty().
- *   - Unmap flush: sys_munmap() flushes entire vnode for simplicity (range flush TBD).
- *   - Explicit flush APIs: page_cache_flush_vnode() (per file) and page_cache_sync_all().
- *
- * Public API Summary
+ * Reference counting
  * ------------------
- *   Initialization:
- *     void page_cache_init(size_t max_pages);
- *   Lookup / Pin:
- *     int page_cache_get(vnode_t* vn, u64 index, page_cache_page_t** out, bool* newly_loaded);
- *     void page_cache_release(page_cache_page_t* pg);
- *   State Mutation:
- *     void page_cache_mark_dirty(page_cache_page_t* pg);
- *     int  page_cache_flush_vnode(vnode_t* vn);
- *     int  page_cache_sync_all(void);
- *     size_t page_cache_evict_some(size_t target);
- *   Mapping Helpers (mmap/fault):
- *     int page_cache_map_into(as, vn, file_off, va, prot, writable_hint);
- *     int page_cache_remap_writable(as, vn, file_off, va, prot);
- *   Debug / Introspection:
- *     page_cache_page_info_t (fields: index, pa, refcnt, flags, present)
- *     int page_cache_debug_lookup(vnode_t* vn, u64 file_off, page_cache_page_info_t* out);
- *     size_t page_cache_debug_range(vnode_t* vn, u64 file_off, u64 length,
- *              page_cache_page_info_t* out_array, size_t max_entries, u32 flags_filter);
+ *   - refcnt counts users of the descriptor; the tree holds one. page_cache_get()
+ *     and page_cache_lookup() return a reference that page_cache_release() drops.
+ *   - The physical frame has its own PMM reference count. The cache holds one
+ *     and each user mapping takes another (pmm_page_ref), so eviction never
+ *     frees a frame that is still mapped.
  *
- * Usage Patterns
- * --------------
- *   VFS Read:
- *     - For each requested file span: translate offset->page_index, call page_cache_get().
- *       Copy bytes from (pa + in_page_off). Release page.
- *   VFS Write:
- *     - Acquire page via page_cache_get() (creating if needed), modify memory, mark dirty, release.
- *   mmap Fault:
- *     - Initial: page_cache_map_into(... writable=false) -> RO mapping.
- *     - Write fault: page_cache_remap_writable() sets DIRTY.
- *   Flush:
- *     - On file sync / unmap: page_cache_flush_vnode() then optionally evict clean pages.
- *   Debugging Dirty Pages:
- *     - Use page_cache_debug_range(vn, start_off, span, arr, n, PAGE_CACHE_DIRTY) to list only dirty pages.
+ * Eviction
+ * --------
+ * page_cache_evict_some() scans the inactive tail. Referenced pages are
+ * activated, dirty, locked, pinned or mapped pages are rotated, and the rest
+ * are removed from their tree and freed. Insertions evict a batch once the
+ * cache grows past max_pages. Dirty pages are left to writeback (writeback.h),
+ * which reclaim wakes when it keeps running into them.
  *
- * Concurrency & Future Work
- * -------------------------
- *   - Phase 1 assumes single-threaded or externally serialized access; no locks
- *     are present around hash/LRU operations beyond implicit calling context.
- *   - Future: add spinlocks or fine-grained per-bucket locks, plus atomic refcounts.
- *   - Planned enhancements:
- *       * Background writeback (dirty clustering + throttling)
- *       * Page range flush (offset + length specificity)
- *       * Readahead heuristics (sequential detection)
- *       * Async IO integration (submit writes without blocking)
- *       * Memory pressure callbacks (global shrinker)
- *       * Vnode refcount integration & invalidation on truncation
+ * page_cache_evict_mapping() must run before a vnode is freed, since
+ * mappings are keyed by vnode address. It drops every page of the vnode,
+ * dirty ones included, and recycles the tree's nodes. Pages still referenced are
+ * detached (mapping == NULL): their data stays valid until released, but
+ * they can no longer be found, dirtied or written back.
  *
- * Return Codes & Error Model
- * --------------------------
+ * Return Codes
+ * ------------
  *   - Functions return 0 on success; negative K_E* constants on failure.
  *   - page_cache_get(): K_EINVAL (bad args), K_ENOMEM (alloc failure)
- *   - map helpers propagate vmm_map return codes.
  *
- * Debug Flag Semantics
- * --------------------
- *   PAGE_CACHE_PRESENT: Page has valid data loaded.
- *   PAGE_CACHE_DIRTY:   Page modified and not yet flushed.
- *   PAGE_CACHE_LOCKED:  Temporary load/creation barrier.
+ * Flag Semantics
+ * --------------
+ *   PAGE_CACHE_PRESENT:    Page has valid data loaded.
+ *   PAGE_CACHE_DIRTY:      Page modified and not yet written back.
+ *   PAGE_CACHE_LOCKED:     Being loaded; contents not valid yet.
+ *   PAGE_CACHE_WRITEBACK:  Write to storage in progress.
+ *   PAGE_CACHE_REFERENCED: Accessed since it was last aged.
+ *   PAGE_CACHE_ACTIVE:     On the active list.
+ *   PAGE_CACHE_LRU:        On an LRU list (not waiting in a per-CPU batch).
  *
  * Example (Dirty Page Enumeration):
  *   page_cache_page_info_t buf[32];
  *   size_t n = page_cache_debug_range(vn, 0, 512*1024, buf, 32, PAGE_CACHE_DIRTY);
  *   for(size_t i=0;i<n;i++) { [inspect buf[i].index / flags] }
- *
- * This header intentionally centralizes documentation to satisfy the
- * "Documentation updates" milestone for page cache & mmap integration.
  */
 #ifdef __cplusplus
 extern "C" { 
 #endif
 
 typedef struct page_cache_page page_cache_page_t;
+typedef struct page_cache_mapping page_cache_mapping_t;
 
 struct page_cache_page {
-    page_cache_page_t* hnext;      /* hash chain */
-    page_cache_page_t* lru_prev;   /* LRU list */
-    page_cache_page_t* lru_next;
-    vnode_t* vnode;                /* owning vnode */
+    page_cache_mapping_t* mapping; /* owning mapping */
     u64 index;                     /* page index in file */
     phys_addr_t pa;                /* physical backing */
-    u32 refcnt;                    /* active references (pins) */
+    u32 refcnt;                    /* active references, the tree holds one */
     u32 flags;                     /* PAGE_CACHE_* */
+    page_cache_page_t* lru_prev;   /* LRU list */
+    page_cache_page_t* lru_next;
+};
+
+enum {
+    PAGE_CACHE_PRESENT    = 1u << 0,
+    PAGE_CACHE_DIRTY      = 1u << 1,
+    PAGE_CACHE_LOCKED     = 1u << 2,
+    PAGE_CACHE_WRITEBACK  = 1u << 3,
+    PAGE_CACHE_REFERENCED = 1u << 4,
+    PAGE_CACHE_ACTIVE     = 1u << 5,
+    PAGE_CACHE_LRU        = 1u << 6,
 };
 
+/* Radix tree tags */
 enum {
-    PAGE_CACHE_PRESENT = 1u << 0,
-    PAGE_CACHE_DIRTY   = 1u << 1,
-    PAGE_CACHE_LOCKED  = 1u << 2,
+    PAGE_CACHE_TAG_DIRTY = 0,
+    PAGE_CACHE_TAG_WRITEBACK = 1,
+    PAGE_CACHE_NR_TAGS
 };
 
+/* max_pages == 0 sizes the cache to half of physical memory */
 void page_cache_init(size_t max_pages);
+
+/* Per-vnode mapping, created on first use when create is set */
+page_cache_mapping_t* page_cache_mapping(vnode_t* vn, bool create);
+
+/* Lookup or load; returns a referenced page */
 int  page_cache_get(vnode_t* vn, u64 index, page_cache_page_t** out_pg, bool* newly_loaded);
+/* Lookup only (never loads); referenced page or NULL */
+page_cache_page_t* page_cache_lookup(vnode_t* vn, u64 index);
+/* Another reference on a page the caller already holds one on */
+void page_cache_page_get(page_cache_page_t* pg);
 void page_cache_release(page_cache_page_t* pg);
+void page_cache_mark_accessed(page_cache_page_t* pg);
+
+/* Dirty and writeback state (kept in sync with the tree tags) */
 void page_cache_mark_dirty(page_cache_page_t* pg);
+void page_cache_start_writeback(page_cache_page_t* pg);
+void page_cache_end_writeback(page_cache_page_t* pg);
+/* Referenced pages carrying tag at index >= start, in index order */
+size_t page_cache_find_tagged(vnode_t* vn, u64 start, int tag, page_cache_page_t** pages, size_t max_pages);
+
+/* Buffered file I/O for vnodes with a bmap op; writes may throttle */
+long page_cache_read(vnode_t* vn, u64 off, void* buf, size_t len);
+long page_cache_write(vnode_t* vn, u64 off, const void* buf, size_t len);
+
+/* Write dirty pages through the vnode write op, one page at a time */
 int  page_cache_flush_vnode(vnode_t* vn);
 int  page_cache_sync_all(void);
 size_t page_cache_evict_some(size_t target);
+/* Drop everything cached for vn; call before freeing the vnode */
+void page_cache_evict_mapping(vnode_t* vn);
 
 /* Stats */
-struct page_cache_stats { u64 lookups; u64 hits; u64 loads; u64 flushes; u64 evictions; };
+struct page_cache_stats {
+    u64 lookups; u64 hits; u64 loads; u64 flushes; u64 evictions;
+    u64 activations; u64 deactivations;
+    u64 nr_pages; u64 nr_active; u64 nr_inactive; u64 nr_dirty; u64 nr_writeback;
+};
 const struct page_cache_stats* page_cache_get_stats(void);
-/* Map a cached page at given VA. If writable==false maps read-only even if prot requests write
- * to enable later write-fault dirty marking.
- */
-int page_cache_map_into(vmm_aspace_t* as, vnode_t* vn, u64 file_off, virt_addr_t va, int prot, bool writable);
-int page_cache_remap_writable(vmm_aspace_t* as, vnode_t* vn, u64 file_off, virt_addr_t va, int prot);
 
 /* Debug: snapshot info for a single cached page (no refcount changes) */
 typedef struct page_cache_page_info { u64 index; phys_addr_t pa; u32 refcnt; u32 flags; int present; } page_cache_page_info_t;
@@ -1,35 +1,207 @@
-#pragma once
-#include "kernel.h"
-/* Per-CPU infrastructure (Phase 1)
- * Single-core placeholder; will expand for real SMP.
+/*
+ * LimitlessOS - Per-CPU Data
+ *
+ * Variables defined with DEFINE_PER_CPU() are collected by the linker
+ * into the .percpu section, which serves as a template: every CPU gets
+ * its own copy of it at bring-up, and its GS segment base is set to the
+ * distance between that copy and the template. A variable's link-time
+ * address, taken relative to GS, therefore lands in the running CPU's
+ * copy, and this_cpu_read()/this_cpu_write()/this_cpu_inc() compile to
+ * a single GS-prefixed instruction: no CPU number lookup, no lock, and
+ * no atomic.
+ *
+ * Single-instruction read-modify-writes cannot be torn by an interrupt
+ * on the same CPU, so this_cpu_add() and friends are safe from IRQ
+ * context. 64-bit variables on i386 take two instructions; add/inc
+ * remain IRQ-safe (the carry survives the interrupt), but a read can
+ * see a half-updated value, which is fine for statistics.
+ *
+ * per_cpu(var, cpu) reaches another CPU's copy, e.g. to sum counters.
+ * Until percpu_setup_boot_cpu() has run, CPU 0 works on the template
+ * itself; the bootloader leaves GS flat, so the accessors already work.
  */
-#ifdef __cplusplus
-extern "C" {
-#endif
 
-#ifndef KERNEL_MAX_CPUS
-#define KERNEL_MAX_CPUS 8
-#endif
+#ifndef KERNEL_PERCPU_H
+#define KERNEL_PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PERCPU_MAX_CPUS 256
+
+#define DEFINE_PER_CPU(type, name) \
+    __attribute__((section(".percpu"))) __typeof__(type) name
+
+#define DECLARE_PER_CPU(type, name) \
+    extern __attribute__((section(".percpu"))) __typeof__(type) name
+
+/* Bounds of the template, from the linker script */
+extern char __per_cpu_start[], __per_cpu_end[];
+
+/* Distance from the template to each CPU's copy; 0 until set up */
+extern uintptr_t __per_cpu_offset[PERCPU_MAX_CPUS];
+
+/* CPUs that have a copy, plus CPU 0 */
+extern uint32_t percpu_nr_cpus;
+
+DECLARE_PER_CPU(uint32_t, cpu_number);
+DECLARE_PER_CPU(uintptr_t, this_cpu_off);
+
+#define per_cpu_ptr(ptr, cpu) \
+    ((__typeof__(ptr))((uintptr_t)(ptr) + __per_cpu_offset[(cpu)]))
+
+#define per_cpu(var, cpu) (*per_cpu_ptr(&(var), (cpu)))
+
+/* Iterate over every copy, e.g. to sum a counter */
+#define for_each_percpu_cpu(cpu) \
+    for ((cpu) = 0; (cpu) < percpu_nr_cpus; (cpu)++)
+
+extern void __bad_percpu_size(void);
+
+#define this_cpu_read(var) ({                                               \
+    __typeof__(var) __ret;                                                  \
+    switch (sizeof(var)) {                                                  \
+    case 1:                                                                 \
+        __asm__ __volatile__("movb %%gs:%1, %0"                             \
+                             : "=q"(__ret) : "m"(var));                     \
+        break;                                                              \
+    case 2:                                                                 \
+        __asm__ __volatile__("movw %%gs:%1, %0"                             \
+                             : "=r"(__ret) : "m"(var));                     \
+        break;                                                              \
+    case 4:                                                                 \
+        __asm__ __volatile__("movl %%gs:%1, %0"                             \
+                             : "=r"(__ret) : "m"(var));                     \
+        break;                                                              \
+    case 8: {                                                               \
+        uint64_t __v = __this_cpu_read_8(&(var));                           \
+        __builtin_memcpy(&__ret, &__v, sizeof(__ret));                      \
+        break;                                                              \
+    }                                                                       \
+    default:                                                                \
+        __bad_percpu_size();                                                \
+    }                                                                       \
+    __ret;                                                                  \
+})
+
+#define this_cpu_write(var, val) do {                                       \
+    __typeof__(var) __val = (val);                                          \
+    switch (sizeof(var)) {                                                  \
+    case 1:                                                                 \
+        __asm__ __volatile__("movb %1, %%gs:%0"                             \
+                             : "=m"(var) : "qi"(__val));                    \
+        break;                                                              \
+    case 2:                                                                 \
+        __asm__ __volatile__("movw %1, %%gs:%0"                             \
+                             : "=m"(var) : "ri"(__val));                    \
+        break;                                                              \
+    case 4:                                                                 \
+        __asm__ __volatile__("movl %1, %%gs:%0"                             \
+                             : "=m"(var) : "ri"(__val));                    \
+        break;                                                              \
+    case 8: {                                                               \
+        uint64_t __v = 0;                                                   \
+        __builtin_memcpy(&__v, &__val, sizeof(__val));                      \
+        __this_cpu_write_8(&(var), __v);                                    \
+        break;                                                              \
+    }                                                                       \
+    default:                                                                \
+        __bad_percpu_size();                                                \
+    }                                                                       \
+} while (0)
 
-static inline u32 percpu_cpu_count(void) {
-    extern u32 hal_cpu_count(void); /* weak/stub */
-    u32 c = hal_cpu_count();
-    if (c == 0 || c > KERNEL_MAX_CPUS) return 1;
-    return c;
+#define this_cpu_add(var, val) do {                                         \
+    switch (sizeof(var)) {                                                  \
+    case 1:                                                                 \
+        __asm__ __volatile__("addb %1, %%gs:%0"                             \
+                             : "+m"(var) : "qi"((uint8_t)(val)));           \
+        break;                                                              \
+    case 2:                                                                 \
+        __asm__ __volatile__("addw %1, %%gs:%0"                             \
+                             : "+m"(var) : "ri"((uint16_t)(val)));          \
+        break;                                                              \
+    case 4:                                                                 \
+        __asm__ __volatile__("addl %1, %%gs:%0"                             \
+                             : "+m"(var) : "ri"((uint32_t)(val)));          \
+        break;                                                              \
+    case 8:                                                                 \
+        __this_cpu_add_8(&(var), (uint64_t)(val));                          \
+        break;                                                              \
+    default:                                                                \
+        __bad_percpu_size();                                                \
+    }                                                                       \
+} while (0)
+
+#define this_cpu_sub(var, val)  this_cpu_add(var, -(__typeof__(var))(val))
+#define this_cpu_inc(var)       this_cpu_add(var, 1)
+#define this_cpu_dec(var)       this_cpu_sub(var, 1)
+
+/* Address of the running CPU's copy of var */
+#define this_cpu_ptr(ptr) \
+    ((__typeof__(ptr))((uintptr_t)(ptr) + this_cpu_read(this_cpu_off)))
+
+#ifdef __x86_64__
+
+static inline uint64_t __this_cpu_read_8(void *p) {
+    uint64_t v;
+    __asm__ __volatile__("movq %%gs:%1, %0" : "=r"(v) : "m"(*(uint64_t *)p));
+    return v;
 }
 
-static inline u32 percpu_current_id(void) {
-    extern u32 hal_cpu_id(void); /* weak/stub */
-    return hal_cpu_id();
+static inline void __this_cpu_write_8(void *p, uint64_t v) {
+    __asm__ __volatile__("movq %1, %%gs:%0" : "=m"(*(uint64_t *)p) : "r"(v));
 }
 
-typedef struct percpu_sched {
-    u64 ticks;          /* total ticks accounted */
-    u64 context_switch; /* number of context switches */
-} percpu_sched_t;
+static inline void __this_cpu_add_8(void *p, uint64_t v) {
+    __asm__ __volatile__("addq %1, %%gs:%0" : "+m"(*(uint64_t *)p) : "r"(v));
+}
+
+#else
 
-extern percpu_sched_t g_percpu_sched[KERNEL_MAX_CPUS];
+static inline uint64_t __this_cpu_read_8(void *p) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("movl %%gs:%2, %0\n\t"
+                         "movl %%gs:%3, %1"
+                         : "=&r"(lo), "=r"(hi)
+                         : "m"(((uint32_t *)p)[0]), "m"(((uint32_t *)p)[1]));
+    return ((uint64_t)hi << 32) | lo;
+}
 
-#ifdef __cplusplus
+static inline void __this_cpu_write_8(void *p, uint64_t v) {
+    __asm__ __volatile__("movl %2, %%gs:%0\n\t"
+                         "movl %3, %%gs:%1"
+                         : "=m"(((uint32_t *)p)[0]), "=m"(((uint32_t *)p)[1])
+                         : "r"((uint32_t)v), "r"((uint32_t)(v >> 32)));
 }
+
+static inline void __this_cpu_add_8(void *p, uint64_t v) {
+    __asm__ __volatile__("addl %2, %%gs:%0\n\t"
+                         "adcl %3, %%gs:%1"
+                         : "+m"(((uint32_t *)p)[0]), "+m"(((uint32_t *)p)[1])
+                         : "ri"((uint32_t)v), "ri"((uint32_t)(v >> 32))
+                         : "cc");
+}
+
 #endif
+
+/* The kernel's one CPU id: a GS-relative load, valid from early boot as
+ * CPU 0 reads the template until its own copy is set up. Lives here so
+ * code that cannot include smp.h (e.g. the linux/ compat headers) has it. */
+static inline uint32_t smp_processor_id(void) {
+    return this_cpu_read(cpu_number);
+}
+
+/* Helpers for per-CPU blocks of uint64_t counters such as stats structs:
+ * add up every CPU's copy into out, or clear them all */
+void percpu_sum_u64(const void *var, size_t size, void *out);
+void percpu_zero(void *var, size_t size);
+
+/* Gives the boot CPU its own copy. The template must still be pristine,
+ * so this runs before anything writes per-CPU data. */
+int percpu_setup_boot_cpu(void);
+/* Allocates a copy for an AP, from the boot CPU */
+int percpu_alloc_cpu(uint32_t cpu);
+/* Fills the calling AP's copy from the template and loads GS */
+void percpu_init_cpu(uint32_t cpu);
+
+#endif /* KERNEL_PERCPU_H */
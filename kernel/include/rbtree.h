@@ -0,0 +1,107 @@
+/*
+ * LimitlessOS - Intrusive Red-Black Trees
+ *
+ * Nodes are embedded in the objects they order and the tree never
+ * allocates. Callers either search for the link themselves and call
+ * rb_link_node() + rb_insert_color(), or use rb_add_cached() with a
+ * comparison. rb_root_cached also tracks the leftmost node so the minimum
+ * is available in O(1), which is what runqueues and timer queues want.
+ * Insert and erase are O(log n); neither takes locks.
+ */
+
+#ifndef KERNEL_RBTREE_H
+#define KERNEL_RBTREE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct rb_node {
+    unsigned long rb_parent_color;  // Parent pointer, colour in bit 0
+    struct rb_node *rb_right;
+    struct rb_node *rb_left;
+} __attribute__((aligned(sizeof(long))));
+
+struct rb_root {
+    struct rb_node *rb_node;
+};
+
+struct rb_root_cached {
+    struct rb_root rb_root;
+    struct rb_node *rb_leftmost;
+};
+
+#define RB_RED      0
+#define RB_BLACK    1
+
+#define RB_ROOT         (struct rb_root){ NULL }
+#define RB_ROOT_CACHED  (struct rb_root_cached){ { NULL }, NULL }
+
+#define rb_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#define rb_entry_safe(ptr, type, member) \
+    ((ptr) ? rb_entry(ptr, type, member) : NULL)
+
+#define rb_parent(r)        ((struct rb_node *)((r)->rb_parent_color & ~3UL))
+#define RB_EMPTY_ROOT(root) ((root)->rb_node == NULL)
+// Nodes that are not in a tree point at themselves
+#define RB_EMPTY_NODE(node) ((node)->rb_parent_color == (unsigned long)(node))
+#define RB_CLEAR_NODE(node) ((node)->rb_parent_color = (unsigned long)(node))
+
+// Attach a new red leaf at *rb_link; follow with rb_insert_color()
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **rb_link) {
+    node->rb_parent_color = (unsigned long)parent;
+    node->rb_left = node->rb_right = NULL;
+    *rb_link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+// In-order traversal
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+
+// Black height of a well-formed tree, -1 if an invariant is broken
+int rb_validate(const struct rb_root *root);
+
+// Cached-leftmost variants; leftmost says the new node went left all the way
+static inline void rb_insert_color_cached(struct rb_node *node, struct rb_root_cached *root,
+                                          bool leftmost) {
+    if (leftmost) root->rb_leftmost = node;
+    rb_insert_color(node, &root->rb_root);
+}
+
+static inline void rb_erase_cached(struct rb_node *node, struct rb_root_cached *root) {
+    if (root->rb_leftmost == node) root->rb_leftmost = rb_next(node);
+    rb_erase(node, &root->rb_root);
+}
+
+#define rb_first_cached(root) ((root)->rb_leftmost)
+
+// Insert ordered by less(); equal keys go after existing ones. Returns
+// true if the node became the leftmost.
+static inline bool rb_add_cached(struct rb_node *node, struct rb_root_cached *tree,
+                                 bool (*less)(const struct rb_node *, const struct rb_node *)) {
+    struct rb_node **link = &tree->rb_root.rb_node;
+    struct rb_node *parent = NULL;
+    bool leftmost = true;
+
+    while (*link) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = false;
+        }
+    }
+
+    rb_link_node(node, parent, link);
+    rb_insert_color_cached(node, tree, leftmost);
+    return leftmost;
+}
+
+#endif // KERNEL_RBTREE_H
@@ -0,0 +1,99 @@
+/*
+ * LimitlessOS - Read-Copy-Update
+ *
+ * Quiescent-state-based RCU for read-mostly tables. Readers take no lock
+ * and execute no atomic instruction: rcu_read_lock() and rcu_read_unlock()
+ * are compiler barriers. Writers serialise among themselves with an
+ * ordinary lock, publish new data with rcu_assign_pointer(), and may free
+ * what they unlinked only after a grace period, either by blocking in
+ * synchronize_rcu() or by handing the object to call_rcu().
+ *
+ * A grace period ends once every online CPU has passed a quiescent state,
+ * which is a context switch, a pass through the idle loop, or a return
+ * to user mode (a system call, or a tick that interrupted user code;
+ * see isr.c). A CPU idling with its tick stopped is in an extended
+ * quiescent state and does not hold grace periods up at all. The price
+ * of free readers is that a read-side section must not sleep or call schedule(): the
+ * scheduler would report the CPU quiescent while the reader still holds
+ * a pointer.
+ */
+
+#ifndef KERNEL_RCU_H
+#define KERNEL_RCU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+static inline void rcu_read_lock(void) {
+    __asm__ __volatile__("" ::: "memory");
+}
+
+static inline void rcu_read_unlock(void) {
+    __asm__ __volatile__("" ::: "memory");
+}
+
+/* Load an RCU-protected pointer for use inside a read-side section */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/* Publish p = v, ordered after the stores that initialised *v */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* Plain store, for NULL or for data that readers cannot see yet */
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+
+/*
+ * Singly linked chains threaded through a next-pointer member, as used
+ * by hash buckets and hook lists. pp points at the link to update, i.e.
+ * the bucket head or the member of the previous node. Deletion leaves
+ * node->member intact so that readers standing on node can move on.
+ */
+#define rcu_chain_insert(pp, node, member) do {                          \
+    (node)->member = *(pp);                                             \
+    rcu_assign_pointer(*(pp), (node));                                  \
+} while (0)
+
+#define rcu_chain_del(pp, node, member) \
+    rcu_assign_pointer(*(pp), (node)->member)
+
+#define rcu_chain_for_each(pos, head, member)                           \
+    for ((pos) = rcu_dereference(head); (pos);                          \
+         (pos) = rcu_dereference((pos)->member))
+
+/* Wait until all read-side sections that may have seen old data are over */
+void synchronize_rcu(void);
+
+/* Run func(head) from the tick once a grace period has elapsed */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+/*
+ * Scheduler hooks. rcu_qs() reports that the CPU holds no RCU-protected
+ * pointers (context switch, idle loop, return to user mode);
+ * rcu_check_callbacks() runs from
+ * the tick to advance grace periods and invoke expired callbacks.
+ */
+void rcu_qs(uint32_t cpu);
+void rcu_check_callbacks(uint32_t cpu);
+
+/*
+ * Extended quiescent states for dynticks idle. Between rcu_idle_enter()
+ * and rcu_idle_exit() the CPU counts as quiescent without ever calling
+ * rcu_qs(); the common hardware interrupt path (isr.c) brackets every
+ * handler with rcu_irq_enter()/rcu_irq_exit() so that their readers are seen.
+ * rcu_needs_cpu() tells the idle loop whether this CPU has callbacks
+ * that need the tick to make progress.
+ */
+void rcu_idle_enter(uint32_t cpu);
+void rcu_idle_exit(uint32_t cpu);
+void rcu_irq_enter(uint32_t cpu);
+void rcu_irq_exit(uint32_t cpu);
+bool rcu_needs_cpu(uint32_t cpu);
+
+void rcu_init(void);
+
+#endif /* KERNEL_RCU_H */
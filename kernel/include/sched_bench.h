@@ -0,0 +1,98 @@
+/*
+ * LimitlessOS - Scheduler Benchmarks
+ *
+ * In-kernel equivalents of the usual scheduler microbenchmarks, run on
+ * the SMP scheduler with kernel tasks:
+ *
+ *  - ctxsw:   two tasks on one CPU yielding to each other; cost per switch
+ *  - wakeup:  schbench-style wakeup-to-run latency, p50/p99/p99.9/max,
+ *             with CPU hogs running in the background
+ *  - fair:    N CPU hogs for a fixed time; Jain's index over their runtimes
+ *  - pipe:    hackbench-style ping-pong over one-slot pipes; round trips/s
+ *
+ * sched_bench_run() must be called from a scheduler task; it blocks until
+ * every benchmark is done. Each result is also printed as one line
+ *
+ *     SCHEDBENCH name=<bench> key=value ...
+ *
+ * with integer values only, so runs from different builds can be
+ * grepped out of the console log and compared.
+ */
+
+#ifndef KERNEL_SCHED_BENCH_H
+#define KERNEL_SCHED_BENCH_H
+
+#include <stdint.h>
+
+#define SCHED_BENCH_MAX_TASKS       64
+#define SCHED_BENCH_MAX_SAMPLES     16384
+
+typedef struct sched_bench_params {
+    uint32_t ctxsw_iters;       // Yields per task
+    uint32_t wakeup_samples;    // Wakeups timed, over all pairs
+    uint32_t wakeup_pairs;      // Waker/sleeper pairs; 0 = one per CPU
+    uint32_t wakeup_hogs;       // Background hogs; 0 = one per CPU
+    uint32_t fair_hogs;         // 0 = two per CPU
+    uint32_t fair_ms;           // How long the hogs run
+    uint32_t pipe_pairs;        // 0 = one per CPU
+    uint32_t pipe_msgs;         // Round trips per pair
+} sched_bench_params_t;
+
+#define SCHED_BENCH_PARAMS_DEFAULT {    \
+    .ctxsw_iters = 20000,               \
+    .wakeup_samples = 10000,            \
+    .wakeup_pairs = 0,                  \
+    .wakeup_hogs = 0,                   \
+    .fair_hogs = 0,                     \
+    .fair_ms = 2000,                    \
+    .pipe_pairs = 0,                    \
+    .pipe_msgs = 20000,                 \
+}
+
+typedef struct sched_bench_result {
+    uint64_t ctxsw_switches;
+    uint64_t ctxsw_ns;              // Per switch
+
+    uint32_t wakeup_samples;
+    uint64_t wakeup_p50_ns;
+    uint64_t wakeup_p99_ns;
+    uint64_t wakeup_p999_ns;
+    uint64_t wakeup_max_ns;
+
+    uint32_t fair_hogs;
+    uint32_t fair_jain;             // Jain's fairness index x1000; 1000 is perfectly fair
+    uint32_t fair_min_pct;          // Least runtime as a percentage of the most
+
+    uint64_t pipe_round_trips;
+    uint64_t pipe_rtt_ns;           // Per round trip, one pair
+    uint64_t pipe_msgs_per_sec;     // All pairs together
+} sched_bench_result_t;
+
+// NULL params runs the defaults; returns 0, or -1 if a benchmark could not run
+int sched_bench_run(const sched_bench_params_t *params, sched_bench_result_t *res);
+
+int sched_bench_ctxsw(const sched_bench_params_t *params, sched_bench_result_t *res);
+int sched_bench_wakeup(const sched_bench_params_t *params, sched_bench_result_t *res);
+int sched_bench_fair(const sched_bench_params_t *params, sched_bench_result_t *res);
+int sched_bench_pipe(const sched_bench_params_t *params, sched_bench_result_t *res);
+
+// Result arithmetic; inline so it can be checked without the SMP scheduler
+
+// per_mille of the n sorted samples are at or below the result
+static inline uint64_t sched_bench_percentile(const uint32_t *sorted, uint32_t n, uint32_t per_mille) {
+    return n ? sorted[(uint64_t)(n - 1) * per_mille / 1000] : 0;
+}
+
+// Jain's index (sum x)^2 / (n * sum x^2), x1000; the caller scales x so
+// that (sum x)^2 * 1000 fits in 64 bits
+static inline uint32_t sched_bench_jain(const uint64_t *x, uint32_t n) {
+    uint64_t sum = 0, sum_sq = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        sum += x[i];
+        sum_sq += x[i] * x[i];
+    }
+    return sum_sq ? (uint32_t)(sum * sum * 1000 / (n * sum_sq)) : 0;
+}
+
+#endif /* KERNEL_SCHED_BENCH_H */
@@ -0,0 +1,27 @@
+/**
+ * SCHED_DEADLINE by PID for LimitlessOS
+ *
+ * The part of the deadline class (sched_deadline.c) that code outside
+ * the SMP scheduler uses, such as the real-time policy layer. It needs
+ * nothing from smp_scheduler.h. Times are nanoseconds; see there for
+ * the meaning of runtime, deadline and period.
+ *
+ * Copyright (c) 2024 LimitlessOS Project
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct sched_dl_stats {
+    uint64_t runtime;
+    uint64_t deadline;
+    uint64_t period;
+    uint64_t nr_throttled;
+    uint64_t nr_missed;
+} sched_dl_stats_t;
+
+/* Return -1 for an unknown pid, bad parameters or failed admission */
+int sched_dl_set_pid(int pid, uint64_t runtime, uint64_t deadline, uint64_t period);
+int sched_dl_clear_pid(int pid);
+int sched_dl_get_stats(int pid, sched_dl_stats_t *stats);
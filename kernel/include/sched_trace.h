@@ -0,0 +1,73 @@
+/*
+ * LimitlessOS - Scheduler Trace Ring
+ *
+ * Binary event log for the scheduler, one ring per CPU. Each CPU only
+ * writes its own ring, without locks: a writer claims a slot by bumping
+ * the ring head and publishes it with a sequence number, so an interrupt
+ * that traces in the middle of another event just takes the next slot.
+ * The rings overwrite their oldest events; readers notice and count them
+ * as lost instead of stalling the scheduler.
+ *
+ * Tracing is off by default. Trace points then cost one load and a
+ * not-taken branch. /dev/sched_trace turns it on and off (write "1" or
+ * "0", or the ioctls below) and reading it drains whole
+ * sched_trace_event_t records from every CPU in TSC order: the reader
+ * merges the per-CPU rings, each already in order, so the TSCs are
+ * assumed to be synchronised across CPUs.
+ */
+
+#ifndef KERNEL_SCHED_TRACE_H
+#define KERNEL_SCHED_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SCHED_TRACE_RING_SIZE   1024    // Events per CPU, power of two
+
+// Event types
+#define SCHED_TRACE_SWITCH      1       // arg0 prev id, arg1 next id, arg2 prev state
+#define SCHED_TRACE_WAKEUP      2       // arg0 task id, arg1 target CPU
+#define SCHED_TRACE_MIGRATE     3       // arg0 task id, arg1 source CPU, arg2 dest CPU
+#define SCHED_TRACE_TICK        4       // arg0 running task id
+
+typedef struct sched_trace_event {
+    uint64_t tsc;               // rdtsc at the trace point
+    uint16_t type;              // SCHED_TRACE_*
+    uint16_t cpu;               // CPU that recorded it
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+} sched_trace_event_t;
+
+typedef struct sched_trace_stats {
+    uint64_t recorded;          // Events written, all CPUs
+    uint64_t read;              // Events handed to readers
+    uint64_t lost;              // Overwritten before they were read
+} sched_trace_stats_t;
+
+// ioctls on /dev/sched_trace
+#define SCHED_TRACE_IOC_ENABLE  0x5301
+#define SCHED_TRACE_IOC_DISABLE 0x5302
+#define SCHED_TRACE_IOC_RESET   0x5303
+#define SCHED_TRACE_IOC_STATS   0x5304  // arg: sched_trace_stats_t*
+
+extern volatile uint32_t sched_trace_enabled;
+
+void __sched_trace_record(uint16_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+static inline void sched_trace(uint16_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+    if (__builtin_expect(sched_trace_enabled, 0)) {
+        __sched_trace_record(type, arg0, arg1, arg2);
+    }
+}
+
+// Registers /dev/sched_trace; the rings are static and usable before this
+void sched_trace_init(void);
+void sched_trace_enable(bool on);
+void sched_trace_reset(void);
+// Drains up to len bytes of whole events; returns bytes copied
+size_t sched_trace_read(void* buf, size_t len);
+void sched_trace_get_stats(sched_trace_stats_t* stats);
+
+#endif // KERNEL_SCHED_TRACE_H
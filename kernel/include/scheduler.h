@@ -11,6 +11,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "mm/mm.h"
+#include "rbtree.h"
 
 // Define pid_t for kernel use
 typedef int pid_t;
@@ -19,7 +20,6 @@ typedef unsigned int gid_t;
 
 // Forward declarations for types used in this header
 struct rq;
-struct rb_node { struct rb_node *left, *right, *parent; int color; };
 
 // Constants (move NR_CPUS and related macros up)
 #define NR_CPUS 64
@@ -301,12 +301,18 @@ typedef struct task {
     int priority;
     uint64_t quantum;
     void* stack;
-    struct task* next;
+    struct mempolicy mempolicy;  // NUMA allocation policy, inherited by children
+    uint64_t wake_tick;          // TASK_SLEEPING: timer tick to wake at, 0 = task_wake() only
+    struct task* next;           // Ready queue or sleep list
 } task_t;
 
 // Legacy API for compatibility
 extern task_t* create_task(void (*entry)(void));
 extern void switch_to_task(task_t* task);
+extern task_t* get_running_task(void);
+// Sleep for ticks timer ticks (0 = until task_wake()); returns early if woken
+extern void task_sleep(uint64_t ticks);
+extern void task_wake(task_t* task);
 
 // Constants
 #define NR_CPUS 64
@@ -32,6 +32,7 @@ typedef struct cpu_topology {
     uint32_t package_id;    /* Physical CPU package */
     uint32_t core_id;       /* Core within package */
     uint32_t thread_id;     /* Thread within core (for SMT) */
+    uint32_t llc_id;        /* Last-level cache, unique across packages */
     uint32_t numa_node;     /* NUMA node ID */
     bool is_smt;            /* Simultaneous multithreading enabled */
 } cpu_topology_t;
@@ -58,7 +59,7 @@ typedef struct cpu_info {
     
     /* Timing and statistics */
     uint64_t tsc_freq;          /* TSC frequency */
-    uint64_t boot_time;         /* When this CPU came online */
+    uint64_t boot_time;         /* ktime_get_ns() when this CPU came online */
     uint64_t idle_time;         /* Time spent in idle */
     uint64_t irq_time;          /* Time spent in interrupts */
     
@@ -133,8 +134,7 @@ void smp_init_secondary(void);
 int smp_boot_cpu(uint32_t cpu_id);
 void smp_shutdown_cpu(uint32_t cpu_id);
 
-/* CPU management */
-uint32_t smp_processor_id(void);
+/* CPU management; smp_processor_id() comes from percpu.h, included below */
 cpu_info_t* smp_cpu_data(uint32_t cpu_id);
 bool smp_cpu_online(uint32_t cpu_id);
 void smp_set_cpu_state(uint32_t cpu_id, cpu_state_t state);
@@ -165,24 +165,29 @@ uint32_t cpu_mask_first(const cpu_mask_t *mask);
 uint32_t cpu_mask_next(uint32_t cpu, const cpu_mask_t *mask);
 uint32_t cpu_mask_weight(const cpu_mask_t *mask);
 bool cpu_mask_empty(const cpu_mask_t *mask);
+uint32_t cpu_mask_first_and(const cpu_mask_t *a, const cpu_mask_t *b);
 
 /* CPU hotplug support */
 int cpu_up(uint32_t cpu_id);
 int cpu_down(uint32_t cpu_id);
 void cpu_hotplug_init(void);
 
-/* Per-CPU variables support */
-#define DEFINE_PER_CPU(type, name) \
-    __attribute__((section(".percpu"))) type name[MAX_CPUS]
-
-#define per_cpu(var, cpu) (var[cpu])
-#define this_cpu(var) per_cpu(var, smp_processor_id())
+/* Per-CPU variables support, and smp_processor_id() */
+#include "percpu.h"
 
 /* Memory barriers for SMP */
 #define smp_mb()    __asm__ __volatile__("mfence" ::: "memory")
 #define smp_rmb()   __asm__ __volatile__("lfence" ::: "memory")
 #define smp_wmb()   __asm__ __volatile__("sfence" ::: "memory")
 
+/* Local interrupt masking for per-CPU fast paths */
+#ifndef local_irq_save
+#define local_irq_save(flags) \
+    __asm__ __volatile__("pushf ; pop %0 ; cli" : "=g" (flags) : : "memory")
+#define local_irq_restore(flags) \
+    __asm__ __volatile__("push %0 ; popf" : : "g" (flags) : "memory", "cc")
+#endif
+
 /* Atomic operations for SMP coordination */
 static inline void atomic_inc(volatile int *v) {
     __asm__ __volatile__("lock incl %0" : "+m" (*v));
@@ -208,35 +213,8 @@ static inline bool atomic_dec_and_test(volatile int *v) {
     return c != 0;
 }
 
-/* Spinlock implementation for SMP */
-typedef struct {
-    volatile unsigned int slock;
-    uint32_t owner_cpu;
-    void *owner_pc;
-} spinlock_t;
-
-#define SPINLOCK_INIT { 0, 0, NULL }
-
-void spin_lock_init(spinlock_t *lock);
-void spin_lock(spinlock_t *lock);
-void spin_unlock(spinlock_t *lock);
-bool spin_trylock(spinlock_t *lock);
-void spin_lock_irqsave(spinlock_t *lock, unsigned long *flags);
-void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags);
-
-/* Read-write locks */
-typedef struct {
-    volatile int lock;
-    volatile int readers;
-} rwlock_t;
-
-#define RWLOCK_INIT { 0, 0 }
-
-void rwlock_init(rwlock_t *lock);
-void read_lock(rwlock_t *lock);
-void read_unlock(rwlock_t *lock);
-void write_lock(rwlock_t *lock);
-void write_unlock(rwlock_t *lock);
+/* Spinlocks and reader-writer locks */
+#include "spinlock.h"
 
 /* CPU frequency scaling */
 void smp_init_frequency_scaling(void);
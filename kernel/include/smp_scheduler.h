@@ -12,13 +12,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "smp.h"
+#include "rbtree.h"
+#include "linux/list.h"
+#include "hrtimer.h"
 #include "mm/mm.h"
+#include "sched_deadline.h"
 
 /* Scheduling classes */
 #define SCHED_CLASS_NORMAL      0   /* Default CFS scheduler */
 #define SCHED_CLASS_RT          1   /* Real-time scheduler */
 #define SCHED_CLASS_IDLE        2   /* Idle tasks */
 #define SCHED_CLASS_STOP        3   /* Stop machine tasks */
+#define SCHED_CLASS_DEADLINE    4   /* EDF with CBS throttling, above RT */
 
 /* Task states */
 typedef enum {
@@ -40,6 +45,7 @@ typedef enum {
 
 /* CPU scheduling entity */
 typedef struct sched_entity {
+    struct rb_node run_node;    /* Position in the CFS tree, keyed by vruntime */
     uint64_t vruntime;          /* Virtual runtime */
     uint64_t exec_start;        /* Last execution start time */
     uint64_t sum_exec_runtime;  /* Total execution time */
@@ -47,6 +53,7 @@ typedef struct sched_entity {
     
     /* Load and priority */
     unsigned long load_weight;  /* Load weight for this entity */
+    uint32_t inv_weight;        /* 2^32 / load_weight, for calc_delta_fair() */
     int prio;                   /* Static priority */
     int nice;                   /* Nice value (-20 to +19) */
     
@@ -66,6 +73,28 @@ typedef struct rt_sched_entity {
     int nr_cpus_allowed;        /* CPUs this task can run on */
 } rt_sched_entity_t;
 
+/* Deadline scheduling entity; all times in ns of sched_clock() */
+typedef struct dl_sched_entity {
+    struct rb_node rb_node;     /* Position in the EDF tree, keyed by deadline */
+    
+    /* Reservation, fixed by sched_setattr_deadline() */
+    uint64_t dl_runtime;        /* Budget per period */
+    uint64_t dl_deadline;       /* Relative deadline */
+    uint64_t dl_period;         /* Replenishment period */
+    uint64_t dl_bw;             /* dl_runtime / dl_period, BW_SHIFT fixed point */
+    
+    /* Current job */
+    int64_t runtime;            /* Budget left; negative after an overrun */
+    uint64_t deadline;          /* Absolute deadline */
+    bool dl_throttled;          /* Out of budget until dl_timer replenishes it */
+    bool dl_missed;             /* Already counted in nr_missed */
+    struct hrtimer dl_timer;
+    
+    /* Statistics */
+    uint64_t nr_throttled;      /* Times the budget ran out */
+    uint64_t nr_missed;         /* Jobs still running at their deadline */
+} dl_sched_entity_t;
+
 /* Task structure (Process Control Block) */
 typedef struct task {
     /* Basic task information */
@@ -91,6 +120,7 @@ typedef struct task {
     int sched_class;            /* Scheduling class */
     sched_entity_t se;          /* CFS scheduling entity */
     rt_sched_entity_t rt;       /* RT scheduling entity */
+    dl_sched_entity_t dl;       /* Deadline scheduling entity */
     
     /* CPU affinity and NUMA */
     cpu_mask_t cpu_affinity;    /* CPUs this task can run on */
@@ -126,7 +156,7 @@ typedef struct task {
     struct list_head task_list; /* Global task list entry */
     
     /* Reference counting */
-    atomic_t usage;             /* Reference count */
+    int usage;                  /* Reference count, see atomic_inc() in smp.h */
     
     /* Performance monitoring */
     uint64_t nvcsw;             /* Voluntary context switches */
@@ -141,8 +171,7 @@ typedef struct cpu_runqueue {
     
     /* CFS (Completely Fair Scheduler) */
     struct {
-        struct rb_root_cached root;  /* RB-tree for CFS tasks */
-        struct rb_node *leftmost;    /* Leftmost node in tree */
+        struct rb_root_cached root;  /* RB-tree for CFS tasks, leftmost cached */
         uint64_t min_vruntime;       /* Minimum vruntime */
         uint32_t nr_running;         /* Number of running tasks */
         uint64_t load_weight;        /* Total load weight */
@@ -156,15 +185,26 @@ typedef struct cpu_runqueue {
         uint64_t rt_throttled;       /* RT throttling time */
     } rt;
     
+    /* Deadline scheduler */
+    struct {
+        struct rb_root_cached root;  /* Earliest deadline leftmost */
+        uint32_t nr_running;         /* Queued, unthrottled deadline tasks */
+        uint64_t total_bw;           /* Bandwidth admitted on this CPU */
+    } dl;
+    
     /* Current task */
     task_t *curr;               /* Currently running task */
     task_t *idle;               /* Idle task for this CPU */
     task_t *stop;               /* Stop task for this CPU */
+    volatile bool need_resched; /* Set by resched_curr(), cleared by schedule() */
     
     /* Load balancing */
     uint64_t next_balance;      /* Next load balance time */
     uint32_t balance_interval;  /* Load balance interval */
     uint64_t avg_load_per_task; /* Average load per task */
+    uint64_t lb_count;          /* Balance attempts that found an imbalance */
+    uint64_t lb_failed;         /* ...and could not move anything */
+    uint64_t nr_migrations;     /* Tasks pulled to this CPU */
     
     /* CPU utilization */
     uint64_t cpu_load[5];       /* CPU load averages */
@@ -175,6 +215,7 @@ typedef struct cpu_runqueue {
     uint64_t sched_goidle;      /* Times went idle */
     uint64_t ttwu_count;        /* Times tried to wake up */
     uint64_t ttwu_local;        /* Times woke up local task */
+    uint64_t ttwu_affine;       /* Wakeups placed by the waker's cache, not the wakee's */
     
     /* Clock and timing */
     uint64_t clock;             /* Runqueue clock */
@@ -196,9 +237,24 @@ typedef struct sched_domain {
     uint32_t imbalance_pct;         /* Imbalance percentage threshold */
     uint32_t cache_nice_tries;      /* Cache-hot migration tries */
     
+    /* Balancing state */
+    uint64_t last_balance;          /* jiffies of the last periodic pass */
+    uint32_t nr_balance_failed;     /* Consecutive passes that moved nothing */
+    
     char name[32];                  /* Domain name for debugging */
 } sched_domain_t;
 
+/* Domain flags */
+#define SD_LOAD_BALANCE         0x0001  /* Do periodic balancing in this domain */
+#define SD_BALANCE_NEWIDLE      0x0002  /* Pull when a CPU is about to go idle */
+#define SD_SHARE_CPUCAPACITY    0x0004  /* SMT siblings, all caches shared */
+#define SD_SHARE_PKG_RESOURCES  0x0008  /* Last-level cache shared */
+#define SD_NUMA                 0x0010  /* Spans NUMA nodes */
+
+/* A queued task that ran this recently is assumed to still have its
+ * working set in the source CPU's cache */
+#define SCHED_MIGRATION_COST_NS 500000ULL
+
 /* Load balancing groups */
 typedef struct sched_group {
     struct sched_group *next;       /* Next group in domain */
@@ -230,6 +286,8 @@ void sched_build_domains(void);
 /* Task management */
 task_t *sched_create_task(void (*entry_point)(void), const char *name);
 void sched_destroy_task(task_t *task);
+void wake_up_new_task(task_t *task);
+void sched_exit(int code) __attribute__((noreturn));
 pid_t sched_get_next_pid(void);
 
 /* Core scheduling functions */
@@ -239,10 +297,15 @@ void preempt_schedule(void);
 void preempt_schedule_irq(void);
 task_t *pick_next_task(cpu_runqueue_t *rq);
 void put_prev_task(cpu_runqueue_t *rq, task_t *prev);
+void enqueue_task_fair(cpu_runqueue_t *rq, task_t *task);
+void dequeue_task_fair(cpu_runqueue_t *rq, task_t *task);
+void resched_curr(cpu_runqueue_t *rq);
+bool need_resched(void);
 
 /* Task state management */
 void set_task_state(task_t *task, task_state_t state);
 void wake_up_process(task_t *task);
+void wake_up_process_sync(task_t *task);
 int wake_up_state(task_t *task, task_state_t state);
 void scheduler_tick(void);
 
@@ -269,6 +332,30 @@ int sched_get_rt_priority(pid_t pid);
 void sched_set_fifo(task_t *task, int priority);
 void sched_set_rr(task_t *task, int priority);
 
+/*
+ * Deadline scheduling (sched_deadline.c). A task reserves runtime ns of
+ * CPU time in every period, to be received within deadline ns of the
+ * start of each period; runtime <= deadline <= period, and a period of
+ * 0 means period == deadline. Returns -1 for invalid parameters or when
+ * the task's CPU cannot admit the bandwidth.
+ */
+#define BW_SHIFT            20
+#define BW_UNIT             (1ULL << BW_SHIFT)
+
+/* The by-PID calls and sched_dl_stats_t are in sched_deadline.h */
+int sched_setattr_deadline(task_t *task, uint64_t runtime, uint64_t deadline, uint64_t period);
+void sched_clear_deadline(task_t *task);
+
+/* Class hooks, called with the runqueue locked */
+void init_dl_rq(cpu_runqueue_t *rq);
+void init_dl_task(task_t *p);
+void enqueue_task_dl(cpu_runqueue_t *rq, task_t *p, bool wakeup);
+task_t *pick_next_task_dl(cpu_runqueue_t *rq);
+void update_curr_dl(cpu_runqueue_t *rq, task_t *curr);
+void task_tick_dl(cpu_runqueue_t *rq, task_t *curr, uint64_t delta_exec);
+bool dl_should_preempt(cpu_runqueue_t *rq, task_t *p);
+void yield_task_dl(task_t *curr);
+
 /* Idle tasks */
 task_t *sched_create_idle_task(uint32_t cpu);
 void cpu_idle_loop(void);
@@ -323,7 +410,7 @@ void sched_debug_show_domains(void);
 void sched_profile_tick(void);
 
 /* Macros for common operations */
-#define current         (this_cpu(current_task))
+#define current         (this_cpu_read(current_task))
 #define current_cpu()   smp_processor_id()
 #define task_cpu(p)     ((p)->last_cpu)
 #define cpu_rq(cpu)     (&cpu_runqueues[cpu])
@@ -344,43 +431,8 @@ void sched_profile_tick(void);
 #define MIN_TIMESLICE       (5 * 1000000ULL)    /* 5ms in ns */
 #define MAX_TIMESLICE       (800 * 1000000ULL)  /* 800ms in ns */
 
-/* Red-Black tree support for CFS */
-struct rb_node {
-    unsigned long rb_parent_color;
-    struct rb_node *rb_right;
-    struct rb_node *rb_left;
-};
-
-struct rb_root {
-    struct rb_node *rb_node;
-};
-
-struct rb_root_cached {
-    struct rb_root rb_root;
-    struct rb_node *rb_leftmost;
-};
-
-/* List support */
-struct list_head {
-    struct list_head *next, *prev;
-};
-
-/* Atomic operations */
-typedef struct {
-    int counter;
-} atomic_t;
-
-#define ATOMIC_INIT(i) { (i) }
-
-void atomic_set(atomic_t *v, int i);
-int atomic_read(atomic_t *v);
-void atomic_inc(atomic_t *v);
-void atomic_dec(atomic_t *v);
-int atomic_inc_return(atomic_t *v);
-int atomic_dec_return(atomic_t *v);
-
 /* Per-CPU current task pointer */
-DEFINE_PER_CPU(task_t *, current_task);
+DECLARE_PER_CPU(task_t *, current_task);
 
 /* Scheduler class operations */
 struct sched_class {
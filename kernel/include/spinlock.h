@@ -0,0 +1,113 @@
+/*
+ * LimitlessOS - Queued Spinlocks and Reader-Writer Locks
+ *
+ * spinlock_t is a queued (MCS) lock in one 32-bit word: a locked byte
+ * plus the tail of a queue of waiting CPUs. The uncontended path is a
+ * single cmpxchg. Under contention each waiter spins on its own per-CPU
+ * queue node rather than on the lock word, and the lock is handed over
+ * in arrival order, so waiters neither starve nor pull the lock's cache
+ * line back and forth.
+ *
+ * rwlock_t is a queued reader-writer lock. Readers share it, writers are
+ * exclusive, and anyone who has to wait queues on an internal spinlock,
+ * which keeps a stream of readers from starving a writer.
+ *
+ * Build with CONFIG_LOCK_STAT to count acquisitions, contended
+ * acquisitions, wait time and hold time per lock class (TSC cycles).
+ * The counters are readable as text from /dev/lock_stat; writing "0"
+ * clears them. Locks initialised without a class share "<unnamed>".
+ * Without CONFIG_LOCK_STAT the class arguments compile away.
+ */
+
+#ifndef KERNEL_SPINLOCK_H
+#define KERNEL_SPINLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Lock class, one per kind of lock (e.g. every runqueue lock) */
+struct lock_class {
+    const char *name;
+    struct lock_class *next;        /* Registered classes, most recent first */
+    volatile uint32_t registered;
+    uint64_t acquisitions;
+    uint64_t contended;             /* Acquisitions that had to wait */
+    uint64_t wait_cycles;
+    uint64_t wait_max;
+    uint64_t hold_cycles;           /* Spinlocks and write locks only */
+    uint64_t hold_max;
+};
+
+#define DEFINE_LOCK_CLASS(var, lname) \
+    struct lock_class var = { .name = (lname) }
+
+typedef struct spinlock {
+    union {
+        volatile uint32_t val;
+        struct {
+            volatile uint8_t locked;
+            uint8_t reserved;
+            volatile uint16_t tail;     /* Last queued CPU and nesting level, 0 if none */
+        };
+    };
+#ifdef CONFIG_LOCK_STAT
+    struct lock_class *lc;
+    uint64_t acquired_at;
+#endif
+} spinlock_t;
+
+#ifdef CONFIG_LOCK_STAT
+#define SPINLOCK_INIT                   { { 0 }, NULL, 0 }
+#define SPINLOCK_INIT_CLASS(cls)        { { 0 }, &(cls), 0 }
+#else
+#define SPINLOCK_INIT                   { { 0 } }
+#define SPINLOCK_INIT_CLASS(cls)        SPINLOCK_INIT
+#endif
+
+void spin_lock_init(spinlock_t *lock);
+void spin_lock_init_class(spinlock_t *lock, struct lock_class *lc);
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+bool spin_trylock(spinlock_t *lock);
+void spin_lock_irqsave(spinlock_t *lock, unsigned long *flags);
+void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags);
+
+static inline bool spin_is_locked(spinlock_t *lock) {
+    return __atomic_load_n(&lock->locked, __ATOMIC_RELAXED) != 0;
+}
+
+/* Read-write locks */
+typedef struct {
+    volatile uint32_t cnts;         /* Reader count << 9 | writer bits */
+    spinlock_t wait_lock;           /* Queue for readers and writers that wait */
+#ifdef CONFIG_LOCK_STAT
+    struct lock_class *lc;
+    uint64_t acquired_at;
+#endif
+} rwlock_t;
+
+#ifdef CONFIG_LOCK_STAT
+#define RWLOCK_INIT                     { 0, SPINLOCK_INIT, NULL, 0 }
+#define RWLOCK_INIT_CLASS(cls)          { 0, SPINLOCK_INIT, &(cls), 0 }
+#else
+#define RWLOCK_INIT                     { 0, SPINLOCK_INIT }
+#define RWLOCK_INIT_CLASS(cls)          RWLOCK_INIT
+#endif
+
+void rwlock_init(rwlock_t *lock);
+void rwlock_init_class(rwlock_t *lock, struct lock_class *lc);
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+bool read_trylock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
+bool write_trylock(rwlock_t *lock);
+
+/* Lock statistics; no-ops without CONFIG_LOCK_STAT */
+void lock_stat_init(void);
+void lock_stat_reset(void);
+/* Text report in /proc/lock_stat style; returns bytes written */
+size_t lock_stat_show(char *buf, size_t len);
+
+#endif /* KERNEL_SPINLOCK_H */
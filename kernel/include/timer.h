@@ -0,0 +1,80 @@
+/*
+ * LimitlessOS - Timer Wheel
+ *
+ * Coarse timeouts in jiffies: network retransmits, delayed work, lock
+ * and watchdog timeouts. Almost all of them are cancelled before they
+ * expire, so the wheel is built to make add and delete O(1) and to keep
+ * expiry cheap, at the price of precision: a timer far in the future
+ * lands in a bucket whose granularity grows with the distance and may
+ * fire up to 1/8 of its timeout late. Timers never fire early.
+ *
+ * Every CPU has its own wheel; mod_timer() queues on the calling CPU.
+ * Callbacks run from the tick interrupt of that CPU with interrupts
+ * off, so they must be short and must not sleep. Anything precise or
+ * sub-jiffy belongs on an hrtimer (hrtimer.h).
+ */
+
+#ifndef KERNEL_TIMER_H
+#define KERNEL_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define HZ              1000
+#define TICK_NSEC       (1000000000ULL / HZ)
+
+/* Jiffies since boot, advanced by whichever CPU's tick gets there first */
+extern uint64_t jiffies;
+
+/* Untorn read of jiffies, which is two words on i386 */
+static inline uint64_t get_jiffies_64(void) {
+    return __atomic_load_n(&jiffies, __ATOMIC_RELAXED);
+}
+
+struct timer_list {
+    struct timer_list *next;
+    struct timer_list **pprev;      /* NULL while not queued */
+    uint64_t expires;               /* In jiffies */
+    void (*function)(struct timer_list *timer);
+    uint32_t cpu;                   /* Wheel the timer is (or was last) on */
+    uint32_t idx;                   /* Bucket within that wheel */
+};
+
+#define TIMER_NEXT_NONE UINT64_MAX
+
+static inline uint64_t msecs_to_jiffies(uint32_t ms) {
+    return ((uint64_t)ms * HZ + 999) / 1000;
+}
+
+static inline bool timer_pending(const struct timer_list *timer) {
+    return timer->pprev != NULL;
+}
+
+void timer_setup(struct timer_list *timer, void (*function)(struct timer_list *timer));
+
+/*
+ * (Re)arm timer for the absolute jiffy expires. Returns 1 if it was
+ * pending before, 0 otherwise. add_timer() arms an idle timer.
+ */
+int mod_timer(struct timer_list *timer, uint64_t expires);
+void add_timer(struct timer_list *timer);
+
+/*
+ * Dequeue timer; returns 1 if it was pending. del_timer_sync() also
+ * waits for a callback running on another CPU, so the caller may free
+ * the timer afterwards. It must not be called from the callback itself.
+ */
+int del_timer(struct timer_list *timer);
+int del_timer_sync(struct timer_list *timer);
+
+/* Tick hook: expire this CPU's due timers */
+void run_local_timers(void);
+
+/* Earliest jiffy at which this CPU has a timer due, or TIMER_NEXT_NONE */
+uint64_t timer_next_expiry(void);
+
+/* Set up cpu's wheel; its per-CPU area must exist already */
+void timers_init_cpu(uint32_t cpu);
+
+#endif /* KERNEL_TIMER_H */
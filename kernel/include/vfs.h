@@ -44,6 +44,11 @@ typedef struct vnode_ops {
 
     /* Drop reference (optional no-op for static vnodes) */
     void (*release)(struct vnode* vn);
+
+    /* Optional: storage device and first 512-byte sector of file page
+     * 'index'; the page must be contiguous on disk. Files that provide it are read and
+     * written through the page cache. Return 0 or <0 if unmapped. */
+    int  (*bmap)(struct vnode* vn, u64 index, u64* dev, u64* lba);
 } vnode_ops_t;
 
 typedef struct vnode {
@@ -197,6 +202,8 @@ int vfs_listdir(const char* path, vfs_dirent_cb cb, void* ctx);
 /* Helpers */
 vnode_t* vfs_ref(vnode_t* vn);
 void     vfs_put(vnode_t* vn);
+/* Free a kmalloc'd vnode, dropping its cached pages first */
+void     vfs_vnode_free(vnode_t* vn);
 vfs_mount_t* vfs_get_root_mount(void);
 
 /* Phase 6 bootstrap: mounts root on vda and /tmp tmpfs (if available), then execs /sbin/init */
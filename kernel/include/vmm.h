@@ -22,6 +22,7 @@ void  vmm_kfree(void* ptr, size_t size);
 #define PAGE_ALIGN_UP(addr) (((addr) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
 #endif
 #define PTE_COW (1ull << 10)  /* Custom COW bit in available field */
+#define PTE_COLLAPSE (1ull << 11)  /* PDE: khugepaged is copying this range */
 
 /* Missing definitions */
 #define PHYS_TO_VIRT_DIRECT(paddr) ((vaddr_t)(paddr) + 0xFFFF800000000000ULL)
@@ -50,6 +51,25 @@ enum {
     PTE_NX = 1ull << 63
 };
 
+/* Physical frame bits of a page-table entry */
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ull
+
+/* Huge pages: 2 MiB leaf entries at the page-directory level (PTE_HUGE) */
+#define HPAGE_SHIFT     21
+#define HPAGE_SIZE      (1ull << HPAGE_SHIFT)
+#define HPAGE_MASK      (~(HPAGE_SIZE - 1))
+#define HPAGE_ORDER     (HPAGE_SHIFT - 12)
+#define HPAGE_NR_PAGES  (1u << HPAGE_ORDER)
+
+/* PML4 slots from here up are the kernel half (the direct map starts at
+ * slot 256). Every address space points them at the kernel's own PDPTs
+ * instead of owning copies. */
+#define VMM_KERNEL_PML4_FIRST   256
+
+/* Table an entry points to. Page tables are reached through the identity
+ * map vmm_init() builds; frame contents go through the direct map. */
+#define VMM_TABLE(e)    ((u64*)(uintptr_t)((e) & PTE_ADDR_MASK))
+
 /* W^X policy: pages may be Writable OR Executable, not both.
  * Execution permission is represented by absence of NX (PTE_NX cleared).
  */
@@ -76,7 +96,7 @@ typedef struct vmm_region {
     virt_addr_t start;
     size_t length;
     u32 flags; /* VMM_REGION_* */
-    struct vmm_file_mapping* file_map; /* non-NULL if VMM_REGION_FILE */
+    struct vmm_file_mapping* file_map; /* non-NULL if VMM_REGION_FILE; owned by the region */
 } vmm_region_t;
 
 enum {
@@ -87,6 +107,14 @@ enum {
     VMM_REGION_FILE   = 0x0010, /* file-backed (page cache) */
 };
 
+/* Page table flags for a freshly populated page of a region */
+static inline u32 vmm_region_pte_flags(const vmm_region_t* r) {
+    u32 flags = PTE_PRESENT;
+    if (r->flags & VMM_REGION_WRITE) flags |= PTE_WRITABLE;
+    if (r->flags & VMM_REGION_USER) flags |= PTE_USER;
+    return flags;
+}
+
 /* File-backed mapping metadata (attached via region->fs_priv or extended structure) */
 typedef struct vmm_file_mapping {
     struct vnode* vnode; /* referenced vnode */
@@ -103,8 +131,11 @@ typedef struct vmm_page {
     pte_flags_t flags;
 } vmm_page_t;
 
+/* Regions are kept sorted by start address and never overlap */
 int vmm_region_add(vmm_aspace_t* as, virt_addr_t start, size_t length, u32 flags);
 vmm_region_t* vmm_region_find(vmm_aspace_t* as, virt_addr_t addr);
+int vmm_region_remove(vmm_aspace_t* as, virt_addr_t start, size_t length);
+int vmm_region_set_flags(vmm_aspace_t* as, virt_addr_t start, size_t length, u32 flags);
 
 /* Early boot */
 void vmm_init(const boot_info_t* bi);
@@ -119,13 +150,23 @@ void vmm_destroy_aspace(vmm_aspace_t* as);
 
 /* Mapping */
 int vmm_map(vmm_aspace_t* as, virt_addr_t va, phys_addr_t pa, size_t size, pte_flags_t flags);
+/* PTE_HUGE in flags installs a 2 MiB mapping in the page directory */
 status_t vmm_map_page(vmm_aspace_t* aspace, vaddr_t vaddr, paddr_t paddr, uint32_t flags);
 
+/* Page-table walks without allocation; NULL when a level is missing.
+ * vmm_get_pte() also returns NULL when the range is a huge mapping. */
+u64* vmm_get_pde(vmm_aspace_t* aspace, vaddr_t vaddr);
+u64* vmm_get_pte(vmm_aspace_t* aspace, vaddr_t vaddr);
+void vmm_flush_tlb_page(vaddr_t vaddr);
+
 /* Physical memory management */
 paddr_t pmm_alloc_page(void);
 void pmm_free_page(paddr_t paddr);
 paddr_t pmm_alloc_pages(size_t pages);
 void pmm_free_pages(paddr_t paddr, size_t pages);
+/* Shared frames: pmm_free_page() drops one reference, the last one frees */
+void pmm_page_ref(paddr_t paddr);
+uint32_t pmm_page_refcount(paddr_t paddr);
 int vmm_unmap(vmm_aspace_t* as, virt_addr_t va, size_t size);
 /* Query physical address of a mapped virtual page */
 int vmm_get_physical(vmm_aspace_t* as, virt_addr_t va, phys_addr_t* out_pa);
@@ -133,8 +174,12 @@ int vmm_get_physical(vmm_aspace_t* as, virt_addr_t va, phys_addr_t* out_pa);
 /* Page fault */
 void vmm_handle_page_fault(u64 fault_addr, u64 err_code);
 
-/* Fork helpers */
+/* Fork helpers: user pages end up shared read-only with PTE_COW set on
+ * writable ones; the first write fault copies the page, or reuses it when
+ * no other address space maps it any more. */
 int vmm_clone_address_space_cow(vmm_aspace_t* dst, vmm_aspace_t* src);
+vmm_aspace_t* vmm_clone_cow(vmm_aspace_t* src);
+bool vmm_mark_cow(vmm_aspace_t* space, vaddr_t vaddr);
 vmm_region_t* vmm_region_find_range(vmm_aspace_t* as, virt_addr_t start, size_t length);
 status_t vmm_unmap_page(vmm_aspace_t* aspace, vaddr_t vaddr);
 vmm_aspace_t* vmm_get_current_aspace(void);
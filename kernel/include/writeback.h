@@ -0,0 +1,57 @@
+/*
+ * LimitlessOS - Page Cache Writeback
+ *
+ * Dirty file pages are written back by one flusher task per storage
+ * device. A vnode joins its device's dirty list when its first page is
+ * dirtied and leaves it once written clean. Flushers wake every
+ * interval to write vnodes dirty for longer than the expiry age, and
+ * earlier when dirty memory crosses the background ratio. Writers that
+ * push it past the dirty ratio are throttled in balance_dirty_pages().
+ *
+ * Vnodes that implement the bmap op are written as runs of pages that
+ * are contiguous both in the file and on disk, one
+ * hal_storage_write_sectors() per run. Other vnodes fall back to the
+ * per-page write op.
+ */
+
+#ifndef KERNEL_WRITEBACK_H
+#define KERNEL_WRITEBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vfs.h"
+
+#define WB_MAX_DEVICES  8
+#define WB_MAX_RUN      64      // Pages per storage request (256 KiB)
+
+typedef struct writeback_stats {
+    uint64_t requests;          // Storage write requests issued
+    uint64_t pages_written;     // Pages written by those requests
+    uint64_t fallback_pages;    // Pages written through the vnode write op
+    uint64_t expired;           // Vnodes written because they aged out
+    uint64_t background_runs;   // Flusher passes over the background ratio
+    uint64_t throttled;         // balance_dirty_pages() calls that paused
+    uint64_t direct_flushes;    // Writers that had to write back themselves
+    uint64_t errors;            // Failed writes; the pages stay dirty
+} writeback_stats_t;
+
+// Called by the page cache when a clean vnode gets its first dirty page
+void writeback_inode_dirtied(vnode_t* vn, u64 index);
+// Kick every flusher, e.g. when reclaim only finds dirty pages
+void writeback_wakeup_all(void);
+// Take a vnode off the dirty lists before it is freed; waits out a
+// flusher that is writing it (page_cache_evict_mapping() calls this)
+void writeback_forget_vnode(vnode_t* vn);
+// Throttle the caller while dirty memory is over the dirty ratio
+void balance_dirty_pages(vnode_t* vn);
+
+// Write back a vnode (msync) or everything (sync) and wait for it
+int writeback_sync_vnode(vnode_t* vn);
+int writeback_sync_all(void);
+
+// Ratios are percent of RAM; ages and intervals in milliseconds
+void writeback_set_params(unsigned int dirty_ratio, unsigned int background_ratio,
+                          unsigned int expire_ms, unsigned int interval_ms);
+void writeback_get_stats(writeback_stats_t* stats);
+
+#endif // KERNEL_WRITEBACK_H
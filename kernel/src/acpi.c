@@ -1,3 +1,53 @@
+/**
+ * ACPI Implementation for LimitlessOS SMP Support
+ * 
+ * Simplified ACPI implementation focused on CPU detection for SMP.
+ * 
+ * Copyright (c) 2024 LimitlessOS Project
+ */
+
+#include "acpi.h"
+#include "kernel.h"
+#include <string.h>
+
+/* Global ACPI state */
+acpi_rsdp_t *acpi_rsdp = NULL;
+acpi_rsdt_t *acpi_rsdt = NULL;
+acpi_xsdt_t *acpi_xsdt = NULL;
+acpi_madt_t *acpi_madt = NULL;
+acpi_fadt_t *acpi_fadt = NULL;
+
+acpi_cpu_info_t acpi_cpus[256];
+uint32_t acpi_cpu_count = 0;
+acpi_ioapic_info_t acpi_ioapics[8];
+uint32_t acpi_ioapic_count = 0;
+acpi_irq_override_t acpi_irq_overrides[16];
+uint32_t acpi_irq_override_count = 0;
+
+acpi_srat_t *acpi_srat = NULL;
+acpi_slit_t *acpi_slit = NULL;
+
+/* NUMA topology; node IDs are dense, proximity domains may not be */
+static uint32_t acpi_numa_pxm[ACPI_MAX_NUMA_NODES];
+static uint32_t acpi_numa_nodes = 0;
+static acpi_numa_memblk_t acpi_numa_memblks[ACPI_MAX_NUMA_MEMBLKS];
+static uint32_t acpi_numa_memblk_nr = 0;
+static struct {
+    uint32_t apic_id;
+    uint32_t node;
+} acpi_numa_cpus[256];
+static uint32_t acpi_numa_cpu_nr = 0;
+static bool acpi_numa_parsed = false;
+
+/*
+ * ACPICA glue. It needs the ACPICA tree and its OS services layer,
+ * which the kernel build does not provide; the native MADT/SRAT parser
+ * below is what SMP bring-up and the NUMA allocator use.
+ */
+#ifdef CONFIG_ACPICA
+
+#include "../../acpica/source/include/acpi.h"
+
 // =============================
 // Full ACPI Power Management Logic
 // =============================
@@ -86,19 +136,6 @@ void acpi_disable_battery_management(void) {
     // Disable battery monitoring
     kprintf("[ACPI] Battery management disabled\n");
 }
-/**
- * ACPI Implementation for LimitlessOS SMP Support
- * 
- * Simplified ACPI implementation focused on CPU detection for SMP.
- * 
- * Copyright (c) 2024 LimitlessOS Project
- */
-
-#include "acpi.h"
-#include "kernel.h"
-#include <string.h>
-
-#include "../../acpica/source/include/acpi.h"
 
 // ACPICA initialization for full parity
 int acpi_init(void) {
@@ -147,19 +184,7 @@ ACPI_STATUS acpi_device_callback(ACPI_HANDLE obj_handle, UINT32 nesting_level, v
     return AE_OK;
 }
 
-/* Global ACPI state */
-acpi_rsdp_t *acpi_rsdp = NULL;
-acpi_rsdt_t *acpi_rsdt = NULL;
-acpi_xsdt_t *acpi_xsdt = NULL;
-acpi_madt_t *acpi_madt = NULL;
-acpi_fadt_t *acpi_fadt = NULL;
-
-acpi_cpu_info_t acpi_cpus[256];
-uint32_t acpi_cpu_count = 0;
-acpi_ioapic_info_t acpi_ioapics[8];
-uint32_t acpi_ioapic_count = 0;
-acpi_irq_override_t acpi_irq_overrides[16];
-uint32_t acpi_irq_override_count = 0;
+#else
 
 /**
  * Initialize ACPI subsystem
@@ -194,12 +219,17 @@ int acpi_init(void) {
         return ACPI_ERROR_INVALID;
     }
     
+    /* NUMA topology is optional; single-node machines have no SRAT */
+    acpi_numa_init();
+    
     kprintf("[ACPI] ACPI initialization complete\n");
     kprintf("[ACPI] Found %u CPUs, %u I/O APICs\n", acpi_cpu_count, acpi_ioapic_count);
     
     return ACPI_SUCCESS;
 }
 
+#endif /* CONFIG_ACPICA */
+
 /**
  * Detect RSDP in memory
  */
@@ -522,6 +552,275 @@ uint32_t acpi_map_irq_to_gsi(uint8_t irq) {
     return irq;
 }
 
+/**
+ * Map a proximity domain to a dense node ID, allocating one if needed
+ */
+static int acpi_pxm_to_node(uint32_t pxm) {
+    for (uint32_t i = 0; i < acpi_numa_nodes; i++) {
+        if (acpi_numa_pxm[i] == pxm) {
+            return (int)i;
+        }
+    }
+    
+    if (acpi_numa_nodes >= ACPI_MAX_NUMA_NODES) {
+        kprintf("[ACPI] SRAT: too many proximity domains, ignoring %u\n", pxm);
+        return -1;
+    }
+    
+    acpi_numa_pxm[acpi_numa_nodes] = pxm;
+    return (int)acpi_numa_nodes++;
+}
+
+static void acpi_srat_add_cpu(uint32_t apic_id, uint32_t pxm) {
+    int node = acpi_pxm_to_node(pxm);
+    if (node < 0 || acpi_numa_cpu_nr >= 256) {
+        return;
+    }
+    
+    acpi_numa_cpus[acpi_numa_cpu_nr].apic_id = apic_id;
+    acpi_numa_cpus[acpi_numa_cpu_nr].node = (uint32_t)node;
+    acpi_numa_cpu_nr++;
+    
+    kprintf("[ACPI] SRAT: APIC ID %u -> PXM %u -> Node %d\n", apic_id, pxm, node);
+}
+
+/**
+ * Parse SRAT for CPU and memory affinity
+ */
+int acpi_parse_srat(void) {
+    acpi_srat = (acpi_srat_t*)acpi_find_table(ACPI_SIG_SRAT);
+    if (!acpi_srat) {
+        return ACPI_ERROR_NOT_FOUND;
+    }
+    
+    uint8_t *entry_ptr = acpi_srat->entries;
+    uint8_t *srat_end = (uint8_t*)acpi_srat + acpi_srat->header.length;
+    
+    while (entry_ptr + sizeof(acpi_madt_entry_header_t) <= srat_end) {
+        acpi_madt_entry_header_t *header = (acpi_madt_entry_header_t*)entry_ptr;
+        
+        if (header->length == 0 || entry_ptr + header->length > srat_end) {
+            break;  /* Malformed entry */
+        }
+        
+        switch (header->type) {
+            case ACPI_SRAT_CPU_AFFINITY: {
+                acpi_srat_cpu_affinity_t *cpu = (acpi_srat_cpu_affinity_t*)entry_ptr;
+                if (!(cpu->flags & ACPI_SRAT_ENABLED)) {
+                    break;
+                }
+                
+                /* Revision 1 tables only define the low byte */
+                uint32_t pxm = cpu->proximity_domain_lo;
+                if (acpi_srat->header.revision >= 2) {
+                    pxm |= (uint32_t)cpu->proximity_domain_hi[0] << 8;
+                    pxm |= (uint32_t)cpu->proximity_domain_hi[1] << 16;
+                    pxm |= (uint32_t)cpu->proximity_domain_hi[2] << 24;
+                }
+                acpi_srat_add_cpu(cpu->apic_id, pxm);
+                break;
+            }
+            
+            case ACPI_SRAT_X2APIC_AFFINITY: {
+                acpi_srat_x2apic_affinity_t *x2apic = (acpi_srat_x2apic_affinity_t*)entry_ptr;
+                if (x2apic->flags & ACPI_SRAT_ENABLED) {
+                    acpi_srat_add_cpu(x2apic->x2apic_id, x2apic->proximity_domain);
+                }
+                break;
+            }
+            
+            case ACPI_SRAT_MEM_AFFINITY: {
+                acpi_srat_mem_affinity_t *mem = (acpi_srat_mem_affinity_t*)entry_ptr;
+                if (!(mem->flags & ACPI_SRAT_ENABLED) || mem->length == 0) {
+                    break;
+                }
+                
+                int node = acpi_pxm_to_node(mem->proximity_domain);
+                if (node < 0 || acpi_numa_memblk_nr >= ACPI_MAX_NUMA_MEMBLKS) {
+                    break;
+                }
+                
+                acpi_numa_memblk_t *blk = &acpi_numa_memblks[acpi_numa_memblk_nr++];
+                blk->start = mem->base_address;
+                blk->end = mem->base_address + mem->length;
+                blk->node = (uint32_t)node;
+                blk->hotpluggable = (mem->flags & ACPI_SRAT_HOTPLUGGABLE) != 0;
+                
+                kprintf("[ACPI] SRAT: Node %d PXM %u [0x%08X%08X-0x%08X%08X]%s\n",
+                        node, mem->proximity_domain,
+                        (uint32_t)(blk->start >> 32), (uint32_t)blk->start,
+                        (uint32_t)((blk->end - 1) >> 32), (uint32_t)(blk->end - 1),
+                        blk->hotpluggable ? " hotplug" : "");
+                break;
+            }
+            
+            default:
+                break;
+        }
+        
+        entry_ptr += header->length;
+    }
+    
+    kprintf("[ACPI] SRAT: %u nodes, %u memory ranges, %u CPUs\n",
+            acpi_numa_nodes, acpi_numa_memblk_nr, acpi_numa_cpu_nr);
+    
+    return acpi_numa_nodes ? ACPI_SUCCESS : ACPI_ERROR_NOT_FOUND;
+}
+
+/**
+ * Parse SLIT for the node distance matrix
+ */
+int acpi_parse_slit(void) {
+    acpi_slit = (acpi_slit_t*)acpi_find_table(ACPI_SIG_SLIT);
+    if (!acpi_slit) {
+        return ACPI_ERROR_NOT_FOUND;
+    }
+    
+    uint64_t count = acpi_slit->locality_count;
+    if (count == 0 || count > 256 ||
+        sizeof(acpi_slit_t) + count * count > acpi_slit->header.length) {
+        kprintf("[ACPI] SLIT: bad locality count %u\n", (uint32_t)count);
+        acpi_slit = NULL;
+        return ACPI_ERROR_INVALID;
+    }
+    
+    /* Local distance must be 10 and every remote distance larger */
+    for (uint64_t i = 0; i < count; i++) {
+        for (uint64_t j = 0; j < count; j++) {
+            uint8_t d = acpi_slit->entry[i * count + j];
+            if ((i == j && d != ACPI_NUMA_LOCAL_DISTANCE) ||
+                (i != j && d <= ACPI_NUMA_LOCAL_DISTANCE)) {
+                kprintf("[ACPI] SLIT: invalid distance %u at [%u][%u], ignoring table\n",
+                        d, (uint32_t)i, (uint32_t)j);
+                acpi_slit = NULL;
+                return ACPI_ERROR_INVALID;
+            }
+        }
+    }
+    
+    kprintf("[ACPI] SLIT: %u localities\n", (uint32_t)count);
+    return ACPI_SUCCESS;
+}
+
+/**
+ * Discover the NUMA topology. Safe to call before acpi_init() (the page
+ * allocator needs it first) and idempotent.
+ */
+int acpi_numa_init(void) {
+    if (acpi_numa_parsed) {
+        return acpi_numa_nodes ? ACPI_SUCCESS : ACPI_ERROR_NOT_FOUND;
+    }
+    
+    if (!acpi_rsdt) {
+        if (!acpi_rsdp && acpi_detect_rsdp() != ACPI_SUCCESS) {
+            return ACPI_ERROR_NOT_FOUND;
+        }
+        acpi_parse_tables();
+        if (!acpi_rsdt) {
+            return ACPI_ERROR_NOT_FOUND;
+        }
+    }
+    
+    acpi_numa_parsed = true;
+    
+    if (acpi_parse_srat() != ACPI_SUCCESS) {
+        acpi_numa_nodes = 0;
+        acpi_numa_memblk_nr = 0;
+        acpi_numa_cpu_nr = 0;
+        return ACPI_ERROR_NOT_FOUND;
+    }
+    
+    acpi_parse_slit();
+    return ACPI_SUCCESS;
+}
+
+/**
+ * Get number of NUMA nodes (0 if the firmware has no SRAT)
+ */
+uint32_t acpi_numa_node_count(void) {
+    return acpi_numa_nodes;
+}
+
+/**
+ * Get number of SRAT memory ranges
+ */
+uint32_t acpi_numa_memblk_count(void) {
+    return acpi_numa_memblk_nr;
+}
+
+/**
+ * Get SRAT memory range by index
+ */
+const acpi_numa_memblk_t *acpi_numa_get_memblk(uint32_t index) {
+    if (index >= acpi_numa_memblk_nr) {
+        return NULL;
+    }
+    return &acpi_numa_memblks[index];
+}
+
+/**
+ * Get node of a CPU (MADT index), or -1 if SRAT does not list it
+ */
+int acpi_numa_cpu_to_node(uint32_t cpu_index) {
+    if (cpu_index >= acpi_cpu_count) {
+        return -1;
+    }
+    
+    uint32_t apic_id = acpi_cpus[cpu_index].apic_id;
+    for (uint32_t i = 0; i < acpi_numa_cpu_nr; i++) {
+        if (acpi_numa_cpus[i].apic_id == apic_id) {
+            return (int)acpi_numa_cpus[i].node;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Get SLIT distance between two nodes (10 = local)
+ */
+uint32_t acpi_numa_distance(uint32_t from, uint32_t to) {
+    if (from == to) {
+        return ACPI_NUMA_LOCAL_DISTANCE;
+    }
+    if (!acpi_slit || from >= acpi_numa_nodes || to >= acpi_numa_nodes) {
+        return ACPI_NUMA_REMOTE_DISTANCE;
+    }
+    
+    uint64_t count = acpi_slit->locality_count;
+    uint64_t pxm_from = acpi_numa_pxm[from];
+    uint64_t pxm_to = acpi_numa_pxm[to];
+    if (pxm_from >= count || pxm_to >= count) {
+        return ACPI_NUMA_REMOTE_DISTANCE;
+    }
+    return acpi_slit->entry[pxm_from * count + pxm_to];
+}
+
+/**
+ * Get total bytes of memory SRAT assigns to a node
+ */
+uint64_t acpi_numa_node_memory(uint32_t node) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < acpi_numa_memblk_nr; i++) {
+        if (acpi_numa_memblks[i].node == node) {
+            total += acpi_numa_memblks[i].end - acpi_numa_memblks[i].start;
+        }
+    }
+    return total;
+}
+
+/**
+ * Get mask of CPU indices (first 64) that belong to a node
+ */
+uint64_t acpi_numa_node_cpus(uint32_t node) {
+    uint64_t mask = 0;
+    for (uint32_t cpu = 0; cpu < acpi_cpu_count && cpu < 64; cpu++) {
+        if (acpi_numa_cpu_to_node(cpu) == (int)node) {
+            mask |= 1ULL << cpu;
+        }
+    }
+    return mask;
+}
+
 /**
  * Legacy compatibility functions
  */
@@ -540,6 +839,7 @@ bool acpi_has_power_management(void) {
     return acpi_fadt != NULL;
 }
 
+#ifdef CONFIG_ACPICA
 
 void acpi_enable_power_management(void) {
     // Enable ACPI power management: S-states, device D-states, CPU P/C states
@@ -580,6 +880,17 @@ void acpi_disable_power_management(void) {
     kprintf("[ACPI] Power management disabled\n");
 }
 
+#else
+
+/* S-state and device power control go through ACPICA, see acpi_init() */
+void acpi_enable_power_management(void) {
+}
+
+void acpi_disable_power_management(void) {
+}
+
+#endif /* CONFIG_ACPICA */
+
 /**
  * Memory mapping stubs
  */
@@ -23,6 +23,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include "acpi_numa.h"
 
 // Memory Types
 #define MEMORY_TYPE_CONVENTIONAL    0x01    // Conventional RAM
@@ -934,11 +935,30 @@ void memory_print_info(void)
                      mem_system.mce.error_stats.corrected_errors);
 }
 
+// NUMA topology parsed from SRAT/SLIT (acpi.c)
+static bool acpi_srat_available(void) { return acpi_numa_init() == 0; }
+
+static int acpi_srat_get_node_info(uint32_t node_id, numa_node_t *node)
+{
+    if (node_id >= acpi_numa_node_count()) {
+        return -ENODEV;
+    }
+    
+    node->node_id = node_id;
+    node->cpu_mask = (uint32_t)acpi_numa_node_cpus(node_id);
+    node->total_memory = acpi_numa_node_memory(node_id);
+    node->free_memory = node->total_memory;
+    node->used_memory = 0;
+    return 0;
+}
+
+static uint32_t acpi_slit_get_distance(uint32_t from, uint32_t to)
+{
+    return acpi_numa_distance(from, to);
+}
+
 // Stub functions (would be implemented elsewhere)
 static bool acpi_is_available(void) { return true; }
-static bool acpi_srat_available(void) { return true; }
-static int acpi_srat_get_node_info(uint32_t node_id, numa_node_t *node) { return 0; }
-static uint32_t acpi_slit_get_distance(uint32_t from, uint32_t to) { return 20; }
 static bool uefi_is_available(void) { return true; }
 static void memory_parse_uefi_memory_map(void) { }
 static void memory_parse_e820_memory_map(void) { }
@@ -9,6 +9,8 @@
 
 #include "apic.h"
 #include "acpi.h"
+#include "hrtimer.h"
+#include "isr.h"
 #include "kernel.h"
 #include <string.h>
 
@@ -24,6 +26,8 @@ static uint32_t vector_bitmap[8] = {0};  /* 256 bits for vectors 0-255 */
 /* Default Local APIC base address */
 static uintptr_t apic_base = 0xFEE00000;
 
+static void apic_timer_isr(registers_t *regs);
+
 /**
  * Initialize APIC subsystem
  */
@@ -81,6 +85,8 @@ int apic_init(void) {
     if (is_bsp) {
         ioapic_init();
         apic_setup_irq_routing();
+        /* One handler table for all CPUs; idt_init() installed the gate */
+        register_interrupt_handler(APIC_VECTOR_TIMER, apic_timer_isr);
     }
     
     /* Set up Local Vector Table */
@@ -487,6 +493,60 @@ void apic_timer_stop(void) {
     apic_write(APIC_REG_TIMER_ICR, 0);
 }
 
+void apic_timer_set_mode(uint32_t mode) {
+    if (mode != APIC_TIMER_TSC_DEADLINE) {
+        apic_write(APIC_REG_TIMER_DCR, 0x03);  /* Divide by 16 */
+    }
+    apic_setup_lvt_timer(APIC_VECTOR_TIMER, mode);
+
+    /* The LVT write must be ordered before the first deadline MSR write */
+    if (mode == APIC_TIMER_TSC_DEADLINE) {
+        __asm__ __volatile__("mfence" ::: "memory");
+    }
+}
+
+uint32_t apic_timer_get_count(void) {
+    return apic_read(APIC_REG_TIMER_CCR);
+}
+
+void apic_timer_set_deadline(uint64_t tsc) {
+    write_msr(MSR_IA32_TSC_DEADLINE, tsc);
+}
+
+/**
+ * Measure the timer rate (after the divider) against the TSC, which
+ * clocksource_init() has calibrated already
+ */
+void apic_calibrate_timer(void) {
+    uint64_t start, cycles = (uint64_t)tsc_khz * 10;
+    uint32_t elapsed;
+
+    apic_write(APIC_REG_TIMER_DCR, 0x03);
+    apic_write(APIC_REG_TIMER, APIC_VECTOR_TIMER | LVT_MASKED);
+    apic_write(APIC_REG_TIMER_ICR, 0xFFFFFFFF);
+
+    start = rdtsc_ordered();
+    while (rdtsc_ordered() - start < cycles) {
+        __asm__ __volatile__("pause");
+    }
+    elapsed = 0xFFFFFFFF - apic_read(APIC_REG_TIMER_CCR);
+    apic_write(APIC_REG_TIMER_ICR, 0);
+
+    /* 10 ms window */
+    local_apic.timer_frequency = elapsed ? elapsed * 100 : 1000000;
+    apic_setup_lvt_timer(APIC_VECTOR_TIMER, APIC_TIMER_ONE_SHOT);
+}
+
+void apic_timer_interrupt(void) {
+    apic_eoi();
+    hrtimer_interrupt();
+}
+
+static void apic_timer_isr(registers_t *regs) {
+    (void)regs;
+    apic_timer_interrupt();
+}
+
 /**
  * Vector allocation
  */
@@ -530,6 +590,12 @@ bool cpu_has_apic(void) {
     return (edx & (1 << 9)) != 0;
 }
 
+bool cpu_has_tsc_deadline(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    return (ecx & (1 << 24)) != 0;
+}
+
 bool cpu_has_x2apic(void) {
     uint32_t eax, ebx, ecx, edx;
     __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
@@ -55,7 +55,7 @@ vnode_t* devfs_create_device_node(device_t* dev) {
     
     devfs_node_t* node = kmalloc(sizeof(devfs_node_t));
     if (!node) {
-        kfree(vn);
+        vfs_vnode_free(vn);
         return NULL;
     }
     
@@ -203,6 +203,22 @@ long sys_lseek(int fd, long offset, int whence) {
     return new_offset;
 }
 
+// Vnode behind a file descriptor, for mmap and the page cache
+vnode_t *fd_get_vnode(int fd) {
+    if (!current_fd_table) return NULL;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROCESS) return NULL;
+    
+    file_t *file = current_fd_table->files[fd];
+    return file ? file->vn : NULL;
+}
+
+file_t *fd_get_file(int fd) {
+    if (!current_fd_table) return NULL;
+    if (fd < 0 || fd >= MAX_FILES_PER_PROCESS) return NULL;
+    
+    return current_fd_table->files[fd];
+}
+
 // sys_fstat - get file status
 // TODO: Implement when vfs_stat_t is defined in vfs.h
 /*
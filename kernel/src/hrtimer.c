@@ -0,0 +1,321 @@
+/*
+ * LimitlessOS - High-Resolution Timers
+ *
+ * See hrtimer.h. The clock is the TSC scaled to nanoseconds with a
+ * 32-bit multiplier and a shift; the split multiply below keeps the
+ * 64x32 product from overflowing on i386 without a 128-bit type.
+ *
+ * Each CPU's base holds its queued hrtimers in a cached rbtree, so the
+ * next expiry is the leftmost node. base->expires_next mirrors what the
+ * APIC timer is armed for. Starting a timer only reprograms the APIC
+ * when the timer becomes the new first one; cancelling never does, the
+ * interrupt that then comes early finds nothing due and re-arms for
+ * what is left.
+ */
+
+#include "hrtimer.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "apic.h"
+#include "port_io.h"
+
+#define CLOCK_SHIFT         22
+
+/* PIT channel 2, used once at boot to measure the TSC */
+#define PIT_TICK_RATE       1193182U
+#define PIT_CH2             0x42
+#define PIT_CMD             0x43
+#define PIT_GATE            0x61
+#define CALIBRATE_MS        10
+
+struct hrtimer_cpu_base {
+    spinlock_t lock;
+    uint32_t cpu;
+    struct rb_root_cached active;
+    struct hrtimer *running;        /* Callback in progress, lock dropped */
+    uint64_t expires_next;
+    bool in_hrtirq;                 /* hrtimer_interrupt() reprograms on exit */
+    uint64_t nr_events;
+};
+
+static DEFINE_PER_CPU(struct hrtimer_cpu_base, hrtimer_bases);
+
+uint32_t tsc_khz;
+
+static struct {
+    uint64_t tsc_base;
+    uint32_t ns_mult;               /* ns = cycles * ns_mult >> CLOCK_SHIFT */
+    uint32_t tsc_mult;              /* cycles = ns * tsc_mult >> CLOCK_SHIFT */
+    bool tsc_deadline;              /* APIC timer takes absolute TSC deadlines */
+    uint64_t max_delta_ns;          /* Longest one-shot count the APIC timer holds */
+} clock;
+
+/* ==================== Clock ==================== */
+
+static inline uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mul, uint32_t shift) {
+    uint64_t lo = (uint64_t)(uint32_t)a * mul;
+    uint64_t hi = (a >> 32) * mul;
+
+    return (hi << (32 - shift)) + (lo >> shift);
+}
+
+uint64_t ktime_get_ns(void) {
+    return mul_u64_u32_shr(rdtsc_ordered() - clock.tsc_base, clock.ns_mult, CLOCK_SHIFT);
+}
+
+uint64_t ktime_to_tsc(uint64_t ns) {
+    return clock.tsc_base + mul_u64_u32_shr(ns, clock.tsc_mult, CLOCK_SHIFT);
+}
+
+/*
+ * Count TSC cycles across CALIBRATE_MS of PIT channel 2 in one-shot
+ * mode; the gate output goes high when the count runs out.
+ */
+static uint32_t pit_calibrate_tsc(void) {
+    uint32_t latch = PIT_TICK_RATE / (1000 / CALIBRATE_MS);
+    uint64_t t1, t2;
+
+    outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+    outb(PIT_CMD, 0xB0);
+    outb(PIT_CH2, latch & 0xFF);
+    outb(PIT_CH2, latch >> 8);
+
+    t1 = rdtsc_ordered();
+    while (!(inb(PIT_GATE) & 0x20)) {
+        __asm__ __volatile__("pause");
+    }
+    t2 = rdtsc_ordered();
+
+    return (uint32_t)((t2 - t1) / CALIBRATE_MS);
+}
+
+void clocksource_init(void) {
+    tsc_khz = pit_calibrate_tsc();
+    if (!tsc_khz) {
+        tsc_khz = 1000000;      /* No PIT: assume 1 GHz rather than divide by zero */
+    }
+
+    clock.ns_mult = (uint32_t)((NSEC_PER_MSEC << CLOCK_SHIFT) / tsc_khz);
+    clock.tsc_mult = (uint32_t)(((uint64_t)tsc_khz << CLOCK_SHIFT) / NSEC_PER_MSEC);
+    clock.tsc_deadline = cpu_has_tsc_deadline();
+    clock.tsc_base = rdtsc_ordered();
+}
+
+/* ==================== Clock Events ==================== */
+
+static void clockevent_program(uint64_t expires) {
+    uint64_t now, delta;
+    uint32_t count;
+
+    if (clock.tsc_deadline) {
+        /* 0 disarms; a deadline already passed fires at once */
+        apic_timer_set_deadline(expires == KTIME_MAX ? 0 : ktime_to_tsc(expires));
+        return;
+    }
+
+    if (expires == KTIME_MAX) {
+        apic_timer_stop();
+        return;
+    }
+
+    now = ktime_get_ns();
+    delta = expires > now ? expires - now : 0;
+    if (delta > clock.max_delta_ns) {
+        delta = clock.max_delta_ns;     /* Fires early and re-arms for the rest */
+    }
+
+    count = (uint32_t)(delta * local_apic.timer_frequency / NSEC_PER_SEC);
+    apic_timer_start(count ? count : 1);
+}
+
+/* ==================== Queueing ==================== */
+
+static bool hrtimer_less(const struct rb_node *a, const struct rb_node *b) {
+    return rb_entry(a, struct hrtimer, node)->expires <
+           rb_entry(b, struct hrtimer, node)->expires;
+}
+
+/* Called with base->lock held; returns true if timer is now the first */
+static bool enqueue_hrtimer(struct hrtimer *timer, struct hrtimer_cpu_base *base) {
+    timer->base = base;
+    timer->queued = true;
+    return rb_add_cached(&timer->node, &base->active, hrtimer_less);
+}
+
+/* Called with base->lock held */
+static int remove_hrtimer(struct hrtimer *timer, struct hrtimer_cpu_base *base) {
+    if (!timer->queued) {
+        return 0;
+    }
+    rb_erase_cached(&timer->node, &base->active);
+    RB_CLEAR_NODE(&timer->node);
+    timer->queued = false;
+    return 1;
+}
+
+static inline uint64_t hrtimer_next_expiry(struct hrtimer_cpu_base *base) {
+    struct rb_node *first = rb_first_cached(&base->active);
+
+    return first ? rb_entry(first, struct hrtimer, node)->expires : KTIME_MAX;
+}
+
+/* timer->base only changes under the old base's lock; recheck it once held */
+static struct hrtimer_cpu_base *lock_hrtimer_base(struct hrtimer *timer, unsigned long *flags) {
+    for (;;) {
+        struct hrtimer_cpu_base *base = __atomic_load_n(&timer->base, __ATOMIC_RELAXED);
+
+        spin_lock_irqsave(&base->lock, flags);
+        if (base == timer->base) {
+            return base;
+        }
+        spin_unlock_irqrestore(&base->lock, *flags);
+    }
+}
+
+void hrtimer_init(struct hrtimer *timer, enum hrtimer_restart (*function)(struct hrtimer *)) {
+    RB_CLEAR_NODE(&timer->node);
+    timer->expires = 0;
+    timer->function = function;
+    timer->base = this_cpu_ptr(&hrtimer_bases);
+    timer->queued = false;
+}
+
+void hrtimer_start(struct hrtimer *timer, uint64_t expires, enum hrtimer_mode mode) {
+    struct hrtimer_cpu_base *base, *new_base;
+    unsigned long flags;
+
+    if (mode == HRTIMER_MODE_REL) {
+        expires += ktime_get_ns();
+    }
+
+    base = lock_hrtimer_base(timer, &flags);
+    remove_hrtimer(timer, base);
+
+    /* Stay put while the callback runs elsewhere, hrtimer_cancel() waits on it */
+    new_base = this_cpu_ptr(&hrtimer_bases);
+    if (base != new_base && base->running != timer) {
+        timer->base = new_base;
+        spin_unlock(&base->lock);
+        base = new_base;
+        spin_lock(&base->lock);
+        /* A racing start may have queued it here in the meantime */
+        remove_hrtimer(timer, base);
+    }
+
+    timer->expires = expires;
+    if (enqueue_hrtimer(timer, base) && base == new_base && !base->in_hrtirq &&
+        expires < base->expires_next) {
+        base->expires_next = expires;
+        clockevent_program(expires);
+    }
+
+    spin_unlock_irqrestore(&base->lock, flags);
+}
+
+int hrtimer_try_to_cancel(struct hrtimer *timer) {
+    struct hrtimer_cpu_base *base;
+    unsigned long flags;
+    int ret = -1;
+
+    base = lock_hrtimer_base(timer, &flags);
+    if (base->running != timer) {
+        ret = remove_hrtimer(timer, base);
+    }
+    spin_unlock_irqrestore(&base->lock, flags);
+
+    return ret;
+}
+
+int hrtimer_cancel(struct hrtimer *timer) {
+    for (;;) {
+        int ret = hrtimer_try_to_cancel(timer);
+        if (ret >= 0) {
+            return ret;
+        }
+        __asm__ __volatile__("pause" ::: "memory");
+    }
+}
+
+uint64_t hrtimer_forward(struct hrtimer *timer, uint64_t now, uint64_t interval) {
+    uint64_t delta, orun;
+
+    if (now < timer->expires) {
+        return 0;
+    }
+
+    /* Missed periods are skipped, not replayed */
+    delta = now - timer->expires;
+    orun = delta < interval ? 1 : delta / interval + 1;
+    timer->expires += orun * interval;
+    return orun;
+}
+
+/* ==================== Expiry ==================== */
+
+/* Called with base->lock held; drops it around each callback */
+static void run_hrtimers(struct hrtimer_cpu_base *base, uint64_t now) {
+    struct rb_node *node;
+
+    while ((node = rb_first_cached(&base->active))) {
+        struct hrtimer *timer = rb_entry(node, struct hrtimer, node);
+        enum hrtimer_restart restart;
+
+        if (timer->expires > now) {
+            break;
+        }
+
+        remove_hrtimer(timer, base);
+        base->running = timer;
+
+        spin_unlock(&base->lock);
+        restart = timer->function(timer);
+        spin_lock(&base->lock);
+
+        /* Unless the callback re-armed it itself, possibly elsewhere */
+        if (restart == HRTIMER_RESTART && !timer->queued && timer->base == base) {
+            enqueue_hrtimer(timer, base);
+        }
+        base->running = NULL;
+    }
+}
+
+void hrtimer_interrupt(void) {
+    struct hrtimer_cpu_base *base = this_cpu_ptr(&hrtimer_bases);
+    uint64_t next;
+
+    spin_lock(&base->lock);
+    base->nr_events++;
+    base->in_hrtirq = true;
+
+    run_hrtimers(base, ktime_get_ns());
+
+    /* Anything that fell due meanwhile makes the APIC fire again at once */
+    next = hrtimer_next_expiry(base);
+    base->in_hrtirq = false;
+    base->expires_next = next;
+    clockevent_program(next);
+    spin_unlock(&base->lock);
+}
+
+void hrtimers_init_cpu(uint32_t cpu) {
+    struct hrtimer_cpu_base *base = per_cpu_ptr(&hrtimer_bases, cpu);
+
+    spin_lock_init(&base->lock);
+    base->cpu = cpu;
+    base->active = RB_ROOT_CACHED;
+    base->running = NULL;
+    base->expires_next = KTIME_MAX;
+    base->in_hrtirq = false;
+    base->nr_events = 0;
+
+    if (clock.tsc_deadline) {
+        apic_timer_set_mode(APIC_TIMER_TSC_DEADLINE);
+        return;
+    }
+
+    apic_timer_set_mode(APIC_TIMER_ONE_SHOT);
+    if (!local_apic.timer_frequency) {
+        apic_calibrate_timer();
+    }
+    clock.max_delta_ns = 0xFFFFFFFFULL * NSEC_PER_SEC / local_apic.timer_frequency;
+}
@@ -16,6 +16,7 @@
 #include <string.h>
 
 #include "hal/hal_kernel.h"
+#include "apic.h"
 
 // Declare the external ISR stub functions from assembly
 extern void isr0();
@@ -69,6 +70,9 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 
+// Local APIC timer
+extern void isr239();
+
 // System call interrupt
 extern void isr128();
 
@@ -182,6 +186,9 @@ void idt_init()
     idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
     
+    // Local APIC timer: every CPU's tick and hrtimers (see apic.c)
+    idt_set_gate(APIC_VECTOR_TIMER, (uint32_t)isr239, 0x08, 0x8E);
+    
     // Set up system call handler (int 0x80 = 128)
     // Flags: 0xEE = Present, Ring 3 (user mode can call), 32-bit Interrupt Gate
     idt_set_gate(128, (uint32_t)isr128, 0x08, 0xEE);
@@ -189,3 +196,13 @@ void idt_init()
     // Load the IDT
     idt_flush((uint32_t)&idt_ptr);
 }
+
+/**
+ * Load the IDT built by idt_init() on this CPU
+ * 
+ * Application processors share the boot CPU's table.
+ */
+void idt_load(void)
+{
+    idt_flush((uint32_t)&idt_ptr);
+}
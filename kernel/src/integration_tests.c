@@ -13,12 +13,25 @@
 #include "kernel.h"
 #include "vfs.h"
 #include "device.h"
+#include "rbtree.h"
+#include "page_cache.h"
+#include "writeback.h"
+#include "hal/hal_kernel.h"
+#include "sched_bench.h"
+#include "spinlock.h"
+#include "isr.h"
+
+// Only linked into SMP scheduler builds
+extern int sched_bench_run(const sched_bench_params_t *params, sched_bench_result_t *res) __attribute__((weak));
+
+// Only linked with the NUMA allocator (mm/pmm.c)
+extern int pmm_numa_selftest(void) __attribute__((weak));
 
 // Test result tracking
 typedef struct {
     const char* name;
     int (*test_func)(void);
-    int result;  // 0 = not run, 1 = pass, -1 = fail
+    int result;  // 0 = skipped, 1 = pass, -1 = fail
     const char* error_msg;
 } test_case_t;
 
@@ -26,6 +39,7 @@ static const char* last_error = NULL;
 
 #define TEST_PASS(msg) do { last_error = NULL; kprintf("    [PASS] %s\n", msg); return 1; } while(0)
 #define TEST_FAIL(msg) do { last_error = msg; kprintf("    [FAIL] %s\n", msg); return -1; } while(0)
+#define TEST_SKIP(msg) do { last_error = NULL; kprintf("    [SKIP] %s\n", msg); return 0; } while(0)
 #define ASSERT(cond, msg) if (!(cond)) TEST_FAIL(msg)
 
 // Test 1: Memory allocation stress test
@@ -92,7 +106,7 @@ static int test_vfs_memory_integration(void) {
     
     // Cleanup
     kfree(buffer);
-    kfree(vn);
+    vfs_vnode_free(vn);
     
     TEST_PASS("VFS + Memory integration successful");
 }
@@ -340,12 +354,276 @@ static int test_file_io_simulation(void) {
     
     // Cleanup
     kfree(file_data);
-    kfree(fd->vnode);
+    vfs_vnode_free(fd->vnode);
     kfree(fd);
     
     TEST_PASS("End-to-end file I/O simulation successful");
 }
 
+// Test 9: RB-tree ordering as the CFS runqueue uses it
+typedef struct {
+    struct rb_node node;
+    u64 key;
+} rb_test_entry_t;
+
+#define RB_TEST_NODES 512
+
+static rb_test_entry_t rb_test_nodes[RB_TEST_NODES];
+
+static bool rb_test_less(const struct rb_node* a, const struct rb_node* b) {
+    return rb_entry(a, rb_test_entry_t, node)->key <
+           rb_entry(b, rb_test_entry_t, node)->key;
+}
+
+static int rb_test_sorted(struct rb_root_cached* tree, int expect) {
+    int count = 0;
+    u64 prev = 0;
+    for (struct rb_node* n = rb_first_cached(tree); n; n = rb_next(n)) {
+        u64 key = rb_entry(n, rb_test_entry_t, node)->key;
+        if (count && key < prev) return -1;
+        prev = key;
+        count++;
+    }
+    return count == expect ? 0 : -1;
+}
+
+static int test_rbtree_runqueue(void) {
+    kprintf("  Testing rb-tree runqueue ordering...\n");
+    
+    struct rb_root_cached tree = RB_ROOT_CACHED;
+    u32 seed = 12345;
+    
+    // Insert keys with plenty of duplicates, like equal vruntimes
+    for (int i = 0; i < RB_TEST_NODES; i++) {
+        seed = seed * 1103515245 + 12345;
+        rb_test_nodes[i].key = (seed >> 16) % 1000;
+        rb_add_cached(&rb_test_nodes[i].node, &tree, rb_test_less);
+        ASSERT(rb_first_cached(&tree) == rb_first(&tree.rb_root), "Cached leftmost is stale after insert");
+    }
+    ASSERT(rb_validate(&tree.rb_root) >= 0, "Red-black invariants broken after insert");
+    ASSERT(rb_test_sorted(&tree, RB_TEST_NODES) == 0, "In-order walk not sorted after insert");
+    
+    // Erase every third node, including the leftmost ones
+    int left = RB_TEST_NODES;
+    for (int i = 0; i < RB_TEST_NODES; i += 3) {
+        rb_erase_cached(&rb_test_nodes[i].node, &tree);
+        ASSERT(RB_EMPTY_NODE(&rb_test_nodes[i].node), "Erased node not cleared");
+        ASSERT(rb_first_cached(&tree) == rb_first(&tree.rb_root), "Cached leftmost is stale after erase");
+        left--;
+    }
+    ASSERT(rb_validate(&tree.rb_root) >= 0, "Red-black invariants broken after erase");
+    ASSERT(rb_test_sorted(&tree, left) == 0, "In-order walk not sorted after erase");
+    
+    // Drain from the left the way pick_next_task() does
+    u64 prev = 0;
+    while (left > 0) {
+        struct rb_node* n = rb_first_cached(&tree);
+        ASSERT(n != NULL, "Tree emptied early");
+        u64 key = rb_entry(n, rb_test_entry_t, node)->key;
+        ASSERT(key >= prev, "Leftmost picks out of order");
+        prev = key;
+        rb_erase_cached(n, &tree);
+        left--;
+    }
+    ASSERT(RB_EMPTY_ROOT(&tree.rb_root) && rb_first_cached(&tree) == NULL, "Tree not empty after drain");
+    
+    TEST_PASS("RB-tree ordering and cached leftmost correct");
+}
+
+// Test 10: rwlock readers in interrupt context get past a waiting writer
+static int test_rwlock_irq_reader(void) {
+    kprintf("  Testing rwlock reader in interrupt context...\n");
+    
+    rwlock_t lock;
+    rwlock_init(&lock);
+    
+    ASSERT(read_trylock(&lock), "Uncontended read_trylock failed");
+    ASSERT(!write_trylock(&lock), "Writer got in past a reader");
+    
+    // Pose as a writer waiting for that reader to drain: it holds
+    // wait_lock and has set the waiting bit (0x100)
+    spin_lock(&lock.wait_lock);
+    __atomic_or_fetch(&lock.cnts, 0x100, __ATOMIC_RELAXED);
+    
+    // A reader in task context would queue behind the writer now; one in
+    // an interrupt on the reader's CPU must get through or it deadlocks
+    this_cpu_inc(hardirq_count);
+    read_lock(&lock);
+    this_cpu_dec(hardirq_count);
+    ASSERT((lock.cnts >> 9) == 2, "Interrupt reader not counted");
+    read_unlock(&lock);
+    read_unlock(&lock);
+    
+    __atomic_and_fetch(&lock.cnts, ~0x100U, __ATOMIC_RELAXED);
+    spin_unlock(&lock.wait_lock);
+    
+    ASSERT(write_trylock(&lock), "Writer could not take the drained lock");
+    ASSERT(!read_trylock(&lock), "Reader got in past a writer");
+    write_unlock(&lock);
+    ASSERT(lock.cnts == 0, "Lock word not clean after unlock");
+    
+    TEST_PASS("Interrupt reader passed a waiting writer");
+}
+
+// Test 11: Scheduler benchmarks produce sane numbers
+static int test_sched_bench(void) {
+    kprintf("  Testing scheduler benchmarks...\n");
+
+    // Result arithmetic, shared with sched_bench.c through the header
+    static const uint32_t sorted[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    ASSERT(sched_bench_percentile(sorted, 10, 500) == 5, "p50 of 1..10 is not 5");
+    ASSERT(sched_bench_percentile(sorted, 10, 999) == 9, "p99.9 of 1..10 is not 9");
+    ASSERT(sched_bench_percentile(sorted, 10, 1000) == 10, "p100 of 1..10 is not 10");
+    ASSERT(sched_bench_percentile(sorted, 0, 500) == 0, "Percentile of no samples is not 0");
+
+    static const uint64_t even[] = {50, 50, 50, 50};
+    static const uint64_t one_hog[] = {100, 0, 0, 0};
+    ASSERT(sched_bench_jain(even, 4) == 1000, "Equal runtimes are not perfectly fair");
+    ASSERT(sched_bench_jain(one_hog, 4) == 250, "One of four runtimes is not 1/n fair");
+
+    if (!sched_bench_run) {
+        TEST_PASS("Result arithmetic correct; live runs need make sched-bench");
+    }
+
+    // Short runs; this checks the harness, not the scheduler's speed
+    sched_bench_params_t params = SCHED_BENCH_PARAMS_DEFAULT;
+    sched_bench_result_t res;
+    params.ctxsw_iters = 1000;
+    params.wakeup_samples = 500;
+    params.fair_ms = 200;
+    params.pipe_msgs = 1000;
+
+    ASSERT(sched_bench_run(&params, &res) == 0, "Benchmark run failed");
+    ASSERT(res.ctxsw_switches > 0 && res.ctxsw_ns > 0, "No context switches measured");
+    ASSERT(res.wakeup_samples > 0, "No wakeups measured");
+    ASSERT(res.wakeup_p50_ns <= res.wakeup_p99_ns &&
+           res.wakeup_p99_ns <= res.wakeup_p999_ns &&
+           res.wakeup_p999_ns <= res.wakeup_max_ns, "Wakeup percentiles out of order");
+    ASSERT(res.fair_jain >= 700, "CPU hogs got badly uneven runtime");
+    ASSERT(res.pipe_round_trips > 0, "No pipe round trips completed");
+
+    TEST_PASS("Scheduler benchmarks completed");
+}
+
+// Test 12: Page cache lookups, tags, writeback and reclaim
+static int test_page_cache(void) {
+    kprintf("  Testing page cache...\n");
+
+    int err = page_cache_selftest();
+    if (err) {
+        kprintf("    page_cache_selftest() = %d\n", err);
+        TEST_FAIL("Page cache self-test failed");
+    }
+
+    TEST_PASS("Page cache self-test passed");
+}
+
+// Test 13: Buffered writes reach the vnode through writeback
+static u32 wb_test_writes;
+static u64 wb_test_bytes;
+
+static long wb_test_read(vnode_t* vn, u64 off, void* buf, size_t len) {
+    (void)vn;
+    (void)off;
+    memset(buf, 0, len);
+    return (long)len;
+}
+
+static long wb_test_write(vnode_t* vn, u64 off, const void* buf, size_t len) {
+    (void)vn;
+    // Every page of the test file starts with its page number
+    if (((const u8*)buf)[0] != (u8)(off / PAGE_SIZE)) return -1;
+    wb_test_writes++;
+    wb_test_bytes += len;
+    return (long)len;
+}
+
+// Pages of the block-mapped file sit back to back on storage device 0
+static int wb_test_bmap(vnode_t* vn, u64 index, u64* dev, u64* lba) {
+    (void)vn;
+    *dev = 0;
+    *lba = 2048 + index * (PAGE_SIZE / 512);
+    return 0;
+}
+
+static int test_writeback(void) {
+    kprintf("  Testing page cache writeback...\n");
+
+    static const vnode_ops_t ops = { .read = wb_test_read, .write = wb_test_write };
+    vnode_t* vn = (vnode_t*)kmalloc(sizeof(vnode_t));
+    ASSERT(vn != NULL, "Failed to allocate vnode");
+    memset(vn, 0, sizeof(*vn));
+    vn->type = VNODE_FILE;
+    vn->ops = &ops;
+
+    // Three full pages and a partial one
+    const size_t len = 3 * PAGE_SIZE + 100;
+    u8* buf = (u8*)kmalloc(len);
+    ASSERT(buf != NULL, "Failed to allocate buffer");
+    memset(buf, 0xA5, len);
+    for (size_t p = 0; p * PAGE_SIZE < len; p++) buf[p * PAGE_SIZE] = (u8)p;
+
+    writeback_stats_t before, after;
+    writeback_get_stats(&before);
+    wb_test_writes = 0;
+    wb_test_bytes = 0;
+
+    ASSERT(page_cache_write(vn, 0, buf, len) == (long)len, "Buffered write failed");
+    ASSERT(vn->size == len, "File size not extended");
+    ASSERT(writeback_sync_vnode(vn) == 0, "Writeback reported an error");
+
+    page_cache_page_t* pg;
+    ASSERT(page_cache_find_tagged(vn, 0, PAGE_CACHE_TAG_DIRTY, &pg, 1) == 0, "Dirty pages left after sync");
+    ASSERT(wb_test_writes == 4 && wb_test_bytes == len, "Written data does not match the file");
+    writeback_get_stats(&after);
+    ASSERT(after.fallback_pages - before.fallback_pages == 4, "Pages not counted as written");
+
+    // Freeing a dirty vnode drops it from the flusher's list unwritten
+    ASSERT(page_cache_write(vn, 0, buf, 1) == 1, "Buffered rewrite failed");
+    vfs_vnode_free(vn);
+    ASSERT(writeback_sync_all() == 0, "Sync after free failed");
+    ASSERT(wb_test_writes == 4, "Freed vnode was written back");
+
+    // A block-mapped file goes to the device as one request per run
+    ASSERT(hal_storage_get_device_count() > 0, "No storage device to write to");
+    static const vnode_ops_t bmap_ops = { .read = wb_test_read, .write = wb_test_write, .bmap = wb_test_bmap };
+    vn = (vnode_t*)kmalloc(sizeof(vnode_t));
+    ASSERT(vn != NULL, "Failed to allocate vnode");
+    memset(vn, 0, sizeof(*vn));
+    vn->type = VNODE_FILE;
+    vn->ops = &bmap_ops;
+
+    writeback_get_stats(&before);
+    ASSERT(page_cache_write(vn, 0, buf, 3 * PAGE_SIZE) == (long)(3 * PAGE_SIZE), "Buffered write failed");
+    ASSERT(writeback_sync_vnode(vn) == 0, "Batched writeback reported an error");
+    writeback_get_stats(&after);
+    ASSERT(after.requests - before.requests == 1, "Contiguous run not sent as one request");
+    ASSERT(after.pages_written - before.pages_written == 3, "Batched pages not counted");
+    ASSERT(after.fallback_pages == before.fallback_pages, "Block-mapped pages took the fallback");
+    ASSERT(wb_test_writes == 4, "Block-mapped pages went through the write op");
+    vfs_vnode_free(vn);
+
+    kfree(buf);
+    TEST_PASS("Writeback wrote every dirty page once");
+}
+
+// Test 14: NUMA allocations stay on the requested node
+static int test_numa_node_local(void) {
+    kprintf("  Testing node-local page allocation...\n");
+
+    if (!pmm_numa_selftest) {
+        TEST_SKIP("NUMA allocator not linked (kernel/src/mm/pmm.c)");
+    }
+
+    int err = pmm_numa_selftest();
+    if (err) {
+        kprintf("    pmm_numa_selftest() = %d\n", err);
+        TEST_FAIL("NUMA allocator self-test failed");
+    }
+
+    TEST_PASS("Blocks came from the requested node and merged on free");
+}
+
 // Define all test cases
 static test_case_t test_cases[] = {
     {"Memory Allocation Stress", test_memory_stress, 0, NULL},
@@ -356,6 +634,12 @@ static test_case_t test_cases[] = {
     {"Multi-Device Concurrent Access", test_multi_device_access, 0, NULL},
     {"Complex Memory Patterns", test_memory_patterns, 0, NULL},
     {"End-to-End File I/O Simulation", test_file_io_simulation, 0, NULL},
+    {"RB-Tree Runqueue Ordering", test_rbtree_runqueue, 0, NULL},
+    {"RW-Lock Interrupt Reader", test_rwlock_irq_reader, 0, NULL},
+    {"Scheduler Benchmarks", test_sched_bench, 0, NULL},
+    {"Page Cache", test_page_cache, 0, NULL},
+    {"Page Cache Writeback", test_writeback, 0, NULL},
+    {"NUMA Node-Local Allocation", test_numa_node_local, 0, NULL},
     {NULL, NULL, 0, NULL}
 };
 
@@ -370,6 +654,7 @@ int run_integration_tests(void) {
     int total = 0;
     int passed = 0;
     int failed = 0;
+    int skipped = 0;
     
     // Count tests
     for (int i = 0; test_cases[i].name != NULL; i++) {
@@ -386,6 +671,8 @@ int run_integration_tests(void) {
         
         if (result > 0) {
             passed++;
+        } else if (result == 0) {
+            skipped++;
         } else {
             failed++;
             if (last_error) {
@@ -401,6 +688,7 @@ int run_integration_tests(void) {
     kprintf("  Total:   %d\n", total);
     kprintf("  Passed:  %d\n", passed);
     kprintf("  Failed:  %d\n", failed);
+    kprintf("  Skipped: %d\n", skipped);
     kprintf("\n");
     
     if (failed == 0) {
@@ -10,10 +10,19 @@
 #include <isr.h>
 #include <common.h>
 #include <drivers/vga_text.h>
+#include <percpu.h>
 
 // Array of function pointers for custom interrupt handlers
 isr_t interrupt_handlers[256];
 
+DEFINE_PER_CPU(uint32_t, hardirq_count);
+
+// Only linked into kernels that have RCU / dynticks
+extern void rcu_qs(uint32_t cpu) __attribute__((weak));
+extern void rcu_irq_enter(uint32_t cpu) __attribute__((weak));
+extern void rcu_irq_exit(uint32_t cpu) __attribute__((weak));
+extern void tick_nohz_irq_exit(void) __attribute__((weak));
+
 // Exception messages for CPU exceptions
 static const char *exception_messages[] = {
     "Division By Zero",
@@ -61,6 +70,50 @@ void register_interrupt_handler(uint8_t n, isr_t handler)
     interrupt_handlers[n] = handler;
 }
 
+/**
+ * Report an RCU quiescent state when about to return to user mode
+ * 
+ * Whether this is a system call returning or a tick that interrupted
+ * user code, the CPU holds no RCU-protected pointers at this point, so
+ * a CPU that stays in user mode does not hold up grace periods.
+ */
+static inline void rcu_user_return(registers_t *regs)
+{
+    if (rcu_qs && (regs->cs & 3) == 3)
+    {
+        rcu_qs(smp_processor_id());
+    }
+}
+
+/**
+ * Common entry/exit of every hardware interrupt handler
+ * 
+ * Counts the nesting for in_interrupt(), lets RCU see readers in handlers
+ * that interrupted dynticks idle, and re-aims a stopped tick in case the
+ * handler queued a timer.
+ */
+static inline void hardirq_enter(void)
+{
+    this_cpu_inc(hardirq_count);
+    if (rcu_irq_enter)
+    {
+        rcu_irq_enter(smp_processor_id());
+    }
+}
+
+static inline void hardirq_exit(void)
+{
+    if (tick_nohz_irq_exit)
+    {
+        tick_nohz_irq_exit();
+    }
+    if (rcu_irq_exit)
+    {
+        rcu_irq_exit(smp_processor_id());
+    }
+    this_cpu_dec(hardirq_count);
+}
+
 /**
  * Main ISR handler - called from assembly stub
  * 
@@ -70,11 +123,23 @@ void register_interrupt_handler(uint8_t n, isr_t handler)
  */
 void isr_handler(registers_t *regs)
 {
+    // Vectors above the exceptions other than int 0x80 are hardware (APIC)
+    bool hardirq = regs->int_no >= 32 && regs->int_no != 128;
+
     // If a custom handler has been registered for this interrupt, call it
     if (interrupt_handlers[regs->int_no] != 0)
     {
         isr_t handler = interrupt_handlers[regs->int_no];
+        if (hardirq)
+        {
+            hardirq_enter();
+        }
         handler(regs);
+        if (hardirq)
+        {
+            hardirq_exit();
+        }
+        rcu_user_return(regs);
     }
     else
     {
@@ -127,6 +192,9 @@ void irq_handler(registers_t *regs)
     if (interrupt_handlers[regs->int_no] != 0)
     {
         isr_t handler = interrupt_handlers[regs->int_no];
+        hardirq_enter();
         handler(regs);
+        hardirq_exit();
     }
+    rcu_user_return(regs);
 }
@@ -12,32 +12,8 @@
 // PRODUCTION CONCURRENCY PRIMITIVES - Critical Fix
 // =====================================================================
 
-// Spinlock implementation for atomic memory operations
-typedef struct {
-    volatile uint32_t locked;
-} spinlock_t;
-
-#define SPINLOCK_INIT { 0 }
-
-static inline void spin_lock(spinlock_t *lock) {
-    while (__sync_lock_test_and_set(&lock->locked, 1)) {
-        // Busy wait with pause instruction to reduce CPU power  
-        #ifdef __GNUC__
-        __asm__ __volatile__("pause" ::: "memory");
-        #else
-        // Fallback for other compilers
-        for (volatile int i = 0; i < 10; i++);
-        #endif
-    }
-}
-
-static inline void spin_unlock(spinlock_t *lock) {
-    __sync_lock_release(&lock->locked);
-}
-
-static inline int spin_trylock(spinlock_t *lock) {
-    return !__sync_lock_test_and_set(&lock->locked, 1);
-}
+// Queued spinlocks shared with the rest of the kernel
+#include "spinlock.h"
 
 // Memory barriers for proper ordering
 #define memory_barrier() __asm__ __volatile__("mfence" ::: "memory")
@@ -761,4 +737,56 @@ void* limitless_numa_alloc(uint32_t node, size_t size) {
     }
     
     return ptr;
-}
\ No newline at end of file
+}
+
+// =====================================================================
+// Huge Page Support
+// =====================================================================
+
+#define HUGEPAGE_ORDER  9   // HUGE_PAGE_2MB / PAGE_SIZE
+
+/**
+ * Huge pages are naturally aligned buddy blocks of order 9 or above
+ */
+int limitless_hugepage_init() {
+    return buddy_initialized ? 0 : -1;
+}
+
+static uint32_t hugepage_order(size_t size) {
+    uint64_t count = (size + HUGE_PAGE_2MB - 1) / HUGE_PAGE_2MB;
+    uint32_t order = HUGEPAGE_ORDER;
+    while ((1ULL << (order - HUGEPAGE_ORDER)) < count) {
+        order++;
+    }
+    return order;
+}
+
+/**
+ * Allocate 2MB-aligned memory, rounded up to a power of two huge pages
+ */
+void* limitless_hugepage_alloc(size_t size, uint32_t numa_node) {
+    if (!buddy_initialized || size == 0) return NULL;
+
+    uint32_t order = hugepage_order(size);
+    if (order > global_buddy.max_order) return NULL;
+
+    void *ptr = limitless_buddy_alloc(order);
+    if (!ptr) return NULL;
+
+    // Blocks are aligned relative to the buddy base; it must be 2MB aligned too
+    if ((uint64_t)ptr & (HUGE_PAGE_2MB - 1)) {
+        limitless_buddy_free(ptr, order);
+        return NULL;
+    }
+
+    if (numa_initialized && numa_node < numa_topology.node_count) {
+        numa_topology.nodes[numa_node].free_memory -= (1ULL << order) * PAGE_SIZE;
+    }
+
+    return ptr;
+}
+
+void limitless_hugepage_free(void *addr, size_t size) {
+    if (!addr || size == 0) return;
+    limitless_buddy_free(addr, hugepage_order(size));
+}
@@ -0,0 +1,421 @@
+/*
+ * LimitlessOS - Transparent Huge Pages
+ *
+ * Anonymous memory is backed by 2 MiB pages wherever the region allows:
+ *  - Fault time: the first touch of an aligned, unpopulated 2 MiB range of
+ *    an anonymous region maps a whole huge page at the page-directory level.
+ *  - khugepaged: ranges that had to be populated with 4 KiB pages (the
+ *    region was grown, or a PT already existed) are copied into a huge page
+ *    once they are mostly populated, and the page table is freed.
+ *  - Split: partial munmap/mprotect turns the huge mapping back into a page
+ *    table of 512 entries over the same frames, so single pages can go.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "kernel.h"
+#include "vmm.h"
+#include "scheduler.h"
+#include "mm/pmm_simple.h"
+#include "mm/huge_memory.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "hal/hal_kernel.h"
+
+#define KHUGEPAGED_MAX_SPACES       64
+#define KHUGEPAGED_PAGES_TO_SCAN    (HPAGE_NR_PAGES * 8)
+#define KHUGEPAGED_SLEEP_MS         10000
+
+static int thp_mode = THP_ALWAYS;
+static unsigned int thp_max_ptes_none = HPAGE_NR_PAGES / 8;
+static DEFINE_PER_CPU(thp_stats_t, thp_stats);
+
+static struct {
+    spinlock_t lock;            // Registry and cursor
+    vmm_aspace_t* spaces[KHUGEPAGED_MAX_SPACES];
+    unsigned int nr_spaces;
+    unsigned int cursor;        // Space currently being scanned
+    vaddr_t scan_addr;          // Next 2 MiB range to look at in it
+    vmm_aspace_t* busy;         // Space a collapse is working on, unlocked
+} khugepaged = { .lock = SPINLOCK_INIT };
+
+// Only linked into SMP kernels; runs func on every other online CPU
+extern void smp_call_function(void (*func)(void*), void* data, bool wait) __attribute__((weak));
+
+/* Collapse rewrites a live page table; keep this CPU from running anything else */
+static inline unsigned long thp_irq_save(void) {
+    unsigned long flags;
+    __asm__ __volatile__("pushf ; pop %0 ; cli" : "=g" (flags) : : "memory");
+    return flags;
+}
+
+static inline void thp_irq_restore(unsigned long flags) {
+    __asm__ __volatile__("push %0 ; popf" : : "g" (flags) : "memory", "cc");
+}
+
+/* The 2 MiB range at haddr may be a huge page in this region */
+static bool thp_range_suitable(const vmm_region_t* region, vaddr_t haddr) {
+    if (thp_mode != THP_ALWAYS) return false;
+    if (!(region->flags & VMM_REGION_ANON)) return false;
+    if (region->flags & (VMM_REGION_FILE | VMM_REGION_COW)) return false;
+    return haddr >= region->start && haddr + HPAGE_SIZE <= region->start + region->length;
+}
+
+static inline bool pde_is_huge(const u64* pde) {
+    return pde && (*pde & PTE_PRESENT) && (*pde & PTE_HUGE);
+}
+
+int thp_handle_fault(vmm_aspace_t* space, vmm_region_t* region, vaddr_t vaddr) {
+    vaddr_t haddr = vaddr & HPAGE_MASK;
+    if (!space || !region || !thp_range_suitable(region, haddr)) return -1;
+
+    // Some 4 KiB pages are mapped here already; khugepaged may merge them later
+    u64* pde = vmm_get_pde(space, haddr);
+    if (pde && (*pde & PTE_PRESENT)) return -1;
+
+    paddr_t page = pmm_alloc_pages(HPAGE_ORDER);
+    if (!page) {
+        this_cpu_inc(thp_stats.fault_fallback);
+        return -1;
+    }
+
+    memset((void*)(uintptr_t)PHYS_TO_VIRT_DIRECT(page), 0, HPAGE_SIZE);
+
+    if (vmm_map_page(space, haddr, page, vmm_region_pte_flags(region) | PTE_HUGE) != K_OK) {
+        pmm_free_pages(page, HPAGE_ORDER);
+        this_cpu_inc(thp_stats.fault_fallback);
+        return -1;
+    }
+
+    this_cpu_inc(thp_stats.fault_alloc);
+    return 0;
+}
+
+/*
+ * Give this address space its own copy of a huge page it shares with
+ * others since a fork, mapped with 'flags'. The copy keeps the access and
+ * dirty bits; the shared block loses our reference.
+ */
+static int thp_unshare(u64* pde, vaddr_t haddr, u64 flags) {
+    paddr_t old = *pde & PTE_ADDR_MASK & HPAGE_MASK;
+
+    paddr_t page = pmm_alloc_pages(HPAGE_ORDER);
+    if (!page) return -1;
+    memcpy((void*)(uintptr_t)PHYS_TO_VIRT_DIRECT(page), (void*)(uintptr_t)PHYS_TO_VIRT_DIRECT(old), HPAGE_SIZE);
+
+    *pde = page | flags;
+    vmm_flush_tlb_page(haddr);
+    pmm_free_pages(old, HPAGE_ORDER);
+    return 0;
+}
+
+int thp_handle_cow_fault(vmm_aspace_t* space, vaddr_t vaddr) {
+    vaddr_t haddr = vaddr & HPAGE_MASK;
+    u64* pde = vmm_get_pde(space, haddr);
+    if (!pde_is_huge(pde) || !(*pde & PTE_COW)) return -1;
+
+    // mprotect() may have taken write access away since the fork
+    vmm_region_t* region = vmm_region_find(space, vaddr);
+    if (region && !(region->flags & VMM_REGION_WRITE)) return -1;
+
+    u64 flags = (*pde & ~(PTE_ADDR_MASK | PTE_COW)) | PTE_WRITABLE | PTE_DIRTY;
+    paddr_t base = *pde & PTE_ADDR_MASK & HPAGE_MASK;
+
+    // The other sharers are gone: take the page over
+    if (pmm_page_refcount(base) == 1) {
+        *pde = base | flags;
+        vmm_flush_tlb_page(haddr);
+        return 0;
+    }
+
+    if (thp_unshare(pde, haddr, flags) != 0) return -1;
+    this_cpu_inc(thp_stats.cow_copy);
+    return 0;
+}
+
+int thp_split_huge_pmd(vmm_aspace_t* space, vaddr_t vaddr) {
+    vaddr_t haddr = vaddr & HPAGE_MASK;
+    u64* pde = vmm_get_pde(space, haddr);
+    if (!pde_is_huge(pde)) return 0;
+
+    // Splitting changes the block's page descriptors, which the other
+    // sharers still map as one huge page
+    if (pmm_page_refcount(*pde & PTE_ADDR_MASK & HPAGE_MASK) > 1 &&
+        thp_unshare(pde, haddr, *pde & ~PTE_ADDR_MASK) != 0) {
+        return -1;
+    }
+
+    paddr_t pt_phys = pmm_alloc_page();
+    if (!pt_phys) return -1;
+
+    // Same frames and protection, one entry per 4 KiB page
+    u64* pt = VMM_TABLE(pt_phys);
+    paddr_t base = *pde & PTE_ADDR_MASK & HPAGE_MASK;
+    u64 flags = *pde & (~PTE_ADDR_MASK) & ~(u64)PTE_HUGE;
+    for (unsigned int i = 0; i < HPAGE_NR_PAGES; i++) {
+        pt[i] = (base + (paddr_t)i * PAGE_SIZE) | flags;
+    }
+
+    // Each page must be freeable on its own from now on
+    pmm_split_pages(base, HPAGE_ORDER);
+
+    *pde = pt_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
+    vmm_flush_tlb_page(haddr);
+
+    this_cpu_inc(thp_stats.split);
+    return 0;
+}
+
+int thp_zap_huge_pmd(vmm_aspace_t* space, vaddr_t vaddr) {
+    vaddr_t haddr = vaddr & HPAGE_MASK;
+    u64* pde = vmm_get_pde(space, haddr);
+    if (!pde_is_huge(pde)) return -1;
+
+    paddr_t base = *pde & PTE_ADDR_MASK & HPAGE_MASK;
+    *pde = 0;
+    vmm_flush_tlb_page(haddr);
+    pmm_free_pages(base, HPAGE_ORDER);
+    return 0;
+}
+
+/*
+ * A page table can be collapsed when enough of it is populated and every
+ * mapped page is private and has the region's protection.
+ */
+static bool collapse_allowed(const u64* pt, u32 flags) {
+    const u64 prot = PTE_WRITABLE | PTE_USER;
+    unsigned int none = 0;
+
+    for (unsigned int i = 0; i < HPAGE_NR_PAGES; i++) {
+        if (!(pt[i] & PTE_PRESENT)) {
+            if (++none > thp_max_ptes_none) return false;
+            continue;
+        }
+        if ((pt[i] & PTE_COW) || (pt[i] & prot) != (flags & prot)) return false;
+    }
+    return none < HPAGE_NR_PAGES;
+}
+
+static void thp_flush_range_local(void* arg) {
+    vaddr_t haddr = *(const vaddr_t*)arg;
+    for (unsigned int i = 0; i < HPAGE_NR_PAGES; i++) {
+        vmm_flush_tlb_page(haddr + (vaddr_t)i * PAGE_SIZE);
+    }
+}
+
+/*
+ * Drop the 2 MiB range from every CPU's TLB. Address spaces do not track
+ * the CPUs they run on, so the other CPUs are all asked; flushing a range
+ * a CPU does not have mapped is harmless.
+ */
+static void thp_flush_range(vaddr_t haddr) {
+    thp_flush_range_local(&haddr);
+    if (smp_call_function) smp_call_function(thp_flush_range_local, &haddr, true);
+}
+
+// Changes whenever an entry of the page table does
+static u64 pt_checksum(const u64* pt) {
+    u64 sum = 0;
+    for (unsigned int i = 0; i < HPAGE_NR_PAGES; i++) {
+        sum = (sum << 1 | sum >> 63) ^ pt[i];
+    }
+    return sum;
+}
+
+int thp_collapse(vmm_aspace_t* space, vaddr_t haddr) {
+    if (haddr & (HPAGE_SIZE - 1)) return -1;
+
+    vmm_region_t* region = vmm_region_find(space, haddr);
+    if (!region || !thp_range_suitable(region, haddr)) return -1;
+
+    u64* pde = vmm_get_pde(space, haddr);
+    if (!pde || !(*pde & PTE_PRESENT) || (*pde & PTE_HUGE)) return -1;
+
+    u32 flags = vmm_region_pte_flags(region);
+    paddr_t pt_phys = *pde & PTE_ADDR_MASK;
+    u64* pt = VMM_TABLE(pt_phys);
+    if (!collapse_allowed(pt, flags)) return -1;
+
+    paddr_t hpage = pmm_alloc_pages(HPAGE_ORDER);
+    if (!hpage) {
+        this_cpu_inc(thp_stats.collapse_failed);
+        return -1;
+    }
+
+    // Write-protect the whole range at the directory level and mark it:
+    // writers fault and retry, and demand paging leaves the page table
+    // alone until the collapse is over
+    unsigned long irq = thp_irq_save();
+    u64 old_pde = *pde;
+    bool ok = (old_pde & PTE_PRESENT) && !(old_pde & (PTE_HUGE | PTE_COLLAPSE)) &&
+              (old_pde & PTE_ADDR_MASK) == pt_phys;
+    if (ok) *pde = (old_pde & ~(u64)PTE_WRITABLE) | PTE_COLLAPSE;
+    thp_irq_restore(irq);
+
+    if (ok) {
+        // Cross-CPU calls need interrupts on
+        thp_flush_range(haddr);
+        irq = thp_irq_save();
+
+        // Faults may have run while we allocated; look again now that no
+        // CPU can write through a stale TLB entry
+        u64 sum = pt_checksum(pt);
+        ok = collapse_allowed(pt, flags);
+
+        u8* dst = (u8*)(uintptr_t)PHYS_TO_VIRT_DIRECT(hpage);
+        u64 young_dirty = 0;
+        for (unsigned int i = 0; ok && i < HPAGE_NR_PAGES; i++) {
+            if (pt[i] & PTE_PRESENT) {
+                memcpy(dst + i * PAGE_SIZE, (void*)(uintptr_t)PHYS_TO_VIRT_DIRECT(pt[i] & PTE_ADDR_MASK), PAGE_SIZE);
+                young_dirty |= pt[i] & (PTE_ACCESSED | PTE_DIRTY);
+            } else {
+                memset(dst + i * PAGE_SIZE, 0, PAGE_SIZE);
+            }
+        }
+
+        // A fault that got past the mark before it was set filled an entry
+        if (ok && pt_checksum(pt) != sum) ok = false;
+
+        // Lifting the write protection again needs no flush
+        *pde = ok ? (hpage | flags | PTE_HUGE | young_dirty) : old_pde;
+        thp_irq_restore(irq);
+    }
+
+    if (!ok) {
+        pmm_free_pages(hpage, HPAGE_ORDER);
+        this_cpu_inc(thp_stats.collapse_failed);
+        return -1;
+    }
+
+    thp_flush_range(haddr);
+
+    // Nobody can reach the old pages or the page table any more
+    for (unsigned int i = 0; i < HPAGE_NR_PAGES; i++) {
+        if (pt[i] & PTE_PRESENT) pmm_free_page(pt[i] & PTE_ADDR_MASK);
+    }
+    pmm_free_page(pt_phys);
+
+    this_cpu_inc(thp_stats.collapse_alloc);
+    return 0;
+}
+
+void khugepaged_add(vmm_aspace_t* space) {
+    if (!space) return;
+
+    unsigned long flags;
+    spin_lock_irqsave(&khugepaged.lock, &flags);
+    bool found = false;
+    for (unsigned int i = 0; i < khugepaged.nr_spaces; i++) {
+        if (khugepaged.spaces[i] == space) found = true;
+    }
+    if (!found && khugepaged.nr_spaces < KHUGEPAGED_MAX_SPACES) {
+        khugepaged.spaces[khugepaged.nr_spaces++] = space;
+    }
+    spin_unlock_irqrestore(&khugepaged.lock, flags);
+}
+
+// Returns once khugepaged no longer uses space, so it can be freed
+void khugepaged_remove(vmm_aspace_t* space) {
+    unsigned long flags;
+    spin_lock_irqsave(&khugepaged.lock, &flags);
+
+    for (unsigned int i = 0; i < khugepaged.nr_spaces; i++) {
+        if (khugepaged.spaces[i] != space) continue;
+
+        khugepaged.spaces[i] = khugepaged.spaces[--khugepaged.nr_spaces];
+        if (khugepaged.cursor == i) khugepaged.scan_addr = 0;
+        break;
+    }
+
+    while (khugepaged.busy == space) {
+        spin_unlock_irqrestore(&khugepaged.lock, flags);
+        schedule();
+        spin_lock_irqsave(&khugepaged.lock, &flags);
+    }
+
+    spin_unlock_irqrestore(&khugepaged.lock, flags);
+}
+
+/* Next 2 MiB range at or after 'from' that could be a huge page */
+static vaddr_t khugepaged_next_range(vmm_aspace_t* space, vaddr_t from) {
+    for (vmm_region_t* r = space->regions; r; r = r->next) {
+        vaddr_t haddr = (r->start + HPAGE_SIZE - 1) & HPAGE_MASK;
+        if (haddr < from) haddr = from;
+        if (thp_range_suitable(r, haddr)) return haddr;
+    }
+    return 0;
+}
+
+unsigned int khugepaged_scan(unsigned int pages) {
+    unsigned int scanned = 0;
+    unsigned int exhausted = 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&khugepaged.lock, &flags);
+    while (scanned < pages && exhausted <= khugepaged.nr_spaces && khugepaged.nr_spaces) {
+        if (khugepaged.cursor >= khugepaged.nr_spaces) {
+            khugepaged.cursor = 0;
+        }
+
+        vmm_aspace_t* space = khugepaged.spaces[khugepaged.cursor];
+        vaddr_t haddr = khugepaged_next_range(space, khugepaged.scan_addr);
+        if (!haddr) {
+            // Done with this address space, move on to the next one
+            khugepaged.cursor++;
+            khugepaged.scan_addr = 0;
+            exhausted++;
+            continue;
+        }
+
+        khugepaged.scan_addr = haddr + HPAGE_SIZE;
+        scanned += HPAGE_NR_PAGES;
+        this_cpu_add(thp_stats.pages_scanned, HPAGE_NR_PAGES);
+
+        u64* pde = vmm_get_pde(space, haddr);
+        if (pde && (*pde & PTE_PRESENT) && !(*pde & PTE_HUGE)) {
+            // khugepaged_remove() waits for busy before the space is freed
+            khugepaged.busy = space;
+            spin_unlock_irqrestore(&khugepaged.lock, flags);
+            thp_collapse(space, haddr);
+            spin_lock_irqsave(&khugepaged.lock, &flags);
+            khugepaged.busy = NULL;
+        }
+    }
+    spin_unlock_irqrestore(&khugepaged.lock, flags);
+
+    return scanned;
+}
+
+static void khugepaged_main(void) {
+    for (;;) {
+        khugepaged_scan(KHUGEPAGED_PAGES_TO_SCAN);
+
+        // Off the run queue until the next scan is due
+        uint32_t per_ms = (uint32_t)hal_timer_get_frequency() / 1000;
+        task_sleep((uint64_t)KHUGEPAGED_SLEEP_MS * (per_ms ? per_ms : 1));
+    }
+}
+
+void thp_init(void) {
+    percpu_zero(&thp_stats, sizeof(thp_stats));
+    if (!create_task(khugepaged_main)) {
+        kprintf("[THP] Failed to start khugepaged\n");
+    }
+}
+
+void thp_set_mode(int mode) {
+    thp_mode = (mode == THP_ALWAYS) ? THP_ALWAYS : THP_NEVER;
+}
+
+int thp_get_mode(void) {
+    return thp_mode;
+}
+
+void thp_set_max_ptes_none(unsigned int max_ptes_none) {
+    thp_max_ptes_none = max_ptes_none < HPAGE_NR_PAGES ? max_ptes_none : HPAGE_NR_PAGES - 1;
+}
+
+void thp_get_stats(thp_stats_t* stats) {
+    if (stats) percpu_sum_u64(&thp_stats, sizeof(thp_stats), stats);
+}
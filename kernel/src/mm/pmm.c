@@ -3,26 +3,35 @@
  *
  * Production-grade buddy allocator for managing physical page frames.
  * Implements power-of-2 sized blocks with efficient coalescing.
+ *
+ * Memory is split into one zone per NUMA node as described by the ACPI
+ * SRAT. Allocations start on a node picked by the task's memory policy
+ * and fall back through that node's zonelist, nearest (SLIT) node first.
  */
 
 #include "mm/mm.h"
+#include "linux/mmzone.h"
+#include "acpi_numa.h"
+#include "percpu.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-/* Basic string operations */
-static void* memset(void *s, int c, size_t n) {
-    unsigned char *p = (unsigned char *)s;
-    while (n--) *p++ = (unsigned char)c;
-    return s;
-}
-
-// This would be defined in a boot-time memory map parser
-extern uint64_t memory_map_size;
-extern uint64_t memory_map_addr;
 extern void* kernel_end;
 
-#define PAGE_MASK (~(PAGE_SIZE - 1))
+/* Boot memory map type of RAM the allocator may hand out */
+#define MEMORY_REGION_USABLE 1
+
+/* Per-CPU page list defaults */
+#define PCP_LOW   0
+#define PCP_HIGH  186
+#define PCP_BATCH 31
+
+/* The owning node lives in the top bits of page->flags */
+#define PAGE_NODE_SHIFT (sizeof(unsigned long) * 8 - NODES_SHIFT)
+#define PAGE_NODE_MASK  ((1UL << NODES_SHIFT) - 1)
+
+#define ALL_NODES ((nodemask_t)-1)
 
 static inline void set_page_address(page_t *page, void *addr) {
     page->virtual = addr;
@@ -32,41 +41,111 @@ static inline void *get_page_address(page_t *page) {
     return page->virtual;
 }
 
+static inline int page_to_nid(const page_t *page) {
+    return (int)((page->flags >> PAGE_NODE_SHIFT) & PAGE_NODE_MASK);
+}
+
+static inline void set_page_node(page_t *page, int nid) {
+    page->flags &= ~(PAGE_NODE_MASK << PAGE_NODE_SHIFT);
+    page->flags |= ((unsigned long)nid & PAGE_NODE_MASK) << PAGE_NODE_SHIFT;
+}
+
 typedef struct {
     spinlock_t lock;
-    pglist_data_t node; // For now, we assume a single NUMA node
+    pglist_data_t nodes[MAX_NUMNODES];
+    int nr_nodes;
+    nodemask_t nodes_with_memory;
+    uint8_t distance[MAX_NUMNODES][MAX_NUMNODES];
+    int8_t cpu_node[PCP_MAX_CPUS];  // NUMA_NO_NODE until resolved
     page_t* page_map;
     uint64_t total_pages;
-    uint64_t free_pages;
 } pmm_state_t;
 
 static pmm_state_t pmm_state;
 
-void pmm_init() {
-    // Simplified: We just take all memory after the kernel for the PMM
-    // A real implementation would parse the memory map from the bootloader
-    uint64_t total_mem = 1024 * 1024 * 1024; // Assume 1GB for now
-    pmm_state.total_pages = total_mem / PAGE_SIZE;
-    pmm_state.free_pages = pmm_state.total_pages;
+static inline zone_t* node_zone(int nid) {
+    return &pmm_state.nodes[nid].node_zones[ZONE_NORMAL];
+}
 
-    uint64_t kernel_end_aligned = ((uint64_t)kernel_end + PAGE_SIZE - 1) & PAGE_MASK;
-    
-    uint64_t page_map_size = pmm_state.total_pages * sizeof(page_t);
-    pmm_state.page_map = (page_t*)kernel_end_aligned;
-    uint64_t pmm_area_end = kernel_end_aligned + page_map_size;
-    memset(pmm_state.page_map, 0, page_map_size);
+static inline uint64_t page_to_pfn(const page_t* page) {
+    return (uint64_t)(page - pmm_state.page_map);
+}
+
+/* Whether 'page' heads a free block of exactly 'order' in 'zone' */
+static inline bool page_is_buddy(const zone_t* zone, const page_t* page, unsigned int order) {
+    return (page->flags & (1UL << PG_buddy)) && page->private == order &&
+           page_to_nid(page) == zone->node;
+}
+
+static inline void add_to_free_area(zone_t* zone, page_t* page, unsigned int order) {
+    page->flags |= 1UL << PG_buddy;
+    page->private = order;
+    list_add(&page->lru, &zone->free_area[order].free_list);
+    zone->free_area[order].nr_free++;
+}
+
+static inline void del_from_free_area(zone_t* zone, page_t* page, unsigned int order) {
+    list_del(&page->lru);
+    page->flags &= ~(1UL << PG_buddy);
+    page->private = 0;
+    zone->free_area[order].nr_free--;
+}
+
+/*
+ * Give a 2^order block back to the zone, merging it with its buddy for
+ * as long as the buddy is free as well (zone->lock held).
+ */
+static void zone_free_block(zone_t* zone, page_t* page, unsigned int order) {
+    uint64_t pfn = page_to_pfn(page);
+    uint64_t start = zone->zone_start_pfn;
+    uint64_t end = start + zone->spanned_pages;
+
+    zone->free_pages += 1UL << order;
+    while (order < MAX_ORDER - 1) {
+        uint64_t buddy_pfn = pfn ^ (1ULL << order);
+        if (buddy_pfn < start || buddy_pfn >= end) break;
+
+        page_t* buddy = &pmm_state.page_map[buddy_pfn];
+        if (!page_is_buddy(zone, buddy, order)) break;
+
+        del_from_free_area(zone, buddy, order);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    add_to_free_area(zone, &pmm_state.page_map[pfn], order);
+}
+
+/*
+ * Take a 2^order block off the zone, splitting the smallest larger block
+ * when that order's list is empty (zone->lock held).
+ */
+static page_t* zone_take_block(zone_t* zone, unsigned int order) {
+    for (unsigned int cur = order; cur < MAX_ORDER; cur++) {
+        struct list_head* list = &zone->free_area[cur].free_list;
+        if (list_empty(list)) continue;
+
+        page_t* page = list_entry(list->next, page_t, lru);
+        del_from_free_area(zone, page, cur);
+
+        // Hand the upper halves back until the block is the right size
+        while (cur > order) {
+            cur--;
+            add_to_free_area(zone, page + (1UL << cur), cur);
+        }
+        zone->free_pages -= 1UL << order;
+        return page;
+    }
+    return NULL;
+}
 
-    // Initialize the buddy allocator structures
-    pg_data_t* node = &pmm_state.node;
-    node->node_id = 0;
-    node->node_start_pfn = 0;
-    node->node_spanned_pages = pmm_state.total_pages;
+static void pmm_init_node(int nid) {
+    pglist_data_t* node = &pmm_state.nodes[nid];
+    node->node_id = nid;
     node->nr_zones = 1; // Just ZONE_NORMAL for now
-    
+
     zone_t* zone = &node->node_zones[ZONE_NORMAL];
     zone->name = "Normal";
-    zone->zone_start_pfn = 0;
-    zone->spanned_pages = pmm_state.total_pages;
+    zone->node = nid;
     spin_lock_init(&zone->lock);
 
     for (int i = 0; i < MAX_ORDER; i++) {
@@ -74,28 +153,375 @@ void pmm_init() {
         zone->free_area[i].nr_free = 0;
     }
 
-    // Add free pages to the buddy allocator
-    // We mark pages used by the kernel and PMM as reserved
-    uint64_t reserved_pages = pmm_area_end / PAGE_SIZE;
-    pmm_state.free_pages = 0;
-    for (uint64_t pfn = reserved_pages; pfn < pmm_state.total_pages; pfn++) {
+    for (int cpu = 0; cpu < PCP_MAX_CPUS; cpu++) {
+        struct per_cpu_pages *pcp = &zone->pageset[cpu];
+        INIT_LIST_HEAD(&pcp->list);
+        pcp->count = 0;
+        pcp->low = PCP_LOW;
+        pcp->high = PCP_HIGH;
+        pcp->batch = PCP_BATCH;
+        pcp->hits = 0;
+        pcp->misses = 0;
+    }
+}
+
+/*
+ * Order every node's fallback list by distance. Equidistant nodes are
+ * rotated by the source node ID so that remote pressure is spread out
+ * instead of all spilling onto the lowest-numbered node.
+ */
+static void pmm_build_zonelists(void) {
+    int nr = pmm_state.nr_nodes;
+
+    for (int nid = 0; nid < nr; nid++) {
+        zonelist_t* zl = &pmm_state.nodes[nid].node_zonelist;
+        int order[MAX_NUMNODES];
+        int n = 0;
+
+        for (int i = 0; i < nr; i++) {
+            int other = (nid + i) % nr;
+            if (!(pmm_state.nodes_with_memory & (1ULL << other))) continue;
+
+            int pos = n++;
+            while (pos > 0 && pmm_state.distance[nid][order[pos - 1]] > pmm_state.distance[nid][other]) {
+                order[pos] = order[pos - 1];
+                pos--;
+            }
+            order[pos] = other;
+        }
+
+        for (int i = 0; i < n; i++) {
+            zl->_zones[i] = node_zone(order[i]);
+        }
+        zl->_zones[n] = NULL;
+    }
+}
+
+/* Assign pages to nodes one SRAT memory block at a time; the rest stay on node 0 */
+static void pmm_assign_nodes(void) {
+    uint32_t count = acpi_numa_memblk_count();
+
+    for (uint32_t i = 0; i < count; i++) {
+        const acpi_numa_memblk_t* blk = acpi_numa_get_memblk(i);
+        if ((int)blk->node >= pmm_state.nr_nodes) continue;
+
+        uint64_t first = blk->start / PAGE_SIZE;
+        uint64_t last = blk->end / PAGE_SIZE;
+        if (last > pmm_state.total_pages) last = pmm_state.total_pages;
+        for (uint64_t pfn = first; pfn < last; pfn++) {
+            set_page_node(&pmm_state.page_map[pfn], (int)blk->node);
+        }
+    }
+}
+
+void pmm_init() {
+    // The page map spans up to the end of the highest usable RAM region;
+    // holes and reserved ranges below it stay allocated
+    uint64_t total_mem = 0;
+    for (u32 i = 0; i < g_boot_info.mem_map_count; i++) {
+        const memory_region_t* r = &g_boot_info.mem_map[i];
+        if (r->type == MEMORY_REGION_USABLE && r->base + r->length > total_mem) {
+            total_mem = r->base + r->length;
+        }
+    }
+    if (!total_mem) {
+        kprintf("[PMM] No usable memory in the boot memory map\n");
+    }
+    pmm_state.total_pages = total_mem / PAGE_SIZE;
+
+    uint64_t kernel_end_aligned = ((uint64_t)(uintptr_t)kernel_end + PAGE_SIZE - 1) & PAGE_MASK;
+    
+    uint64_t page_map_size = pmm_state.total_pages * sizeof(page_t);
+    pmm_state.page_map = (page_t*)(uintptr_t)kernel_end_aligned;
+    uint64_t pmm_area_end = kernel_end_aligned + page_map_size;
+    memset(pmm_state.page_map, 0, page_map_size);
+
+    // Node layout from the firmware; a machine without SRAT is one node
+    pmm_state.nr_nodes = 1;
+    if (acpi_numa_init() == 0) {
+        uint32_t count = acpi_numa_node_count();
+        pmm_state.nr_nodes = count > MAX_NUMNODES ? MAX_NUMNODES : (int)count;
+    }
+
+    for (int from = 0; from < pmm_state.nr_nodes; from++) {
+        for (int to = 0; to < pmm_state.nr_nodes; to++) {
+            uint32_t d = acpi_numa_distance(from, to);
+            pmm_state.distance[from][to] = (uint8_t)(d > 255 ? 255 : d);
+        }
+    }
+
+    for (int cpu = 0; cpu < PCP_MAX_CPUS; cpu++) {
+        pmm_state.cpu_node[cpu] = NUMA_NO_NODE;
+    }
+
+    for (int nid = 0; nid < pmm_state.nr_nodes; nid++) {
+        pmm_init_node(nid);
+    }
+
+    if (pmm_state.nr_nodes > 1) {
+        pmm_assign_nodes();
+    }
+
+    // Every page starts out reserved; this also fixes the node spans
+    for (uint64_t pfn = 0; pfn < pmm_state.total_pages; pfn++) {
         page_t* page = &pmm_state.page_map[pfn];
-        atomic_set(&page->_refcount, 0);
-        set_page_address(page, (void*)(pfn * PAGE_SIZE));
+        pglist_data_t* node = &pmm_state.nodes[page_to_nid(page)];
+        zone_t* zone = &node->node_zones[ZONE_NORMAL];
+
+        set_page_address(page, (void*)(uintptr_t)(pfn * PAGE_SIZE));
         INIT_LIST_HEAD(&page->lru);
-        list_add(&page->lru, &zone->free_area[0].free_list);
-        zone->free_area[0].nr_free++;
-        pmm_state.free_pages++;
+        atomic_set(&page->_refcount, 1);
+
+        if (node->node_spanned_pages == 0) {
+            node->node_start_pfn = pfn;
+            zone->zone_start_pfn = pfn;
+        }
+        node->node_spanned_pages = pfn - node->node_start_pfn + 1;
+        zone->spanned_pages = node->node_spanned_pages;
+    }
+
+    // Free the usable RAM above the kernel and the page map, letting the
+    // buddy allocator merge it into the largest blocks it can
+    uint64_t reserved_pages = pmm_area_end / PAGE_SIZE;
+    for (u32 i = 0; i < g_boot_info.mem_map_count; i++) {
+        const memory_region_t* r = &g_boot_info.mem_map[i];
+        if (r->type != MEMORY_REGION_USABLE) continue;
+
+        uint64_t first = (r->base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t last = (r->base + r->length) / PAGE_SIZE;
+        if (first < reserved_pages) first = reserved_pages;
+        if (last > pmm_state.total_pages) last = pmm_state.total_pages;
+
+        for (uint64_t pfn = first; pfn < last; pfn++) {
+            page_t* page = &pmm_state.page_map[pfn];
+            // Overlapping map entries must not free a page twice
+            if (atomic_read(&page->_refcount) == 0) continue;
+
+            pglist_data_t* node = &pmm_state.nodes[page_to_nid(page)];
+            atomic_set(&page->_refcount, 0);
+            zone_free_block(&node->node_zones[ZONE_NORMAL], page, 0);
+            node->node_present_pages++;
+        }
+    }
+
+    for (int nid = 0; nid < pmm_state.nr_nodes; nid++) {
+        pglist_data_t* node = &pmm_state.nodes[nid];
+        zone_t* zone = &node->node_zones[ZONE_NORMAL];
+        zone->present_pages = node->node_present_pages;
+        zone->managed_pages = node->node_present_pages;
+        if (node->node_present_pages) {
+            pmm_state.nodes_with_memory |= 1ULL << nid;
+        }
+    }
+
+    pmm_build_zonelists();
+}
+
+
+/* The pcp lists are only touched by their own CPU with interrupts off */
+static inline unsigned long pcp_irq_save(void) {
+    unsigned long flags;
+    __asm__ __volatile__("pushf ; pop %0 ; cli" : "=g" (flags) : : "memory");
+    return flags;
+}
+
+static inline void pcp_irq_restore(unsigned long flags) {
+    __asm__ __volatile__("push %0 ; popf" : : "g" (flags) : "memory", "cc");
+}
+
+/* Move up to 'count' cold pages from the pcp list back to the zone */
+static void pcp_drain(zone_t* zone, struct per_cpu_pages* pcp, int count) {
+    spin_lock(&zone->lock);
+    while (count-- > 0 && !list_empty(&pcp->list)) {
+        page_t* page = list_entry(pcp->list.prev, page_t, lru);
+        list_del(&page->lru);
+        pcp->count--;
+        zone_free_block(zone, page, 0);
+    }
+    spin_unlock(&zone->lock);
+}
+
+/**
+ * @brief Order-0 allocation from this CPU's page list.
+ *
+ * The zone lock is only taken to refill the list a batch at a time.
+ */
+static page_t* pcp_alloc_page(zone_t* zone) {
+    unsigned long flags = pcp_irq_save();
+
+    u32 cpu = smp_processor_id();
+    if (cpu >= PCP_MAX_CPUS) {
+        pcp_irq_restore(flags);
+        spin_lock(&zone->lock);
+        page_t* page = zone_take_block(zone, 0);
+        spin_unlock(&zone->lock);
+        return page;
+    }
+
+    struct per_cpu_pages* pcp = &zone->pageset[cpu];
+    if (pcp->count > pcp->low) {
+        pcp->hits++;
+    } else {
+        pcp->misses++;
+        spin_lock(&zone->lock);
+        while (pcp->count < pcp->low + pcp->batch) {
+            page_t* page = zone_take_block(zone, 0);
+            if (!page) break;
+            list_add_tail(&page->lru, &pcp->list);
+            pcp->count++;
+        }
+        spin_unlock(&zone->lock);
+    }
+
+    page_t* page = NULL;
+    if (!list_empty(&pcp->list)) {
+        page = list_entry(pcp->list.next, page_t, lru);
+        list_del(&page->lru);
+        pcp->count--;
+    }
+
+    pcp_irq_restore(flags);
+    return page;
+}
+
+/**
+ * @brief Order-0 free into this CPU's page list (hot end).
+ */
+static void pcp_free_page(zone_t* zone, page_t* page) {
+    unsigned long flags = pcp_irq_save();
+
+    u32 cpu = smp_processor_id();
+    if (cpu >= PCP_MAX_CPUS) {
+        spin_lock(&zone->lock);
+        zone_free_block(zone, page, 0);
+        spin_unlock(&zone->lock);
+    } else {
+        struct per_cpu_pages* pcp = &zone->pageset[cpu];
+        list_add(&page->lru, &pcp->list);
+        pcp->count++;
+        if (pcp->count > pcp->high) {
+            pcp_drain(zone, pcp, pcp->batch);
+        }
+    }
+
+    pcp_irq_restore(flags);
+}
+
+/* Node of the CPU we are running on, looked up in the SRAT once per CPU */
+static int pmm_local_node(void) {
+    if (pmm_state.nr_nodes <= 1) {
+        return 0;
     }
 
-    node->node_present_pages = pmm_state.free_pages;
-    zone->present_pages = pmm_state.free_pages;
-    zone->managed_pages = pmm_state.free_pages;
+    u32 cpu = smp_processor_id();
+    if (cpu >= PCP_MAX_CPUS) {
+        int nid = acpi_numa_cpu_to_node(cpu);
+        return (nid >= 0 && nid < pmm_state.nr_nodes) ? nid : 0;
+    }
+
+    int nid = pmm_state.cpu_node[cpu];
+    if (nid == NUMA_NO_NODE) {
+        // The MADT may not be parsed yet this early; don't cache a miss
+        nid = acpi_numa_cpu_to_node(cpu);
+        if (nid < 0 || nid >= pmm_state.nr_nodes) {
+            return 0;
+        }
+        pmm_state.cpu_node[cpu] = (int8_t)nid;
+    }
+    return nid;
+}
+
+/*
+ * Walk the zonelist of 'nid', skipping nodes outside 'allowed', and take
+ * the first zone that can satisfy the request.
+ */
+static page_t* alloc_pages_zonelist(int nid, nodemask_t allowed, unsigned int order) {
+    zone_t** zones = pmm_state.nodes[nid].node_zonelist._zones;
+
+    for (int i = 0; zones[i]; i++) {
+        zone_t* zone = zones[i];
+        if (!(allowed & (1ULL << zone->node))) continue;
+
+        page_t* page;
+        if (order == 0) {
+            page = pcp_alloc_page(zone);
+        } else {
+            spin_lock(&zone->lock);
+            page = zone_take_block(zone, order);
+            spin_unlock(&zone->lock);
+        }
+        if (!page) continue;
+
+        if (zone->node == nid) {
+            pmm_state.nodes[nid].numa_hit++;
+        } else {
+            pmm_state.nodes[zone->node].numa_miss++;
+            pmm_state.nodes[nid].numa_foreign++;
+        }
+        return page;
+    }
+    return NULL;
+}
+
+/* Next node in the policy mask after the one handed out last time */
+static int interleave_next_node(struct mempolicy* pol, nodemask_t allowed) {
+    int nr = pmm_state.nr_nodes;
+    for (int i = 1; i <= nr; i++) {
+        int nid = (pol->il_next + i) % nr;
+        if (allowed & (1ULL << nid)) {
+            pol->il_next = (uint16_t)nid;
+            return nid;
+        }
+    }
+    return NUMA_NO_NODE;
 }
 
+static page_t* alloc_pages_policy(struct mempolicy* pol, unsigned int order) {
+    int local = pmm_local_node();
+
+    if (!pol || pmm_state.nr_nodes <= 1) {
+        return alloc_pages_zonelist(local, ALL_NODES, order);
+    }
+
+    nodemask_t allowed = pol->nodes & pmm_state.nodes_with_memory;
+
+    switch (pol->mode) {
+    case MPOL_PREFERRED:
+        if (allowed) {
+            return alloc_pages_zonelist(__builtin_ctzll(allowed), ALL_NODES, order);
+        }
+        break;
+    case MPOL_BIND:
+        return alloc_pages_zonelist(local, pol->nodes, order);
+    case MPOL_INTERLEAVE: {
+        int nid = interleave_next_node(pol, allowed);
+        if (nid == NUMA_NO_NODE) break;
+        page_t* page = alloc_pages_zonelist(nid, ALL_NODES, order);
+        if (page && page_to_nid(page) == nid) {
+            pmm_state.nodes[nid].interleave_hit++;
+        }
+        return page;
+    }
+    default:
+        break;
+    }
+
+    return alloc_pages_zonelist(local, ALL_NODES, order);
+}
+
+/* Mark a freshly allocated block as in use */
+static page_t* prep_new_page(page_t* page) {
+    if (page) {
+        atomic_set(&page->_refcount, 1);
+        page->flags |= (1 << PG_locked);
+    }
+    return page;
+}
 
 /**
  * @brief Allocates a block of contiguous physical pages.
+ *
+ * Placement follows the running task's memory policy.
  * 
  * @param order The order of the allocation (2^order pages).
  * @return A pointer to the first page descriptor, or NULL if allocation fails.
@@ -105,27 +531,24 @@ page_t* alloc_pages(unsigned int order) {
         return NULL;
     }
 
-    spin_lock(&pmm_state.node.node_zones[ZONE_NORMAL].lock);
+    return prep_new_page(alloc_pages_policy(get_task_mempolicy(), order));
+}
 
-    struct list_head* list = &pmm_state.node.node_zones[ZONE_NORMAL].free_area[0].free_list;
-    if (list_empty(list)) {
-        spin_unlock(&pmm_state.node.node_zones[ZONE_NORMAL].lock);
-        return NULL; // Out of memory
+/**
+ * @brief Allocates from a given node, falling back to the nearest others.
+ *
+ * @param nid The preferred node, or NUMA_NO_NODE for the local node.
+ * @param order The order of the allocation (2^order pages).
+ */
+page_t* alloc_pages_node(int nid, unsigned int order) {
+    if (order >= MAX_ORDER) {
+        return NULL;
+    }
+    if (nid < 0 || nid >= pmm_state.nr_nodes) {
+        nid = pmm_local_node();
     }
 
-    page_t* page = list_entry(list->next, page_t, lru);
-    list_del(&page->lru);
-
-    // Mark page as used
-    atomic_set(&page->_refcount, 1);
-    page->flags |= (1 << PG_locked);
-
-    pmm_state.node.node_zones[ZONE_NORMAL].free_area[0].nr_free--;
-    pmm_state.free_pages--;
-
-    spin_unlock(&pmm_state.node.node_zones[ZONE_NORMAL].lock);
-
-    return page;
+    return prep_new_page(alloc_pages_zonelist(nid, ALL_NODES, order));
 }
 
 /**
@@ -137,17 +560,201 @@ page_t* alloc_pages(unsigned int order) {
 void free_pages(page_t* page, unsigned int order) {
     if (!page) return;
 
-    spin_lock(&pmm_state.node.node_zones[ZONE_NORMAL].lock);
+    zone_t* zone = node_zone(page_to_nid(page));
 
     // Clear flags and add back to free list
     page->flags &= ~(1 << PG_locked);
     atomic_set(&page->_refcount, 0);
-    
-    list_add(&page->lru, &pmm_state.node.node_zones[ZONE_NORMAL].free_area[order].free_list);
-    pmm_state.node.node_zones[ZONE_NORMAL].free_area[order].nr_free++;
-    pmm_state.free_pages += (1 << order);
 
-    spin_unlock(&pmm_state.node.node_zones[ZONE_NORMAL].lock);
+    if (order == 0) {
+        pcp_free_page(zone, page);
+        return;
+    }
+
+    spin_lock(&zone->lock);
+    zone_free_block(zone, page, order);
+    spin_unlock(&zone->lock);
+}
+
+/**
+ * @brief Tunes the per-CPU page list watermarks of every CPU.
+ *
+ * @return 0 on success, -1 if the values are inconsistent.
+ */
+int pmm_set_pcp_watermarks(int low, int high, int batch) {
+    if (batch <= 0 || low < 0 || low + batch > high) {
+        return -1;
+    }
+
+    for (int nid = 0; nid < pmm_state.nr_nodes; nid++) {
+        zone_t* zone = node_zone(nid);
+        for (int cpu = 0; cpu < PCP_MAX_CPUS; cpu++) {
+            zone->pageset[cpu].low = low;
+            zone->pageset[cpu].high = high;
+            zone->pageset[cpu].batch = batch;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the per-CPU page list hit/miss counters for one CPU,
+ *        summed over all nodes.
+ */
+void pmm_get_pcp_stats(unsigned int cpu, unsigned long* hits, unsigned long* misses) {
+    if (cpu >= PCP_MAX_CPUS) return;
+
+    unsigned long h = 0, m = 0;
+    for (int nid = 0; nid < pmm_state.nr_nodes; nid++) {
+        h += node_zone(nid)->pageset[cpu].hits;
+        m += node_zone(nid)->pageset[cpu].misses;
+    }
+    if (hits) *hits = h;
+    if (misses) *misses = m;
+}
+
+/**
+ * @brief Number of NUMA nodes the allocator manages (at least 1).
+ */
+int pmm_nr_nodes(void) {
+    return pmm_state.nr_nodes;
+}
+
+/**
+ * @brief Node a CPU belongs to.
+ */
+int pmm_node_of_cpu(unsigned int cpu) {
+    if (cpu < PCP_MAX_CPUS && pmm_state.cpu_node[cpu] != NUMA_NO_NODE) {
+        return pmm_state.cpu_node[cpu];
+    }
+    int nid = acpi_numa_cpu_to_node(cpu);
+    return (nid >= 0 && nid < pmm_state.nr_nodes) ? nid : 0;
+}
+
+/**
+ * @brief Node that owns a physical page.
+ */
+int pmm_page_to_nid(paddr_t paddr) {
+    uint64_t pfn = paddr / PAGE_SIZE;
+    if (pfn >= pmm_state.total_pages) {
+        return NUMA_NO_NODE;
+    }
+    return page_to_nid(&pmm_state.page_map[pfn]);
+}
+
+/**
+ * @brief SLIT distance between two nodes (10 = local).
+ */
+int pmm_node_distance(int from, int to) {
+    if (from < 0 || to < 0 || from >= pmm_state.nr_nodes || to >= pmm_state.nr_nodes) {
+        return -1;
+    }
+    return pmm_state.distance[from][to];
+}
+
+/**
+ * @brief Reads a node's free page count and NUMA hit/miss counters.
+ *
+ * @return 0 on success, -1 if the node does not exist.
+ */
+int pmm_get_node_stats(int nid, unsigned long* free_pages,
+                       unsigned long* numa_hit, unsigned long* numa_miss) {
+    if (nid < 0 || nid >= pmm_state.nr_nodes) {
+        return -1;
+    }
+
+    pglist_data_t* node = &pmm_state.nodes[nid];
+    if (free_pages) *free_pages = node->node_zones[ZONE_NORMAL].free_pages;
+    if (numa_hit) *numa_hit = node->numa_hit;
+    if (numa_miss) *numa_miss = node->numa_miss;
+    return 0;
+}
+
+/**
+ * @brief Checks node-local placement and buddy split/merge on every node.
+ *
+ * @return 0 on success, <0 naming the check that failed.
+ */
+int pmm_numa_selftest(void) {
+    for (int nid = 0; nid < pmm_state.nr_nodes; nid++) {
+        if (!(pmm_state.nodes_with_memory & (1ULL << nid))) continue;
+
+        zone_t* zone = node_zone(nid);
+        unsigned long before = zone->free_pages;
+
+        // An order-3 block comes from this node, naturally aligned
+        page_t* page = alloc_pages_node(nid, 3);
+        if (!page) return -1;
+        uint64_t pfn = page_to_pfn(page);
+        if (page_to_nid(page) != nid) return -2;
+        if (pfn & 7) return -3;
+        if (zone->free_pages != before - 8) return -4;
+
+        // Freeing merges the block back into one of order 3 or more
+        free_pages(page, 3);
+        if (zone->free_pages != before) return -5;
+
+        bool merged = false;
+        spin_lock(&zone->lock);
+        for (unsigned int order = 3; order < MAX_ORDER && !merged; order++) {
+            uint64_t head = pfn & ~((1ULL << order) - 1);
+            merged = page_is_buddy(zone, &pmm_state.page_map[head], order);
+        }
+        spin_unlock(&zone->lock);
+        if (!merged) return -6;
+
+        // Single pages honour the node too; these go through the pcp list
+        paddr_t single = pmm_alloc_pages_node(nid, 1);
+        if (!single) return -7;
+        if (pmm_page_to_nid(single) != nid) return -8;
+        pmm_free_page(single);
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets the running task's memory policy.
+ *
+ * @param mode One of MPOL_DEFAULT, MPOL_PREFERRED, MPOL_BIND, MPOL_INTERLEAVE.
+ * @param nodes Node mask; ignored for MPOL_DEFAULT, otherwise it must
+ *              contain at least one node that has memory.
+ * @return 0 on success, -1 on an invalid request or without a task.
+ */
+int set_mempolicy(int mode, nodemask_t nodes) {
+    if (mode < 0 || mode >= MPOL_MAX) {
+        return -1;
+    }
+
+    struct mempolicy* pol = get_task_mempolicy();
+    if (!pol) {
+        return -1;
+    }
+
+    if (mode == MPOL_DEFAULT) {
+        nodes = 0;
+    } else if (!(nodes & pmm_state.nodes_with_memory)) {
+        return -1;
+    }
+
+    pol->mode = (uint16_t)mode;
+    pol->nodes = nodes;
+    // Start interleaving at the lowest node in the mask
+    pol->il_next = (uint16_t)(pmm_state.nr_nodes - 1);
+    return 0;
+}
+
+/**
+ * @brief Reads the running task's memory policy.
+ */
+int get_mempolicy(int* mode, nodemask_t* nodes) {
+    struct mempolicy* pol = get_task_mempolicy();
+    if (!pol) {
+        return -1;
+    }
+
+    if (mode) *mode = pol->mode;
+    if (nodes) *nodes = pol->nodes;
+    return 0;
 }
 
 /**
@@ -192,6 +799,19 @@ paddr_t pmm_alloc_pages(size_t pages) {
     return (paddr_t)((uint64_t)get_page_address(page));
 }
 
+/**
+ * @brief Allocates contiguous physical pages from a given node.
+ */
+paddr_t pmm_alloc_pages_node(int nid, size_t pages) {
+    unsigned int order = 0;
+    while ((1U << order) < pages) order++;
+    page_t* page = alloc_pages_node(nid, order);
+    if (!page) {
+        return 0;
+    }
+    return (paddr_t)((uint64_t)get_page_address(page));
+}
+
 /**
  * @brief Frees multiple contiguous physical pages.
  * 
@@ -1,9 +1,15 @@
 /*
  * LimitlessOS - Production Grade Physical Memory Manager
  * Simple but robust buddy allocator implementation
+ *
+ * Free blocks live on intrusive, doubly linked per-order lists, and a
+ * bitmap records which orders are non-empty. Whether a page heads a free
+ * block (and of which order) is kept in its page_frame_t, so finding,
+ * unlinking and merging a buddy are all O(1).
  */
 
 #include "mm/pmm_simple.h"
+#include "smp.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -15,18 +21,31 @@ static void* memset_local(void *s, int c, size_t n) {
     return s;
 }
 
-/* Maximum order for buddy allocator (2^11 pages = 8MB) */
-#define MAX_ORDER 11
+/* Number of buddy orders; the largest block is 2^PMM_MAX_ORDER pages */
+#define MAX_ORDER (PMM_MAX_ORDER + 1)
 #define PAGE_SHIFT 12
 #define PAGE_SIZE (1UL << PAGE_SHIFT)
 #define PAGE_MASK (~(PAGE_SIZE - 1))
 
+/* Page frame flags */
+#define PG_SLAB  0x0001       /* Page belongs to a slab (owner is the slab) */
+#define PG_BUDDY 0x0002       /* Page heads a free block of 2^order pages */
+#define PG_RESERVED 0x0004    /* Never handed out (page frame array) */
+#define PG_PCP   0x0008       /* Page is parked on a per-CPU page list */
+
+/* Per-CPU page list defaults (order-0 pages) */
+#define PCP_DEFAULT_LOW   0
+#define PCP_DEFAULT_HIGH  186
+#define PCP_DEFAULT_BATCH 31
+
 /* Page frame structure */
 typedef struct page_frame {
     struct page_frame *next;  /* Next in free list */
+    struct page_frame *prev;  /* Previous in free list */
     uint32_t order;           /* Block order (power of 2) */
     uint32_t ref_count;       /* Reference count */
     uint32_t flags;           /* Page flags */
+    void *owner;              /* Back-pointer for allocated pages (e.g. slab) */
 } page_frame_t;
 
 /* Free list for each order */
@@ -35,14 +54,39 @@ typedef struct {
     uint32_t count;
 } free_list_t;
 
+/*
+ * Per-CPU list of free order-0 pages. Recently freed (cache-hot) pages
+ * sit at the head, cold ones at the tail. Only the owning CPU touches
+ * it, with local interrupts masked; the zone lock is taken once per
+ * batch refill or drain. Other CPUs can only ask for a list to be
+ * drained (drain_pending), which its owner does on its next pcp access.
+ */
+typedef struct pcp_list {
+    page_frame_t *head;
+    page_frame_t *tail;
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refills;
+    uint64_t drains;
+    bool drain_pending;
+} __attribute__((aligned(64))) pcp_list_t;
+
 /* PMM state */
 static struct {
+    spinlock_t lock;             /* Zone lock: protects the buddy lists */
     page_frame_t *page_frames;   /* Array of page frames */
     free_list_t free_lists[MAX_ORDER];
+    uint32_t free_bitmap;        /* Bit n set when free_lists[n] is non-empty */
+    uint64_t base_pfn;           /* First pfn described by page_frames */
     uint64_t total_pages;
     uint64_t free_pages;
     uint64_t start_addr;
     uint32_t initialized;
+    uint32_t pcp_low;            /* Refill when a list is at or below this */
+    uint32_t pcp_high;           /* Drain a batch when a list exceeds this */
+    uint32_t pcp_batch;          /* Pages moved per refill/drain */
+    pcp_list_t pcp[MAX_CPUS];
 } pmm_state;
 
 /* Helper: Get page frame number from physical address */
@@ -57,13 +101,13 @@ static inline uint64_t pfn_to_addr(uint64_t pfn) {
 
 /* Helper: Get page frame structure from pfn */
 static inline page_frame_t* pfn_to_page(uint64_t pfn) {
-    if (pfn >= pmm_state.total_pages) return NULL;
-    return &pmm_state.page_frames[pfn];
+    if (pfn < pmm_state.base_pfn || pfn - pmm_state.base_pfn >= pmm_state.total_pages) return NULL;
+    return &pmm_state.page_frames[pfn - pmm_state.base_pfn];
 }
 
 /* Helper: Get pfn from page frame structure */
 static inline uint64_t page_to_pfn(page_frame_t *page) {
-    return (uint64_t)(page - pmm_state.page_frames);
+    return pmm_state.base_pfn + (uint64_t)(page - pmm_state.page_frames);
 }
 
 /* Helper: Calculate buddy pfn */
@@ -71,179 +115,350 @@ static inline uint64_t buddy_pfn(uint64_t pfn, uint32_t order) {
     return pfn ^ (1UL << order);
 }
 
+/* Helper: Push a free block onto its order's list (O(1)) */
+static inline void free_list_add(page_frame_t *page, uint32_t order) {
+    free_list_t *list = &pmm_state.free_lists[order];
+    page->order = order;
+    page->flags |= PG_BUDDY;
+    page->prev = NULL;
+    page->next = list->head;
+    if (list->head) list->head->prev = page;
+    list->head = page;
+    list->count++;
+    pmm_state.free_bitmap |= 1U << order;
+}
+
+/* Helper: Unlink a free block from its order's list (O(1)) */
+static inline void free_list_del(page_frame_t *page, uint32_t order) {
+    free_list_t *list = &pmm_state.free_lists[order];
+    if (page->prev) page->prev->next = page->next;
+    else list->head = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags &= ~PG_BUDDY;
+    if (--list->count == 0) pmm_state.free_bitmap &= ~(1U << order);
+}
+
+/* Helper: Is pfn the head of a free block of exactly this order? */
+static inline page_frame_t* free_buddy(uint64_t pfn, uint32_t order) {
+    page_frame_t *buddy = pfn_to_page(pfn);
+    if (!buddy || !(buddy->flags & PG_BUDDY) || buddy->order != order) return NULL;
+    return buddy;
+}
+
+/* Helper: Largest naturally aligned order that starts at pfn and ends by end_pfn */
+static inline uint32_t max_block_order(uint64_t pfn, uint64_t end_pfn) {
+    uint32_t order = MAX_ORDER - 1;
+    while (order > 0 && ((pfn & ((1UL << order) - 1)) || pfn + (1UL << order) > end_pfn)) {
+        order--;
+    }
+    return order;
+}
+
 /* Initialize PMM with memory region */
 void pmm_init(uint64_t mem_start, uint64_t mem_size) {
     if (pmm_state.initialized) return;
-    
+
     pmm_state.start_addr = mem_start & PAGE_MASK;
+    pmm_state.base_pfn = addr_to_pfn(pmm_state.start_addr);
     pmm_state.total_pages = mem_size >> PAGE_SHIFT;
     pmm_state.free_pages = 0;
-    
+    pmm_state.free_bitmap = 0;
+    pmm_state.pcp_low = PCP_DEFAULT_LOW;
+    pmm_state.pcp_high = PCP_DEFAULT_HIGH;
+    pmm_state.pcp_batch = PCP_DEFAULT_BATCH;
+    spin_lock_init(&pmm_state.lock);
+
     /* Initialize free lists */
     for (int i = 0; i < MAX_ORDER; i++) {
         pmm_state.free_lists[i].head = NULL;
         pmm_state.free_lists[i].count = 0;
     }
-    
+
     /* Allocate page frame array at start of memory */
     uint64_t frames_size = pmm_state.total_pages * sizeof(page_frame_t);
     frames_size = (frames_size + PAGE_SIZE - 1) & PAGE_MASK;
     pmm_state.page_frames = (page_frame_t*)pmm_state.start_addr;
     memset_local(pmm_state.page_frames, 0, frames_size);
-    
+
     /* Mark frame array pages as used */
     uint64_t reserved_pages = frames_size >> PAGE_SHIFT;
-    
-    /* Add remaining pages to buddy system */
-    for (uint64_t pfn = reserved_pages; pfn < pmm_state.total_pages; pfn++) {
-        page_frame_t *page = pfn_to_page(pfn);
-        page->order = 0;
-        page->ref_count = 0;
-        page->flags = 0;
-        page->next = pmm_state.free_lists[0].head;
-        pmm_state.free_lists[0].head = page;
-        pmm_state.free_lists[0].count++;
-        pmm_state.free_pages++;
+    for (uint64_t i = 0; i < reserved_pages && i < pmm_state.total_pages; i++) {
+        pmm_state.page_frames[i].ref_count = 1;
+        pmm_state.page_frames[i].flags = PG_RESERVED;
     }
-    
-    /* Coalesce into larger blocks */
-    for (uint32_t order = 0; order < MAX_ORDER - 1; order++) {
-        page_frame_t *page = pmm_state.free_lists[order].head;
-        page_frame_t **prev_ptr = &pmm_state.free_lists[order].head;
-        
-        while (page != NULL) {
-            uint64_t pfn = page_to_pfn(page);
-            uint64_t buddy_pfn_val = buddy_pfn(pfn, order);
-            
-            /* Check if buddy is also free */
-            if (buddy_pfn_val < pmm_state.total_pages) {
-                page_frame_t *buddy = pfn_to_page(buddy_pfn_val);
-                if (buddy->ref_count == 0 && buddy->order == order) {
-                    /* Remove both from current list */
-                    *prev_ptr = page->next;
-                    pmm_state.free_lists[order].count--;
-                    
-                    /* Remove buddy from list */
-                    page_frame_t **buddy_prev = &pmm_state.free_lists[order].head;
-                    while (*buddy_prev != NULL) {
-                        if (*buddy_prev == buddy) {
-                            *buddy_prev = buddy->next;
-                            pmm_state.free_lists[order].count--;
-                            break;
-                        }
-                        buddy_prev = &(*buddy_prev)->next;
-                    }
-                    
-                    /* Add merged block to next order */
-                    uint64_t lower_pfn = (pfn < buddy_pfn_val) ? pfn : buddy_pfn_val;
-                    page_frame_t *merged = pfn_to_page(lower_pfn);
-                    merged->order = order + 1;
-                    merged->next = pmm_state.free_lists[order + 1].head;
-                    pmm_state.free_lists[order + 1].head = merged;
-                    pmm_state.free_lists[order + 1].count++;
-                    
-                    page = *prev_ptr;
-                    continue;
-                }
-            }
-            
-            prev_ptr = &page->next;
-            page = page->next;
-        }
+
+    /*
+     * Seed the remaining memory directly as maximal naturally aligned
+     * blocks; no per-page pass and no coalescing scan is needed.
+     */
+    uint64_t pfn = pmm_state.base_pfn + reserved_pages;
+    uint64_t end_pfn = pmm_state.base_pfn + pmm_state.total_pages;
+    while (pfn < end_pfn) {
+        uint32_t order = max_block_order(pfn, end_pfn);
+        free_list_add(pfn_to_page(pfn), order);
+        pmm_state.free_pages += 1UL << order;
+        pfn += 1UL << order;
     }
-    
+
     pmm_state.initialized = 1;
 }
 
-/* Allocate pages */
-uint64_t pmm_alloc_pages(uint32_t order) {
-    if (!pmm_state.initialized || order >= MAX_ORDER) return 0;
-    
-    /* Find free block of requested order or larger */
-    uint32_t current_order = order;
-    while (current_order < MAX_ORDER) {
-        if (pmm_state.free_lists[current_order].head != NULL) break;
-        current_order++;
-    }
-    
-    if (current_order >= MAX_ORDER) return 0; /* Out of memory */
-    
+/* Take a 2^order block out of the buddy lists (caller holds pmm_state.lock) */
+static page_frame_t* buddy_alloc(uint32_t order) {
+    /* Smallest non-empty order >= requested, straight from the bitmap */
+    uint32_t candidates = pmm_state.free_bitmap & ~((1U << order) - 1);
+    if (!candidates) return NULL; /* Out of memory */
+    uint32_t current_order = (uint32_t)__builtin_ctz(candidates);
+
     /* Remove block from free list */
     page_frame_t *page = pmm_state.free_lists[current_order].head;
-    pmm_state.free_lists[current_order].head = page->next;
-    pmm_state.free_lists[current_order].count--;
-    
-    /* Split block if necessary */
+    free_list_del(page, current_order);
+
+    /* Split block if necessary, returning upper halves to the free lists */
+    uint64_t pfn = page_to_pfn(page);
     while (current_order > order) {
         current_order--;
-        uint64_t pfn = page_to_pfn(page);
-        uint64_t buddy_pfn_val = pfn + (1UL << current_order);
-        
-        if (buddy_pfn_val < pmm_state.total_pages) {
-            page_frame_t *buddy = pfn_to_page(buddy_pfn_val);
-            buddy->order = current_order;
-            buddy->ref_count = 0;
-            buddy->next = pmm_state.free_lists[current_order].head;
-            pmm_state.free_lists[current_order].head = buddy;
-            pmm_state.free_lists[current_order].count++;
-        }
+        free_list_add(pfn_to_page(pfn + (1UL << current_order)), current_order);
     }
-    
+
     page->order = order;
     page->ref_count = 1;
-    
-    uint32_t pages_allocated = 1U << order;
-    pmm_state.free_pages -= pages_allocated;
-    
+    pmm_state.free_pages -= 1UL << order;
+    return page;
+}
+
+/* Return a 2^order block to the buddy lists (caller holds pmm_state.lock) */
+static void buddy_free(uint64_t pfn, uint32_t order) {
+    pmm_state.free_pages += 1UL << order;
+
+    /* Coalesce with buddy while it heads a free block of the same order */
+    while (order < MAX_ORDER - 1) {
+        page_frame_t *buddy = free_buddy(buddy_pfn(pfn, order), order);
+        if (!buddy) break;
+
+        free_list_del(buddy, order);
+
+        /* Merge into larger block headed by the lower address */
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    /* Add to free list */
+    free_list_add(pfn_to_page(pfn), order);
+}
+
+/* Helper: Unlink a page from a pcp list */
+static inline void pcp_list_del(pcp_list_t *pcp, page_frame_t *page) {
+    if (page->prev) page->prev->next = page->next;
+    else pcp->head = page->next;
+    if (page->next) page->next->prev = page->prev;
+    else pcp->tail = page->prev;
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags &= ~PG_PCP;
+    pcp->count--;
+}
+
+/* Helper: Add a page at the hot (head) or cold (tail) end of a pcp list */
+static inline void pcp_list_add(pcp_list_t *pcp, page_frame_t *page, bool cold) {
+    page->flags |= PG_PCP;
+    if (cold) {
+        page->next = NULL;
+        page->prev = pcp->tail;
+        if (pcp->tail) pcp->tail->next = page;
+        else pcp->head = page;
+        pcp->tail = page;
+    } else {
+        page->prev = NULL;
+        page->next = pcp->head;
+        if (pcp->head) pcp->head->prev = page;
+        else pcp->tail = page;
+        pcp->head = page;
+    }
+    pcp->count++;
+}
+
+/* Refill a pcp list with one batch under a single zone lock round trip */
+static void pcp_refill(pcp_list_t *pcp) {
+    uint32_t want = pmm_state.pcp_low + pmm_state.pcp_batch;
+    spin_lock(&pmm_state.lock);
+    while (pcp->count < want) {
+        page_frame_t *page = buddy_alloc(0);
+        if (!page) break;
+        page->ref_count = 0;
+        pcp_list_add(pcp, page, true);
+    }
+    spin_unlock(&pmm_state.lock);
+    pcp->refills++;
+}
+
+/* Return up to count of the coldest pages of a pcp list to the buddy lists */
+static void pcp_drain(pcp_list_t *pcp, uint32_t count) {
+    spin_lock(&pmm_state.lock);
+    while (count-- && pcp->tail) {
+        page_frame_t *page = pcp->tail;
+        pcp_list_del(pcp, page);
+        buddy_free(page_to_pfn(page), 0);
+    }
+    spin_unlock(&pmm_state.lock);
+    pcp->drains++;
+}
+
+/* Honour a drain another CPU asked for (local interrupts masked) */
+static inline void pcp_check_drain(pcp_list_t *pcp) {
+    if (__atomic_load_n(&pcp->drain_pending, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&pcp->drain_pending, false, __ATOMIC_RELAXED);
+        if (pcp->count) pcp_drain(pcp, pcp->count);
+    }
+}
+
+/* Order-0 allocation from this CPU's pcp list */
+static uint64_t pcp_alloc_page(bool cold) {
+    unsigned long flags;
+    local_irq_save(flags);
+
+    uint32_t cpu = smp_processor_id();
+    if (cpu >= MAX_CPUS) {
+        local_irq_restore(flags);
+        spin_lock_irqsave(&pmm_state.lock, &flags);
+        page_frame_t *page = buddy_alloc(0);
+        spin_unlock_irqrestore(&pmm_state.lock, flags);
+        return page ? pfn_to_addr(page_to_pfn(page)) : 0;
+    }
+
+    pcp_list_t *pcp = &pmm_state.pcp[cpu];
+    pcp_check_drain(pcp);
+    if (pcp->count > pmm_state.pcp_low) {
+        pcp->hits++;
+    } else {
+        pcp->misses++;
+        pcp_refill(pcp);
+    }
+
+    page_frame_t *page = cold ? pcp->tail : pcp->head;
+    if (page) {
+        pcp_list_del(pcp, page);
+        page->order = 0;
+        page->ref_count = 1;
+    }
+
+    local_irq_restore(flags);
+    return page ? pfn_to_addr(page_to_pfn(page)) : 0;
+}
+
+/* Order-0 free into this CPU's pcp list */
+static void pcp_free_page(page_frame_t *page, bool cold) {
+    unsigned long flags;
+    local_irq_save(flags);
+
+    uint32_t cpu = smp_processor_id();
+    if (cpu >= MAX_CPUS) {
+        spin_lock(&pmm_state.lock);
+        buddy_free(page_to_pfn(page), 0);
+        spin_unlock(&pmm_state.lock);
+        local_irq_restore(flags);
+        return;
+    }
+
+    pcp_list_t *pcp = &pmm_state.pcp[cpu];
+    pcp_check_drain(pcp);
+    pcp_list_add(pcp, page, cold);
+    if (pcp->count > pmm_state.pcp_high) {
+        pcp_drain(pcp, pmm_state.pcp_batch);
+    }
+
+    local_irq_restore(flags);
+}
+
+/* Allocate pages */
+uint64_t pmm_alloc_pages(uint32_t order) {
+    if (!pmm_state.initialized || order >= MAX_ORDER) return 0;
+    if (order == 0) return pcp_alloc_page(false);
+
+    unsigned long flags;
+    spin_lock_irqsave(&pmm_state.lock, &flags);
+    page_frame_t *page = buddy_alloc(order);
+    spin_unlock_irqrestore(&pmm_state.lock, flags);
+
+    if (!page) {
+        /* Order-0 pages parked on the pcp lists may be blocking a merge */
+        pmm_pcp_drain_all();
+        spin_lock_irqsave(&pmm_state.lock, &flags);
+        page = buddy_alloc(order);
+        spin_unlock_irqrestore(&pmm_state.lock, flags);
+        if (!page) return 0;
+    }
+
     return pfn_to_addr(page_to_pfn(page));
 }
 
+/* Release the owner back-pointers of a block about to be freed */
+static page_frame_t* prepare_free(uint64_t addr, uint32_t order) {
+    uint64_t pfn = addr_to_pfn(addr);
+    page_frame_t *page = pfn_to_page(pfn);
+    if (!page) return NULL;
+    if (page->ref_count == 0 || (page->flags & (PG_BUDDY | PG_PCP | PG_RESERVED))) return NULL; /* Already free */
+
+    /* Shared (copy-on-write) pages stay allocated until the last user drops them */
+    if (__atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL) != 0) return NULL;
+
+    /* Drop any owner back-pointers left on the block */
+    for (uint64_t i = 0; i < (1UL << order); i++) {
+        page_frame_t *p = pfn_to_page(pfn + i);
+        if (!p) break;
+        p->owner = NULL;
+        p->flags &= ~PG_SLAB;
+    }
+    return page;
+}
+
 /* Free pages */
 void pmm_free_pages(uint64_t addr, uint32_t order) {
     if (!pmm_state.initialized || order >= MAX_ORDER) return;
-    
+
+    page_frame_t *page = prepare_free(addr, order);
+    if (!page) return;
+
+    if (order == 0) {
+        pcp_free_page(page, false);
+        return;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&pmm_state.lock, &flags);
+    buddy_free(page_to_pfn(page), order);
+    spin_unlock_irqrestore(&pmm_state.lock, flags);
+}
+
+/* Give every page of an allocated block its own order-0 identity */
+void pmm_split_pages(uint64_t addr, uint32_t order) {
+    if (!pmm_state.initialized || order >= MAX_ORDER) return;
+
     uint64_t pfn = addr_to_pfn(addr);
-    if (pfn >= pmm_state.total_pages) return;
-    
-    page_frame_t *page = pfn_to_page(pfn);
-    if (page->ref_count == 0) return; /* Already free */
-    
-    page->ref_count = 0;
-    page->order = order;
-    
-    uint32_t pages_freed = 1U << order;
-    pmm_state.free_pages += pages_freed;
-    
-    /* Coalesce with buddy */
-    while (order < MAX_ORDER - 1) {
-        uint64_t buddy_pfn_val = buddy_pfn(pfn, order);
-        if (buddy_pfn_val >= pmm_state.total_pages) break;
-        
-        page_frame_t *buddy = pfn_to_page(buddy_pfn_val);
-        if (buddy->ref_count != 0 || buddy->order != order) break;
-        
-        /* Remove buddy from free list */
-        page_frame_t **prev = &pmm_state.free_lists[order].head;
-        while (*prev != NULL) {
-            if (*prev == buddy) {
-                *prev = buddy->next;
-                pmm_state.free_lists[order].count--;
-                break;
-            }
-            prev = &(*prev)->next;
-        }
-        
-        /* Merge into larger block */
-        pfn = (pfn < buddy_pfn_val) ? pfn : buddy_pfn_val;
-        page = pfn_to_page(pfn);
-        order++;
-        page->order = order;
+    page_frame_t *head = pfn_to_page(pfn);
+    if (!head || head->ref_count == 0 || head->order != order) return;
+
+    for (uint64_t i = 0; i < (1UL << order); i++) {
+        page_frame_t *page = pfn_to_page(pfn + i);
+        page->order = 0;
+        page->ref_count = 1;
     }
-    
-    /* Add to free list */
-    page->next = pmm_state.free_lists[order].head;
-    pmm_state.free_lists[order].head = page;
-    pmm_state.free_lists[order].count++;
+}
+
+/* Take an extra reference on an allocated page */
+void pmm_page_ref(uint64_t addr) {
+    page_frame_t *page = pfn_to_page(addr_to_pfn(addr));
+    if (!page || page->ref_count == 0 || (page->flags & PG_RESERVED)) return;
+    __atomic_add_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+/* Number of users of an allocated page, 0 if it is free */
+uint32_t pmm_page_refcount(uint64_t addr) {
+    page_frame_t *page = pfn_to_page(addr_to_pfn(addr));
+    if (!page || (page->flags & PG_RESERVED)) return 0;
+    return __atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE);
 }
 
 /* Allocate single page */
@@ -251,13 +466,127 @@ uint64_t pmm_alloc_page(void) {
     return pmm_alloc_pages(0);
 }
 
+/* Allocate a single cache-cold page (e.g. a DMA or read-ahead target) */
+uint64_t pmm_alloc_page_cold(void) {
+    if (!pmm_state.initialized) return 0;
+    return pcp_alloc_page(true);
+}
+
 /* Free single page */
 void pmm_free_page(uint64_t addr) {
     pmm_free_pages(addr, 0);
 }
 
+/* Free a single page whose contents are not expected to be in cache */
+void pmm_free_page_cold(uint64_t addr) {
+    if (!pmm_state.initialized) return;
+    page_frame_t *page = prepare_free(addr, 0);
+    if (page) pcp_free_page(page, true);
+}
+
+/* Tune the pcp watermarks: refill when at or below low, drain above high */
+int pmm_pcp_set_watermarks(uint32_t low, uint32_t high, uint32_t batch) {
+    if (batch == 0 || low + batch > high) return -1;
+    pmm_state.pcp_low = low;
+    pmm_state.pcp_high = high;
+    pmm_state.pcp_batch = batch;
+    return 0;
+}
+
+/* Return every page parked on this CPU's pcp list to the buddy lists */
+void pmm_pcp_drain_local(void) {
+    unsigned long flags;
+    local_irq_save(flags);
+    uint32_t cpu = smp_processor_id();
+    if (cpu < MAX_CPUS && pmm_state.pcp[cpu].count) {
+        pcp_drain(&pmm_state.pcp[cpu], pmm_state.pcp[cpu].count);
+    }
+    local_irq_restore(flags);
+}
+
+/* Only linked into SMP kernels; runs func on every other online CPU */
+extern void smp_call_function(void (*func)(void *), void *data, bool wait) __attribute__((weak));
+
+static void pcp_drain_ipi(void *unused) {
+    (void)unused;
+    pmm_pcp_drain_local();
+}
+
+/*
+ * Drain every CPU's pcp list. With cross-CPU calls the remote lists are
+ * empty on return; without them they are only flagged, and their owners
+ * drain them on their next pcp access, so a caller that retries once may
+ * still miss pages parked on an idle CPU.
+ */
+void pmm_pcp_drain_all(void) {
+    pmm_pcp_drain_local();
+
+    if (smp_call_function) {
+        smp_call_function(pcp_drain_ipi, NULL, true);
+        return;
+    }
+
+    uint32_t self = smp_processor_id();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu != self && __atomic_load_n(&pmm_state.pcp[cpu].count, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&pmm_state.pcp[cpu].drain_pending, true, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* Per-CPU pcp counters */
+void pmm_pcp_get_stats(uint32_t cpu, pmm_pcp_stats_t *stats) {
+    if (!stats) return;
+    memset_local(stats, 0, sizeof(*stats));
+    if (cpu >= MAX_CPUS) return;
+    pcp_list_t *pcp = &pmm_state.pcp[cpu];
+    stats->count = pcp->count;
+    stats->hits = pcp->hits;
+    stats->misses = pcp->misses;
+    stats->refills = pcp->refills;
+    stats->drains = pcp->drains;
+}
+
+/* Attach an owner back-pointer to every page of an allocated block */
+void pmm_set_page_owner(uint64_t addr, uint32_t order, void *owner) {
+    uint64_t pfn = addr_to_pfn(addr);
+    for (uint64_t i = 0; i < (1UL << order); i++) {
+        page_frame_t *page = pfn_to_page(pfn + i);
+        if (!page) break;
+        page->owner = owner;
+        if (owner) page->flags |= PG_SLAB;
+        else page->flags &= ~PG_SLAB;
+    }
+}
+
+/* Look up the owner back-pointer of the page containing addr */
+void *pmm_get_page_owner(uint64_t addr) {
+    page_frame_t *page = pfn_to_page(addr_to_pfn(addr));
+    if (!page || !(page->flags & PG_SLAB)) return NULL;
+    return page->owner;
+}
+
+/* Order of the allocated block starting at addr, or -1 if none starts there */
+int pmm_get_block_order(uint64_t addr) {
+    if (addr & ~PAGE_MASK) return -1;
+    page_frame_t *page = pfn_to_page(addr_to_pfn(addr));
+    if (!page || page->ref_count == 0 || (page->flags & PG_RESERVED)) return -1;
+    return (int)page->order;
+}
+
 /* Get statistics */
 void pmm_get_stats(uint64_t *total, uint64_t *free) {
     if (total) *total = pmm_state.total_pages;
-    if (free) *free = pmm_state.free_pages;
+    if (free) {
+        /* Pages parked on pcp lists are free too */
+        uint64_t pcp_pages = 0;
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) pcp_pages += pmm_state.pcp[cpu].count;
+        *free = pmm_state.free_pages + pcp_pages;
+    }
+}
+
+/* Number of free blocks currently on the list for one order */
+uint32_t pmm_get_free_blocks(uint32_t order) {
+    if (order >= MAX_ORDER) return 0;
+    return pmm_state.free_lists[order].count;
 }
@@ -4,60 +4,244 @@
  * This file implements a slab allocator for kernel objects, providing
  * a more efficient way to manage small, fixed-size allocations than
  * the page-level allocator.
+ *
+ * The allocator has three layers:
+ *  - Per-CPU magazines: every CPU owns a "loaded" and a "previous"
+ *    magazine (bounded LIFO stacks of object pointers), held in a
+ *    kmem_cpu_cache allocated the first time that CPU uses the cache.
+ *    Alloc and free only touch these with local interrupts masked, so
+ *    the fast path takes no lock and shares no cache lines with other CPUs.
+ *  - Depot: per-cache lists of full and empty magazines. A CPU whose
+ *    magazines run dry (or overflow) trades a whole magazine with the
+ *    depot under the depot lock, amortising the lock over many objects.
+ *  - Slab layer: page-backed slabs with an embedded free list. Every
+ *    page of a slab carries a back-pointer to the slab in its PMM page
+ *    descriptor, so freeing an object finds its slab in O(1).
  */
 
 #include "../include/mm/mm.h"
+#include "mm/pmm_simple.h"
+#include "smp.h"
 #include <stddef.h>
 #include <stdbool.h>
 
-#define NUM_GENERAL_CACHES 10
-static kmem_cache_t* general_caches[NUM_GENERAL_CACHES];
-static const size_t general_cache_sizes[NUM_GENERAL_CACHES] = {
-    8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096
+#define KMEM_MAGAZINE_SIZE   15     /* Rounds (objects) per magazine */
+#define KMEM_SLAB_MAX_ORDER  3      /* Largest slab is 8 pages */
+#define KMEM_SLAB_MIN_OBJS   8      /* Grow the slab order until this many fit */
+#define KMEM_FREE_SLABS_KEEP 1      /* Empty slabs kept per cache before release */
+
+/* Cache flags */
+#define KMEM_CACHE_NOMAG     0x0001 /* Bypass the magazine layer */
+
+typedef struct slab_s {
+    struct slab_s* next;
+    struct slab_s* prev;
+    struct kmem_cache* cache;   /* Owning cache */
+    void* free_list;            /* Embedded list of free objects */
+    size_t inuse;
+    size_t capacity;
+} slab_t;
+
+typedef struct kmem_magazine {
+    struct kmem_magazine* next; /* Depot list linkage */
+    size_t rounds;              /* Objects currently held */
+    void* objs[KMEM_MAGAZINE_SIZE];
+} kmem_magazine_t;
+
+/*
+ * Per-CPU magazine pair. "previous" is always either completely full or
+ * completely empty, which lets alloc/free absorb a full magazine's worth
+ * of churn before going to the depot.
+ */
+typedef struct kmem_cpu_cache {
+    kmem_magazine_t* loaded;
+    kmem_magazine_t* previous;
+    uint64_t alloc_hits;
+    uint64_t free_hits;
+    uint64_t depot_exchanges;
+} __attribute__((aligned(64))) kmem_cpu_cache_t;
+
+struct kmem_cache {
+    const char* name;
+    size_t object_size;
+    size_t object_align;
+    size_t stride;              /* Object size rounded up to the alignment */
+    size_t objs_per_slab;
+    uint32_t slab_order;        /* Each slab is 2^slab_order pages */
+    uint32_t flags;
+
+    spinlock_t lock;            /* Protects the slab lists */
+    slab_t* slabs_full;
+    slab_t* slabs_partial;
+    slab_t* slabs_free;
+    size_t nr_slabs;
+    size_t nr_free_slabs;
+    uint64_t slab_allocs;
+    uint64_t slab_frees;
+
+    spinlock_t depot_lock;      /* Protects the magazine depot */
+    kmem_magazine_t* depot_full;
+    kmem_magazine_t* depot_empty;
+    size_t depot_nr_full;
+    size_t depot_nr_empty;
+
+    struct kmem_cache* next;    /* Global cache chain */
+    kmem_cpu_cache_t* cpu[KERNEL_MAX_CPUS];  /* NULL until the CPU first uses the cache */
 };
 
-// Forward declaration
-static void kmem_cache_grow(kmem_cache_t* cache);
+/* Bootstrap caches: caches, per-CPU state and magazines are themselves slab objects */
+static kmem_cache_t kmem_cache_cache;
+static kmem_cache_t kmem_cpu_cache_cache;
+static kmem_cache_t kmem_magazine_cache;
+
+/* Only linked into SMP kernels; runs func on every other online CPU */
+extern void smp_call_function(void (*func)(void *), void *data, bool wait) __attribute__((weak));
+
+static kmem_cache_t* cache_chain;
+static spinlock_t cache_chain_lock = SPINLOCK_INIT;
+
+/*
+ * kmalloc size classes. Up to 64 bytes the classes are 8 bytes apart;
+ * above that every power-of-two interval is split into 8 steps, so a
+ * request never wastes more than 1/9 (~11%) of its object. Requests above
+ * KMALLOC_MAX_CACHE_SIZE go straight to the buddy allocator.
+ */
+#define KMALLOC_MIN_SIZE        8
+#define KMALLOC_SMALL_MAX       64
+#define KMALLOC_STEPS_SHIFT     3       /* 2^3 classes per power of two */
+#define KMALLOC_MAX_CACHE_SHIFT 13
+#define KMALLOC_MAX_CACHE_SIZE  (1UL << KMALLOC_MAX_CACHE_SHIFT)
+#define KMALLOC_NR_SMALL        (KMALLOC_SMALL_MAX / KMALLOC_MIN_SIZE)
+#define KMALLOC_NR_CLASSES      (KMALLOC_NR_SMALL + \
+                                 (KMALLOC_MAX_CACHE_SHIFT - 6) * (1 << KMALLOC_STEPS_SHIFT))
+
+static kmem_cache_t* kmalloc_caches[KMALLOC_NR_CLASSES];
+static char kmalloc_cache_names[KMALLOC_NR_CLASSES][16];
+
+static inline size_t kmem_align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline size_t kmem_slab_header_size(kmem_cache_t* cache) {
+    return kmem_align_up(sizeof(slab_t), cache->object_align);
+}
+
+static inline uint64_t kmem_slab_paddr(slab_t* slab) {
+    return (uint64_t)(uintptr_t)slab;
+}
+
+/* O(1) object-to-slab lookup through the page descriptor back-pointer */
+static inline slab_t* kmem_obj_to_slab(const void* obj) {
+    return (slab_t*)pmm_get_page_owner((uint64_t)(uintptr_t)obj);
+}
+
+// --- Slab lists ---
+
+static void slab_list_add(slab_t** head, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_del(slab_t** head, slab_t* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// --- Slab layer ---
 
 /**
- * @brief Creates a new kernel memory cache.
- * @param name The name of the cache.
- * @param size The size of objects in the cache.
- * @param align The alignment of objects in the cache.
- * @return A pointer to the new cache, or NULL on failure.
+ * @brief Fills in the geometry of a cache.
+ * @return true if at least one object fits into the largest slab.
  */
-kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
-    kmem_cache_t* cache = (kmem_cache_t*)pmm_alloc_page(); // Simplified: should use a smaller allocation
-    if (!cache) return NULL;
+static bool kmem_cache_setup(kmem_cache_t* cache, const char* name, size_t size,
+                             size_t align, uint32_t flags) {
+    k_memset(cache, 0, sizeof(*cache));
+
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (align & (align - 1)) return false;
+    if (size < sizeof(void*)) size = sizeof(void*);
 
     cache->name = name;
     cache->object_size = size;
     cache->object_align = align;
-    cache->slabs_full = NULL;
-    cache->slabs_partial = NULL;
-    cache->slabs_free = NULL;
+    cache->stride = kmem_align_up(size, align);
+    cache->flags = flags;
+    spin_lock_init(&cache->lock);
+    spin_lock_init(&cache->depot_lock);
 
-    return cache;
+    size_t header = kmem_slab_header_size(cache);
+    for (uint32_t order = 0; order <= KMEM_SLAB_MAX_ORDER; order++) {
+        size_t slab_bytes = (size_t)PAGE_SIZE << order;
+        if (slab_bytes <= header) continue;
+        cache->slab_order = order;
+        cache->objs_per_slab = (slab_bytes - header) / cache->stride;
+        if (cache->objs_per_slab >= KMEM_SLAB_MIN_OBJS) break;
+    }
+
+    return cache->objs_per_slab > 0;
 }
 
 /**
- * @brief Allocates an object from a kernel memory cache.
- * @param cache The cache to allocate from.
- * @return A pointer to the allocated object, or NULL on failure.
+ * @brief Allocates and formats a new slab for a cache.
  */
-void* kmem_cache_alloc(kmem_cache_t* cache) {
+static slab_t* kmem_slab_create(kmem_cache_t* cache) {
+    uint64_t paddr = pmm_alloc_pages(cache->slab_order);
+    if (!paddr) return NULL;
+
+    slab_t* slab = (slab_t*)(uintptr_t)paddr;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->capacity = cache->objs_per_slab;
+
+    // Thread the embedded free list through the objects
+    char* base = (char*)slab + kmem_slab_header_size(cache);
+    for (size_t i = 0; i < slab->capacity - 1; i++) {
+        *((void**)(base + i * cache->stride)) = base + (i + 1) * cache->stride;
+    }
+    *((void**)(base + (slab->capacity - 1) * cache->stride)) = NULL;
+    slab->free_list = base;
+
+    pmm_set_page_owner(paddr, cache->slab_order, slab);
+    return slab;
+}
+
+/**
+ * @brief Returns an empty slab's pages to the PMM.
+ */
+static void kmem_slab_destroy(kmem_cache_t* cache, slab_t* slab) {
+    uint64_t paddr = kmem_slab_paddr(slab);
+    pmm_set_page_owner(paddr, cache->slab_order, NULL);
+    pmm_free_pages(paddr, cache->slab_order);
+}
+
+/**
+ * @brief Takes one object from the slab lists, growing the cache if needed.
+ */
+static void* kmem_slab_alloc(kmem_cache_t* cache) {
+    unsigned long flags;
+    spin_lock_irqsave(&cache->lock, &flags);
+
     slab_t* slab = cache->slabs_partial;
     if (!slab) {
         slab = cache->slabs_free;
-        if (!slab) {
-            kmem_cache_grow(cache);
-            slab = cache->slabs_free;
+        if (slab) {
+            slab_list_del(&cache->slabs_free, slab);
+            cache->nr_free_slabs--;
+        } else {
+            spin_unlock_irqrestore(&cache->lock, flags);
+            slab = kmem_slab_create(cache);
             if (!slab) return NULL;
+            spin_lock_irqsave(&cache->lock, &flags);
+            cache->nr_slabs++;
         }
-        // Move slab from free to partial list
-        cache->slabs_free = slab->next;
-        slab->next = cache->slabs_partial;
-        cache->slabs_partial = slab;
+        slab_list_add(&cache->slabs_partial, slab);
     }
 
     void* obj = slab->free_list;
@@ -65,87 +249,470 @@ void* kmem_cache_alloc(kmem_cache_t* cache) {
     slab->inuse++;
 
     if (slab->inuse == slab->capacity) {
-        // Move slab from partial to full list
-        cache->slabs_partial = slab->next;
-        slab->next = cache->slabs_full;
-        cache->slabs_full = slab;
+        slab_list_del(&cache->slabs_partial, slab);
+        slab_list_add(&cache->slabs_full, slab);
     }
 
+    cache->slab_allocs++;
+    spin_unlock_irqrestore(&cache->lock, flags);
     return obj;
 }
 
+/**
+ * @brief Returns one object to its slab, releasing surplus empty slabs.
+ */
+static void kmem_slab_free(kmem_cache_t* cache, slab_t* slab, void* obj) {
+    slab_t* release = NULL;
+    unsigned long flags;
+    spin_lock_irqsave(&cache->lock, &flags);
+
+    bool was_full = (slab->inuse == slab->capacity);
+    *((void**)obj) = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse--;
+
+    if (was_full) {
+        slab_list_del(&cache->slabs_full, slab);
+        if (slab->inuse > 0) slab_list_add(&cache->slabs_partial, slab);
+    } else if (slab->inuse == 0) {
+        slab_list_del(&cache->slabs_partial, slab);
+    }
+
+    if (slab->inuse == 0) {
+        if (cache->nr_free_slabs >= KMEM_FREE_SLABS_KEEP) {
+            cache->nr_slabs--;
+            release = slab;
+        } else {
+            slab_list_add(&cache->slabs_free, slab);
+            cache->nr_free_slabs++;
+        }
+    }
+
+    cache->slab_frees++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (release) kmem_slab_destroy(cache, release);
+}
+
+// --- Magazine and depot layer ---
+
+static void kmem_depot_push(kmem_magazine_t** list, size_t* count, kmem_magazine_t* mag) {
+    mag->next = *list;
+    *list = mag;
+    (*count)++;
+}
+
+static kmem_magazine_t* kmem_depot_pop(kmem_magazine_t** list, size_t* count) {
+    kmem_magazine_t* mag = *list;
+    if (mag) {
+        *list = mag->next;
+        mag->next = NULL;
+        (*count)--;
+    }
+    return mag;
+}
+
+/**
+ * @brief Returns every object held by a magazine to the slab layer.
+ */
+static void kmem_magazine_empty(kmem_cache_t* cache, kmem_magazine_t* mag) {
+    while (mag->rounds > 0) {
+        void* obj = mag->objs[--mag->rounds];
+        kmem_slab_free(cache, kmem_obj_to_slab(obj), obj);
+    }
+}
+
+/**
+ * @brief Empties a magazine and frees it.
+ */
+static void kmem_magazine_release(kmem_cache_t* cache, kmem_magazine_t* mag) {
+    kmem_magazine_empty(cache, mag);
+    kmem_slab_free(&kmem_magazine_cache, kmem_obj_to_slab(mag), mag);
+}
+
+/**
+ * @brief Returns this CPU's magazine pair for a cache, allocating it on
+ *        first use. Called with local interrupts masked.
+ * @return NULL if the CPU has none and none could be allocated.
+ */
+static kmem_cpu_cache_t* kmem_cpu_cache_get(kmem_cache_t* cache, uint32_t cpu) {
+    if (cpu >= KERNEL_MAX_CPUS) return NULL;
+
+    kmem_cpu_cache_t* cc = cache->cpu[cpu];
+    if (!cc) {
+        cc = (kmem_cpu_cache_t*)kmem_slab_alloc(&kmem_cpu_cache_cache);
+        if (!cc) return NULL;
+        k_memset(cc, 0, sizeof(*cc));
+        // Published for kmem_cache_get_stats() on other CPUs
+        __atomic_store_n(&cache->cpu[cpu], cc, __ATOMIC_RELEASE);
+    }
+    return cc;
+}
+
+/**
+ * @brief Empties the running CPU's magazines of a cache (cross-CPU call
+ *        target, so it takes the cache as a void pointer).
+ */
+static void kmem_cpu_drain(void* arg) {
+    kmem_cache_t* cache = (kmem_cache_t*)arg;
+    kmem_magazine_t* loaded = NULL;
+    kmem_magazine_t* previous = NULL;
+
+    unsigned long flags;
+    local_irq_save(flags);
+    uint32_t cpu = smp_processor_id();
+    kmem_cpu_cache_t* cc = cpu < KERNEL_MAX_CPUS ? cache->cpu[cpu] : NULL;
+    if (cc) {
+        loaded = cc->loaded;
+        previous = cc->previous;
+        cc->loaded = NULL;
+        cc->previous = NULL;
+    }
+    local_irq_restore(flags);
+
+    if (loaded) kmem_magazine_release(cache, loaded);
+    if (previous) kmem_magazine_release(cache, previous);
+}
+
+/**
+ * @brief Creates a new kernel memory cache.
+ * @param name The name of the cache.
+ * @param size The size of objects in the cache.
+ * @param align The alignment of objects in the cache.
+ * @return A pointer to the new cache, or NULL on failure.
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
+    kmem_cache_t* cache = (kmem_cache_t*)kmem_slab_alloc(&kmem_cache_cache);
+    if (!cache) return NULL;
+
+    if (!kmem_cache_setup(cache, name, size, align, 0)) {
+        kmem_slab_free(&kmem_cache_cache, kmem_obj_to_slab(cache), cache);
+        return NULL;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&cache_chain_lock, &flags);
+    cache->next = cache_chain;
+    cache_chain = cache;
+    spin_unlock_irqrestore(&cache_chain_lock, flags);
+
+    return cache;
+}
+
+/**
+ * @brief Allocates an object from a kernel memory cache.
+ * @param cache The cache to allocate from.
+ * @return A pointer to the allocated object, or NULL on failure.
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) return NULL;
+    if (cache->flags & KMEM_CACHE_NOMAG) return kmem_slab_alloc(cache);
+
+    unsigned long flags;
+    local_irq_save(flags);
+
+    kmem_cpu_cache_t* cc = kmem_cpu_cache_get(cache, smp_processor_id());
+    if (!cc) {
+        local_irq_restore(flags);
+        return kmem_slab_alloc(cache);
+    }
+
+    for (;;) {
+        kmem_magazine_t* mag = cc->loaded;
+        if (mag && mag->rounds > 0) {
+            void* obj = mag->objs[--mag->rounds];
+            cc->alloc_hits++;
+            local_irq_restore(flags);
+            return obj;
+        }
+
+        // Previous magazine is full: swap it in
+        if (cc->previous && cc->previous->rounds > 0) {
+            kmem_magazine_t* tmp = cc->previous;
+            cc->previous = mag;
+            cc->loaded = tmp;
+            continue;
+        }
+
+        // Both magazines empty: trade the previous one for a full one
+        spin_lock(&cache->depot_lock);
+        kmem_magazine_t* full = kmem_depot_pop(&cache->depot_full, &cache->depot_nr_full);
+        if (!full) {
+            spin_unlock(&cache->depot_lock);
+            break;
+        }
+        if (cc->previous) {
+            kmem_depot_push(&cache->depot_empty, &cache->depot_nr_empty, cc->previous);
+        }
+        spin_unlock(&cache->depot_lock);
+
+        cc->previous = cc->loaded;
+        cc->loaded = full;
+        cc->depot_exchanges++;
+    }
+
+    local_irq_restore(flags);
+    return kmem_slab_alloc(cache);
+}
+
 /**
  * @brief Frees an object back to a kernel memory cache.
  * @param cache The cache the object belongs to.
  * @param obj The object to free.
  */
 void kmem_cache_free(kmem_cache_t* cache, void* obj) {
-    // This is a simplified implementation. A real one would need to find the slab for the object.
-    // For now, we assume we can find the slab.
-    slab_t* slab = cache->slabs_full; // Simplified search
-    if (!slab) slab = cache->slabs_partial;
+    if (!obj) return;
 
-    *((void**)obj) = slab->free_list;
-    slab->free_list = obj;
-    slab->inuse--;
+    slab_t* slab = kmem_obj_to_slab(obj);
+    if (!slab) return; // Not a slab object
+
+    // The page map is authoritative about ownership
+    cache = slab->cache;
+    if (cache->flags & KMEM_CACHE_NOMAG) {
+        kmem_slab_free(cache, slab, obj);
+        return;
+    }
+
+    unsigned long flags;
+    local_irq_save(flags);
+
+    kmem_cpu_cache_t* cc = kmem_cpu_cache_get(cache, smp_processor_id());
+    if (!cc) {
+        local_irq_restore(flags);
+        kmem_slab_free(cache, slab, obj);
+        return;
+    }
+
+    for (;;) {
+        kmem_magazine_t* mag = cc->loaded;
+        if (mag && mag->rounds < KMEM_MAGAZINE_SIZE) {
+            mag->objs[mag->rounds++] = obj;
+            cc->free_hits++;
+            local_irq_restore(flags);
+            return;
+        }
+
+        // Previous magazine is empty: swap it in
+        if (cc->previous && cc->previous->rounds == 0) {
+            kmem_magazine_t* tmp = cc->previous;
+            cc->previous = mag;
+            cc->loaded = tmp;
+            continue;
+        }
+
+        // Both magazines full: trade the previous one for an empty one
+        spin_lock(&cache->depot_lock);
+        kmem_magazine_t* empty = kmem_depot_pop(&cache->depot_empty, &cache->depot_nr_empty);
+        spin_unlock(&cache->depot_lock);
+
+        if (!empty) {
+            empty = (kmem_magazine_t*)kmem_slab_alloc(&kmem_magazine_cache);
+            if (!empty) break;
+            empty->next = NULL;
+            empty->rounds = 0;
+        }
+
+        if (cc->previous) {
+            spin_lock(&cache->depot_lock);
+            kmem_depot_push(&cache->depot_full, &cache->depot_nr_full, cc->previous);
+            spin_unlock(&cache->depot_lock);
+        }
+
+        cc->previous = cc->loaded;
+        cc->loaded = empty;
+        cc->depot_exchanges++;
+    }
 
-    // Simplified: move slab between lists if needed
+    local_irq_restore(flags);
+    kmem_slab_free(cache, slab, obj);
 }
 
 /**
- * @brief Grows a kernel memory cache by adding a new slab.
- * @param cache The cache to grow.
+ * @brief Releases cached memory: every CPU's magazines, the depot, and
+ *        empty slabs are all returned to the page allocator.
+ *
+ * Magazines are only ever touched by their own CPU, so other CPUs empty
+ * theirs through a cross-CPU call. Kernels built without SMP support have
+ * no such call (and no other CPU running), and only drain this CPU's.
+ *
+ * @param cache The cache to shrink.
  */
-static void kmem_cache_grow(kmem_cache_t* cache) {
-    void* page = pmm_alloc_page();
-    if (!page) return;
+void kmem_cache_shrink(kmem_cache_t* cache) {
+    if (!cache) return;
 
-    slab_t* slab = (slab_t*)page;
-    slab->inuse = 0;
-    slab->capacity = (PAGE_SIZE - sizeof(slab_t)) / cache->object_size;
-    slab->free_list = (char*)page + sizeof(slab_t);
+    unsigned long flags;
+    kmem_magazine_t* mags = NULL;
 
-    // Initialize the free list in the new slab
-    char* ptr = (char*)slab->free_list;
-    for (size_t i = 0; i < slab->capacity - 1; i++) {
-        *((void**)(ptr + i * cache->object_size)) = ptr + (i + 1) * cache->object_size;
+    if (!(cache->flags & KMEM_CACHE_NOMAG)) {
+        kmem_cpu_drain(cache);
+        if (smp_call_function) smp_call_function(kmem_cpu_drain, cache, true);
+
+        spin_lock_irqsave(&cache->depot_lock, &flags);
+        kmem_magazine_t* mag;
+        while ((mag = kmem_depot_pop(&cache->depot_full, &cache->depot_nr_full)) != NULL) {
+            mag->next = mags;
+            mags = mag;
+        }
+        while ((mag = kmem_depot_pop(&cache->depot_empty, &cache->depot_nr_empty)) != NULL) {
+            mag->next = mags;
+            mags = mag;
+        }
+        spin_unlock_irqrestore(&cache->depot_lock, flags);
     }
-    *((void**)(ptr + (slab->capacity - 1) * cache->object_size)) = NULL;
 
-    // Add the new slab to the free list
-    slab->next = cache->slabs_free;
-    cache->slabs_free = slab;
+    while (mags) {
+        kmem_magazine_t* next = mags->next;
+        kmem_magazine_release(cache, mags);
+        mags = next;
+    }
+
+    // Release every empty slab, including the reserve
+    spin_lock_irqsave(&cache->lock, &flags);
+    slab_t* slab = cache->slabs_free;
+    cache->slabs_free = NULL;
+    cache->nr_slabs -= cache->nr_free_slabs;
+    cache->nr_free_slabs = 0;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    while (slab) {
+        slab_t* next = slab->next;
+        kmem_slab_destroy(cache, slab);
+        slab = next;
+    }
+}
+
+/**
+ * @brief Reports allocation statistics for a cache.
+ * @param cache The cache to query.
+ * @param stats Output structure.
+ */
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+    if (!cache || !stats) return;
+
+    k_memset(stats, 0, sizeof(*stats));
+    for (uint32_t cpu = 0; cpu < KERNEL_MAX_CPUS; cpu++) {
+        kmem_cpu_cache_t* cc = __atomic_load_n(&cache->cpu[cpu], __ATOMIC_ACQUIRE);
+        if (!cc) continue;
+        stats->magazine_allocs += cc->alloc_hits;
+        stats->magazine_frees += cc->free_hits;
+        stats->depot_exchanges += cc->depot_exchanges;
+    }
+    stats->slab_allocs = cache->slab_allocs;
+    stats->slab_frees = cache->slab_frees;
+    stats->nr_slabs = cache->nr_slabs;
+    stats->objs_per_slab = cache->objs_per_slab;
+}
+
+// --- kmalloc ---
+
+static inline uint32_t kmalloc_fls(size_t value) {
+    uint32_t bit = 0;
+    while (value >>= 1) bit++;
+    return bit;
+}
+
+/**
+ * @brief Maps a request size to its size class index in O(1).
+ */
+static inline uint32_t kmalloc_index(size_t size) {
+    if (size <= KMALLOC_SMALL_MAX) {
+        return (uint32_t)((size + KMALLOC_MIN_SIZE - 1) / KMALLOC_MIN_SIZE) - 1;
+    }
+
+    // size lies in (2^shift, 2^(shift+1)], split into 8 equal steps
+    uint32_t shift = kmalloc_fls(size - 1);
+    size_t step = (size_t)1 << (shift - KMALLOC_STEPS_SHIFT);
+    size_t offset = (size - ((size_t)1 << shift) + step - 1) / step;
+    return KMALLOC_NR_SMALL + (shift - 6) * (1 << KMALLOC_STEPS_SHIFT) + (uint32_t)offset - 1;
+}
+
+static size_t kmalloc_index_size(uint32_t index) {
+    if (index < KMALLOC_NR_SMALL) {
+        return (size_t)(index + 1) * KMALLOC_MIN_SIZE;
+    }
+    uint32_t group = (index - KMALLOC_NR_SMALL) >> KMALLOC_STEPS_SHIFT;
+    uint32_t step = ((index - KMALLOC_NR_SMALL) & ((1 << KMALLOC_STEPS_SHIFT) - 1)) + 1;
+    return ((size_t)1 << (group + 6)) + step * ((size_t)1 << (group + 6 - KMALLOC_STEPS_SHIFT));
+}
+
+/**
+ * @brief Buddy order for a large allocation: smallest 2^order pages >= size.
+ */
+static inline uint32_t kmalloc_large_order(size_t size) {
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t order = kmalloc_fls(pages);
+    if (((size_t)1 << order) < pages) order++;
+    return order;
+}
+
+static void kmalloc_format_name(char* buf, size_t size) {
+    static const char prefix[] = "kmalloc-";
+    char digits[12];
+    int n = 0;
+    size_t i = 0;
+
+    for (; prefix[i]; i++) buf[i] = prefix[i];
+    do {
+        digits[n++] = (char)('0' + size % 10);
+        size /= 10;
+    } while (size);
+    while (n) buf[i++] = digits[--n];
+    buf[i] = '\0';
 }
 
 /**
  * @brief Initializes the slab allocator and general purpose caches.
  */
 void slab_init(void) {
-    for (int i = 0; i < NUM_GENERAL_CACHES; i++) {
-        char* name = "gen-cache"; // Simplified name
-        general_caches[i] = kmem_cache_create(name, general_cache_sizes[i], 0);
+    kmem_cache_setup(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t),
+                     __alignof__(kmem_cache_t), KMEM_CACHE_NOMAG);
+    kmem_cache_setup(&kmem_cpu_cache_cache, "kmem_cpu_cache", sizeof(kmem_cpu_cache_t),
+                     __alignof__(kmem_cpu_cache_t), KMEM_CACHE_NOMAG);
+    kmem_cache_setup(&kmem_magazine_cache, "kmem_magazine", sizeof(kmem_magazine_t),
+                     0, KMEM_CACHE_NOMAG);
+
+    for (uint32_t i = 0; i < KMALLOC_NR_CLASSES; i++) {
+        size_t size = kmalloc_index_size(i);
+        kmalloc_format_name(kmalloc_cache_names[i], size);
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_cache_names[i], size, 0);
     }
 }
 
 /**
  * @brief Allocates a block of memory from the kernel heap.
+ *
+ * Small requests are served by the size-class caches; larger ones get a
+ * naturally aligned 2^order page block. No header is stored in-band: the
+ * page map tells kfree() which it was.
+ *
  * @param size The size of the block to allocate.
  * @return A pointer to the allocated block, or NULL on failure.
  */
 void* kmalloc(size_t size) {
-    if (size > general_cache_sizes[NUM_GENERAL_CACHES - 1]) {
-        // For large allocations, fall back to the page allocator
-        // This is a simplified approach.
-        size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-        return pmm_alloc_pages(0); // Simplified: order should be calculated
-    }
+    if (size == 0) return NULL;
 
-    for (int i = 0; i < NUM_GENERAL_CACHES; i++) {
-        if (size <= general_cache_sizes[i]) {
-            return kmem_cache_alloc(general_caches[i]);
-        }
+    if (size > KMALLOC_MAX_CACHE_SIZE) {
+        uint32_t order = kmalloc_large_order(size);
+        if (order > PMM_MAX_ORDER) return NULL;
+        return (void*)(uintptr_t)pmm_alloc_pages(order);
     }
-    return NULL; // Should not be reached
+
+    return kmem_cache_alloc(kmalloc_caches[kmalloc_index(size)]);
+}
+
+/**
+ * @brief Returns the usable size of a kmalloc() block.
+ * @param ptr The block to query.
+ * @return The size of the backing object or page block, or 0 if unknown.
+ */
+size_t ksize(const void* ptr) {
+    if (!ptr) return 0;
+
+    slab_t* slab = kmem_obj_to_slab(ptr);
+    if (slab) return slab->cache->object_size;
+
+    int order = pmm_get_block_order((uint64_t)(uintptr_t)ptr);
+    return order < 0 ? 0 : (size_t)PAGE_SIZE << order;
 }
 
 /**
@@ -153,7 +720,18 @@ void* kmalloc(size_t size) {
  * @param ptr The block to free.
  */
 void kfree(void* ptr) {
-    // This is highly simplified. A real implementation needs to determine
-    // which cache the allocation came from. This often involves storing
-    // metadata near the allocation.
+    if (!ptr) return;
+
+    slab_t* slab = kmem_obj_to_slab(ptr);
+    if (slab) {
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    // Not a slab page: a large allocation heads its own buddy block
+    uint64_t paddr = (uint64_t)(uintptr_t)ptr;
+    int order = pmm_get_block_order(paddr);
+    if (order >= 0) {
+        pmm_free_pages(paddr, (uint32_t)order);
+    }
 }
@@ -16,7 +16,10 @@ static vmm_aspace_t kernel_as;
 // Helper function to get the next level of a page table
 static uint64_t* get_next_level(uint64_t* table, size_t index, bool allocate) {
     if (table[index] & VMM_FLAG_PRESENT) {
-        return (uint64_t*)(table[index] & ~0xFFF);
+        if (table[index] & PTE_HUGE) {
+            return NULL; // Leaf mapping, there is no table below it
+        }
+        return VMM_TABLE(table[index]);
     }
     if (!allocate) {
         return NULL;
@@ -55,11 +58,16 @@ void vmm_init(const boot_info_t* bi) {
 
 /**
  * @brief Maps a virtual page to a physical page in a given address space.
+ *
+ * With PTE_HUGE in flags the mapping is a 2 MiB leaf in the page directory;
+ * both addresses must then be 2 MiB aligned and the directory slot empty.
+ * A 4 KiB mapping inside an existing huge mapping fails; split it first.
+ *
  * @param as The address space.
  * @param virt The virtual address to map.
  * @param phys The physical address to map to.
  * @param flags The page table entry flags.
- * @return true on success, false on failure.
+ * @return K_OK on success, K_ERR on failure.
  */
 status_t vmm_map_page(vmm_aspace_t* aspace, vaddr_t vaddr, paddr_t paddr, uint32_t flags) {
     size_t pml4_idx = (vaddr >> 39) & 0x1FF;
@@ -71,6 +79,14 @@ status_t vmm_map_page(vmm_aspace_t* aspace, vaddr_t vaddr, paddr_t paddr, uint32
     if (!pdpt) return K_ERR;
     uint64_t* pdt = get_next_level(pdpt, pdpt_idx, true);
     if (!pdt) return K_ERR;
+
+    if (flags & PTE_HUGE) {
+        if ((vaddr | paddr) & (HPAGE_SIZE - 1)) return K_ERR;
+        if (pdt[pdt_idx] & VMM_FLAG_PRESENT) return K_ERR;
+        pdt[pdt_idx] = paddr | flags;
+        return K_OK;
+    }
+
     uint64_t* pt = get_next_level(pdt, pdt_idx, true);
     if (!pt) return K_ERR;
 
@@ -78,6 +94,38 @@ status_t vmm_map_page(vmm_aspace_t* aspace, vaddr_t vaddr, paddr_t paddr, uint32
     return K_OK;
 }
 
+/**
+ * @brief Returns the page-directory entry covering vaddr, or NULL.
+ */
+uint64_t* vmm_get_pde(vmm_aspace_t* aspace, vaddr_t vaddr) {
+    if (!aspace || !aspace->arch_pml) return NULL;
+
+    uint64_t* pdpt = get_next_level((uint64_t*)aspace->arch_pml, (vaddr >> 39) & 0x1FF, false);
+    if (!pdpt) return NULL;
+    uint64_t* pdt = get_next_level(pdpt, (vaddr >> 30) & 0x1FF, false);
+    if (!pdt) return NULL;
+    return &pdt[(vaddr >> 21) & 0x1FF];
+}
+
+/**
+ * @brief Returns the 4 KiB page-table entry for vaddr, or NULL if there is
+ *        no page table (including when the range is a huge mapping).
+ */
+uint64_t* vmm_get_pte(vmm_aspace_t* aspace, vaddr_t vaddr) {
+    uint64_t* pde = vmm_get_pde(aspace, vaddr);
+    if (!pde) return NULL;
+    uint64_t* pt = get_next_level(pde, 0, false);
+    if (!pt) return NULL;
+    return &pt[(vaddr >> 12) & 0x1FF];
+}
+
+/**
+ * @brief Drops the TLB entry for vaddr (the whole 2 MiB entry if huge).
+ */
+void vmm_flush_tlb_page(vaddr_t vaddr) {
+    __asm__ volatile("invlpg (%0)" : : "r"((uintptr_t)vaddr) : "memory");
+}
+
 /**
  * @brief Switches the current address space.
  * @param as The address space to switch to.
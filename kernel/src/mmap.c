@@ -15,9 +15,19 @@
 #include <string.h>
 #include "kernel.h"
 #include "vmm.h"
+#include "vfs.h"
+#include "page_cache.h"
+#include "writeback.h"
+#include "mm/huge_memory.h"
 
 #define MAX_MAPPINGS 256
-#define PAGE_CACHE_SIZE 1024
+#define MMAP_BASE       0x40000000  // Start of the user mmap area
+#define MAX_RA_FILES    64
+
+// File fault tuning (pages)
+#define FAULT_AROUND_PAGES  16  // Cached neighbours mapped on a random fault
+#define RA_MIN_PAGES        4   // First read-ahead window of a stream
+#define RA_MAX_PAGES        64  // Read-ahead window cap (256 KiB)
 
 // mmap protection flags
 #define PROT_NONE  0x0
@@ -35,6 +45,7 @@
 typedef struct {
     bool in_use;
     int fd;                  // File descriptor
+    vnode_t *vn;             // Backing file, keys the page cache
     uint64_t file_offset;    // Offset in file
     vaddr_t vaddr;           // Virtual address
     uint32_t size;           // Size of mapping
@@ -43,25 +54,29 @@ typedef struct {
     vmm_aspace_t *space;     // Address space
 } file_mapping_t;
 
-// Page cache entry
+// Read-ahead state of an open file
 typedef struct {
-    bool valid;
-    int fd;                  // File descriptor
-    uint64_t file_offset;    // Offset in file (page-aligned)
-    paddr_t paddr;           // Physical page address
-    bool dirty;              // Modified flag
-    uint64_t last_access;    // For LRU eviction
-} page_cache_entry_t;
+    bool in_use;
+    vnode_t *vn;
+    uint64_t start;          // First page of the current window
+    uint32_t size;           // Window size in pages, 0 after a random access
+    uint64_t prev_index;     // Page of the last fault
+} file_ra_state_t;
 
 static file_mapping_t mappings[MAX_MAPPINGS];
-static page_cache_entry_t page_cache[PAGE_CACHE_SIZE];
-static uint64_t access_counter = 0;
+
+static file_ra_state_t ra_states[MAX_RA_FILES];
+static uint32_t ra_next_victim = 0;
+
+// File fault statistics
+static uint64_t file_faults = 0;
+static uint64_t ra_pages_read = 0;
+static uint64_t fault_around_mapped = 0;
 
 // Initialize mmap subsystem
 void mmap_init(void) {
     memset(mappings, 0, sizeof(mappings));
-    memset(page_cache, 0, sizeof(page_cache));
-    access_counter = 0;
+    memset(ra_states, 0, sizeof(ra_states));
 }
 
 // Find free mapping slot
@@ -74,79 +89,47 @@ static int find_free_mapping(void) {
     return -1;
 }
 
-// Find page in cache
-static page_cache_entry_t *find_cached_page(int fd, uint64_t file_offset) {
-    for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
-        if (page_cache[i].valid && 
-            page_cache[i].fd == fd && 
-            page_cache[i].file_offset == file_offset) {
-            page_cache[i].last_access = access_counter++;
-            return &page_cache[i];
+// Find the mapping that contains [start, end)
+static int find_mapping_range(vmm_aspace_t *space, vaddr_t start, vaddr_t end) {
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappings[i].in_use &&
+            mappings[i].space == space &&
+            mappings[i].vaddr <= start &&
+            end <= mappings[i].vaddr + mappings[i].size) {
+            return i;
         }
     }
-    return NULL;
+    return -1;
 }
 
-// Allocate cache entry (LRU eviction)
-static page_cache_entry_t *alloc_cache_entry(void) {
-    // First try to find invalid entry
-    for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
-        if (!page_cache[i].valid) {
-            return &page_cache[i];
+// Pick an unused address range; large mappings are 2 MiB aligned so they
+// can be backed by huge pages
+static vaddr_t find_free_range(vmm_aspace_t *space, uint32_t size) {
+    vaddr_t align = size >= HPAGE_SIZE ? HPAGE_SIZE : PAGE_SIZE;
+    vaddr_t vaddr = MMAP_BASE;
+    bool moved = true;
+
+    while (moved) {
+        moved = false;
+        for (int i = 0; i < MAX_MAPPINGS; i++) {
+            file_mapping_t *m = &mappings[i];
+            if (!m->in_use || m->space != space) continue;
+            if (vaddr < m->vaddr + m->size && m->vaddr < vaddr + size) {
+                vaddr = (m->vaddr + m->size + align - 1) & ~(align - 1);
+                moved = true;
+            }
         }
-    }
-    
-    // Find LRU entry
-    uint64_t min_access = page_cache[0].last_access;
-    int lru_idx = 0;
-    
-    for (int i = 1; i < PAGE_CACHE_SIZE; i++) {
-        if (page_cache[i].last_access < min_access) {
-            min_access = page_cache[i].last_access;
-            lru_idx = i;
+        vmm_region_t *r = vmm_region_find_range(space, vaddr, size);
+        if (r) {
+            vaddr = (r->start + r->length + align - 1) & ~(align - 1);
+            moved = true;
         }
     }
-    
-    // Evict LRU entry (write back if dirty)
-    page_cache_entry_t *entry = &page_cache[lru_idx];
-    if (entry->dirty) {
-        // Write back to file (would call VFS write here)
-        // fs_write(entry->fd, entry->file_offset, (void *)entry->paddr, PAGE_SIZE);
-    }
-    
-    entry->valid = false;
-    return entry;
+    return vaddr;
 }
 
-// Read page from file into cache
-static paddr_t read_file_page(int fd, uint64_t file_offset) {
-    // Check cache first
-    page_cache_entry_t *cached = find_cached_page(fd, file_offset);
-    if (cached) {
-        return cached->paddr;
-    }
-    
-    // Not in cache - allocate page
-    paddr_t page = pmm_alloc_page();
-    if (!page) return 0;
-    
-    // Clear the page (zero-fill for now - would read from file)
-    void *page_virt = (void *)PHYS_TO_VIRT_DIRECT(page);
-    memset(page_virt, 0, PAGE_SIZE);
-    
-    // Add to cache
-    page_cache_entry_t *entry = alloc_cache_entry();
-    if (entry) {
-        entry->valid = true;
-        entry->fd = fd;
-        entry->file_offset = file_offset;
-        entry->paddr = page;
-        entry->dirty = false;
-        entry->last_access = access_counter++;
-    }
-    
-    return page;
-}
+// Resolves an open descriptor of the current process (fd.c)
+extern vnode_t *fd_get_vnode(int fd);
 
 // mmap system call
 void *sys_mmap(void *addr, uint32_t length, int prot, int flags, int fd, uint64_t offset) {
@@ -159,67 +142,47 @@ void *sys_mmap(void *addr, uint32_t length, int prot, int flags, int fd, uint64_
     vmm_aspace_t *space = vmm_get_current_aspace();
     if (!space) return (void *)-1;
     
+    // Round up to page boundary
+    uint32_t page_count = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    
     // Determine virtual address
     vaddr_t vaddr;
     if (flags & MAP_FIXED) {
         vaddr = (vaddr_t)addr;
     } else {
-        // Find free virtual address (simplified)
-        vaddr = 0x40000000; // Start of user mmap region
+        vaddr = find_free_range(space, page_count * PAGE_SIZE);
     }
     
-    // Round up to page boundary
-    uint32_t page_count = (length + PAGE_SIZE - 1) / PAGE_SIZE;
-    
-    // Convert protection to page flags
-    uint32_t page_flags = PTE_PRESENT | PTE_USER;
-    if (prot & PROT_WRITE) page_flags |= PTE_WRITABLE;
-    if (!(prot & PROT_EXEC)) page_flags |= PTE_NX;
-    
     // Map pages
+    vnode_t *vn = NULL;
     if (flags & MAP_ANONYMOUS) {
-        // Anonymous mapping - allocate zero pages
-        for (uint32_t i = 0; i < page_count; i++) {
-            paddr_t page = pmm_alloc_page();
-            if (!page) {
-                // Cleanup on failure
-                for (uint32_t j = 0; j < i; j++) {
-                    vmm_unmap_page(space, vaddr + j * PAGE_SIZE);
-                }
-                return (void *)-1;
-            }
-            
-            void *page_virt = (void *)PHYS_TO_VIRT_DIRECT(page);
-            memset(page_virt, 0, PAGE_SIZE);
-            
-            if (vmm_map_page(space, vaddr + i * PAGE_SIZE, page, page_flags) != 0) {
-                pmm_free_page(page);
-                // Cleanup
-                for (uint32_t j = 0; j < i; j++) {
-                    vmm_unmap_page(space, vaddr + j * PAGE_SIZE);
-                }
-                return (void *)-1;
-            }
+        // Anonymous mapping - populated on first touch by the page fault
+        // handler, with huge pages where the range allows
+        uint32_t region_flags = VMM_REGION_ANON | VMM_REGION_USER;
+        if (prot & PROT_WRITE) region_flags |= VMM_REGION_WRITE;
+        
+        if (vmm_region_add(space, vaddr, page_count * PAGE_SIZE, region_flags) != 0) {
+            return (void *)-1;
         }
+        khugepaged_add(space);
     } else {
-        // File-backed mapping
-        for (uint32_t i = 0; i < page_count; i++) {
-            uint64_t file_off = offset + i * PAGE_SIZE;
-            paddr_t paddr = read_file_page(fd, file_off);
-            
-            if (!paddr || vmm_map_page(space, vaddr + i * PAGE_SIZE, paddr, page_flags) != 0) {
-                // Cleanup
-                for (uint32_t j = 0; j < i; j++) {
-                    vmm_unmap_page(space, vaddr + j * PAGE_SIZE);
-                }
-                return (void *)-1;
-            }
+        // File-backed mapping - pages are read in and mapped by
+        // mmap_file_fault(), a read-ahead window at a time
+        vn = fd_get_vnode(fd);
+        if (!vn || (offset & (PAGE_SIZE - 1))) return (void *)-1;
+        
+        uint32_t region_flags = VMM_REGION_FILE | VMM_REGION_USER;
+        if (prot & PROT_WRITE) region_flags |= VMM_REGION_WRITE;
+        
+        if (vmm_region_add(space, vaddr, page_count * PAGE_SIZE, region_flags) != 0) {
+            return (void *)-1;
         }
     }
     
     // Record mapping
     mappings[map_idx].in_use = true;
     mappings[map_idx].fd = fd;
+    mappings[map_idx].vn = vn;
     mappings[map_idx].file_offset = offset;
     mappings[map_idx].vaddr = vaddr;
     mappings[map_idx].size = page_count * PAGE_SIZE;
@@ -230,44 +193,319 @@ void *sys_mmap(void *addr, uint32_t length, int prot, int flags, int fd, uint64_
     return (void *)vaddr;
 }
 
+// Read-ahead state for a file, recycling the oldest slot when full
+static file_ra_state_t *ra_get(vnode_t *vn) {
+    for (int i = 0; i < MAX_RA_FILES; i++) {
+        if (ra_states[i].in_use && ra_states[i].vn == vn) {
+            return &ra_states[i];
+        }
+    }
+    
+    file_ra_state_t *ra = &ra_states[ra_next_victim];
+    ra_next_victim = (ra_next_victim + 1) % MAX_RA_FILES;
+    
+    ra->in_use = true;
+    ra->vn = vn;
+    ra->start = 0;
+    ra->size = 0;
+    ra->prev_index = (uint64_t)-1;  // A fault on page 0 starts a stream
+    return ra;
+}
+
+// Size the read-ahead window for a fault on file page index. Faults that
+// continue a stream double the window up to RA_MAX_PAGES; anything else
+// is treated as random access and reads just the faulting page.
+static uint32_t ra_next_window(file_ra_state_t *ra, uint64_t index) {
+    bool sequential = index == ra->prev_index + 1 ||
+                      (ra->size && index >= ra->start && index <= ra->start + ra->size);
+    ra->prev_index = index;
+    
+    if (!sequential) {
+        ra->start = index;
+        ra->size = 0;
+        return 1;
+    }
+    
+    uint32_t size = ra->size ? ra->size * 2 : RA_MIN_PAGES;
+    if (size > RA_MAX_PAGES) size = RA_MAX_PAGES;
+    
+    ra->start = index;
+    ra->size = size;
+    return size;
+}
+
+// Map one cached file page; private writable mappings get it copy-on-write
+static bool map_file_page(vmm_aspace_t *space, vmm_region_t *region, file_mapping_t *m,
+                          vaddr_t va, paddr_t paddr) {
+    uint32_t flags = vmm_region_pte_flags(region);
+    if ((flags & PTE_WRITABLE) && !(m->flags & MAP_SHARED)) {
+        flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+    }
+    
+    if (vmm_map_page(space, va, paddr, flags) != 0) return false;
+    
+    // The mapping keeps the page alive if the cache evicts it
+    pmm_page_ref(paddr);
+    return true;
+}
+
+// Demand fault on a file-backed mapping: read the read-ahead window into
+// the page cache, then map the faulting page and its cached neighbours
+int mmap_file_fault(vmm_aspace_t *space, vaddr_t vaddr) {
+    vaddr_t page_addr = vaddr & ~(PAGE_SIZE - 1);
+    
+    int map_idx = find_mapping_range(space, page_addr, page_addr + PAGE_SIZE);
+    if (map_idx < 0) return -1;
+    file_mapping_t *m = &mappings[map_idx];
+    if (m->flags & MAP_ANONYMOUS) return -1;
+    
+    vmm_region_t *region = vmm_region_find(space, page_addr);
+    if (!region) return -1;
+    
+    file_faults++;
+    
+    // Pages are numbered relative to the start of the mapping
+    uint64_t nr_pages = m->size / PAGE_SIZE;
+    uint64_t fault_page = (page_addr - m->vaddr) / PAGE_SIZE;
+    uint64_t base_index = m->file_offset / PAGE_SIZE;
+    
+    // Read-ahead; the faulting page stays pinned until it is mapped
+    uint64_t ra_end = fault_page + ra_next_window(ra_get(m->vn), base_index + fault_page);
+    if (ra_end > nr_pages) ra_end = nr_pages;
+    
+    page_cache_page_t *fault_pg = NULL;
+    if (page_cache_get(m->vn, base_index + fault_page, &fault_pg, NULL) != 0) return -1;
+    
+    for (uint64_t i = fault_page + 1; i < ra_end; i++) {
+        page_cache_page_t *pg;
+        bool loaded;
+        if (page_cache_get(m->vn, base_index + i, &pg, &loaded) != 0) break;
+        page_cache_release(pg);
+        if (loaded) ra_pages_read++;
+    }
+    
+    // Fault-around: a stream maps its whole window so the next fault is at
+    // the start of the next one; a random fault maps the cached pages of
+    // the surrounding aligned block
+    uint64_t map_start = fault_page;
+    uint64_t map_end = ra_end;
+    if (ra_end - fault_page <= 1) {
+        map_start = fault_page & ~(uint64_t)(FAULT_AROUND_PAGES - 1);
+        map_end = map_start + FAULT_AROUND_PAGES;
+        if (map_end > nr_pages) map_end = nr_pages;
+    }
+    
+    bool mapped = false;
+    for (uint64_t i = map_start; i < map_end; i++) {
+        vaddr_t va = m->vaddr + i * PAGE_SIZE;
+        
+        u64 *pte = vmm_get_pte(space, va);
+        if (pte && (*pte & PTE_PRESENT)) continue;
+        
+        page_cache_page_t *pg = (i == fault_page) ? fault_pg : page_cache_lookup(m->vn, base_index + i);
+        if (!pg) continue;
+        
+        bool ok = map_file_page(space, region, m, va, pg->pa);
+        if (i != fault_page) page_cache_release(pg);
+        if (!ok) continue;
+        
+        if (i == fault_page) mapped = true;
+        else fault_around_mapped++;
+    }
+    
+    page_cache_release(fault_pg);
+    return mapped ? 0 : -1;
+}
+
+// Move hardware dirty bits of a shared file mapping into the page cache
+static void mmap_sync_dirty(vmm_aspace_t *space, file_mapping_t *m, vaddr_t start, vaddr_t end) {
+    if (!m->vn || !(m->flags & MAP_SHARED)) return;
+    
+    for (vaddr_t va = start; va < end; va += PAGE_SIZE) {
+        u64 *pte = vmm_get_pte(space, va);
+        if (!pte || !(*pte & PTE_PRESENT) || !(*pte & PTE_DIRTY)) continue;
+        
+        *pte &= ~(u64)PTE_DIRTY;
+        vmm_flush_tlb_page(va);
+        
+        uint64_t index = (m->file_offset + (va - m->vaddr)) / PAGE_SIZE;
+        page_cache_page_t *pg = page_cache_lookup(m->vn, index);
+        if (!pg) continue;
+        if (pg->pa == (*pte & PTE_ADDR_MASK)) page_cache_mark_dirty(pg);
+        page_cache_release(pg);
+    }
+}
+
 // munmap system call
 int sys_munmap(void *addr, uint32_t length) {
     vaddr_t vaddr = (vaddr_t)addr;
     vmm_aspace_t *space = vmm_get_current_aspace();
     
+    if (length == 0 || (vaddr & (PAGE_SIZE - 1))) return -1;
+    vaddr_t end = vaddr + ((length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    
     // Find mapping
-    int map_idx = -1;
-    for (int i = 0; i < MAX_MAPPINGS; i++) {
-        if (mappings[i].in_use && 
-            mappings[i].vaddr == vaddr && 
-            mappings[i].space == space) {
-            map_idx = i;
-            break;
-        }
+    int map_idx = find_mapping_range(space, vaddr, end);
+    if (map_idx < 0) return -1;
+    
+    file_mapping_t *m = &mappings[map_idx];
+    vaddr_t map_end = m->vaddr + m->size;
+    
+    // Punching a hole needs a second record for the tail
+    int tail_idx = -1;
+    if (vaddr > m->vaddr && end < map_end) {
+        tail_idx = find_free_mapping();
+        if (tail_idx < 0) return -1;
     }
     
-    if (map_idx < 0) return -1;
+    mmap_sync_dirty(space, m, vaddr, end);
     
     // Unmap pages
-    uint32_t page_count = (length + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint32_t i = 0; i < page_count; i++) {
+    vaddr_t va = vaddr;
+    while (va < end) {
+        // Whole huge pages go back in one piece
+        if (!(va & (HPAGE_SIZE - 1)) && va + HPAGE_SIZE <= end &&
+            thp_zap_huge_pmd(space, va) == 0) {
+            va += HPAGE_SIZE;
+            continue;
+        }
+        
+        // vmm_unmap_page splits a huge page that is only partly unmapped
         paddr_t paddr;
-        if (vmm_get_physical(space, vaddr + i * PAGE_SIZE, &paddr) == 0) {
-            vmm_unmap_page(space, vaddr + i * PAGE_SIZE);
+        if (vmm_get_physical(space, va, &paddr) == 0) {
+            vmm_unmap_page(space, va);
             
-            // Free if private mapping
-            if (mappings[map_idx].flags & MAP_PRIVATE) {
-                pmm_free_page(paddr);
+            // Drop the mapping's reference; the page cache and other
+            // processes sharing the page keep theirs
+            pmm_free_page(paddr);
+        }
+        va += PAGE_SIZE;
+    }
+    
+    vmm_region_remove(space, vaddr, end - vaddr);
+    
+    // Remove mapping, or trim it to what is left
+    if (vaddr == m->vaddr && end == map_end) {
+        m->in_use = false;
+    } else if (vaddr == m->vaddr) {
+        m->file_offset += end - m->vaddr;
+        m->size = map_end - end;
+        m->vaddr = end;
+    } else if (end == map_end) {
+        m->size = vaddr - m->vaddr;
+    } else {
+        mappings[tail_idx] = *m;
+        mappings[tail_idx].file_offset += end - m->vaddr;
+        mappings[tail_idx].vaddr = end;
+        mappings[tail_idx].size = map_end - end;
+        m->size = vaddr - m->vaddr;
+    }
+    
+    return 0;
+}
+
+// mprotect system call
+int sys_mprotect(void *addr, uint32_t length, int prot) {
+    vaddr_t vaddr = (vaddr_t)addr;
+    vmm_aspace_t *space = vmm_get_current_aspace();
+    
+    if (length == 0 || (vaddr & (PAGE_SIZE - 1))) return -1;
+    vaddr_t end = vaddr + ((length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    
+    int map_idx = find_mapping_range(space, vaddr, end);
+    if (map_idx < 0) return -1;
+    file_mapping_t *m = &mappings[map_idx];
+    
+    // PROT_NONE keeps the frames but takes them away from user mode
+    const uint64_t mask = PTE_WRITABLE | PTE_USER;
+    uint64_t bits = 0;
+    if (prot != PROT_NONE) bits |= PTE_USER;
+    if (prot & PROT_WRITE) bits |= PTE_WRITABLE;
+    
+    vaddr_t va = vaddr;
+    while (va < end) {
+        u64 *pde = vmm_get_pde(space, va);
+        if (pde && (*pde & PTE_PRESENT) && (*pde & PTE_HUGE)) {
+            if (!(va & (HPAGE_SIZE - 1)) && va + HPAGE_SIZE <= end) {
+                *pde = (*pde & ~mask) | bits;
+                vmm_flush_tlb_page(va);
+                va += HPAGE_SIZE;
+                continue;
+            }
+            // Only part of the huge page changes
+            if (thp_split_huge_pmd(space, va) != 0) return -1;
+        }
+        
+        u64 *pte = vmm_get_pte(space, va);
+        if (pte && (*pte & PTE_PRESENT)) {
+            uint64_t new_bits = bits;
+            // Private pages shared with another process stay read-only
+            // until the write fault copies them
+            if ((new_bits & PTE_WRITABLE) && !(m->flags & MAP_SHARED) &&
+                ((*pte & PTE_COW) || pmm_page_refcount(*pte & PTE_ADDR_MASK) > 1)) {
+                new_bits = (new_bits & ~(uint64_t)PTE_WRITABLE) | PTE_COW;
             }
+            *pte = (*pte & ~(mask | PTE_COW)) | new_bits;
+            vmm_flush_tlb_page(va);
         }
+        va += PAGE_SIZE;
     }
     
-    // Remove mapping
-    mappings[map_idx].in_use = false;
+    // Pages faulted in later pick their protection up from the region
+    uint32_t region_flags = (m->flags & MAP_ANONYMOUS) ? VMM_REGION_ANON : VMM_REGION_FILE;
+    if (prot != PROT_NONE) region_flags |= VMM_REGION_USER;
+    if (prot & PROT_WRITE) region_flags |= VMM_REGION_WRITE;
+    vmm_region_set_flags(space, vaddr, end - vaddr, region_flags);
+    
+    if (vaddr == m->vaddr && end == m->vaddr + m->size) {
+        m->prot = prot;
+    }
     
     return 0;
 }
 
+// Forget the mapping records of an address space that is going away
+void mmap_exit(vmm_aspace_t *space) {
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappings[i].in_use && mappings[i].space == space) {
+            mappings[i].in_use = false;
+        }
+    }
+}
+
+// Give a freshly forked address space copies of the parent's mapping
+// records. The page tables were already cloned copy-on-write.
+int mmap_fork(vmm_aspace_t *parent, vmm_aspace_t *child) {
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        if (!mappings[i].in_use || mappings[i].space != parent) continue;
+        
+        int idx = find_free_mapping();
+        if (idx < 0) {
+            mmap_exit(child);
+            return -1;
+        }
+        mappings[idx] = mappings[i];
+        mappings[idx].space = child;
+        
+        if (mappings[i].flags & MAP_ANONYMOUS) {
+            khugepaged_add(child);
+        }
+        
+        // MAP_SHARED pages must stay shared: undo the COW marking
+        if (mappings[i].flags & MAP_SHARED) {
+            for (vaddr_t va = mappings[i].vaddr; va < mappings[i].vaddr + mappings[i].size; va += PAGE_SIZE) {
+                u64 *ppte = vmm_get_pte(parent, va);
+                u64 *cpte = vmm_get_pte(child, va);
+                if (!ppte || !cpte || !(*ppte & PTE_COW)) continue;
+                *ppte = (*ppte & ~PTE_COW) | PTE_WRITABLE;
+                *cpte = (*cpte & ~PTE_COW) | PTE_WRITABLE;
+                vmm_flush_tlb_page(va);
+            }
+        }
+    }
+    return 0;
+}
+
 // msync - sync file-backed mapping to disk
 int sys_msync(void *addr, uint32_t length, int flags) {
     vaddr_t vaddr = (vaddr_t)addr;
@@ -286,38 +524,26 @@ int sys_msync(void *addr, uint32_t length, int flags) {
     }
     
     if (map_idx < 0) return -1;
-    if (mappings[map_idx].flags & MAP_ANONYMOUS) return 0; // Nothing to sync
+    file_mapping_t *m = &mappings[map_idx];
+    if (m->flags & MAP_ANONYMOUS) return 0; // Nothing to sync
     
-    // For now, just return success - actual sync would write to VFS
-    return 0;
+    vaddr_t end = vaddr + length;
+    if (end > m->vaddr + m->size) end = m->vaddr + m->size;
+    mmap_sync_dirty(space, m, vaddr & ~(vaddr_t)(PAGE_SIZE - 1), end);
+    
+    (void)flags;
+    return writeback_sync_vnode(m->vn) == 0 ? 0 : -1;
 }
 
 // Flush all dirty pages in page cache
 void page_cache_flush_all(void) {
-    for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
-        if (page_cache[i].valid && page_cache[i].dirty) {
-            // Write back
-            // fs_write(page_cache[i].fd, page_cache[i].file_offset,
-            //          (void *)page_cache[i].paddr, PAGE_SIZE);
-            page_cache[i].dirty = false;
-        }
-    }
+    writeback_sync_all();
 }
 
-// Get page cache statistics
-void page_cache_get_stats(uint32_t *total, uint32_t *used, uint32_t *dirty_count) {
-    if (total) *total = PAGE_CACHE_SIZE;
-    
-    uint32_t used_cnt = 0;
-    uint32_t dirty_cnt = 0;
-    
-    for (int i = 0; i < PAGE_CACHE_SIZE; i++) {
-        if (page_cache[i].valid) {
-            used_cnt++;
-            if (page_cache[i].dirty) dirty_cnt++;
-        }
-    }
-    
-    if (used) *used = used_cnt;
-    if (dirty_count) *dirty_count = dirty_cnt;
+// Get file fault statistics: faults taken, pages read ahead, neighbours
+// mapped by fault-around
+void mmap_get_fault_stats(uint64_t *faults, uint64_t *readahead, uint64_t *around) {
+    if (faults) *faults = file_faults;
+    if (readahead) *readahead = ra_pages_read;
+    if (around) *around = fault_around_mapped;
 }
@@ -12,6 +12,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "mm/mm.h"
+#include "mm/huge_memory.h"
 #include <scheduler.h>
 #include "debug.h"
 #include "idt.h"
@@ -130,6 +131,9 @@ static size_t terminal_row = 0;
 static size_t terminal_column = 0;
 static uint8_t terminal_color = 0;
 static uint32_t total_memory = 0;
+/* Memory map handed to the PMM through g_boot_info */
+#define BOOT_MEM_MAP_MAX 64
+static memory_region_t boot_mem_map[BOOT_MEM_MAP_MAX];
 static struct multiboot_tag_framebuffer_common* framebuffer_info = NULL;
 
 /* Graphics system integration */
@@ -380,7 +384,15 @@ static void parse_multiboot_info(uint32_t addr) {
                     terminal_writestring(" bytes) Type: ");
                     print_dec(entry->type);
                     terminal_writestring("\n");
+
+                    if (g_boot_info.mem_map_count < BOOT_MEM_MAP_MAX) {
+                        memory_region_t *r = &boot_mem_map[g_boot_info.mem_map_count++];
+                        r->base = entry->addr;
+                        r->length = entry->len;
+                        r->type = entry->type;
+                    }
                 }
+                g_boot_info.mem_map = boot_mem_map;
                 break;
             }
             
@@ -539,6 +551,10 @@ static void normal_boot(void) {
     scheduler_init();
     terminal_writestring("OK\n");
 
+    terminal_writestring("  [MM] Starting khugepaged... ");
+    thp_init();
+    terminal_writestring("OK\n");
+
     // Create a test task
     terminal_writestring("  [SCHED] Creating test task... ");
     create_task(test_task_entry);
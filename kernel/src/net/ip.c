@@ -11,10 +11,13 @@
 #include "net/skbuff.h"
 #include "net/netdevice.h"
 #include "kernel.h"
+#include "spinlock.h"
+#include "rcu.h"
+#include "percpu.h"
 #include <string.h>
 
-/* IP statistics */
-static struct {
+/* IP statistics, per CPU so the packet path never shares a counter line */
+struct ip_mib {
     uint64_t in_receives;
     uint64_t in_delivers;
     uint64_t in_discards;
@@ -27,14 +30,24 @@ static struct {
     uint64_t frag_creates;
     uint64_t reasm_oks;
     uint64_t reasm_fails;
-} ip_stats;
+};
+
+static DEFINE_PER_CPU(struct ip_mib, ip_stats);
 
-/* Routing table */
+/* Routing table. The packet path reads it under RCU without locking;
+ * add/del replace the whole table under lock. */
 #define MAX_ROUTES 256
-static struct {
-    ipv4_route_t routes[MAX_ROUTES];
+
+typedef struct ip_route_table {
+    struct rcu_head rcu;
     uint32_t count;
-} ip_routing_table;
+    ipv4_route_t routes[];
+} ip_route_table_t;
+
+static struct {
+    ip_route_table_t* table;
+    spinlock_t lock;
+} ip_routing;
 
 /* Fragment reassembly queue */
 #define MAX_FRAGS 64
@@ -151,14 +164,54 @@ int ip_verify_checksum(const iphdr_t* iph) {
 
 /* ==================== Routing ==================== */
 
+/* Readers see one immutable table; updates copy it under the lock and
+ * publish the copy */
+static ip_route_table_t* ip_route_table_alloc(uint32_t count) {
+    ip_route_table_t* table = (ip_route_table_t*)kmalloc(
+        sizeof(ip_route_table_t) + count * sizeof(ipv4_route_t));
+    if (table) {
+        table->count = count;
+    }
+    return table;
+}
+
+static void ip_route_table_free_rcu(struct rcu_head* head) {
+    kfree(container_of(head, ip_route_table_t, rcu));
+}
+
+/* Called with ip_routing.lock held */
+static void ip_route_table_replace(ip_route_table_t* table) {
+    ip_route_table_t* old = ip_routing.table;
+    
+    rcu_assign_pointer(ip_routing.table, table);
+    if (old) {
+        call_rcu(&old->rcu, ip_route_table_free_rcu);
+    }
+}
+
 int ip_route_add(ipv4_addr_t dest, ipv4_addr_t mask, ipv4_addr_t gateway, 
                  struct net_device* dev, uint32_t metric) {
-    if (ip_routing_table.count >= MAX_ROUTES) {
+    spin_lock(&ip_routing.lock);
+    
+    ip_route_table_t* old = ip_routing.table;
+    uint32_t count = old ? old->count : 0;
+    
+    if (count >= MAX_ROUTES) {
+        spin_unlock(&ip_routing.lock);
         kprintf("[IP] Routing table full\n");
         return -1;
     }
     
-    ipv4_route_t* route = &ip_routing_table.routes[ip_routing_table.count++];
+    ip_route_table_t* table = ip_route_table_alloc(count + 1);
+    if (!table) {
+        spin_unlock(&ip_routing.lock);
+        return -1;
+    }
+    if (count) {
+        memcpy(table->routes, old->routes, count * sizeof(ipv4_route_t));
+    }
+    
+    ipv4_route_t* route = &table->routes[count];
     route->dest = dest;
     route->mask = mask;
     route->gateway = gateway;
@@ -170,6 +223,9 @@ int ip_route_add(ipv4_addr_t dest, ipv4_addr_t mask, ipv4_addr_t gateway,
         route->flags |= IP_ROUTE_LOCAL;
     }
     
+    ip_route_table_replace(table);
+    spin_unlock(&ip_routing.lock);
+    
     kprintf("[IP] Added route: %s/%s via %s metric %u\n",
             ip_addr_to_str(dest, NULL, 0),
             ip_addr_to_str(mask, NULL, 0),
@@ -179,13 +235,18 @@ int ip_route_add(ipv4_addr_t dest, ipv4_addr_t mask, ipv4_addr_t gateway,
     return 0;
 }
 
+/* Must be called under rcu_read_lock(); the route is valid until the
+ * read-side section ends */
 ipv4_route_t* ip_route_lookup(ipv4_addr_t dest) {
+    ip_route_table_t* table = rcu_dereference(ip_routing.table);
     ipv4_route_t* best = NULL;
     uint32_t best_mask = 0;
     
+    if (!table) return NULL;
+    
     /* Find most specific matching route (longest prefix match) */
-    for (uint32_t i = 0; i < ip_routing_table.count; i++) {
-        ipv4_route_t* route = &ip_routing_table.routes[i];
+    for (uint32_t i = 0; i < table->count; i++) {
+        ipv4_route_t* route = &table->routes[i];
         
         if ((dest & route->mask) == (route->dest & route->mask)) {
             /* Match found */
@@ -201,15 +262,27 @@ ipv4_route_t* ip_route_lookup(ipv4_addr_t dest) {
 }
 
 int ip_route_del(ipv4_addr_t dest, ipv4_addr_t mask) {
-    for (uint32_t i = 0; i < ip_routing_table.count; i++) {
-        ipv4_route_t* route = &ip_routing_table.routes[i];
+    spin_lock(&ip_routing.lock);
+    
+    ip_route_table_t* old = ip_routing.table;
+    uint32_t count = old ? old->count : 0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        ipv4_route_t* route = &old->routes[i];
         
         if (route->dest == dest && route->mask == mask) {
-            /* Remove route by shifting */
-            for (uint32_t j = i; j < ip_routing_table.count - 1; j++) {
-                ip_routing_table.routes[j] = ip_routing_table.routes[j + 1];
+            /* Copy everything but this route */
+            ip_route_table_t* table = ip_route_table_alloc(count - 1);
+            if (!table) {
+                spin_unlock(&ip_routing.lock);
+                return -1;
             }
-            ip_routing_table.count--;
+            memcpy(table->routes, old->routes, i * sizeof(ipv4_route_t));
+            memcpy(&table->routes[i], &old->routes[i + 1],
+                   (count - i - 1) * sizeof(ipv4_route_t));
+            
+            ip_route_table_replace(table);
+            spin_unlock(&ip_routing.lock);
             
             kprintf("[IP] Removed route: %s/%s\n",
                     ip_addr_to_str(dest, NULL, 0),
@@ -219,15 +292,21 @@ int ip_route_del(ipv4_addr_t dest, ipv4_addr_t mask) {
         }
     }
     
+    spin_unlock(&ip_routing.lock);
     return -1;
 }
 
 void ip_route_dump(void) {
-    kprintf("[IP] Routing table (%u entries):\n", ip_routing_table.count);
+    rcu_read_lock();
+    
+    ip_route_table_t* table = rcu_dereference(ip_routing.table);
+    uint32_t count = table ? table->count : 0;
+    
+    kprintf("[IP] Routing table (%u entries):\n", count);
     kprintf("  Destination     Gateway         Mask            Metric  Dev\n");
     
-    for (uint32_t i = 0; i < ip_routing_table.count; i++) {
-        ipv4_route_t* route = &ip_routing_table.routes[i];
+    for (uint32_t i = 0; i < count; i++) {
+        ipv4_route_t* route = &table->routes[i];
         
         char dest[16], gw[16], mask[16];
         ip_addr_to_str(route->dest, dest, sizeof(dest));
@@ -241,6 +320,8 @@ void ip_route_dump(void) {
                 route->metric,
                 route->dev ? route->dev->name : "none");
     }
+    
+    rcu_read_unlock();
 }
 
 /* ==================== IP Transmission ==================== */
@@ -248,11 +329,14 @@ void ip_route_dump(void) {
 int ip_send(ipv4_addr_t daddr, struct sk_buff* skb) {
     if (!skb) return -1;
     
-    /* Look up route */
+    /* Look up route; the route and its device stay valid until we are
+     * done sending */
+    rcu_read_lock();
     ipv4_route_t* route = ip_route_lookup(daddr);
     if (!route) {
+        rcu_read_unlock();
         kprintf("[IP] No route to host %s\n", ip_addr_to_str(daddr, NULL, 0));
-        ip_stats.out_no_routes++;
+        this_cpu_inc(ip_stats.out_no_routes);
         free_skb(skb);
         return -1;
     }
@@ -282,6 +366,7 @@ int ip_send(ipv4_addr_t daddr, struct sk_buff* skb) {
     
     /* Set skb metadata */
     skb->nh.raw = (uint8_t*)iph;
+    skb_reset_network_header(skb);
     
     kprintf("[IP] Sending packet: %s -> %s proto=%u len=%u\n",
             ip_addr_to_str(saddr, NULL, 0),
@@ -289,19 +374,24 @@ int ip_send(ipv4_addr_t daddr, struct sk_buff* skb) {
             skb->protocol,
             skb->len);
     
-    /* Check if fragmentation needed */
-    if (skb->len > route->dev->mtu) {
-        return ip_fragment(skb, route->dev);
+    /* Check if fragmentation needed. Super-segments are cut into
+     * MTU-sized TCP segments further down instead. */
+    int ret;
+    if (skb->len > route->dev->mtu && !skb_is_gso(skb)) {
+        ret = ip_fragment(skb, route->dev);
+        rcu_read_unlock();
+        return ret;
     }
     
     /* Send to link layer */
     ipv4_addr_t next_hop = route->gateway ? route->gateway : daddr;
-    int ret = ip_output(skb, route->dev, next_hop);
+    ret = ip_output(skb, route->dev, next_hop);
+    rcu_read_unlock();
     
     if (ret == 0) {
-        ip_stats.out_requests++;
+        this_cpu_inc(ip_stats.out_requests);
     } else {
-        ip_stats.out_discards++;
+        this_cpu_inc(ip_stats.out_discards);
     }
     
     return ret;
@@ -326,12 +416,12 @@ int ip_output(struct sk_buff* skb, struct net_device* dev, ipv4_addr_t next_hop)
 void ip_rcv(struct sk_buff* skb) {
     if (!skb) return;
     
-    ip_stats.in_receives++;
+    this_cpu_inc(ip_stats.in_receives);
     
     /* Verify minimum length */
     if (skb->len < sizeof(iphdr_t)) {
         kprintf("[IP] Packet too small\n");
-        ip_stats.in_hdr_errors++;
+        this_cpu_inc(ip_stats.in_hdr_errors);
         free_skb(skb);
         return;
     }
@@ -342,7 +432,7 @@ void ip_rcv(struct sk_buff* skb) {
     /* Verify version */
     if (iph->version != 4) {
         kprintf("[IP] Invalid IP version: %u\n", iph->version);
-        ip_stats.in_hdr_errors++;
+        this_cpu_inc(ip_stats.in_hdr_errors);
         free_skb(skb);
         return;
     }
@@ -350,7 +440,7 @@ void ip_rcv(struct sk_buff* skb) {
     /* Verify header length */
     if (iph->ihl < 5) {
         kprintf("[IP] Invalid header length: %u\n", iph->ihl);
-        ip_stats.in_hdr_errors++;
+        this_cpu_inc(ip_stats.in_hdr_errors);
         free_skb(skb);
         return;
     }
@@ -358,7 +448,7 @@ void ip_rcv(struct sk_buff* skb) {
     /* Verify checksum */
     if (!ip_verify_checksum(iph)) {
         kprintf("[IP] Checksum failed\n");
-        ip_stats.in_hdr_errors++;
+        this_cpu_inc(ip_stats.in_hdr_errors);
         free_skb(skb);
         return;
     }
@@ -379,7 +469,7 @@ void ip_rcv(struct sk_buff* skb) {
         !ip_addr_is_multicast(daddr)) {
         /* Not for us, forward if routing enabled */
         kprintf("[IP] Packet not for us, dropping\n");
-        ip_stats.in_discards++;
+        this_cpu_inc(ip_stats.in_discards);
         free_skb(skb);
         return;
     }
@@ -405,10 +495,10 @@ void ip_rcv(struct sk_buff* skb) {
     ip_protocol_handler_t handler = ip_protocol_handlers[iph->protocol];
     if (handler) {
         handler(skb);
-        ip_stats.in_delivers++;
+        this_cpu_inc(ip_stats.in_delivers);
     } else {
         kprintf("[IP] No handler for protocol %u\n", iph->protocol);
-        ip_stats.in_discards++;
+        this_cpu_inc(ip_stats.in_discards);
         free_skb(skb);
     }
 }
@@ -432,7 +522,7 @@ int ip_fragment(struct sk_buff* skb, struct net_device* dev) {
     
     if (frag_size == 0) {
         kprintf("[IP] MTU too small for fragmentation\n");
-        ip_stats.frag_fails++;
+        this_cpu_inc(ip_stats.frag_fails);
         free_skb(skb);
         return -1;
     }
@@ -451,15 +541,15 @@ int ip_fragment(struct sk_buff* skb, struct net_device* dev) {
         struct sk_buff* frag = alloc_skb(hlen + chunk, 0);
         if (!frag) {
             kprintf("[IP] Failed to allocate fragment\n");
-            ip_stats.frag_fails++;
+            this_cpu_inc(ip_stats.frag_fails);
             return -1;
         }
         
         /* Copy IP header */
         memcpy(skb_put(frag, hlen), iph, hlen);
         
-        /* Copy data */
-        memcpy(skb_put(frag, chunk), skb->data + hlen + offset, chunk);
+        /* Copy data; the payload may be paged */
+        skb_copy_bits(skb, hlen + offset, skb_put(frag, chunk), chunk);
         
         /* Update IP header */
         iphdr_t* frag_iph = (iphdr_t*)frag->data;
@@ -475,13 +565,13 @@ int ip_fragment(struct sk_buff* skb, struct net_device* dev) {
         frag->dev = dev;
         netdev_start_xmit(frag, dev);
         
-        ip_stats.frag_creates++;
+        this_cpu_inc(ip_stats.frag_creates);
         
         offset += chunk;
         data_len -= chunk;
     }
     
-    ip_stats.frag_oks++;
+    this_cpu_inc(ip_stats.frag_oks);
     free_skb(skb);
     
     return 0;
@@ -513,7 +603,7 @@ struct sk_buff* ip_defragment(struct sk_buff* skb) {
     if (!frag_entry) {
         if (ip_frag_queue.count >= MAX_FRAGS) {
             kprintf("[IP] Fragment queue full\n");
-            ip_stats.reasm_fails++;
+            this_cpu_inc(ip_stats.reasm_fails);
             free_skb(skb);
             return NULL;
         }
@@ -554,7 +644,7 @@ struct sk_buff* ip_defragment(struct sk_buff* skb) {
             }
         }
         
-        ip_stats.reasm_oks++;
+        this_cpu_inc(ip_stats.reasm_oks);
         return complete;
     }
     
@@ -590,7 +680,7 @@ struct sk_buff* ip_reassemble(ip_frag_t* frag) {
     struct sk_buff* complete = alloc_skb(frag->total_len + 20, 0);  /* +20 for IP header */
     if (!complete) {
         kprintf("[IP] Failed to allocate reassembly buffer\n");
-        ip_stats.reasm_fails++;
+        this_cpu_inc(ip_stats.reasm_fails);
         return NULL;
     }
     
@@ -653,10 +743,11 @@ int ip_init(void) {
     kprintf("[IP] Initializing IP layer...\n");
     
     /* Initialize statistics */
-    memset(&ip_stats, 0, sizeof(ip_stats));
+    percpu_zero(&ip_stats, sizeof(ip_stats));
     
     /* Initialize routing table */
-    ip_routing_table.count = 0;
+    ip_routing.table = NULL;
+    spin_lock_init(&ip_routing.lock);
     
     /* Add default routes */
     /* Loopback */
@@ -678,16 +769,19 @@ int ip_init(void) {
 void ip_get_stats(ip_stats_t* stats) {
     if (!stats) return;
     
-    stats->in_receives = ip_stats.in_receives;
-    stats->in_delivers = ip_stats.in_delivers;
-    stats->in_discards = ip_stats.in_discards;
-    stats->in_hdr_errors = ip_stats.in_hdr_errors;
-    stats->out_requests = ip_stats.out_requests;
-    stats->out_discards = ip_stats.out_discards;
-    stats->out_no_routes = ip_stats.out_no_routes;
-    stats->frag_oks = ip_stats.frag_oks;
-    stats->frag_fails = ip_stats.frag_fails;
-    stats->frag_creates = ip_stats.frag_creates;
-    stats->reasm_oks = ip_stats.reasm_oks;
-    stats->reasm_fails = ip_stats.reasm_fails;
+    struct ip_mib mib;
+    percpu_sum_u64(&ip_stats, sizeof(ip_stats), &mib);
+    
+    stats->in_receives = mib.in_receives;
+    stats->in_delivers = mib.in_delivers;
+    stats->in_discards = mib.in_discards;
+    stats->in_hdr_errors = mib.in_hdr_errors;
+    stats->out_requests = mib.out_requests;
+    stats->out_discards = mib.out_discards;
+    stats->out_no_routes = mib.out_no_routes;
+    stats->frag_oks = mib.frag_oks;
+    stats->frag_fails = mib.frag_fails;
+    stats->frag_creates = mib.frag_creates;
+    stats->reasm_oks = mib.reasm_oks;
+    stats->reasm_fails = mib.reasm_fails;
 }
@@ -11,30 +11,97 @@
 #include "net/skbuff.h"
 #include "net/ip.h"
 #include "kernel.h"
+#include "spinlock.h"
+#include "rcu.h"
+#include "percpu.h"
+#include "smp.h"
+#include "smp_scheduler.h"
+#include "hrtimer.h"
 #include <string.h>
 
-/* Global device list */
-#define MAX_NET_DEVICES 16
+/* Receive processing limits for one softirq round, over all NAPIs */
+#define NETDEV_BUDGET           300     /* Packets */
+#define NETDEV_BUDGET_USECS     2000
+#define NETDEV_MAX_BACKLOG      1000    /* Packets queued by netdev_rx() */
 
+/* Global device list, in registration order. Lookups walk it under RCU;
+ * lock serialises register/unregister. */
 static struct {
-    struct net_device* devices[MAX_NET_DEVICES];
+    struct net_device* list;
     uint32_t count;
     uint32_t next_ifindex;
+    spinlock_t lock;
 } netdev_state;
 
 /* Loopback device */
 static struct net_device* loopback_dev = NULL;
 
+/*
+ * Per-CPU receive state. The poll list holds the scheduled NAPIs.
+ * Packets from netdev_rx() wait in the backlog queue, which is polled
+ * through its own NAPI like any device. Flow steering queues packets on
+ * other CPUs' backlogs, so both are under lock, taken with interrupts
+ * off since drivers schedule from their IRQ handlers.
+ *
+ * The backlog's input_queue counters number its packets: tail counts
+ * those queued, head those the stack is done with (dequeued, and out of
+ * GRO). A packet is behind everything whose number is at most head.
+ */
+typedef struct softnet_data {
+    spinlock_t lock;
+    napi_struct_t* poll_list;
+    napi_struct_t* poll_tail;
+    sk_buff_head_t backlog_queue;
+    napi_struct_t backlog;
+    uint32_t input_queue_tail;     /* Under lock */
+    uint32_t input_queue_dequeued; /* Under lock */
+    uint32_t input_queue_head;     /* Written by the owning CPU only */
+    task_t* thread;                /* Runs the poll list */
+} softnet_data_t;
+
+static DEFINE_PER_CPU(softnet_data_t, softnet_data);
+static DEFINE_PER_CPU(softnet_stat_t, softnet_stat);
+
+/*
+ * RFS flow table, indexed by flow hash. desired is the CPU whose task
+ * last consumed the flow; queued is where its packets are being
+ * queued. Both hold CPU + 1, so 0 means none. last_qtail is the queued
+ * CPU's input_queue_tail after the flow's latest packet. Colliding flows
+ * share an entry, which costs locality but never correctness.
+ */
+typedef struct rfs_flow {
+    uint16_t desired;
+    uint16_t queued;
+    uint32_t last_qtail;
+} rfs_flow_t;
+
+static rfs_flow_t rfs_flows[NETDEV_RFS_FLOWS];
+
 /* ==================== Device Registration ==================== */
 
 int netdev_register(struct net_device* dev) {
     if (!dev) return -1;
     
-    if (netdev_state.count >= MAX_NET_DEVICES) {
-        kprintf("[NETDEV] Too many network devices\n");
-        return -1;
+    /* Default XPS: CPUs spread over the TX queues, one queue each */
+    if (dev->num_tx_queues > 1 && !dev->xps_map) {
+        dev->xps_map = (uint16_t*)kmalloc(percpu_nr_cpus * sizeof(uint16_t));
+        if (dev->xps_map) {
+            for (uint32_t cpu = 0; cpu < percpu_nr_cpus; cpu++) {
+                dev->xps_map[cpu] = (uint16_t)(cpu % dev->num_tx_queues);
+            }
+        }
+    }
+    
+    /* Receive merging is in software, so every device gets it */
+    dev->features |= NETIF_F_GRO;
+    
+    /* Default RSS indirection: hashes spread evenly over RX queues */
+    for (uint32_t i = 0; i < NETDEV_RSS_INDIR_SIZE; i++) {
+        dev->rss_indir[i] = dev->num_rx_queues ? (uint16_t)(i % dev->num_rx_queues) : 0;
     }
     
+    spin_lock(&netdev_state.lock);
+    
     /* Assign interface index */
     dev->ifindex = netdev_state.next_ifindex++;
     
@@ -45,17 +112,31 @@ int netdev_register(struct net_device* dev) {
     /* Initialize queues */
     for (uint32_t i = 0; i < dev->num_tx_queues; i++) {
         skb_queue_head_init(&dev->tx_queue[i].queue);
+        dev->tx_queue[i].dev = dev;
+        dev->tx_queue[i].index = (uint16_t)i;
         dev->tx_queue[i].qlen = 0;
         dev->tx_queue[i].stopped = 0;
+        memset(&dev->tx_queue[i].stats, 0, sizeof(netdev_queue_stats_t));
     }
     
     for (uint32_t i = 0; i < dev->num_rx_queues; i++) {
         skb_queue_head_init(&dev->rx_queue[i].queue);
+        dev->rx_queue[i].dev = dev;
+        dev->rx_queue[i].index = (uint16_t)i;
         dev->rx_queue[i].qlen = 0;
+        memset(&dev->rx_queue[i].stats, 0, sizeof(netdev_queue_stats_t));
     }
     
-    /* Add to device list */
-    netdev_state.devices[netdev_state.count++] = dev;
+    /* Publish at the tail, fully initialised */
+    struct net_device** pp = &netdev_state.list;
+    while (*pp) {
+        pp = &(*pp)->next;
+    }
+    dev->prev = NULL;
+    rcu_chain_insert(pp, dev, next);
+    netdev_state.count++;
+    
+    spin_unlock(&netdev_state.lock);
     
     kprintf("[NETDEV] Registered device %s (ifindex=%u type=%u)\n",
             dev->name, dev->ifindex, dev->type);
@@ -70,25 +151,36 @@ void netdev_unregister(struct net_device* dev) {
     netdev_close(dev);
     
     /* Remove from device list */
-    for (uint32_t i = 0; i < netdev_state.count; i++) {
-        if (netdev_state.devices[i] == dev) {
-            for (uint32_t j = i; j < netdev_state.count - 1; j++) {
-                netdev_state.devices[j] = netdev_state.devices[j + 1];
-            }
+    spin_lock(&netdev_state.lock);
+    for (struct net_device** pp = &netdev_state.list; *pp; pp = &(*pp)->next) {
+        if (*pp == dev) {
+            rcu_chain_del(pp, dev, next);
             netdev_state.count--;
             break;
         }
     }
+    spin_unlock(&netdev_state.lock);
+    
+    /* The caller frees dev next; wait out lookups that may have found it */
+    synchronize_rcu();
+    
+    if (dev->xps_map) {
+        kfree(dev->xps_map);
+        dev->xps_map = NULL;
+    }
     
     kprintf("[NETDEV] Unregistered device %s\n", dev->name);
 }
 
+/* Lookups run under rcu_read_lock(); the device stays valid until the
+ * caller's read-side section ends */
 struct net_device* netdev_get_by_name(const char* name) {
     if (!name) return NULL;
     
-    for (uint32_t i = 0; i < netdev_state.count; i++) {
-        if (strcmp(netdev_state.devices[i]->name, name) == 0) {
-            return netdev_state.devices[i];
+    struct net_device* dev;
+    rcu_chain_for_each(dev, netdev_state.list, next) {
+        if (strcmp(dev->name, name) == 0) {
+            return dev;
         }
     }
     
@@ -96,9 +188,10 @@ struct net_device* netdev_get_by_name(const char* name) {
 }
 
 struct net_device* netdev_get_by_index(uint32_t ifindex) {
-    for (uint32_t i = 0; i < netdev_state.count; i++) {
-        if (netdev_state.devices[i]->ifindex == ifindex) {
-            return netdev_state.devices[i];
+    struct net_device* dev;
+    rcu_chain_for_each(dev, netdev_state.list, next) {
+        if (dev->ifindex == ifindex) {
+            return dev;
         }
     }
     
@@ -172,6 +265,25 @@ int netdev_close(struct net_device* dev) {
     return 0;
 }
 
+/*
+ * TX queue selection. With XPS each CPU sends on its own queue, so CPUs
+ * do not contend for a queue or bounce its cache lines, and a flow sent
+ * from one CPU stays in order. Without a map the flow hash picks, which
+ * also keeps each flow on one queue.
+ */
+static uint32_t netdev_pick_tx(struct net_device* dev, struct sk_buff* skb) {
+    if (dev->num_tx_queues <= 1) return 0;
+    
+    if (dev->xps_map) {
+        uint32_t cpu = smp_processor_id();
+        if (cpu < percpu_nr_cpus && dev->xps_map[cpu] < dev->num_tx_queues) {
+            return dev->xps_map[cpu];
+        }
+    }
+    
+    return (uint32_t)(((uint64_t)skb_get_hash(skb) * dev->num_tx_queues) >> 32);
+}
+
 int netdev_start_xmit(struct sk_buff* skb, struct net_device* dev) {
     if (!skb || !dev) return -1;
     
@@ -181,20 +293,56 @@ int netdev_start_xmit(struct sk_buff* skb, struct net_device* dev) {
         return -1;
     }
     
-    /* Select TX queue (simple round-robin for now) */
-    static uint32_t next_queue = 0;
-    uint32_t queue_idx = next_queue % dev->num_tx_queues;
-    next_queue++;
+    /* Super-segments the device cannot take whole are cut up here */
+    if (skb_is_gso(skb) &&
+        (!(dev->features & NETIF_F_TSO) ||
+         (skb_has_frag_list(skb) && !(dev->features & NETIF_F_FRAGLIST)))) {
+        struct sk_buff* segs = skb_gso_segment(skb);
+        free_skb(skb);
+        if (!segs) {
+            dev->stats.tx_dropped++;
+            return -1;
+        }
+        
+        int ret = 0;
+        while (segs) {
+            struct sk_buff* next = segs->next;
+            segs->next = NULL;
+            if (netdev_start_xmit(segs, dev) != 0) {
+                ret = -1;
+            }
+            segs = next;
+        }
+        return ret;
+    }
+    
+    /* Paged skbs need scatter/gather; otherwise hand over a linear copy */
+    if (skb_is_nonlinear(skb) && !(dev->features & NETIF_F_SG)) {
+        struct sk_buff* linear = skb_copy(skb, 0);
+        free_skb(skb);
+        if (!linear) {
+            dev->stats.tx_dropped++;
+            return -1;
+        }
+        skb = linear;
+    }
+    
+    uint32_t queue_idx = netdev_pick_tx(dev, skb);
+    skb->queue_mapping = (uint16_t)queue_idx;
     
     struct netdev_queue* txq = &dev->tx_queue[queue_idx];
     
     /* Check if queue stopped */
     if (txq->stopped) {
-        kprintf("[NETDEV] TX queue %u stopped\n", queue_idx);
+        txq->stats.dropped++;
+        dev->stats.tx_dropped++;
         free_skb(skb);
         return -1;
     }
     
+    /* The driver owns the skb once called */
+    uint32_t len = skb->len;
+    
     /* Call driver's transmit function */
     int ret = -1;
     if (dev->netdev_ops && dev->netdev_ops->ndo_start_xmit) {
@@ -204,12 +352,13 @@ int netdev_start_xmit(struct sk_buff* skb, struct net_device* dev) {
     if (ret == 0) {
         /* Update statistics */
         dev->stats.tx_packets++;
-        dev->stats.tx_bytes += skb->len;
-        txq->tx_packets++;
-        txq->tx_bytes += skb->len;
+        dev->stats.tx_bytes += len;
+        txq->stats.packets++;
+        txq->stats.bytes += len;
     } else {
         dev->stats.tx_errors++;
         dev->stats.tx_dropped++;
+        txq->stats.errors++;
     }
     
     return ret;
@@ -217,15 +366,9 @@ int netdev_start_xmit(struct sk_buff* skb, struct net_device* dev) {
 
 /* ==================== Packet Reception ==================== */
 
-int netdev_rx(struct sk_buff* skb, struct net_device* dev) {
-    if (!skb || !dev) return -1;
-    
-    /* Update statistics */
-    dev->stats.rx_packets++;
-    dev->stats.rx_bytes += skb->len;
-    
-    /* Set device pointer */
-    skb->dev = dev;
+/* Hand a received packet to its protocol; runs in the softirq thread */
+void netdev_deliver_skb(struct sk_buff* skb) {
+    struct net_device* dev = skb->dev;
     
     /* Process based on protocol */
     switch (ntohs(skb->protocol)) {
@@ -245,32 +388,204 @@ int netdev_rx(struct sk_buff* skb, struct net_device* dev) {
             free_skb(skb);
             break;
     }
+}
+
+static void napi_schedule_on(softnet_data_t* sd, struct napi_struct* napi);
+
+static int netdev_cpu_usable(uint32_t cpu) {
+    return cpu < percpu_nr_cpus && cpu_mask_test_cpu(cpu, &cpu_online_mask) &&
+           per_cpu_ptr(&softnet_data, cpu)->thread != NULL;
+}
+
+/*
+ * Pick the CPU to process a received packet on. RFS sends the flow to
+ * the CPU consuming it, so the protocol work and the socket stay in one
+ * cache. Flows no socket has claimed stay where the NIC delivered them,
+ * or are spread by hash when a single RX queue leaves that all to one
+ * CPU. Either way a flow only moves once its old CPU has processed past
+ * the flow's last packet there, since that packet would otherwise be
+ * overtaken. *flowp gets the flow entry for recording last_qtail.
+ */
+static uint32_t netdev_rx_cpu(struct net_device* dev, struct sk_buff* skb, uint32_t this_cpu,
+                              rfs_flow_t** flowp) {
+    uint32_t hash = skb_get_hash(skb);
+    *flowp = NULL;
+    if (!hash) return this_cpu;
+    
+    rfs_flow_t* flow = &rfs_flows[hash & (NETDEV_RFS_FLOWS - 1)];
+    uint16_t desired = __atomic_load_n(&flow->desired, __ATOMIC_RELAXED);
+    uint16_t cur = __atomic_load_n(&flow->queued, __ATOMIC_RELAXED);
+    uint32_t target = this_cpu;
+    
+    if (desired && netdev_cpu_usable(desired - 1u)) {
+        target = desired - 1u;
+    } else if (dev->real_num_rx_queues <= 1) {
+        uint32_t cpu = (uint32_t)(((uint64_t)hash * percpu_nr_cpus) >> 32);
+        if (netdev_cpu_usable(cpu)) {
+            target = cpu;
+        }
+    }
+    
+    if (cur && cur != target + 1 && netdev_cpu_usable(cur - 1u)) {
+        softnet_data_t* old = per_cpu_ptr(&softnet_data, cur - 1u);
+        uint32_t head = __atomic_load_n(&old->input_queue_head, __ATOMIC_ACQUIRE);
+        
+        if ((int32_t)(head - __atomic_load_n(&flow->last_qtail, __ATOMIC_RELAXED)) < 0) {
+            target = cur - 1u;
+        }
+    }
+    
+    if (cur != target + 1) {
+        __atomic_store_n(&flow->queued, (uint16_t)(target + 1), __ATOMIC_RELAXED);
+    }
+    *flowp = flow;
+    return target;
+}
+
+/*
+ * Receive a packet from a driver without NAPI. Safe from interrupt
+ * context: the packet is queued on the backlog of the CPU flow steering
+ * picks, and the protocol stack runs later from that CPU's softirq
+ * thread. Drivers record the RX queue in skb->queue_mapping.
+ */
+int netdev_rx(struct sk_buff* skb, struct net_device* dev) {
+    if (!skb || !dev) return -1;
+    
+    /* Update statistics */
+    dev->stats.rx_packets++;
+    dev->stats.rx_bytes += skb->len;
+    
+    netdev_queue_t* rxq = NULL;
+    if (dev->rx_queue && skb->queue_mapping < dev->num_rx_queues) {
+        rxq = &dev->rx_queue[skb->queue_mapping];
+        rxq->stats.packets++;
+        rxq->stats.bytes += skb->len;
+    }
+    
+    /* Set device pointer */
+    skb->dev = dev;
+    
+    unsigned long flags;
+    rfs_flow_t* flow;
+    local_irq_save(flags);
+    uint32_t cpu = netdev_rx_cpu(dev, skb, smp_processor_id(), &flow);
+    softnet_data_t* sd = per_cpu_ptr(&softnet_data, cpu);
+    
+    spin_lock(&sd->lock);
+    if (skb_queue_len(&sd->backlog_queue) >= NETDEV_MAX_BACKLOG) {
+        spin_unlock(&sd->lock);
+        local_irq_restore(flags);
+        this_cpu_inc(softnet_stat.dropped);
+        dev->stats.rx_dropped++;
+        if (rxq) {
+            rxq->stats.dropped++;
+        }
+        free_skb(skb);
+        return -1;
+    }
+    skb_queue_tail(&sd->backlog_queue, skb);
+    uint32_t qtail = ++sd->input_queue_tail;
+    spin_unlock(&sd->lock);
+    if (flow) {
+        __atomic_store_n(&flow->last_qtail, qtail, __ATOMIC_RELAXED);
+    }
+    
+    napi_schedule_on(sd, &sd->backlog);
+    local_irq_restore(flags);
     
     return 0;
 }
 
 /* ==================== NAPI Functions ==================== */
 
-void napi_schedule(struct napi_struct* napi) {
-    if (!napi || napi->scheduled) return;
+void netif_napi_add(struct net_device* dev, struct napi_struct* napi,
+                    int (*poll)(struct napi_struct* napi, int budget), int weight) {
+    if (!napi) return;
+    
+    memset(napi, 0, sizeof(*napi));
+    napi->dev = dev;
+    napi->poll = poll;
+    napi->weight = weight > 0 ? weight : NAPI_POLL_WEIGHT;
+    skb_queue_head_init(&napi->gro_list);
     
-    napi->scheduled = 1;
+    /* Starts disabled, as after napi_disable() */
+    napi->state = NAPI_STATE_SCHED;
     
-    /* Add to poll list */
-    /* TODO: Implement poll list */
+    if (dev) {
+        napi->next = dev->napi_list;
+        dev->napi_list = napi;
+    }
+}
+
+void napi_enable(struct napi_struct* napi) {
+    if (!napi) return;
+    
+    __atomic_and_fetch(&napi->state, ~NAPI_STATE_SCHED, __ATOMIC_RELEASE);
+}
+
+/* Wait out any poll in progress and keep the NAPI from being scheduled */
+void napi_disable(struct napi_struct* napi) {
+    if (!napi) return;
     
-    kprintf("[NAPI] Scheduled NAPI for device %s\n", napi->dev->name);
+    __atomic_or_fetch(&napi->state, NAPI_STATE_DISABLE, __ATOMIC_ACQ_REL);
+    while (__atomic_fetch_or(&napi->state, NAPI_STATE_SCHED, __ATOMIC_ACQ_REL) & NAPI_STATE_SCHED) {
+        schedule();
+    }
+    __atomic_and_fetch(&napi->state, ~NAPI_STATE_DISABLE, __ATOMIC_RELEASE);
+}
+
+/* Caller holds sd->lock */
+static void napi_list_add_tail(softnet_data_t* sd, struct napi_struct* napi) {
+    napi->poll_next = NULL;
+    if (sd->poll_tail) {
+        sd->poll_tail->poll_next = napi;
+    } else {
+        sd->poll_list = napi;
+    }
+    sd->poll_tail = napi;
 }
 
+static void napi_schedule_on(softnet_data_t* sd, struct napi_struct* napi) {
+    if (__atomic_load_n(&napi->state, __ATOMIC_ACQUIRE) & NAPI_STATE_DISABLE) return;
+    if (__atomic_fetch_or(&napi->state, NAPI_STATE_SCHED, __ATOMIC_ACQ_REL) & NAPI_STATE_SCHED) {
+        return;
+    }
+    
+    unsigned long flags;
+    spin_lock_irqsave(&sd->lock, &flags);
+    int was_empty = (sd->poll_list == NULL);
+    
+    napi_list_add_tail(sd, napi);
+    spin_unlock_irqrestore(&sd->lock, flags);
+    
+    if (was_empty && sd->thread) {
+        wake_up_process(sd->thread);
+    }
+}
+
+/* Put napi on this CPU's poll list; called from the driver's IRQ handler */
+void napi_schedule(struct napi_struct* napi) {
+    if (!napi) return;
+    
+    unsigned long flags;
+    local_irq_save(flags);
+    napi_schedule_on(this_cpu_ptr(&softnet_data), napi);
+    local_irq_restore(flags);
+}
+
+/* Called by poll() when it is done under budget */
 void napi_complete(struct napi_struct* napi) {
     if (!napi) return;
     
-    napi->scheduled = 0;
+    /* Nothing may stay held once the NAPI can go idle */
+    napi_gro_flush(napi);
     
-    /* Remove from poll list */
-    /* TODO: Implement poll list */
+    __atomic_and_fetch(&napi->state, ~NAPI_STATE_SCHED, __ATOMIC_RELEASE);
     
-    kprintf("[NAPI] Completed NAPI for device %s\n", napi->dev->name);
+    /* Interrupts come back only now; until here the device is polled */
+    if (napi->irq_enable) {
+        napi->irq_enable(napi);
+    }
 }
 
 int napi_poll(struct napi_struct* napi, int budget) {
@@ -279,6 +594,198 @@ int napi_poll(struct napi_struct* napi, int budget) {
     return napi->poll(napi, budget);
 }
 
+/* Packets GRO still holds have not reached the stack; publish the rest */
+static inline void backlog_advance_head(softnet_data_t* sd, struct napi_struct* napi) {
+    if (!napi->gro_count) {
+        __atomic_store_n(&sd->input_queue_head, sd->input_queue_dequeued, __ATOMIC_RELEASE);
+    }
+}
+
+/* Poll function of the per-CPU backlog */
+static int process_backlog(struct napi_struct* napi, int budget) {
+    softnet_data_t* sd = this_cpu_ptr(&softnet_data);
+    int work = 0;
+    
+    while (work < budget) {
+        unsigned long flags;
+        spin_lock_irqsave(&sd->lock, &flags);
+        struct sk_buff* skb = skb_dequeue(&sd->backlog_queue);
+        if (!skb && napi->gro_count) {
+            /* Deliver what GRO holds outside the lock, then look again */
+            spin_unlock_irqrestore(&sd->lock, flags);
+            napi_gro_flush(napi);
+            backlog_advance_head(sd, napi);
+            continue;
+        }
+        if (!skb) {
+            /* Completing under the lock means a packet queued after
+             * this reschedules the backlog rather than being stranded.
+             * GRO holds nothing by now, so this delivers nothing. */
+            napi_complete(napi);
+            spin_unlock_irqrestore(&sd->lock, flags);
+            backlog_advance_head(sd, napi);
+            break;
+        }
+        sd->input_queue_dequeued++;
+        spin_unlock_irqrestore(&sd->lock, flags);
+        
+        napi_gro_receive(napi, skb);
+        backlog_advance_head(sd, napi);
+        work++;
+    }
+    
+    return work;
+}
+
+/*
+ * One round over the poll list. Each NAPI gets up to its weight; one
+ * that uses all of it goes to the back of the list. The round stops
+ * when the packet budget or the time limit runs out, leaving the rest
+ * scheduled for the next round.
+ */
+static void net_rx_action(softnet_data_t* sd) {
+    int budget = NETDEV_BUDGET;
+    uint64_t end = ktime_get_ns() + (uint64_t)NETDEV_BUDGET_USECS * 1000;
+    unsigned long flags;
+    
+    for (;;) {
+        spin_lock_irqsave(&sd->lock, &flags);
+        struct napi_struct* napi = sd->poll_list;
+        if (!napi) {
+            spin_unlock_irqrestore(&sd->lock, flags);
+            return;
+        }
+        sd->poll_list = napi->poll_next;
+        if (!sd->poll_list) {
+            sd->poll_tail = NULL;
+        }
+        napi->poll_next = NULL;
+        spin_unlock_irqrestore(&sd->lock, flags);
+        
+        int work = napi_poll(napi, napi->weight);
+        budget -= work;
+        this_cpu_add(softnet_stat.processed, work);
+        
+        /* A poll that used its whole weight did not complete. What
+         * GRO holds goes up now rather than waiting out the other
+         * NAPIs on the list. */
+        if (work >= napi->weight) {
+            napi_gro_flush(napi);
+            if (__atomic_load_n(&napi->state, __ATOMIC_ACQUIRE) & NAPI_STATE_DISABLE) {
+                __atomic_and_fetch(&napi->state, ~NAPI_STATE_SCHED, __ATOMIC_RELEASE);
+            } else {
+                spin_lock_irqsave(&sd->lock, &flags);
+                napi_list_add_tail(sd, napi);
+                spin_unlock_irqrestore(&sd->lock, flags);
+            }
+        }
+        
+        if (budget <= 0 || ktime_get_ns() >= end) {
+            if (__atomic_load_n(&sd->poll_list, __ATOMIC_ACQUIRE)) {
+                this_cpu_inc(softnet_stat.time_squeeze);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Per-CPU softirq thread. It is an ordinary task, so a packet flood
+ * costs CPU time the scheduler can share out rather than an interrupt
+ * storm that starves everything else.
+ */
+static void net_rx_thread(void) {
+    softnet_data_t* sd = this_cpu_ptr(&softnet_data);
+    task_t* self = current;
+    
+    for (;;) {
+        self->state = TASK_INTERRUPTIBLE;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&sd->poll_list, __ATOMIC_ACQUIRE)) {
+            schedule();
+            continue;
+        }
+        self->state = TASK_RUNNING;
+        
+        net_rx_action(sd);
+        
+        if (need_resched()) {
+            schedule();
+        }
+    }
+}
+
+static void softnet_init(void) {
+    uint32_t cpu;
+    
+    for_each_percpu_cpu(cpu) {
+        softnet_data_t* sd = per_cpu_ptr(&softnet_data, cpu);
+        
+        memset(sd, 0, sizeof(*sd));
+        spin_lock_init(&sd->lock);
+        skb_queue_head_init(&sd->backlog_queue);
+        netif_napi_add(NULL, &sd->backlog, process_backlog, NAPI_POLL_WEIGHT);
+        napi_enable(&sd->backlog);
+        
+        if (!cpu_mask_test_cpu(cpu, &cpu_online_mask)) {
+            continue;
+        }
+        
+        task_t* t = sched_create_task(net_rx_thread, "ksoftirqd");
+        if (!t) {
+            kprintf("[NETDEV] Failed to create softirq thread for CPU %u\n", cpu);
+            continue;
+        }
+        cpu_mask_clear(&t->cpu_affinity);
+        cpu_mask_set_cpu(cpu, &t->cpu_affinity);
+        t->last_cpu = cpu;
+        sd->thread = t;
+        wake_up_new_task(t);
+    }
+}
+
+void netdev_softnet_stats(softnet_stat_t* out) {
+    if (!out) return;
+    
+    percpu_sum_u64(&softnet_stat, sizeof(softnet_stat), out);
+}
+
+/* ==================== Flow Steering ==================== */
+
+int netdev_set_xps(struct net_device* dev, uint32_t cpu, uint16_t queue) {
+    if (!dev || !dev->xps_map) return -1;
+    if (cpu >= percpu_nr_cpus || queue >= dev->num_tx_queues) return -1;
+    
+    __atomic_store_n(&dev->xps_map[cpu], queue, __ATOMIC_RELAXED);
+    return 0;
+}
+
+uint16_t netdev_rss_queue(const struct net_device* dev, uint32_t hash) {
+    if (!dev) return 0;
+    
+    return dev->rss_indir[hash & (NETDEV_RSS_INDIR_SIZE - 1)];
+}
+
+/* Called by sockets as their data is consumed, with the flow's hash */
+void netdev_rfs_record(uint32_t hash) {
+    if (!hash) return;
+    
+    rfs_flow_t* flow = &rfs_flows[hash & (NETDEV_RFS_FLOWS - 1)];
+    uint16_t cpu = (uint16_t)(smp_processor_id() + 1);
+    
+    /* Only write on a change; the common case leaves the line shared */
+    if (__atomic_load_n(&flow->desired, __ATOMIC_RELAXED) != cpu) {
+        __atomic_store_n(&flow->desired, cpu, __ATOMIC_RELAXED);
+    }
+}
+
+/* The socket is gone; let the flow's packets go back to default steering */
+void netdev_rfs_forget(uint32_t hash) {
+    if (!hash) return;
+    
+    __atomic_store_n(&rfs_flows[hash & (NETDEV_RFS_FLOWS - 1)].desired, 0, __ATOMIC_RELAXED);
+}
+
 /* ==================== Queue Management ==================== */
 
 void netdev_tx_queue_stop(struct net_device* dev, uint32_t queue_idx) {
@@ -349,6 +856,9 @@ int loopback_init(void) {
     loopback_dev->hard_header_len = 0;
     loopback_dev->addr_len = 0;
     
+    /* Packets never leave memory, so super-segments pass through whole */
+    loopback_dev->features = NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_TSO;
+    
     /* Single queue */
     loopback_dev->num_tx_queues = 1;
     loopback_dev->num_rx_queues = 1;
@@ -407,6 +917,18 @@ void netdev_dump_info(struct net_device* dev) {
             dev->stats.tx_packets, dev->stats.tx_bytes,
             dev->stats.tx_errors, dev->stats.tx_dropped);
     
+    for (uint32_t i = 0; dev->rx_queue && i < dev->num_rx_queues; i++) {
+        netdev_queue_stats_t* qs = &dev->rx_queue[i].stats;
+        kprintf("    rx-%u: packets=%u bytes=%u dropped=%u\n", i,
+                (uint32_t)qs->packets, (uint32_t)qs->bytes, (uint32_t)qs->dropped);
+    }
+    for (uint32_t i = 0; dev->tx_queue && i < dev->num_tx_queues; i++) {
+        netdev_queue_stats_t* qs = &dev->tx_queue[i].stats;
+        kprintf("    tx-%u: packets=%u bytes=%u dropped=%u errors=%u\n", i,
+                (uint32_t)qs->packets, (uint32_t)qs->bytes, (uint32_t)qs->dropped,
+                (uint32_t)qs->errors);
+    }
+    
     kprintf("  Features: 0x%08x\n", dev->features);
     if (dev->features & NETIF_F_SG) kprintf("    Scatter-Gather\n");
     if (dev->features & NETIF_F_IP_CSUM) kprintf("    IP Checksum Offload\n");
@@ -418,14 +940,16 @@ void netdev_dump_info(struct net_device* dev) {
 void netdev_list_all(void) {
     kprintf("[NETDEV] Network Devices (%u):\n", netdev_state.count);
     
-    for (uint32_t i = 0; i < netdev_state.count; i++) {
-        struct net_device* dev = netdev_state.devices[i];
+    struct net_device* dev;
+    rcu_read_lock();
+    rcu_chain_for_each(dev, netdev_state.list, next) {
         kprintf("  %u: %s (%s) mtu=%u\n",
                 dev->ifindex,
                 dev->name,
                 dev->state == NETDEV_STATE_UP ? "UP" : "DOWN",
                 dev->mtu);
     }
+    rcu_read_unlock();
 }
 
 /* ==================== Initialization ==================== */
@@ -436,6 +960,10 @@ int netdev_init(void) {
     /* Initialize state */
     memset(&netdev_state, 0, sizeof(netdev_state));
     netdev_state.next_ifindex = 1;
+    spin_lock_init(&netdev_state.lock);
+    
+    /* Receive processing before any device can deliver */
+    softnet_init();
     
     /* Initialize loopback device */
     loopback_init();
@@ -449,8 +977,9 @@ void netdev_cleanup(void) {
     kprintf("[NETDEV] Cleaning up network device layer...\n");
     
     /* Unregister all devices */
-    for (uint32_t i = 0; i < netdev_state.count; i++) {
-        netdev_unregister(netdev_state.devices[i]);
+    struct net_device* dev;
+    while ((dev = netdev_state.list) != NULL) {
+        netdev_unregister(dev);
     }
     
     kprintf("[NETDEV] Network device layer cleaned up\n");
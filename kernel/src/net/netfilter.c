@@ -11,12 +11,17 @@
 #include "kernel/printk.h"
 #include "kernel/string.h"
 #include "kernel/stdlib.h"
+#include "spinlock.h"
+#include "rcu.h"
+#include "percpu.h"
 
-/* Hook lists for each hook point */
+/* Hook lists for each hook point. Packets walk them under RCU;
+ * nf_hook_lock serialises registration. */
 static nf_hook_ops_t* hook_lists[NF_IP_NUMHOOKS] = {NULL};
+static spinlock_t nf_hook_lock;
 
-/* Global netfilter statistics */
-static netfilter_stats_t nf_stats = {0};
+/* Netfilter statistics, per CPU */
+static DEFINE_PER_CPU(netfilter_stats_t, nf_stats);
 
 /*
  * Initialize Netfilter
@@ -26,7 +31,8 @@ int netfilter_init(void) {
     for (i = 0; i < NF_IP_NUMHOOKS; i++) {
         hook_lists[i] = NULL;
     }
-    memset(&nf_stats, 0, sizeof(nf_stats));
+    spin_lock_init(&nf_hook_lock);
+    percpu_zero(&nf_stats, sizeof(nf_stats));
     printk(KERN_INFO "Netfilter initialized\n");
     return 0;
 }
@@ -45,6 +51,8 @@ int nf_register_hook(nf_hook_ops_t* ops) {
         return -1;
     }
     
+    spin_lock(&nf_hook_lock);
+    
     list = &hook_lists[ops->hooknum];
     
     /* Insert hook in priority order (lower priority value = higher priority) */
@@ -56,8 +64,9 @@ int nf_register_hook(nf_hook_ops_t* ops) {
     }
     
     /* Insert hook */
-    ops->next = *list;
-    *list = ops;
+    rcu_chain_insert(list, ops, next);
+    
+    spin_unlock(&nf_hook_lock);
     
     printk(KERN_DEBUG "Registered netfilter hook at %u with priority %d\n",
            ops->hooknum, ops->priority);
@@ -77,44 +86,39 @@ void nf_unregister_hook(nf_hook_ops_t* ops) {
         return;
     }
     
+    spin_lock(&nf_hook_lock);
+    
     list = &hook_lists[ops->hooknum];
     
     /* Find and remove hook */
     while (*list) {
         if (*list == ops) {
-            *list = ops->next;
-            ops->next = NULL;
+            rcu_chain_del(list, ops, next);
+            spin_unlock(&nf_hook_lock);
+            
+            /* The caller may free ops; packets may still be inside it */
+            synchronize_rcu();
             printk(KERN_DEBUG "Unregistered netfilter hook at %u\n", ops->hooknum);
             return;
         }
         list = &(*list)->next;
     }
+    
+    spin_unlock(&nf_hook_lock);
 }
 
-/*
- * Invoke netfilter hooks
- * 
- * @hooknum: Hook number (NF_IP_PRE_ROUTING, etc.)
- * @skb: Socket buffer
- * @in: Input network device (or NULL)
- * @out: Output network device (or NULL)
- * @return: Verdict (NF_ACCEPT, NF_DROP, etc.)
- */
-unsigned int nf_hook_slow(unsigned int hooknum, struct sk_buff* skb,
-                          const struct net_device* in,
-                          const struct net_device* out) {
+/* Run the hooks at hooknum in priority order, under rcu_read_lock() */
+static unsigned int nf_iterate(unsigned int hooknum, struct sk_buff* skb,
+                               const struct net_device* in,
+                               const struct net_device* out) {
     nf_hook_ops_t* hook;
     unsigned int verdict;
     
-    if (hooknum >= NF_IP_NUMHOOKS || !skb) {
-        return NF_ACCEPT;
-    }
-    
-    hook = hook_lists[hooknum];
+    hook = rcu_dereference(hook_lists[hooknum]);
     
     /* Call each hook in priority order */
     while (hook) {
-        nf_stats.hooks_called++;
+        this_cpu_inc(nf_stats.hooks_called);
         
         verdict = hook->hook(hooknum, skb, in, out, hook->priv);
         
@@ -124,17 +128,17 @@ unsigned int nf_hook_slow(unsigned int hooknum, struct sk_buff* skb,
                 break;
                 
             case NF_DROP:
-                nf_stats.packets_dropped++;
+                this_cpu_inc(nf_stats.packets_dropped);
                 return NF_DROP;
                 
             case NF_STOLEN:
                 /* Hook consumed the packet */
-                nf_stats.packets_stolen++;
+                this_cpu_inc(nf_stats.packets_stolen);
                 return NF_STOLEN;
                 
             case NF_QUEUE:
                 /* Queue to userspace */
-                nf_stats.packets_queued++;
+                this_cpu_inc(nf_stats.packets_queued);
                 return NF_QUEUE;
                 
             case NF_REPEAT:
@@ -146,13 +150,40 @@ unsigned int nf_hook_slow(unsigned int hooknum, struct sk_buff* skb,
                 return NF_DROP;
         }
         
-        hook = hook->next;
+        hook = rcu_dereference(hook->next);
     }
     
-    nf_stats.packets_accepted++;
     return NF_ACCEPT;
 }
 
+/*
+ * Invoke netfilter hooks
+ * 
+ * @hooknum: Hook number (NF_IP_PRE_ROUTING, etc.)
+ * @skb: Socket buffer
+ * @in: Input network device (or NULL)
+ * @out: Output network device (or NULL)
+ * @return: Verdict (NF_ACCEPT, NF_DROP, etc.)
+ */
+unsigned int nf_hook_slow(unsigned int hooknum, struct sk_buff* skb,
+                          const struct net_device* in,
+                          const struct net_device* out) {
+    unsigned int verdict;
+    
+    if (hooknum >= NF_IP_NUMHOOKS || !skb) {
+        return NF_ACCEPT;
+    }
+    
+    rcu_read_lock();
+    verdict = nf_iterate(hooknum, skb, in, out);
+    rcu_read_unlock();
+    
+    if (verdict == NF_ACCEPT) {
+        this_cpu_inc(nf_stats.packets_accepted);
+    }
+    return verdict;
+}
+
 /*
  * Get Netfilter Statistics
  * 
@@ -162,16 +193,19 @@ void netfilter_get_stats(netfilter_stats_t* stats) {
     if (!stats) {
         return;
     }
-    memcpy(stats, &nf_stats, sizeof(netfilter_stats_t));
+    percpu_sum_u64(&nf_stats, sizeof(nf_stats), stats);
 }
 
 /*
  * Dump Netfilter Statistics
  */
 void netfilter_dump_stats(void) {
+    netfilter_stats_t stats;
+    netfilter_get_stats(&stats);
+    
     printk(KERN_INFO "=== Netfilter Statistics ===\n");
-    printk(KERN_INFO "Hooks called: %llu\n", nf_stats.hooks_called);
+    printk(KERN_INFO "Hooks called: %llu\n", stats.hooks_called);
     printk(KERN_INFO "Packets: accepted=%llu dropped=%llu stolen=%llu queued=%llu\n",
-           nf_stats.packets_accepted, nf_stats.packets_dropped,
-           nf_stats.packets_stolen, nf_stats.packets_queued);
+           stats.packets_accepted, stats.packets_dropped,
+           stats.packets_stolen, stats.packets_queued);
 }
@@ -0,0 +1,409 @@
+/*
+ * Generic Receive and Segmentation Offload
+ *
+ * GRO merges consecutive in-order TCP segments of one flow, as they come
+ * out of a NAPI poll, into a single skb before the protocol stack sees
+ * them. GSO is the transmit side: TCP hands down super-segments of up to
+ * 64KB, which are cut into MSS-sized packets only at the device, or not
+ * at all when the device does TSO. Either way the stack runs once per
+ * super-segment rather than once per wire packet.
+ *
+ * Only TCP over IPv4 without IP options is merged or cut.
+ *
+ * Copyright (c) 2025 LimitlessOS Project
+ */
+
+#include "net/netdevice.h"
+#include "net/skbuff.h"
+#include "page_cache.h"
+#include "kernel.h"
+#include <string.h>
+
+/* Flows a NAPI holds packets for at once */
+#define GRO_MAX_HELD        8
+
+/* IP total length limit, which bounds a merged packet */
+#define GRO_MAX_SIZE        65535
+
+#define IPV4_HLEN           20
+#define TCP_HLEN            20
+
+/* TCP flag bits, byte 13 of the header */
+#define TCPF_FIN            0x01
+#define TCPF_SYN            0x02
+#define TCPF_RST            0x04
+#define TCPF_PSH            0x08
+#define TCPF_ACK            0x10
+#define TCPF_URG            0x20
+
+/* ==================== Header Access ==================== */
+
+static inline uint16_t get_be16(const void* p) {
+    const uint8_t* b = (const uint8_t*)p;
+    return (uint16_t)((b[0] << 8) | b[1]);
+}
+
+static inline uint32_t get_be32(const void* p) {
+    const uint8_t* b = (const uint8_t*)p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+static inline void put_be16(void* p, uint16_t v) {
+    uint8_t* b = (uint8_t*)p;
+    b[0] = (uint8_t)(v >> 8);
+    b[1] = (uint8_t)v;
+}
+
+static inline void put_be32(void* p, uint32_t v) {
+    uint8_t* b = (uint8_t*)p;
+    b[0] = (uint8_t)(v >> 24);
+    b[1] = (uint8_t)(v >> 16);
+    b[2] = (uint8_t)(v >> 8);
+    b[3] = (uint8_t)v;
+}
+
+/* Checksum fields hold the complemented sum in the same byte order it
+ * was summed in, which for csum_partial() is native */
+static inline void put_csum(void* p, uint32_t sum) {
+    uint16_t check = (uint16_t)~sum;
+    memcpy(p, &check, sizeof(check));
+}
+
+static void ipv4_fix_header(uint8_t* iph, uint32_t tot_len) {
+    put_be16(iph + 2, (uint16_t)tot_len);
+    memset(iph + 10, 0, 2);
+    put_csum(iph + 10, csum_partial(iph, (iph[0] & 0x0f) * 4, 0));
+}
+
+/* Sum of the TCP pseudo-header */
+static uint32_t tcp4_pseudo_sum(const uint8_t* iph, uint32_t tcp_len) {
+    uint8_t pseudo[12];
+
+    memcpy(pseudo, iph + 12, 8);    /* saddr, daddr */
+    pseudo[8] = 0;
+    pseudo[9] = IPPROTO_TCP;
+    put_be16(pseudo + 10, (uint16_t)tcp_len);
+
+    return csum_partial(pseudo, sizeof(pseudo), 0);
+}
+
+/* A parsed TCP/IPv4 packet; offsets are from skb->data */
+typedef struct tcp4_info {
+    uint32_t l4off;                 /* TCP header */
+    uint32_t hlen;                  /* IP and TCP headers together */
+    uint32_t payload;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t flags;
+} tcp4_info_t;
+
+/* 0 if skb->data starts a TCP/IPv4 packet with its headers linear */
+static int tcp4_parse(const sk_buff_t* skb, tcp4_info_t* info) {
+    const uint8_t* iph = skb->data;
+    uint32_t headlen = skb_headlen(skb);
+
+    if (get_be16(&skb->protocol) != ETH_P_IP) return -1;
+    if (headlen < IPV4_HLEN || iph[0] != 0x45 || iph[9] != IPPROTO_TCP) return -1;
+    if (get_be16(iph + 6) & 0x3fff) return -1;      /* Fragment */
+    if (get_be16(iph + 2) != skb->len) return -1;   /* Padded or truncated */
+
+    const uint8_t* th = iph + IPV4_HLEN;
+    uint32_t thlen = (uint32_t)(th[12] >> 4) * 4;
+    if (thlen < TCP_HLEN || headlen < IPV4_HLEN + thlen) return -1;
+
+    info->l4off = IPV4_HLEN;
+    info->hlen = IPV4_HLEN + thlen;
+    info->payload = skb->len - info->hlen;
+    info->seq = get_be32(th + 4);
+    info->ack = get_be32(th + 8);
+    info->flags = th[13];
+    return 0;
+}
+
+/* ==================== GRO ==================== */
+
+/* Kept in skb->cb of a packet held for merging */
+typedef struct gro_cb {
+    sk_buff_t* last;                /* Tail of the frag list */
+    uint32_t next_seq;              /* Sequence number that may be appended */
+    uint32_t mss;                   /* Payload of the first segment */
+    uint32_t count;                 /* Segments merged, the first included */
+} gro_cb_t;
+
+#define GRO_CB(skb) ((gro_cb_t*)(skb)->cb)
+
+static int gro_same_flow(const sk_buff_t* a, const sk_buff_t* b) {
+    /* Addresses, then ports */
+    return memcmp(a->data + 12, b->data + 12, 8) == 0 &&
+           memcmp(a->data + IPV4_HLEN, b->data + IPV4_HLEN, 4) == 0;
+}
+
+/* Merged packets skip the per-segment checksum check in TCP, so each one
+ * is checked here unless the driver already did it */
+static int gro_csum_ok(sk_buff_t* skb, const tcp4_info_t* info) {
+    if (skb->flags & SKB_FLAG_CHECKSUM_VALID) return 1;
+
+    uint32_t tcp_len = skb->len - info->l4off;
+    uint32_t sum = skb_checksum(skb, info->l4off, tcp_len, tcp4_pseudo_sum(skb->data, tcp_len));
+    if (sum != 0xffff) return 0;
+
+    skb->flags |= SKB_FLAG_CHECKSUM_VALID;
+    return 1;
+}
+
+/* Hand a held packet up, fixing its headers if anything was merged in */
+static void gro_complete(struct napi_struct* napi, sk_buff_t* skb) {
+    skb_unlink(skb, &napi->gro_list);
+    napi->gro_count--;
+
+    gro_cb_t* cb = GRO_CB(skb);
+    if (cb->count > 1) {
+        ipv4_fix_header(skb->data, skb->len);
+
+        /* Marked as a super-segment, so it is cut up again if it is
+         * ever sent on */
+        skb_shared_info_t* shinfo = skb_shinfo(skb);
+        shinfo->gso_size = cb->mss;
+        shinfo->gso_segs = (uint16_t)cb->count;
+        shinfo->gso_type = SKB_GSO_TCPV4;
+    }
+
+    memset(skb->cb, 0, sizeof(gro_cb_t));
+    netdev_deliver_skb(skb);
+}
+
+static sk_buff_t* gro_find(struct napi_struct* napi, const sk_buff_t* skb) {
+    sk_buff_head_t* list = &napi->gro_list;
+
+    for (sk_buff_t* held = list->next; held != (sk_buff_t*)list; held = held->next) {
+        if (gro_same_flow(held, skb)) {
+            return held;
+        }
+    }
+    return NULL;
+}
+
+/* Whether skb may be appended to held, which has the same flow */
+static int gro_can_merge(sk_buff_t* held, sk_buff_t* skb, const tcp4_info_t* info) {
+    gro_cb_t* cb = GRO_CB(held);
+    const uint8_t* hiph = held->data;
+    const uint8_t* iph = skb->data;
+    uint32_t thlen = info->hlen - IPV4_HLEN;
+
+    if (info->seq != cb->next_seq) return 0;
+    if (info->payload > cb->mss) return 0;
+    if (held->len + info->payload > GRO_MAX_SIZE) return 0;
+
+    /* Same ACK, TOS and TTL, and byte-identical options; TCP would
+     * otherwise need to see each segment */
+    if (get_be32(hiph + IPV4_HLEN + 8) != info->ack) return 0;
+    if (hiph[1] != iph[1] || hiph[8] != iph[8]) return 0;
+    if ((uint32_t)(hiph[IPV4_HLEN + 12] >> 4) * 4 != thlen) return 0;
+    if (memcmp(hiph + IPV4_HLEN + TCP_HLEN, iph + IPV4_HLEN + TCP_HLEN, thlen - TCP_HLEN) != 0) return 0;
+
+    return 1;
+}
+
+void napi_gro_flush(struct napi_struct* napi) {
+    if (!napi) return;
+
+    sk_buff_t* skb;
+    while ((skb = skb_peek(&napi->gro_list)) != NULL) {
+        gro_complete(napi, skb);
+    }
+}
+
+/*
+ * Called from poll() for each received packet. A data segment that
+ * continues a held packet of its flow is appended to that packet's frag
+ * list; the merged packet goes up when a short or PSH segment ends the
+ * run, when something else arrives for the flow, or at the end of the
+ * poll. Everything else goes straight up, after anything held for its
+ * flow so that order is kept.
+ */
+void napi_gro_receive(struct napi_struct* napi, struct sk_buff* skb) {
+    if (!skb) return;
+
+    if (!skb->dev && napi) {
+        skb->dev = napi->dev;
+    }
+
+    tcp4_info_t info;
+    if (!napi || !skb->dev || !(skb->dev->features & NETIF_F_GRO) ||
+        tcp4_parse(skb, &info) != 0) {
+        netdev_deliver_skb(skb);
+        return;
+    }
+
+    sk_buff_t* held = gro_find(napi, skb);
+
+    /* Pure data segments only; a clone's buffer is not ours to extend */
+    int mergeable = info.payload > 0 &&
+                    (info.flags & ~TCPF_PSH) == TCPF_ACK &&
+                    !skb->orig && !skb->cloned && !skb_shared(skb) &&
+                    !skb_has_frag_list(skb) &&
+                    gro_csum_ok(skb, &info);
+
+    if (held && mergeable && gro_can_merge(held, skb, &info)) {
+        gro_cb_t* cb = GRO_CB(held);
+        uint8_t* hth = held->data + IPV4_HLEN;
+        const uint8_t* th = skb->data + IPV4_HLEN;
+
+        /* The latest window stands, and a PSH carries over */
+        memcpy(hth + 14, th + 14, 2);
+        hth[13] |= info.flags & TCPF_PSH;
+
+        skb_pull(skb, info.hlen);
+        skb_frag_list_append(held, skb, &cb->last);
+        cb->next_seq += info.payload;
+        cb->count++;
+
+        if (info.payload < cb->mss || (info.flags & TCPF_PSH)) {
+            gro_complete(napi, held);
+        }
+        return;
+    }
+
+    if (held) {
+        gro_complete(napi, held);
+    }
+
+    if (!mergeable || (info.flags & TCPF_PSH)) {
+        netdev_deliver_skb(skb);
+        return;
+    }
+
+    /* Hold it as the start of a run, making room if need be */
+    if (napi->gro_count >= GRO_MAX_HELD) {
+        gro_complete(napi, skb_peek(&napi->gro_list));
+    }
+
+    gro_cb_t* cb = GRO_CB(skb);
+    cb->last = NULL;
+    cb->next_seq = info.seq + info.payload;
+    cb->mss = info.payload;
+    cb->count = 1;
+
+    skb_queue_tail(&napi->gro_list, skb);
+    napi->gro_count++;
+}
+
+/* ==================== GSO ==================== */
+
+/*
+ * Cut a TCP/IPv4 super-segment into gso_size packets, returned as a list
+ * linked through next; NULL if that failed. The caller still owns skb.
+ * Headers are copied into each segment with sequence number, IP ID,
+ * lengths and checksums fixed up, and FIN and PSH kept for the last.
+ * Paged payload is shared with the segments; payload on a frag list is
+ * copied.
+ */
+sk_buff_t* skb_gso_segment(sk_buff_t* skb) {
+    if (!skb || !skb_is_gso(skb)) return NULL;
+
+    skb_shared_info_t* shinfo = skb_shinfo(skb);
+    if (!(shinfo->gso_type & SKB_GSO_TCPV4)) return NULL;
+
+    /* IP header at the network header, or at data if none was set */
+    uint32_t l3off = 0;
+    if (skb->network_header >= skb->data && skb->network_header < skb->tail) {
+        l3off = (uint32_t)(skb->network_header - skb->data);
+    }
+    const uint8_t* iph = skb->data + l3off;
+    uint32_t headlen = skb_headlen(skb);
+
+    if (headlen < l3off + IPV4_HLEN || (iph[0] >> 4) != 4 || iph[9] != IPPROTO_TCP) return NULL;
+
+    uint32_t l4off = l3off + (iph[0] & 0x0f) * 4;
+    if (headlen < l4off + TCP_HLEN) return NULL;
+
+    uint32_t hlen = l4off + (uint32_t)(skb->data[l4off + 12] >> 4) * 4;
+    if (headlen < hlen || skb->len <= hlen) return NULL;
+
+    uint32_t mss = shinfo->gso_size;
+    uint32_t seq = get_be32(skb->data + l4off + 4);
+    uint16_t id = get_be16(iph + 4);
+    uint8_t last_flags = skb->data[l4off + 13];
+    int copy_all = skb_has_frag_list(skb);
+
+    sk_buff_t* segs = NULL;
+    sk_buff_t** tailp = &segs;
+    uint32_t n = 0;
+
+    for (uint32_t off = hlen; off < skb->len; off += mss, n++) {
+        uint32_t len = (skb->len - off < mss) ? skb->len - off : mss;
+
+        /* Payload from the linear part is copied, frags are shared */
+        uint32_t linear = 0;
+        if (copy_all) {
+            linear = len;
+        } else if (off < headlen) {
+            linear = (headlen - off < len) ? headlen - off : len;
+        }
+
+        sk_buff_t* seg = alloc_skb(hlen + linear, 0);
+        if (!seg) goto fail;
+
+        memcpy(skb_put(seg, hlen), skb->data, hlen);
+        if (linear) {
+            skb_copy_bits(skb, off, skb_put(seg, linear), linear);
+        }
+
+        if (linear < len) {
+            uint32_t start = headlen;
+            uint32_t want = off + linear;
+            uint32_t end_off = off + len;
+            for (uint32_t i = 0; i < shinfo->nr_frags && want < end_off; i++) {
+                skb_frag_t* frag = &shinfo->frags[i];
+                uint32_t fend = start + frag->size;
+                if (want < fend) {
+                    uint32_t chunk = ((end_off < fend) ? end_off : fend) - want;
+                    page_cache_page_get(frag->page);
+                    if (skb_add_frag(seg, frag->page, frag->offset + (want - start), chunk) < 0) {
+                        page_cache_release(frag->page);
+                        free_skb(seg);
+                        goto fail;
+                    }
+                    want += chunk;
+                }
+                start = fend;
+            }
+        }
+
+        seg->dev = skb->dev;
+        seg->sk = skb->sk;
+        seg->protocol = skb->protocol;
+        seg->priority = skb->priority;
+        seg->queue_mapping = skb->queue_mapping;
+        seg->hash = skb->hash;
+        seg->flags |= skb->flags & SKB_FLAG_HASH;
+        skb_set_network_header(seg, (int)l3off);
+        skb_set_transport_header(seg, (int)l4off);
+
+        /* Headers for this piece */
+        uint8_t* siph = seg->data + l3off;
+        uint8_t* sth = seg->data + l4off;
+        int last = (off + len >= skb->len);
+
+        put_be16(siph + 4, (uint16_t)(id + n));
+        ipv4_fix_header(siph, seg->len - l3off);
+
+        put_be32(sth + 4, seq + n * mss);
+        sth[13] = last ? last_flags : (uint8_t)(last_flags & ~(TCPF_FIN | TCPF_PSH));
+
+        uint32_t tcp_len = seg->len - l4off;
+        memset(sth + 16, 0, 2);
+        put_csum(sth + 16, skb_checksum(seg, l4off, tcp_len, tcp4_pseudo_sum(siph, tcp_len)));
+
+        *tailp = seg;
+        tailp = &seg->next;
+    }
+
+    *tailp = NULL;
+    return segs;
+
+fail:
+    *tailp = NULL;
+    kfree_skb_list(segs);
+    return NULL;
+}
@@ -4,119 +4,197 @@
  * Production-grade network packet buffer management.
  * Zero-copy design with efficient memory pooling.
  * 
+ * Pooled buffers come from slab caches whose objects hold the sk_buff
+ * header and the data together, so one allocation gets both and the
+ * data starts on its own cache line. In front of the slab, every CPU
+ * keeps a small stack of free skbs per default pool; alloc and free
+ * only touch the running CPU's stack with interrupts masked, and move
+ * SKB_CACHE_BATCH skbs to or from the slab when it runs dry or full.
+ * 
+ * Paged data lives in frags that reference page-cache pages, so file
+ * contents can be sent without copying them into the linear buffer.
+ * The shared info with the frag array follows the linear data.
+ * 
  * Copyright (c) 2025 LimitlessOS Project
  */
 
 #include "net/skbuff.h"
 #include "kernel.h"
+#include "mm/mm.h"
+#include "smp.h"
+#include "percpu.h"
+#include "page_cache.h"
 #include <string.h>
 
-/* Global sk_buff statistics */
-static skb_stats_t global_skb_stats = {0};
+/* Data follows the header at the next cache line */
+#define SKB_CACHE_ALIGN     64
+#define SKB_HEAD_SIZE       ((sizeof(sk_buff_t) + SKB_CACHE_ALIGN - 1) & ~(SKB_CACHE_ALIGN - 1))
+
+/* Global sk_buff statistics, per CPU so the hot path shares no line */
+static DEFINE_PER_CPU(skb_stats_t, skb_stats);
 
-/* Default memory pools for common packet sizes */
+/* Default memory pools for common packet sizes; each size includes
+ * SKB_MIN_HEADROOM, so a full frame fits the pool it is meant for */
 static skb_pool_t small_skb_pool;   /* 256 bytes */
-static skb_pool_t medium_skb_pool;  /* 1500 bytes (MTU) */
-static skb_pool_t large_skb_pool;   /* 9000 bytes (jumbo frames) */
+static skb_pool_t medium_skb_pool;  /* 2048 bytes (MTU) */
+static skb_pool_t large_skb_pool;   /* 9216 bytes (jumbo frames) */
+
+static skb_pool_t* const default_pools[SKB_NR_POOLS] = {
+    &small_skb_pool, &medium_skb_pool, &large_skb_pool
+};
+
+/* Free skbs of the default pools, per CPU. Only the owning CPU touches
+ * its cache, with local interrupts masked. */
+typedef struct skb_cpu_cache {
+    uint32_t count[SKB_NR_POOLS];
+    sk_buff_t* skbs[SKB_NR_POOLS][SKB_CACHE_SIZE];
+} skb_cpu_cache_t;
 
-/* Spinlock for pool access (placeholder for SMP) */
-static uint32_t skb_pool_lock = 0;
+static DEFINE_PER_CPU(skb_cpu_cache_t, skb_cache);
 
 /* ==================== Memory Pool Management ==================== */
 
-int skb_pool_init(skb_pool_t* pool, uint32_t count, uint32_t size) {
+/* Take up to SKB_CACHE_BATCH objects from the slab; interrupts are off */
+static void skb_cache_refill(skb_cpu_cache_t* cc, skb_pool_t* pool) {
+    uint32_t* count = &cc->count[pool->id];
+    
+    while (*count < SKB_CACHE_BATCH) {
+        sk_buff_t* skb = (sk_buff_t*)kmem_cache_alloc(pool->cache);
+        if (!skb) break;
+        cc->skbs[pool->id][(*count)++] = skb;
+    }
+    this_cpu_inc(skb_stats.cache_refills);
+}
+
+/* Return the SKB_CACHE_BATCH coldest objects to the slab; interrupts are off */
+static void skb_cache_drain(skb_cpu_cache_t* cc, skb_pool_t* pool) {
+    sk_buff_t** skbs = cc->skbs[pool->id];
+    
+    for (uint32_t i = 0; i < SKB_CACHE_BATCH; i++) {
+        kmem_cache_free(pool->cache, skbs[i]);
+    }
+    cc->count[pool->id] -= SKB_CACHE_BATCH;
+    memmove(skbs, skbs + SKB_CACHE_BATCH, cc->count[pool->id] * sizeof(sk_buff_t*));
+    this_cpu_inc(skb_stats.cache_drains);
+}
+
+static void skb_shinfo_init(sk_buff_t* skb) {
+    skb_shared_info_t* shinfo = (skb_shared_info_t*)skb->end;
+    
+    shinfo->nr_frags = 0;
+    shinfo->gso_size = 0;
+    shinfo->gso_segs = 0;
+    shinfo->gso_type = 0;
+    shinfo->frag_list = NULL;
+    skb->shinfo = shinfo;
+}
+
+/* Give a pool object its pristine state */
+static void skb_pool_prep(skb_pool_t* pool, sk_buff_t* skb) {
+    uint8_t* data = (uint8_t*)skb + SKB_HEAD_SIZE;
+    
+    memset(skb, 0, sizeof(sk_buff_t));
+    skb->head = data;
+    skb->data = data;
+    skb->tail = data;
+    skb->end = data + pool->size;
+    skb->truesize = pool->size;
+    skb->users = 1;
+    skb->pool = pool;
+    skb_shinfo_init(skb);
+}
+
+static int skb_pool_setup(skb_pool_t* pool, const char* name, uint32_t id,
+                          uint32_t count, uint32_t size) {
     if (!pool || count == 0 || size == 0) {
         return -1;
     }
     
     pool->size = SKB_DATA_ALIGN(size);
-    pool->total = count;
-    pool->free = 0;
-    pool->allocated = 0;
-    pool->freed = 0;
-    pool->failed = 0;
-    pool->free_list = NULL;
-    
-    /* Pre-allocate buffers */
-    for (uint32_t i = 0; i < count; i++) {
-        sk_buff_t* skb = (sk_buff_t*)kmalloc(sizeof(sk_buff_t));
-        if (!skb) {
-            kprintf("[SKB] Pool init failed at %u/%u buffers\n", i, count);
-            return -1;
-        }
-        
-        /* Allocate data buffer */
-        uint8_t* data = (uint8_t*)kmalloc(pool->size);
-        if (!data) {
-            kfree(skb);
-            kprintf("[SKB] Pool data allocation failed\n");
-            return -1;
-        }
-        
-        memset(skb, 0, sizeof(sk_buff_t));
-        skb->head = data;
-        skb->data = data;
-        skb->tail = data;
-        skb->end = data + pool->size;
-        skb->truesize = pool->size;
-        
-        /* Add to free list */
-        skb->next = pool->free_list;
-        pool->free_list = skb;
-        pool->free++;
+    pool->id = id;
+    pool->cache = kmem_cache_create(name, SKB_HEAD_SIZE + pool->size + sizeof(skb_shared_info_t),
+                                    SKB_CACHE_ALIGN);
+    if (!pool->cache) {
+        kprintf("[SKB] Pool cache creation failed for %s\n", name);
+        return -1;
+    }
+    
+    /* Pre-allocate buffers, then free them into the slab's magazines */
+    sk_buff_t* list = NULL;
+    uint32_t got = 0;
+    while (got < count) {
+        sk_buff_t* skb = (sk_buff_t*)kmem_cache_alloc(pool->cache);
+        if (!skb) break;
+        skb->next = list;
+        list = skb;
+        got++;
+    }
+    while (list) {
+        sk_buff_t* next = list->next;
+        kmem_cache_free(pool->cache, list);
+        list = next;
+    }
+    
+    if (got < count) {
+        kprintf("[SKB] Pool init failed at %u/%u buffers\n", got, count);
+        return -1;
     }
     
     return 0;
 }
 
+int skb_pool_init(skb_pool_t* pool, uint32_t count, uint32_t size) {
+    /* Pools other than the defaults have no per-CPU cache; the slab's
+     * own magazines still keep their fast path lock-free */
+    return skb_pool_setup(pool, "skbuff_pool", SKB_NR_POOLS, count, size);
+}
+
+/* The pool must be idle: other CPUs' caches are emptied from here */
 void skb_pool_destroy(skb_pool_t* pool) {
-    if (!pool) return;
-    
-    sk_buff_t* skb = pool->free_list;
-    while (skb) {
-        sk_buff_t* next = skb->next;
-        if (skb->head) {
-            kfree(skb->head);
+    if (!pool || !pool->cache) return;
+    
+    if (pool->id < SKB_NR_POOLS) {
+        uint32_t cpu;
+        for_each_percpu_cpu(cpu) {
+            skb_cpu_cache_t* cc = per_cpu_ptr(&skb_cache, cpu);
+            while (cc->count[pool->id]) {
+                kmem_cache_free(pool->cache, cc->skbs[pool->id][--cc->count[pool->id]]);
+            }
         }
-        kfree(skb);
-        skb = next;
     }
     
-    pool->free_list = NULL;
-    pool->free = 0;
+    /* There is no cache destroy; hand everything the slab holds back */
+    kmem_cache_shrink(pool->cache);
 }
 
 sk_buff_t* skb_pool_alloc(skb_pool_t* pool) {
-    if (!pool || !pool->free_list) {
-        pool->failed++;
+    sk_buff_t* skb = NULL;
+    
+    if (!pool || !pool->cache) {
         return NULL;
     }
     
-    /* TODO: Add spinlock for SMP safety */
-    sk_buff_t* skb = pool->free_list;
-    pool->free_list = skb->next;
-    pool->free--;
-    pool->allocated++;
-    
-    /* Reset skb */
-    skb->next = NULL;
-    skb->prev = NULL;
-    skb->dev = NULL;
-    skb->sk = NULL;
-    skb->len = 0;
-    skb->data_len = 0;
-    skb->users = 1;
-    skb->cloned = 0;
-    skb->flags = 0;
+    if (pool->id < SKB_NR_POOLS) {
+        unsigned long flags;
+        local_irq_save(flags);
+        skb_cpu_cache_t* cc = this_cpu_ptr(&skb_cache);
+        if (cc->count[pool->id] == 0) {
+            skb_cache_refill(cc, pool);
+        }
+        if (cc->count[pool->id] > 0) {
+            skb = cc->skbs[pool->id][--cc->count[pool->id]];
+        }
+        local_irq_restore(flags);
+    } else {
+        skb = (sk_buff_t*)kmem_cache_alloc(pool->cache);
+    }
     
-    /* Reset pointers */
-    skb->data = skb->head;
-    skb->tail = skb->head;
-    skb->mac_header = NULL;
-    skb->network_header = NULL;
-    skb->transport_header = NULL;
+    if (!skb) {
+        return NULL;
+    }
     
-    global_skb_stats.pool_hits++;
+    skb_pool_prep(pool, skb);
+    this_cpu_inc(skb_stats.pool_hits);
     
     return skb;
 }
@@ -124,11 +202,29 @@ sk_buff_t* skb_pool_alloc(skb_pool_t* pool) {
 void skb_pool_free(skb_pool_t* pool, sk_buff_t* skb) {
     if (!pool || !skb) return;
     
-    /* TODO: Add spinlock for SMP safety */
-    skb->next = pool->free_list;
-    pool->free_list = skb;
-    pool->free++;
-    pool->freed++;
+    if (pool->id >= SKB_NR_POOLS) {
+        kmem_cache_free(pool->cache, skb);
+        return;
+    }
+    
+    unsigned long flags;
+    local_irq_save(flags);
+    skb_cpu_cache_t* cc = this_cpu_ptr(&skb_cache);
+    if (cc->count[pool->id] == SKB_CACHE_SIZE) {
+        skb_cache_drain(cc, pool);
+    }
+    cc->skbs[pool->id][cc->count[pool->id]++] = skb;
+    local_irq_restore(flags);
+}
+
+/* Default pool for a buffer of total_size bytes, headroom included */
+static skb_pool_t* skb_pool_for(uint32_t total_size) {
+    for (uint32_t i = 0; i < SKB_NR_POOLS; i++) {
+        if (default_pools[i]->cache && total_size <= default_pools[i]->size) {
+            return default_pools[i];
+        }
+    }
+    return NULL;
 }
 
 /* ==================== Core Allocation Functions ==================== */
@@ -142,119 +238,205 @@ sk_buff_t* alloc_skb_with_headroom(uint32_t size, uint32_t headroom, uint32_t pr
     uint32_t total_size = SKB_DATA_ALIGN(size + headroom);
     
     /* Try pool allocation for common sizes */
-    if (total_size <= 256 && small_skb_pool.free > 0) {
-        skb = skb_pool_alloc(&small_skb_pool);
-    } else if (total_size <= 1500 && medium_skb_pool.free > 0) {
-        skb = skb_pool_alloc(&medium_skb_pool);
-    } else if (total_size <= 9000 && large_skb_pool.free > 0) {
-        skb = skb_pool_alloc(&large_skb_pool);
+    skb_pool_t* pool = skb_pool_for(total_size);
+    if (pool) {
+        skb = skb_pool_alloc(pool);
+        if (skb) {
+            skb_reserve(skb, headroom);
+        }
     }
     
     /* Pool allocation failed or size doesn't match - allocate directly */
     if (!skb) {
-        global_skb_stats.pool_misses++;
-        
+        this_cpu_inc(skb_stats.pool_misses);
+    
         if (total_size > SKB_MAX_ALLOC) {
             kprintf("[SKB] Allocation too large: %u bytes\n", total_size);
-            global_skb_stats.oom_count++;
+            this_cpu_inc(skb_stats.oom_count);
             return NULL;
         }
-        
+    
         skb = (sk_buff_t*)kmalloc(sizeof(sk_buff_t));
         if (!skb) {
-            global_skb_stats.oom_count++;
+            this_cpu_inc(skb_stats.oom_count);
             return NULL;
         }
-        
-        uint8_t* data = (uint8_t*)kmalloc(total_size);
+    
+        uint8_t* data = (uint8_t*)kmalloc(total_size + sizeof(skb_shared_info_t));
         if (!data) {
             kfree(skb);
-            global_skb_stats.oom_count++;
+            this_cpu_inc(skb_stats.oom_count);
             return NULL;
         }
-        
+    
         memset(skb, 0, sizeof(sk_buff_t));
         skb->head = data;
         skb->data = data + headroom;
         skb->tail = data + headroom;
         skb->end = data + total_size;
         skb->truesize = total_size;
+        skb->users = 1;
+        skb_shinfo_init(skb);
     }
     
-    /* Initialize common fields */
-    skb->users = 1;
-    skb->cloned = 0;
-    skb->len = 0;
-    skb->data_len = 0;
     skb->priority = (priority & 0xF);
     
-    global_skb_stats.alloc_count++;
+    this_cpu_inc(skb_stats.alloc_count);
     
     return skb;
 }
 
-void free_skb(sk_buff_t* skb) {
-    if (!skb) return;
+uint32_t skb_alloc_batch(uint32_t size, sk_buff_t** skbs, uint32_t n) {
+    uint32_t total_size = SKB_DATA_ALIGN(size + SKB_MIN_HEADROOM);
+    skb_pool_t* pool = skb_pool_for(total_size);
+    uint32_t got = 0;
     
-    /* Check if this is from a pool */
-    uint32_t size = skb->truesize;
-    int from_pool = 0;
+    if (!skbs) return 0;
     
-    if (size == small_skb_pool.size) {
-        skb_pool_free(&small_skb_pool, skb);
-        from_pool = 1;
-    } else if (size == medium_skb_pool.size) {
-        skb_pool_free(&medium_skb_pool, skb);
-        from_pool = 1;
-    } else if (size == large_skb_pool.size) {
-        skb_pool_free(&large_skb_pool, skb);
-        from_pool = 1;
+    if (!pool) {
+        while (got < n && (skbs[got] = alloc_skb(size, 0)) != NULL) {
+            got++;
+        }
+        return got;
     }
     
-    /* Not from pool - free directly */
-    if (!from_pool) {
-        if (skb->head) {
-            kfree(skb->head);
+    /* Take the whole batch under one interrupt-off section */
+    unsigned long flags;
+    local_irq_save(flags);
+    skb_cpu_cache_t* cc = this_cpu_ptr(&skb_cache);
+    while (got < n) {
+        if (cc->count[pool->id] == 0) {
+            skb_cache_refill(cc, pool);
+            if (cc->count[pool->id] == 0) break;
         }
-        kfree(skb);
+        skbs[got++] = cc->skbs[pool->id][--cc->count[pool->id]];
+    }
+    local_irq_restore(flags);
+    
+    for (uint32_t i = 0; i < got; i++) {
+        skb_pool_prep(pool, skbs[i]);
+        skb_reserve(skbs[i], SKB_MIN_HEADROOM);
+    }
+    
+    this_cpu_add(skb_stats.pool_hits, got);
+    this_cpu_add(skb_stats.alloc_count, got);
+    
+    /* Short of memory for the pool; let the caller see how far it got */
+    if (got < n) {
+        this_cpu_inc(skb_stats.oom_count);
     }
     
-    global_skb_stats.free_count++;
+    return got;
 }
 
-void kfree_skb(sk_buff_t* skb) {
-    if (!skb) return;
+/*
+ * Drop a reference. On the last one, run the destructor and release the
+ * data; returns true if the header itself still has to be freed.
+ */
+static bool skb_release(sk_buff_t* skb) {
+    if (__atomic_sub_fetch(&skb->users, 1, __ATOMIC_ACQ_REL) != 0) {
+        return false;
+    }
     
-    /* Call destructor if present */
     if (skb->destructor) {
         skb->destructor(skb);
     }
     
+    if (skb->orig) {
+        /* Clone: the data belongs to the original */
+        free_skb(skb->orig);
+    } else {
+        skb_shared_info_t* shinfo = skb_shinfo(skb);
+        for (uint32_t i = 0; shinfo && i < shinfo->nr_frags; i++) {
+            page_cache_release(shinfo->frags[i].page);
+        }
+        if (shinfo && shinfo->frag_list) {
+            kfree_skb_list(shinfo->frag_list);
+        }
+        if (!skb->pool && skb->head) {
+            kfree(skb->head);
+        }
+    }
+    
+    this_cpu_inc(skb_stats.free_count);
+    return true;
+}
+
+void free_skb(sk_buff_t* skb) {
+    if (!skb) return;
+    
+    if (!skb_release(skb)) {
+        return;
+    }
+    
+    if (skb->pool) {
+        skb_pool_free(skb->pool, skb);
+    } else {
+        kfree(skb);
+    }
+}
+
+void kfree_skb(sk_buff_t* skb) {
     free_skb(skb);
 }
 
+void kfree_skb_list(sk_buff_t* list) {
+    sk_buff_t* cached[SKB_NR_POOLS] = { NULL };
+    uint32_t nr_cached[SKB_NR_POOLS] = { 0 };
+    
+    /* Release everything, setting aside headers bound for a CPU cache */
+    while (list) {
+        sk_buff_t* skb = list;
+        list = list->next;
+    
+        if (!skb_release(skb)) {
+            continue;
+        }
+    
+        if (skb->pool && skb->pool->id < SKB_NR_POOLS) {
+            skb->next = cached[skb->pool->id];
+            cached[skb->pool->id] = skb;
+            nr_cached[skb->pool->id]++;
+        } else if (skb->pool) {
+            skb_pool_free(skb->pool, skb);
+        } else {
+            kfree(skb);
+        }
+    }
+    
+    /* Then put those back under one interrupt-off section */
+    unsigned long flags;
+    local_irq_save(flags);
+    skb_cpu_cache_t* cc = this_cpu_ptr(&skb_cache);
+    for (uint32_t id = 0; id < SKB_NR_POOLS; id++) {
+        if (!nr_cached[id]) continue;
+        while (cached[id]) {
+            sk_buff_t* skb = cached[id];
+            cached[id] = skb->next;
+            if (cc->count[id] == SKB_CACHE_SIZE) {
+                skb_cache_drain(cc, default_pools[id]);
+            }
+            cc->skbs[id][cc->count[id]++] = skb;
+        }
+    }
+    local_irq_restore(flags);
+}
+
 /* ==================== Reference Counting ==================== */
 
 sk_buff_t* skb_get(sk_buff_t* skb) {
     if (skb) {
-        skb->users++;
+        __atomic_add_fetch(&skb->users, 1, __ATOMIC_RELAXED);
     }
     return skb;
 }
 
 void skb_put_ref(sk_buff_t* skb) {
-    if (!skb) return;
-    
-    if (skb->users > 0) {
-        skb->users--;
-        if (skb->users == 0) {
-            kfree_skb(skb);
-        }
-    }
+    free_skb(skb);
 }
 
 int skb_shared(const sk_buff_t* skb) {
-    return skb && skb->users > 1;
+    return skb && __atomic_load_n(&skb->users, __ATOMIC_RELAXED) > 1;
 }
 
 /* ==================== Cloning and Copying ==================== */
@@ -264,19 +446,26 @@ sk_buff_t* skb_clone(sk_buff_t* skb, uint32_t priority) {
     
     sk_buff_t* clone = (sk_buff_t*)kmalloc(sizeof(sk_buff_t));
     if (!clone) {
-        global_skb_stats.oom_count++;
+        this_cpu_inc(skb_stats.oom_count);
         return NULL;
     }
     
     /* Copy structure */
     memcpy(clone, skb, sizeof(sk_buff_t));
     
-    /* Share the data buffer */
+    /* Share the data buffer and frags; the clone pins the buffer that
+     * owns them, and neither side may change them in place any more */
+    clone->orig = skb->orig ? skb->orig : skb;
+    skb_get(clone->orig);
+    skb->cloned = 1;
+    clone->pool = NULL;
+    clone->next = NULL;
+    clone->prev = NULL;
+    clone->destructor = NULL;
     clone->cloned = 1;
     clone->users = 1;
-    skb->users++;  /* Original buffer reference */
     
-    global_skb_stats.clone_count++;
+    this_cpu_inc(skb_stats.clone_count);
     
     return clone;
 }
@@ -292,23 +481,61 @@ sk_buff_t* skb_copy(const sk_buff_t* skb, uint32_t priority) {
     /* Reserve headroom */
     skb_reserve(copy, skb_headroom(skb));
     
-    /* Copy data */
-    memcpy(skb_put(copy, skb->len), skb->data, skb->len);
+    /* Copy data, frags included; the copy is linear */
+    skb_copy_bits(skb, 0, skb_put(copy, skb->len), skb->len);
     
     /* Copy metadata */
     copy->protocol = skb->protocol;
     copy->pkt_type = skb->pkt_type;
     copy->priority = skb->priority;
     copy->dev = skb->dev;
+    copy->hash = skb->hash;
+    copy->flags |= skb->flags & SKB_FLAG_HASH;
     
-    global_skb_stats.copy_count++;
+    this_cpu_inc(skb_stats.copy_count);
     
     return copy;
 }
 
+/* Copy the linear part; the frags are shared, with page references */
 sk_buff_t* pskb_copy(sk_buff_t* skb, uint32_t priority) {
-    /* For now, same as full copy - can optimize later for nonlinear skbs */
-    return skb_copy(skb, priority);
+    if (!skb) return NULL;
+    
+    uint32_t headlen = skb_headlen(skb);
+    sk_buff_t* copy = alloc_skb(headlen + skb_headroom(skb), priority);
+    if (!copy) {
+        return NULL;
+    }
+    
+    skb_reserve(copy, skb_headroom(skb));
+    memcpy(skb_put(copy, headlen), skb->data, headlen);
+    
+    skb_shared_info_t* from = skb_shinfo(skb);
+    for (uint32_t i = 0; i < from->nr_frags; i++) {
+        page_cache_page_get(from->frags[i].page);
+        skb_add_frag(copy, from->frags[i].page, from->frags[i].offset, from->frags[i].size);
+    }
+    
+    sk_buff_t* last = NULL;
+    for (sk_buff_t* f = from->frag_list; f; f = f->next) {
+        sk_buff_t* clone = skb_clone(f, priority);
+        if (!clone) {
+            free_skb(copy);
+            return NULL;
+        }
+        skb_frag_list_append(copy, clone, &last);
+    }
+    
+    copy->protocol = skb->protocol;
+    copy->pkt_type = skb->pkt_type;
+    copy->priority = skb->priority;
+    copy->dev = skb->dev;
+    copy->hash = skb->hash;
+    copy->flags |= skb->flags & SKB_FLAG_HASH;
+    
+    this_cpu_inc(skb_stats.copy_count);
+    
+    return copy;
 }
 
 /* ==================== Data Manipulation ==================== */
@@ -355,10 +582,370 @@ void skb_reserve(sk_buff_t* skb, uint32_t len) {
 }
 
 void skb_trim(sk_buff_t* skb, uint32_t len) {
-    if (skb->len > len) {
-        skb->len = len;
+    if (skb->len <= len) return;
+    
+    uint32_t headlen = skb_headlen(skb);
+    
+    /* Drop or shorten the frags past len */
+    if (skb->data_len) {
+        skb_shared_info_t* shinfo = skb_shinfo(skb);
+        uint32_t pos = headlen;
+        uint32_t keep = 0;
+        
+        for (uint32_t i = 0; i < shinfo->nr_frags; i++) {
+            skb_frag_t* frag = &shinfo->frags[i];
+            if (pos >= len) {
+                page_cache_release(frag->page);
+                continue;
+            }
+            if (pos + frag->size > len) {
+                frag->size = len - pos;
+            }
+            pos += frag->size;
+            keep++;
+        }
+        shinfo->nr_frags = keep;
+        
+        /* Then the frag list: trim the buffer len falls in, free the rest */
+        sk_buff_t** pp = &shinfo->frag_list;
+        while (*pp && pos < len) {
+            if (pos + (*pp)->len > len) {
+                skb_trim(*pp, len - pos);
+            }
+            pos += (*pp)->len;
+            pp = &(*pp)->next;
+        }
+        kfree_skb_list(*pp);
+        *pp = NULL;
+        
+        skb->data_len = pos > headlen ? pos - headlen : 0;
+    }
+    
+    if (len < headlen) {
         skb->tail = skb->data + len;
     }
+    skb->len = len;
+}
+
+/* ==================== Paged Data ==================== */
+
+static inline uint8_t* skb_frag_address(const skb_frag_t* frag) {
+    return (uint8_t*)(uintptr_t)PHYS_TO_VIRT_DIRECT(frag->page->pa) + frag->offset;
+}
+
+int skb_add_frag(sk_buff_t* skb, page_cache_page_t* page, uint32_t offset, uint32_t size) {
+    if (!skb || !page || !skb->shinfo || size == 0) return -1;
+    
+    skb_shared_info_t* shinfo = skb_shinfo(skb);
+    skb_frag_t* last = shinfo->nr_frags ? &shinfo->frags[shinfo->nr_frags - 1] : NULL;
+    
+    if (last && last->page == page && last->offset + last->size == offset) {
+        /* Continues the last frag in the same page; it already has a reference */
+        last->size += size;
+        page_cache_release(page);
+    } else {
+        /* On failure the reference stays with the caller */
+        if (shinfo->nr_frags >= MAX_SKB_FRAGS) return -1;
+        
+        skb_frag_t* frag = &shinfo->frags[shinfo->nr_frags++];
+        frag->page = page;
+        frag->offset = offset;
+        frag->size = size;
+    }
+    
+    skb->len += size;
+    skb->data_len += size;
+    skb->truesize += size;
+    
+    return 0;
+}
+
+int skb_copy_bits(const sk_buff_t* skb, uint32_t offset, void* to, uint32_t len) {
+    if (!skb || offset + len > skb->len) return -1;
+    
+    uint8_t* dst = (uint8_t*)to;
+    uint32_t headlen = skb_headlen(skb);
+    
+    if (offset < headlen) {
+        uint32_t chunk = (len < headlen - offset) ? len : headlen - offset;
+        memcpy(dst, skb->data + offset, chunk);
+        dst += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    
+    uint32_t start = headlen;
+    skb_shared_info_t* shinfo = skb_shinfo(skb);
+    for (uint32_t i = 0; len > 0 && i < shinfo->nr_frags; i++) {
+        const skb_frag_t* frag = &shinfo->frags[i];
+        uint32_t end = start + frag->size;
+        
+        if (offset < end) {
+            uint32_t chunk = (len < end - offset) ? len : end - offset;
+            memcpy(dst, skb_frag_address(frag) + (offset - start), chunk);
+            dst += chunk;
+            offset += chunk;
+            len -= chunk;
+        }
+        start = end;
+    }
+    
+    for (const sk_buff_t* f = shinfo->frag_list; len > 0 && f; f = f->next) {
+        uint32_t end = start + f->len;
+        
+        if (offset < end) {
+            uint32_t chunk = (len < end - offset) ? len : end - offset;
+            skb_copy_bits(f, offset - start, dst, chunk);
+            dst += chunk;
+            offset += chunk;
+            len -= chunk;
+        }
+        start = end;
+    }
+    
+    return 0;
+}
+
+/* Chain frag onto skb's frag list, taking over the caller's reference.
+ * last caches the list tail across calls; start it at NULL. */
+void skb_frag_list_append(sk_buff_t* skb, sk_buff_t* frag, sk_buff_t** last) {
+    skb_shared_info_t* shinfo = skb_shinfo(skb);
+    sk_buff_t* tail = last ? *last : NULL;
+    
+    if (!tail) {
+        for (tail = shinfo->frag_list; tail && tail->next; tail = tail->next) {
+        }
+    }
+    
+    frag->next = NULL;
+    frag->prev = NULL;
+    if (tail) {
+        tail->next = frag;
+    } else {
+        shinfo->frag_list = frag;
+    }
+    if (last) {
+        *last = frag;
+    }
+    
+    skb->len += frag->len;
+    skb->data_len += frag->len;
+    skb->truesize += frag->truesize;
+}
+
+int skb_linearize(sk_buff_t* skb) {
+    if (!skb) return -1;
+    if (!skb->data_len) return 0;
+    
+    /* Frags shared with a clone cannot be pulled in place, and there is
+     * no growing a buffer in place; callers that cannot guarantee the
+     * tailroom take a linear skb_copy() instead */
+    if (skb->cloned || skb_tailroom(skb) < skb->data_len) return -1;
+    
+    skb_copy_bits(skb, skb_headlen(skb), skb->tail, skb->data_len);
+    
+    skb_shared_info_t* shinfo = skb_shinfo(skb);
+    for (uint32_t i = 0; i < shinfo->nr_frags; i++) {
+        page_cache_release(shinfo->frags[i].page);
+    }
+    shinfo->nr_frags = 0;
+    kfree_skb_list(shinfo->frag_list);
+    shinfo->frag_list = NULL;
+    
+    skb->tail += skb->data_len;
+    skb->data_len = 0;
+    
+    return 0;
+}
+
+/*
+ * Ones' complement sum over bytes in native 16-bit word order. A run that
+ * starts at an odd position of the summed range begins in the high byte.
+ */
+static uint32_t csum_bytes(uint32_t sum, const uint8_t* p, uint32_t len, int odd) {
+    uint64_t acc = sum;
+    
+    if (odd && len) {
+        acc += (uint32_t)*p++ << 8;
+        len--;
+    }
+    while (len > 1) {
+        acc += (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        acc += *p;
+    }
+    
+    while (acc >> 16) {
+        acc = (acc & 0xFFFF) + (acc >> 16);
+    }
+    return (uint32_t)acc;
+}
+
+/* done counts the bytes summed before this call, for the word position */
+static uint32_t skb_checksum_range(const sk_buff_t* skb, uint32_t off, uint32_t left,
+                                   uint32_t csum, uint32_t* done_out) {
+    uint32_t done = *done_out;
+    uint32_t headlen = skb_headlen(skb);
+    
+    if (off < headlen) {
+        uint32_t chunk = (left < headlen - off) ? left : headlen - off;
+        csum = csum_bytes(csum, skb->data + off, chunk, done & 1);
+        done += chunk;
+        off += chunk;
+        left -= chunk;
+    }
+    
+    uint32_t start = headlen;
+    skb_shared_info_t* shinfo = skb_shinfo(skb);
+    for (uint32_t i = 0; left > 0 && i < shinfo->nr_frags; i++) {
+        const skb_frag_t* frag = &shinfo->frags[i];
+        uint32_t end = start + frag->size;
+        
+        if (off < end) {
+            uint32_t chunk = (left < end - off) ? left : end - off;
+            csum = csum_bytes(csum, skb_frag_address(frag) + (off - start), chunk, done & 1);
+            done += chunk;
+            off += chunk;
+            left -= chunk;
+        }
+        start = end;
+    }
+    
+    for (const sk_buff_t* f = shinfo->frag_list; left > 0 && f; f = f->next) {
+        uint32_t end = start + f->len;
+        
+        if (off < end) {
+            uint32_t chunk = (left < end - off) ? left : end - off;
+            csum = skb_checksum_range(f, off - start, chunk, csum, &done);
+            off += chunk;
+            left -= chunk;
+        }
+        start = end;
+    }
+    
+    *done_out = done;
+    return csum;
+}
+
+uint32_t skb_checksum(const sk_buff_t* skb, int offset, int len, uint32_t csum) {
+    uint32_t done = 0;
+    
+    return skb_checksum_range(skb, (uint32_t)offset, (uint32_t)len, csum, &done);
+}
+
+uint32_t csum_partial(const void* buf, uint32_t len, uint32_t csum) {
+    return csum_bytes(csum, (const uint8_t*)buf, len, 0);
+}
+
+/* ==================== Flow Hashing ==================== */
+
+/* The key from the Microsoft RSS specification. Most NICs default to it,
+ * which keeps software and hardware hashes of a flow equal. */
+const uint8_t skb_rss_key[SKB_RSS_KEY_LEN] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* IPv4 addresses and ports: the longest input hashed */
+#define SKB_RSS_TUPLE_LEN   12
+
+/*
+ * Toeplitz hashing XORs in, for each set input bit, the 32 key bits
+ * starting at that bit's position. Per key, that is a fixed function of
+ * each input byte and its position, so skb_rss_key's is tabulated once
+ * and a 4-tuple hash costs 12 lookups.
+ */
+static uint32_t skb_rss_table[SKB_RSS_TUPLE_LEN][256];
+
+/* The 32 key bits starting at bit */
+static uint32_t toeplitz_window(const uint8_t* key, uint32_t bit) {
+    uint32_t byte = bit / 8;
+    uint32_t shift = bit % 8;
+    uint64_t v = ((uint64_t)key[byte] << 32) | ((uint64_t)key[byte + 1] << 24) |
+                 ((uint64_t)key[byte + 2] << 16) | ((uint64_t)key[byte + 3] << 8) |
+                 (uint64_t)key[byte + 4];
+    return (uint32_t)(v >> (8 - shift));
+}
+
+/* Bit-serial reference; key must be at least len + 4 bytes */
+uint32_t skb_toeplitz_hash(const uint8_t* key, const uint8_t* data, uint32_t len) {
+    uint32_t hash = 0;
+    
+    for (uint32_t i = 0; i < len; i++) {
+        for (uint32_t b = 0; b < 8; b++) {
+            if (data[i] & (0x80 >> b)) {
+                hash ^= toeplitz_window(key, i * 8 + b);
+            }
+        }
+    }
+    
+    return hash;
+}
+
+static void skb_rss_init(void) {
+    for (uint32_t i = 0; i < SKB_RSS_TUPLE_LEN; i++) {
+        for (uint32_t v = 0; v < 256; v++) {
+            uint8_t byte = (uint8_t)v;
+            uint32_t hash = 0;
+            for (uint32_t b = 0; b < 8; b++) {
+                if (byte & (0x80 >> b)) {
+                    hash ^= toeplitz_window(skb_rss_key, i * 8 + b);
+                }
+            }
+            skb_rss_table[i][v] = hash;
+        }
+    }
+}
+
+/*
+ * Copy the flow's identifying fields, in wire order, into tuple and
+ * return how many bytes that is. Fragments hash on addresses alone:
+ * only the first carries the ports, and all of a datagram's fragments
+ * must land on the same queue.
+ */
+static uint32_t skb_flow_tuple(const sk_buff_t* skb, uint8_t* tuple) {
+    const uint8_t* iph = skb->network_header ? skb->network_header : skb->data;
+    uint32_t avail = (uint32_t)(skb->data + skb_headlen(skb) - iph);
+    
+    if (avail < 20 || (iph[0] >> 4) != 4) {
+        return 0;
+    }
+    
+    memcpy(tuple, iph + 12, 8);     /* saddr, daddr */
+    
+    uint32_t ihl = (iph[0] & 0x0f) * 4;
+    uint16_t frag = (uint16_t)((iph[6] << 8) | iph[7]);
+    uint8_t proto = iph[9];
+    
+    if ((frag & 0x3fff) == 0 && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+        avail >= ihl + 4) {
+        memcpy(tuple + 8, iph + ihl, 4);  /* sport, dport */
+        return 12;
+    }
+    
+    return 8;
+}
+
+uint32_t skb_get_hash(sk_buff_t* skb) {
+    if (!skb) return 0;
+    if (skb->flags & SKB_FLAG_HASH) return skb->hash;
+    
+    uint8_t tuple[SKB_RSS_TUPLE_LEN];
+    uint32_t len = skb_flow_tuple(skb, tuple);
+    uint32_t hash = 0;
+    
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= skb_rss_table[i][tuple[i]];
+    }
+    
+    skb_set_hash(skb, hash);
+    return hash;
 }
 
 /* ==================== Header Manipulation ==================== */
@@ -489,10 +1076,15 @@ sk_buff_t* skb_peek_tail(sk_buff_head_t* list) {
 void skb_queue_purge(sk_buff_head_t* list) {
     if (!list) return;
     
+    /* Unlink into a chain, then free it in one go */
+    sk_buff_t* chain = NULL;
+    sk_buff_t** tail = &chain;
     sk_buff_t* skb;
     while ((skb = skb_dequeue(list)) != NULL) {
-        kfree_skb(skb);
+        *tail = skb;
+        tail = &skb->next;
     }
+    kfree_skb_list(chain);
 }
 
 uint32_t skb_queue_len(const sk_buff_head_t* list) {
@@ -507,12 +1099,12 @@ int skb_queue_empty(const sk_buff_head_t* list) {
 
 void skb_get_stats(skb_stats_t* stats) {
     if (stats) {
-        memcpy(stats, &global_skb_stats, sizeof(skb_stats_t));
+        percpu_sum_u64(&skb_stats, sizeof(skb_stats), stats);
     }
 }
 
 void skb_reset_stats(void) {
-    memset(&global_skb_stats, 0, sizeof(skb_stats_t));
+    percpu_zero(&skb_stats, sizeof(skb_stats));
 }
 
 void skb_dump(const sk_buff_t* skb) {
@@ -530,8 +1122,9 @@ void skb_dump(const sk_buff_t* skb) {
             skb->users, skb->cloned, skb->priority);
     kprintf("  protocol=0x%04x pkt_type=%u\n",
             skb->protocol, skb->pkt_type);
-    kprintf("  headroom=%u tailroom=%u\n",
-            skb_headroom(skb), skb_tailroom(skb));
+    kprintf("  headroom=%u tailroom=%u nr_frags=%u\n",
+            skb_headroom(skb), skb_tailroom(skb),
+            skb->shinfo ? skb->shinfo->nr_frags : 0);
 }
 
 int skb_validate(const sk_buff_t* skb) {
@@ -540,7 +1133,8 @@ int skb_validate(const sk_buff_t* skb) {
     if (skb->data < skb->head) return -1;
     if (skb->tail < skb->data) return -1;
     if (skb->end < skb->tail) return -1;
-    if (skb->len > (uint32_t)(skb->tail - skb->data)) return -1;
+    if (skb_headlen(skb) > (uint32_t)(skb->tail - skb->data)) return -1;
+    if (skb->data_len && (!skb->shinfo || !skb->shinfo->nr_frags)) return -1;
     return 0;
 }
 
@@ -550,22 +1144,25 @@ int skb_init(void) {
     kprintf("[SKB] Initializing socket buffer subsystem...\n");
     
     /* Initialize memory pools */
-    if (skb_pool_init(&small_skb_pool, 256, 256) < 0) {
+    if (skb_pool_setup(&small_skb_pool, "skbuff_256", 0, 256, 256) < 0) {
         kprintf("[SKB] Failed to initialize small pool\n");
         return -1;
     }
     
-    if (skb_pool_init(&medium_skb_pool, 512, 1500) < 0) {
+    if (skb_pool_setup(&medium_skb_pool, "skbuff_2048", 1, 512, 2048) < 0) {
         kprintf("[SKB] Failed to initialize medium pool\n");
         return -1;
     }
     
-    if (skb_pool_init(&large_skb_pool, 128, 9000) < 0) {
+    if (skb_pool_setup(&large_skb_pool, "skbuff_9216", 2, 128, 9216) < 0) {
         kprintf("[SKB] Failed to initialize large pool\n");
         return -1;
     }
     
-    kprintf("[SKB] Pools: small=256x256, medium=512x1500, large=128x9000\n");
+    skb_rss_init();
+    
+    kprintf("[SKB] Pools: small=256x256, medium=512x2048, large=128x9216, %u per CPU cached\n",
+            SKB_CACHE_SIZE);
     kprintf("[SKB] Socket buffer subsystem initialized\n");
     
     return 0;
@@ -578,11 +1175,13 @@ void skb_cleanup(void) {
     skb_pool_destroy(&medium_skb_pool);
     skb_pool_destroy(&large_skb_pool);
     
+    skb_stats_t stats;
+    skb_get_stats(&stats);
     kprintf("[SKB] Stats: alloc=%llu free=%llu clone=%llu copy=%llu\n",
-            global_skb_stats.alloc_count,
-            global_skb_stats.free_count,
-            global_skb_stats.clone_count,
-            global_skb_stats.copy_count);
+            stats.alloc_count,
+            stats.free_count,
+            stats.clone_count,
+            stats.copy_count);
     
     kprintf("[SKB] Socket buffer subsystem cleaned up\n");
 }
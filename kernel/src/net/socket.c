@@ -432,6 +432,57 @@ ssize_t send(int sockfd, const void* buf, size_t len, int flags) {
     return ret;
 }
 
+/*
+ * Send file data on a connected stream socket without copying it
+ * 
+ * @out_fd: Socket file descriptor
+ * @in_fd: File descriptor of the file to send
+ * @offset: Where to start reading and updated past the data sent, or
+ *          NULL to use and advance the file's own offset
+ * @count: Number of bytes to send
+ * @return: Number of bytes sent on success, negative on error
+ */
+ssize_t sendfile(int out_fd, int in_fd, uint64_t* offset, size_t count) {
+    extern file_t* fd_get_file(int fd);
+    socket_t* sock;
+    file_t* file;
+    ssize_t ret;
+    
+    sock = socket_get_by_fd(out_fd);
+    if (!sock) {
+        return -EBADF;
+    }
+    
+    file = fd_get_file(in_fd);
+    if (!file || !file->vn) {
+        return -EBADF;
+    }
+    
+    /* Only TCP sends straight from the page cache */
+    if (sock->type != SOCK_STREAM) {
+        return -EINVAL;
+    }
+    
+    if (sock->state != SS_CONNECTED) {
+        return -ENOTCONN;
+    }
+    
+    uint64_t pos = offset ? *offset : file->offset;
+    
+    ret = tcp_sendfile(sock->tcp_sock, file->vn, &pos, count);
+    
+    if (ret > 0) {
+        sock->bytes_sent += ret;
+        if (offset) {
+            *offset = pos;
+        } else {
+            file->offset = pos;
+        }
+    }
+    
+    return ret;
+}
+
 /*
  * Receive data from a connected socket
  * 
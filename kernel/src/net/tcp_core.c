@@ -9,18 +9,24 @@
 
 #include "net/tcp_full.h"
 #include "net/ip.h"
+#include "net/netdevice.h"
 #include "kernel.h"
+#include "spinlock.h"
+#include "rcu.h"
 #include <string.h>
 
-/* Global TCP state */
+/* Global TCP state. The hash chains are RCU lists: the receive path
+ * looks sockets up without locking, hash_lock serialises updates. */
 static struct {
     tcp_sock_t* listen_hash[256];   /* Listening sockets hash table */
     tcp_sock_t* conn_hash[1024];    /* Connected sockets hash table */
     uint32_t isn_secret;            /* ISN generation secret */
     tcp_stats_t stats;              /* Global statistics */
-    uint32_t lock;                  /* Global lock */
+    spinlock_t hash_lock;           /* Hash table writers */
 } tcp_state;
 
+static void tcp_socket_free_rcu(struct rcu_head* head);
+
 /* State name strings for debugging */
 static const char* tcp_state_names[TCP_MAX_STATES] = {
     "CLOSED",
@@ -56,6 +62,7 @@ tcp_sock_t* tcp_socket_create(void) {
     
     /* Initialize state */
     sk->state = TCP_CLOSED;
+    sk->refcnt = 1;             /* Dropped by tcp_socket_destroy() */
     
     /* Initialize queues */
     skb_queue_head_init(&sk->write_queue);
@@ -82,8 +89,35 @@ void tcp_socket_destroy(tcp_sock_t* sk) {
     
     kprintf("[TCP] Destroying socket %p state=%s\n", sk, tcp_state_str(sk->state));
     
-    /* Remove from hash tables */
+    /* Remove from hash tables; lookups in progress keep their references */
     tcp_unhash(sk);
+    netdev_rfs_forget(sk->rxhash);
+    tcp_sock_put(sk);
+}
+
+/* Lookups that found the socket just before it was unhashed may still be
+ * about to try for a reference, so the memory outlives a grace period */
+void tcp_sock_put(tcp_sock_t* sk) {
+    if (__atomic_sub_fetch(&sk->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        call_rcu(&sk->rcu, tcp_socket_free_rcu);
+    }
+}
+
+/* Only valid inside a read-side section, where sk's memory is stable */
+static bool tcp_sock_get_unless_zero(tcp_sock_t* sk) {
+    uint32_t ref = __atomic_load_n(&sk->refcnt, __ATOMIC_RELAXED);
+    
+    do {
+        if (ref == 0) {
+            return false;       /* Already on its way to being freed */
+        }
+    } while (!__atomic_compare_exchange_n(&sk->refcnt, &ref, ref + 1, false,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static void tcp_socket_free_rcu(struct rcu_head* head) {
+    tcp_sock_t* sk = container_of(head, tcp_sock_t, rcu);
     
     /* Free queues */
     skb_queue_purge(&sk->write_queue);
@@ -121,9 +155,12 @@ int tcp_bind(tcp_sock_t* sk, ipv4_addr_t addr, uint16_t port) {
     
     /* Check if port is already in use */
     tcp_sock_t* existing = tcp_lookup_listen(addr, port);
-    if (existing && !sk->reuse_addr) {
-        kprintf("[TCP] Port %u already in use\n", port);
-        return -1;
+    if (existing) {
+        tcp_sock_put(existing);
+        if (!sk->reuse_addr) {
+            kprintf("[TCP] Port %u already in use\n", port);
+            return -1;
+        }
     }
     
     sk->local_addr = addr;
@@ -339,90 +376,88 @@ static uint32_t tcp_hash_func(ipv4_addr_t addr, uint16_t port) {
     return (addr ^ port) & 0x3FF;  /* 1024 buckets */
 }
 
+static tcp_sock_t** tcp_hash_bucket(tcp_sock_t* sk) {
+    if (sk->state == TCP_LISTEN) {
+        return &tcp_state.listen_hash[tcp_hash_func(sk->local_addr, sk->local_port) & 0xFF];
+    }
+    return &tcp_state.conn_hash[tcp_hash_func(sk->local_addr ^ sk->remote_addr,
+                                              sk->local_port ^ sk->remote_port)];
+}
+
 void tcp_hash(tcp_sock_t* sk) {
     if (!sk) return;
     
-    if (sk->state == TCP_LISTEN) {
-        /* Add to listen hash */
-        uint32_t hash = tcp_hash_func(sk->local_addr, sk->local_port) & 0xFF;
-        sk->hash_next = tcp_state.listen_hash[hash];
-        if (tcp_state.listen_hash[hash]) {
-            tcp_state.listen_hash[hash]->hash_prev = sk;
-        }
-        tcp_state.listen_hash[hash] = sk;
-        sk->hash_prev = NULL;
-    } else {
-        /* Add to connection hash */
-        uint32_t hash = tcp_hash_func(sk->local_addr ^ sk->remote_addr,
-                                      sk->local_port ^ sk->remote_port);
-        sk->hash_next = tcp_state.conn_hash[hash];
-        if (tcp_state.conn_hash[hash]) {
-            tcp_state.conn_hash[hash]->hash_prev = sk;
-        }
-        tcp_state.conn_hash[hash] = sk;
-        sk->hash_prev = NULL;
+    spin_lock(&tcp_state.hash_lock);
+    
+    tcp_sock_t** bucket = tcp_hash_bucket(sk);
+    if (*bucket) {
+        (*bucket)->hash_prev = sk;
     }
+    sk->hash_prev = NULL;
+    rcu_chain_insert(bucket, sk, hash_next);
+    
+    spin_unlock(&tcp_state.hash_lock);
 }
 
 void tcp_unhash(tcp_sock_t* sk) {
     if (!sk) return;
     
+    spin_lock(&tcp_state.hash_lock);
+    
+    tcp_sock_t** bucket = tcp_hash_bucket(sk);
     if (sk->hash_prev) {
-        sk->hash_prev->hash_next = sk->hash_next;
-    } else {
-        /* Head of list */
-        if (sk->state == TCP_LISTEN) {
-            uint32_t hash = tcp_hash_func(sk->local_addr, sk->local_port) & 0xFF;
-            if (tcp_state.listen_hash[hash] == sk) {
-                tcp_state.listen_hash[hash] = sk->hash_next;
-            }
-        } else {
-            uint32_t hash = tcp_hash_func(sk->local_addr ^ sk->remote_addr,
-                                          sk->local_port ^ sk->remote_port);
-            if (tcp_state.conn_hash[hash] == sk) {
-                tcp_state.conn_hash[hash] = sk->hash_next;
-            }
-        }
+        rcu_chain_del(&sk->hash_prev->hash_next, sk, hash_next);
+    } else if (*bucket == sk) {
+        rcu_chain_del(bucket, sk, hash_next);
     }
     
     if (sk->hash_next) {
         sk->hash_next->hash_prev = sk->hash_prev;
     }
     
-    sk->hash_next = NULL;
+    /* hash_next stays valid for lookups still standing on sk */
     sk->hash_prev = NULL;
+    
+    spin_unlock(&tcp_state.hash_lock);
 }
 
+/* Lookups walk the chains under rcu_read_lock() and take a reference
+ * before leaving it; a socket being destroyed (refcnt already zero) is
+ * skipped as if it had been unhashed */
 tcp_sock_t* tcp_lookup(ipv4_addr_t saddr, uint16_t sport, ipv4_addr_t daddr, uint16_t dport) {
     uint32_t hash = tcp_hash_func(daddr ^ saddr, dport ^ sport);
-    tcp_sock_t* sk = tcp_state.conn_hash[hash];
+    tcp_sock_t* sk;
     
-    while (sk) {
+    rcu_read_lock();
+    rcu_chain_for_each(sk, tcp_state.conn_hash[hash], hash_next) {
         if (sk->local_addr == daddr &&
             sk->local_port == dport &&
             sk->remote_addr == saddr &&
-            sk->remote_port == sport) {
-            return sk;
+            sk->remote_port == sport &&
+            tcp_sock_get_unless_zero(sk)) {
+            break;
         }
-        sk = sk->hash_next;
     }
+    rcu_read_unlock();
     
-    return NULL;
+    return sk;
 }
 
 tcp_sock_t* tcp_lookup_listen(ipv4_addr_t daddr, uint16_t dport) {
     uint32_t hash = tcp_hash_func(daddr, dport) & 0xFF;
-    tcp_sock_t* sk = tcp_state.listen_hash[hash];
+    tcp_sock_t* sk;
     
-    while (sk) {
+    rcu_read_lock();
+    rcu_chain_for_each(sk, tcp_state.listen_hash[hash], hash_next) {
         if (sk->local_port == dport &&
-            (sk->local_addr == 0 || sk->local_addr == daddr)) {
-            return sk;
+            (sk->local_addr == 0 || sk->local_addr == daddr) &&
+            tcp_sock_get_unless_zero(sk)) {
+            break;
         }
-        sk = sk->hash_next;
     }
+    rcu_read_unlock();
     
-    return NULL;
+    return sk;
 }
 
 /* ==================== Utilities ==================== */
@@ -478,6 +513,7 @@ int tcp_init(void) {
     /* Initialize hash tables */
     memset(tcp_state.listen_hash, 0, sizeof(tcp_state.listen_hash));
     memset(tcp_state.conn_hash, 0, sizeof(tcp_state.conn_hash));
+    spin_lock_init(&tcp_state.hash_lock);
     
     /* Generate ISN secret */
     tcp_state.isn_secret = get_ticks() ^ 0xDEADBEEF;  /* Simple randomization */
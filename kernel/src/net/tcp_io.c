@@ -9,19 +9,40 @@
 #include "net/tcp_full.h"
 #include "net/ip.h"
 #include "net/skbuff.h"
+#include "net/netdevice.h"
 #include "kernel.h"
+#include "page_cache.h"
 #include <string.h>
 
+/* Headers pushed in front of a segment: TCP + IP + Ethernet */
+#define TCP_MAX_HEADER      (sizeof(tcphdr_t) + sizeof(iphdr_t) + 14)
+
+/* Page-cache pages sendfile holds at a time */
+#define TCP_SENDFILE_PAGES  16
+
+/* Largest super-segment: what one IP header's length can describe. It is
+ * cut into MSS-sized segments at the device, see skb_gso_segment(). */
+#define TCP_GSO_MAX_SIZE    (65535 - 40)
+
+/* Copied data goes into buffers of this size, chained on a frag list */
+#define TCP_SEND_CHUNK      8192
+
 /* ==================== Packet Transmission ==================== */
 
 int tcp_transmit_skb(tcp_sock_t* sk, struct sk_buff* skb, uint32_t seq, uint32_t ack, uint16_t flags) {
     if (!sk || !skb) return -1;
     
-    /* Reserve space for headers */
-    skb_reserve(skb, sizeof(tcphdr_t) + sizeof(iphdr_t) + 14);  /* TCP + IP + Ethernet */
+    /* Headers go into the headroom alloc_skb() leaves; the payload may
+     * already be in place, linear or in frags */
+    if (skb_headroom(skb) < TCP_MAX_HEADER) {
+        kprintf("[TCP] No headroom for headers\n");
+        free_skb(skb);
+        return -1;
+    }
     
     /* Build TCP header */
     tcphdr_t* th = (tcphdr_t*)skb_push(skb, sizeof(tcphdr_t));
+    skb_reset_transport_header(skb);
     memset(th, 0, sizeof(tcphdr_t));
     
     th->source = htons(sk->local_port);
@@ -39,8 +60,9 @@ int tcp_transmit_skb(tcp_sock_t* sk, struct sk_buff* skb, uint32_t seq, uint32_t
     if (flags & TCP_FLAG_ACK) th->ack = 1;
     if (flags & TCP_FLAG_URG) th->urg = 1;
     
-    /* Calculate checksum */
-    th->check = tcp_checksum(sk, skb);
+    /* Calculate checksum; each piece of a super-segment gets its own
+     * when it is cut up */
+    th->check = skb_is_gso(skb) ? 0 : tcp_checksum(sk, skb);
     
     /* Set skb metadata */
     skb->protocol = IPPROTO_TCP;
@@ -138,30 +160,35 @@ int tcp_send_reset(tcp_sock_t* sk, uint32_t seq, uint32_t ack) {
     return tcp_transmit_skb(sk, skb, seq, ack, flags);
 }
 
-int tcp_send_data(tcp_sock_t* sk, const void* data, uint32_t len, uint16_t flags) {
-    if (!sk || !data || len == 0) return -1;
-    
+/* Room for new data in the send window, or 0 if data may not be sent */
+static uint32_t tcp_send_window(tcp_sock_t* sk) {
     if (sk->state != TCP_ESTABLISHED && sk->state != TCP_CLOSE_WAIT) {
         kprintf("[TCP] Cannot send data in state %s\n", tcp_state_str(sk->state));
-        return -1;
+        return 0;
     }
     
-    /* Check window */
-    uint32_t window = sk->snd_una + sk->snd_wnd - sk->snd_nxt;
-    if (window == 0) {
-        kprintf("[TCP] Send window closed\n");
-        return -2;  /* Window full */
-    }
-    
-    /* Limit to MSS and window */
-    if (len > sk->mss) len = sk->mss;
+    return sk->snd_una + sk->snd_wnd - sk->snd_nxt;
+}
+
+/* How much of len to put in the next super-segment: whole MSS-sized
+ * segments where possible, so only the last of a run can be short */
+static uint32_t tcp_send_goal(tcp_sock_t* sk, uint32_t len, uint32_t window) {
+    if (len > TCP_GSO_MAX_SIZE) len = TCP_GSO_MAX_SIZE;
     if (len > window) len = window;
+    if (len > sk->mss) len -= len % sk->mss;
     
-    /* Allocate skb and copy data */
-    struct sk_buff* skb = alloc_skb(len, 0);
-    if (!skb) return -1;
-    
-    memcpy(skb_put(skb, len), data, len);
+    return len;
+}
+
+/* Transmit a data segment whose len payload bytes are in place. Over
+ * one MSS, it goes down as a super-segment of MSS-sized pieces. */
+static int tcp_send_segment(tcp_sock_t* sk, struct sk_buff* skb, uint32_t len, uint16_t flags) {
+    if (len > sk->mss) {
+        skb_shared_info_t* shinfo = skb_shinfo(skb);
+        shinfo->gso_size = sk->mss;
+        shinfo->gso_segs = (uint16_t)((len + sk->mss - 1) / sk->mss);
+        shinfo->gso_type = SKB_GSO_TCPV4;
+    }
     
     /* Add PSH flag if requested */
     if (flags & TCP_FLAG_PSH) {
@@ -170,6 +197,9 @@ int tcp_send_data(tcp_sock_t* sk, const void* data, uint32_t len, uint16_t flags
         flags = TCP_FLAG_ACK;
     }
     
+    /* The IP layer consumes the skb either way; keep it for the
+     * retransmission queue */
+    skb_get(skb);
     int ret = tcp_transmit_skb(sk, skb, sk->snd_nxt, sk->rcv_nxt, flags);
     
     if (ret == 0) {
@@ -186,13 +216,159 @@ int tcp_send_data(tcp_sock_t* sk, const void* data, uint32_t len, uint16_t flags
         
         /* Update congestion window */
         tcp_ca_on_data_sent(sk, len);
-    } else {
-        free_skb(skb);
     }
     
+    free_skb(skb);
+    return ret;
+}
+
+int tcp_send_data(tcp_sock_t* sk, const void* data, uint32_t len, uint16_t flags) {
+    if (!sk || !data || len == 0) return -1;
+    
+    /* Check window */
+    uint32_t window = tcp_send_window(sk);
+    if (window == 0) {
+        kprintf("[TCP] Send window closed\n");
+        return -2;  /* Window full */
+    }
+    
+    len = tcp_send_goal(sk, len, window);
+    
+    /* Copy the data into the head buffer and, past TCP_SEND_CHUNK, into
+     * further buffers on its frag list, so no allocation exceeds a pool */
+    uint32_t chunk = (len < TCP_SEND_CHUNK) ? len : TCP_SEND_CHUNK;
+    struct sk_buff* skb = alloc_skb(chunk, 0);
+    if (!skb) return -1;
+    
+    memcpy(skb_put(skb, chunk), data, chunk);
+    
+    struct sk_buff* last = NULL;
+    for (uint32_t off = chunk; off < len; off += chunk) {
+        chunk = (len - off < TCP_SEND_CHUNK) ? len - off : TCP_SEND_CHUNK;
+        struct sk_buff* frag = alloc_skb(chunk, 0);
+        if (!frag) {
+            /* Send what was copied, on an MSS boundary */
+            len = (off > sk->mss) ? off - off % sk->mss : off;
+            skb_trim(skb, len);
+            break;
+        }
+        memcpy(skb_put(frag, chunk), (const uint8_t*)data + off, chunk);
+        skb_frag_list_append(skb, frag, &last);
+    }
+    netdev_rfs_record(sk->rxhash);
+    
+    int ret = tcp_send_segment(sk, skb, len, flags);
+    
     return ret == 0 ? (int)len : ret;
 }
 
+/*
+ * Send len bytes starting offset bytes into pages[0] and running on
+ * through the following pages. Each segment is a header-only skb with
+ * the pages attached as frags, holding its own page references; the
+ * caller keeps its own. PSH goes on the last segment if requested.
+ */
+int tcp_sendpages(tcp_sock_t* sk, page_cache_page_t** pages, uint32_t offset,
+                  uint32_t len, uint16_t flags) {
+    if (!sk || !pages || len == 0) return -1;
+    
+    uint32_t sent = 0;
+    while (sent < len) {
+        uint32_t window = tcp_send_window(sk);
+        if (window == 0) {
+            break;
+        }
+        
+        uint32_t seg = tcp_send_goal(sk, len - sent, window);
+        
+        struct sk_buff* skb = alloc_skb(0, 0);
+        if (!skb) break;
+        
+        /* Attach the payload a page at a time */
+        uint32_t pos = offset + sent;
+        uint32_t attached = 0;
+        while (attached < seg) {
+            page_cache_page_t* pg = pages[pos / PAGE_SIZE];
+            uint32_t in_page = PAGE_SIZE - (pos % PAGE_SIZE);
+            uint32_t chunk = (seg - attached < in_page) ? seg - attached : in_page;
+            
+            page_cache_page_get(pg);
+            if (skb_add_frag(skb, pg, pos % PAGE_SIZE, chunk) < 0) {
+                page_cache_release(pg);
+                break;
+            }
+            pos += chunk;
+            attached += chunk;
+        }
+        
+        uint16_t seg_flags = (sent + attached == len) ? flags : 0;
+        if (attached == 0 || tcp_send_segment(sk, skb, attached, seg_flags) != 0) {
+            if (attached == 0) free_skb(skb);
+            break;
+        }
+        sent += attached;
+    }
+    
+    if (sent == 0) {
+        return tcp_send_window(sk) == 0 ? -2 : -1;
+    }
+    return (int)sent;
+}
+
+/*
+ * sendfile(): send up to count bytes of vn from *pos straight out of the
+ * page cache, advancing *pos past what was sent. The payload is never
+ * copied; segments reference the cached pages until they are acked.
+ */
+long tcp_sendfile(tcp_sock_t* sk, vnode_t* vn, uint64_t* pos, uint32_t count) {
+    if (!sk || !vn || !pos) return -1;
+    if (*pos >= vn->size) return 0;
+    if (count > vn->size - *pos) count = (uint32_t)(vn->size - *pos);
+    
+    page_cache_page_t* pages[TCP_SENDFILE_PAGES];
+    long total = 0;
+    
+    while (count > 0) {
+        uint64_t first = *pos / PAGE_SIZE;
+        uint32_t offset = (uint32_t)(*pos % PAGE_SIZE);
+        uint32_t chunk = TCP_SENDFILE_PAGES * PAGE_SIZE - offset;
+        if (chunk > count) chunk = count;
+        
+        /* Pin the pages this chunk spans, loading any that are not cached */
+        uint32_t nr = (offset + chunk + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint32_t got = 0;
+        int err = 0;
+        while (got < nr && (err = page_cache_get(vn, first + got, &pages[got], NULL)) == 0) {
+            got++;
+        }
+        if (got < nr) {
+            chunk = (got * PAGE_SIZE > offset) ? got * PAGE_SIZE - offset : 0;
+        }
+        
+        int sent = chunk ? tcp_sendpages(sk, pages, offset, chunk,
+                                         chunk == count ? TCP_FLAG_PSH : 0) : err;
+        
+        for (uint32_t i = 0; i < got; i++) {
+            page_cache_release(pages[i]);
+        }
+        
+        if (sent <= 0) {
+            return total ? total : sent;
+        }
+        
+        total += sent;
+        *pos += sent;
+        count -= sent;
+        
+        /* Window full, or a page could not be read */
+        if ((uint32_t)sent < chunk || got < nr) {
+            break;
+        }
+    }
+    
+    return total;
+}
+
 /* ==================== Packet Reception ==================== */
 
 void tcp_rcv(struct sk_buff* skb) {
@@ -252,8 +428,13 @@ void tcp_rcv(struct sk_buff* skb) {
     sk->segments_in++;
     sk->bytes_in += skb->len;
     
+    if (sk->state != TCP_LISTEN) {
+        sk->rxhash = skb_get_hash(skb);
+    }
+    
     /* Process based on state */
     tcp_process_segment(sk, skb, th, seq, ack, window);
+    tcp_sock_put(sk);
 }
 
 void tcp_process_segment(tcp_sock_t* sk, struct sk_buff* skb, tcphdr_t* th,
@@ -436,9 +617,12 @@ void tcp_process_syn_recv(tcp_sock_t* sk, struct sk_buff* skb, tcphdr_t* th,
     /* Add to listen queue for accept() */
     /* Find parent listening socket */
     tcp_sock_t* listen_sk = tcp_lookup_listen(sk->local_addr, sk->local_port);
-    if (listen_sk && listen_sk->listen.qlen < listen_sk->listen.max_qlen) {
-        listen_sk->listen.queue[listen_sk->listen.qlen++] = sk;
-        kprintf("[TCP] Added to listen queue (qlen=%u)\n", listen_sk->listen.qlen);
+    if (listen_sk) {
+        if (listen_sk->listen.qlen < listen_sk->listen.max_qlen) {
+            listen_sk->listen.queue[listen_sk->listen.qlen++] = sk;
+            kprintf("[TCP] Added to listen queue (qlen=%u)\n", listen_sk->listen.qlen);
+        }
+        tcp_sock_put(listen_sk);
     }
     
     /* Cancel retransmission timer */
@@ -479,9 +663,9 @@ void tcp_process_established(tcp_sock_t* sk, struct sk_buff* skb, tcphdr_t* th,
     /* Process data */
     if (data_len > 0) {
         if (seq == sk->rcv_nxt) {
-            /* In-order data */
-            uint8_t* data = (uint8_t*)th + (th->doff * 4);
-            tcp_queue_data(sk, data, data_len);
+            /* In-order data; after GRO it may run on into frags */
+            uint32_t offset = (uint32_t)((uint8_t*)th - skb->data) + th->doff * 4;
+            tcp_queue_data(sk, skb, offset, data_len);
             sk->rcv_nxt += data_len;
             
             /* Send ACK */
@@ -586,8 +770,9 @@ void tcp_process_time_wait(tcp_sock_t* sk, struct sk_buff* skb, tcphdr_t* th,
 
 /* ==================== Data Queue Management ==================== */
 
-void tcp_queue_data(tcp_sock_t* sk, const void* data, uint32_t len) {
-    if (!sk || !data || len == 0) return;
+/* Queue len bytes of skb's payload, from offset, for the reader */
+void tcp_queue_data(tcp_sock_t* sk, const struct sk_buff* skb, uint32_t offset, uint32_t len) {
+    if (!sk || !skb || len == 0) return;
     
     /* Allocate buffer */
     tcp_recv_buf_t* buf = (tcp_recv_buf_t*)kmalloc(sizeof(tcp_recv_buf_t));
@@ -602,7 +787,11 @@ void tcp_queue_data(tcp_sock_t* sk, const void* data, uint32_t len) {
         return;
     }
     
-    memcpy(buf->data, data, len);
+    if (skb_copy_bits(skb, offset, buf->data, len) < 0) {
+        kfree(buf->data);
+        kfree(buf);
+        return;
+    }
     buf->len = len;
     buf->next = NULL;
     
@@ -627,6 +816,9 @@ int tcp_read_data(tcp_sock_t* sk, void* buffer, uint32_t len) {
         return 0;  /* No data available */
     }
     
+    /* Have the flow's receive processing follow the reader */
+    netdev_rfs_record(sk->rxhash);
+    
     uint32_t copied = 0;
     uint8_t* dest = (uint8_t*)buffer;
     
@@ -656,31 +848,20 @@ int tcp_read_data(tcp_sock_t* sk, void* buffer, uint32_t len) {
 
 uint16_t tcp_checksum(tcp_sock_t* sk, struct sk_buff* skb) {
     /* Simplified checksum - should include pseudo-header */
-    tcphdr_t* th = (tcphdr_t*)skb->h.raw;
-    uint32_t sum = 0;
-    uint16_t* data = (uint16_t*)th;
-    uint32_t len = skb->len;
-    
-    /* Checksum TCP header and data */
-    while (len > 1) {
-        sum += *data++;
-        len -= 2;
-    }
-    
-    /* Add odd byte if present */
-    if (len == 1) {
-        sum += *((uint8_t*)data);
-    }
+    uint32_t offset = (uint32_t)(skb->transport_header - skb->data);
     
-    /* Fold to 16 bits */
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    }
+    /* Checksum TCP header and data, paged data included */
+    uint32_t sum = skb_checksum(skb, offset, skb->len - offset, 0);
     
     return ~sum;
 }
 
 int tcp_verify_checksum(struct sk_buff* skb) {
+    /* Checked by the device, or by GRO before merging */
+    if (skb->flags & SKB_FLAG_CHECKSUM_VALID) {
+        return 0;
+    }
+    
     /* TODO: Implement proper checksum verification */
     return 0;  /* Accept all for now */
 }
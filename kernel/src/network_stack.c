@@ -8,6 +8,12 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+/* No <sys/types.h> in the kernel; same definitions as net.h */
+typedef long ssize_t;
+typedef long off_t;
+
+static inline uint64_t rdtsc(void);
+
 // Network Protocol Support
 #define MAX_NETWORK_INTERFACES   64
 #define MAX_CONNECTIONS          10000000
@@ -1156,7 +1162,7 @@ int limitless_route_packet(uint32_t dest_addr, uint32_t *next_hop, uint32_t *out
 }
 
 // High-performance timestamp counter for network
-static inline uint64_t rdtsc() {
+static inline uint64_t rdtsc(void) {
     uint32_t low, high;
     #ifdef __GNUC__
     __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
@@ -1164,4 +1170,30 @@ static inline uint64_t rdtsc() {
     low = high = 0;
     #endif
     return ((uint64_t)high << 32) | low;
-}
\ No newline at end of file
+}
+
+/**
+ * Zero-Copy Networking - Real Implementation
+ * 
+ * Both send file data on a connected TCP socket straight from the page
+ * cache through the socket layer's sendfile() (tcp_sendfile underneath).
+ */
+extern ssize_t sendfile(int out_fd, int in_fd, uint64_t *offset, size_t count);
+
+int limitless_sendfile(int out_fd, int in_fd, off_t offset, size_t count) {
+    if (offset < 0) {
+        return -1;
+    }
+    
+    // Reads from offset and leaves the file position alone, like pread()
+    uint64_t pos = (uint64_t)offset;
+    return (int)sendfile(out_fd, in_fd, &pos, count);
+}
+
+/**
+ * Move len bytes from fd_in to fd_out. Only file-to-socket is supported;
+ * it consumes from, and advances, the file's own position.
+ */
+int limitless_splice(int fd_in, int fd_out, size_t len) {
+    return (int)sendfile(fd_out, fd_in, NULL, len);
+}
@@ -0,0 +1,1173 @@
+/*
+ * LimitlessOS - Page Cache
+ *
+ * Per-vnode radix trees of cached file pages with lock-free lookups,
+ * dirty/writeback tags and active/inactive LRU reclaim. The design notes
+ * live in page_cache.h.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "kernel.h"
+#include "vfs.h"
+#include "vmm.h"
+#include "page_cache.h"
+#include "writeback.h"
+#include "mm/mm.h"
+#include "mm/pmm_simple.h"
+#include "smp.h"
+
+#define PC_RADIX_SHIFT      6
+#define PC_RADIX_SLOTS      (1u << PC_RADIX_SHIFT)
+#define PC_RADIX_MASK       (PC_RADIX_SLOTS - 1)
+#define PC_MAPPING_HASH     256
+#define PC_LRU_BATCH        15      // Pages per per-CPU LRU batch
+#define PC_RECLAIM_BATCH    32      // Pages evicted at a time
+#define PC_AGE_BATCH        32      // Active pages aged per reclaim pass
+#define PC_WRITE_BATCH      16      // Dirty pages gathered per flush step
+
+typedef struct pc_node {
+    uint32_t shift;                         // Index bits below this level
+    uint32_t count;                         // Occupied slots
+    uint64_t tags[PAGE_CACHE_NR_TAGS];      // Slot bitmaps: subtree carries the tag
+    void *slots[PC_RADIX_SLOTS];            // Child nodes, or pages when shift == 0
+    struct pc_node *free_next;              // Released nodes awaiting reuse
+} pc_node_t;
+
+struct page_cache_mapping {
+    vnode_t *vn;
+    pc_node_t *root;
+    spinlock_t tree_lock;
+    uint64_t nr_pages;
+    uint64_t nr_dirty;
+    page_cache_mapping_t *hnext;            // Mapping hash chain
+    page_cache_mapping_t *free_next;        // Released mappings awaiting reuse
+};
+
+typedef struct {
+    page_cache_page_t *head;
+    page_cache_page_t *tail;
+    uint64_t count;
+} pc_lru_list_t;
+
+typedef struct {
+    uint32_t nr;
+    page_cache_page_t *pages[PC_LRU_BATCH];
+} pc_batch_t;
+
+static struct {
+    bool initialized;
+    size_t max_pages;
+    uint64_t nr_pages;
+    spinlock_t mapping_lock;
+    page_cache_mapping_t *mappings[PC_MAPPING_HASH];
+    page_cache_mapping_t *free_mappings;
+    spinlock_t lru_lock;
+    pc_lru_list_t active;
+    pc_lru_list_t inactive;
+    spinlock_t pool_lock;
+    page_cache_page_t *free_descs;
+    pc_node_t *free_nodes;
+    struct page_cache_stats stats;
+} pc;
+
+// Pages waiting to be put on the inactive list / moved to the active list
+static pc_batch_t lru_add_batch[MAX_CPUS];
+static pc_batch_t lru_activate_batch[MAX_CPUS];
+
+void page_cache_init(size_t max_pages) {
+    if (!max_pages) {
+        uint64_t total = 0;
+        pmm_get_stats(&total, NULL);
+        max_pages = total ? (size_t)(total / 2) : 1024;
+    }
+    pc.max_pages = max_pages;
+
+    if (pc.initialized) return;
+    spin_lock_init(&pc.mapping_lock);
+    spin_lock_init(&pc.lru_lock);
+    spin_lock_init(&pc.pool_lock);
+    pc.initialized = true;
+}
+
+static inline void pc_ensure_init(void) {
+    if (!pc.initialized) page_cache_init(0);
+}
+
+// --- Page descriptors ---
+
+// Descriptors are carved from whole pages and never handed back to the
+// page allocator, so a lockless reader holding a stale pointer always
+// finds a page_cache_page_t there
+static page_cache_page_t *desc_alloc(void) {
+    unsigned long flags;
+    spin_lock_irqsave(&pc.pool_lock, &flags);
+
+    if (!pc.free_descs) {
+        paddr_t page = pmm_alloc_page();
+        if (page) {
+            page_cache_page_t *d = (page_cache_page_t *)(uintptr_t)PHYS_TO_VIRT_DIRECT(page);
+            for (size_t i = 0; i < PAGE_SIZE / sizeof(*d); i++) {
+                d[i].refcnt = 0;
+                d[i].mapping = NULL;
+                d[i].lru_next = pc.free_descs;
+                pc.free_descs = &d[i];
+            }
+        }
+    }
+
+    page_cache_page_t *pg = pc.free_descs;
+    if (pg) pc.free_descs = pg->lru_next;
+
+    spin_unlock_irqrestore(&pc.pool_lock, flags);
+    return pg;
+}
+
+static void desc_free(page_cache_page_t *pg) {
+    unsigned long flags;
+    spin_lock_irqsave(&pc.pool_lock, &flags);
+    pg->lru_next = pc.free_descs;
+    pc.free_descs = pg;
+    spin_unlock_irqrestore(&pc.pool_lock, flags);
+}
+
+static bool page_get_unless_zero(page_cache_page_t *pg) {
+    uint32_t old = __atomic_load_n(&pg->refcnt, __ATOMIC_RELAXED);
+    do {
+        if (old == 0) return false;
+    } while (!__atomic_compare_exchange_n(&pg->refcnt, &old, old + 1, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
+
+static void page_free(page_cache_page_t *pg) {
+    pmm_free_page(pg->pa);
+    desc_free(pg);
+}
+
+void page_cache_page_get(page_cache_page_t *pg) {
+    __atomic_add_fetch(&pg->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void page_cache_release(page_cache_page_t *pg) {
+    if (pg && __atomic_sub_fetch(&pg->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        page_free(pg);
+    }
+}
+
+static void wait_unlocked(page_cache_page_t *pg) {
+    while (__atomic_load_n(&pg->flags, __ATOMIC_ACQUIRE) & PAGE_CACHE_LOCKED) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+// Lock the tree pg lives in; NULL once its vnode has been released and
+// the page detached (page_cache_evict_mapping)
+static page_cache_mapping_t *page_lock_tree(page_cache_page_t *pg, unsigned long *flags) {
+    page_cache_mapping_t *m = __atomic_load_n(&pg->mapping, __ATOMIC_ACQUIRE);
+    if (!m) return NULL;
+    spin_lock_irqsave(&m->tree_lock, flags);
+    if (pg->mapping != m) {
+        spin_unlock_irqrestore(&m->tree_lock, *flags);
+        return NULL;
+    }
+    return m;
+}
+
+// --- Radix tree ---
+
+// Like descriptors, nodes are never handed back to kmalloc: a lockless
+// reader may still be walking a tree that page_cache_evict_mapping() has
+// released. Released nodes have every slot cleared, so such a reader
+// finds either NULL or a slot published (with its shift) by the new owner.
+static pc_node_t *node_alloc(uint32_t shift) {
+    unsigned long flags;
+    spin_lock_irqsave(&pc.pool_lock, &flags);
+    pc_node_t *node = pc.free_nodes;
+    if (node) pc.free_nodes = node->free_next;
+    spin_unlock_irqrestore(&pc.pool_lock, flags);
+
+    if (!node) {
+        node = (pc_node_t *)kmalloc(sizeof(pc_node_t));
+        if (!node) return NULL;
+        memset(node, 0, sizeof(*node));
+    }
+    node->count = 0;
+    memset(node->tags, 0, sizeof(node->tags));
+    __atomic_store_n(&node->shift, shift, __ATOMIC_RELEASE);
+    return node;
+}
+
+static inline bool node_covers(const pc_node_t *node, uint64_t index) {
+    uint32_t bits = node->shift + PC_RADIX_SHIFT;
+    return bits >= 64 || (index >> bits) == 0;
+}
+
+// Lock-free: nodes are type-stable (node_alloc) and every slot is
+// published with a release store
+static page_cache_page_t *radix_lookup(page_cache_mapping_t *m, uint64_t index) {
+    pc_node_t *node = __atomic_load_n(&m->root, __ATOMIC_ACQUIRE);
+    if (!node || !node_covers(node, index)) return NULL;
+
+    for (;;) {
+        void *slot = __atomic_load_n(&node->slots[(index >> node->shift) & PC_RADIX_MASK],
+                                     __ATOMIC_ACQUIRE);
+        if (!slot || node->shift == 0) return (page_cache_page_t *)slot;
+        node = (pc_node_t *)slot;
+    }
+}
+
+// Make sure the leaf for index exists (tree lock held); nothing is
+// published that a reader could mistake for a page
+static pc_node_t *radix_extend(page_cache_mapping_t *m, uint64_t index) {
+    if (!m->root) {
+        pc_node_t *root = node_alloc(0);
+        if (!root) return NULL;
+        __atomic_store_n(&m->root, root, __ATOMIC_RELEASE);
+    }
+
+    // Grow upwards until the root covers index
+    while (!node_covers(m->root, index)) {
+        pc_node_t *top = node_alloc(m->root->shift + PC_RADIX_SHIFT);
+        if (!top) return NULL;
+        top->slots[0] = m->root;
+        top->count = 1;
+        for (int t = 0; t < PAGE_CACHE_NR_TAGS; t++) {
+            if (m->root->tags[t]) top->tags[t] = 1;
+        }
+        __atomic_store_n(&m->root, top, __ATOMIC_RELEASE);
+    }
+
+    pc_node_t *node = m->root;
+    while (node->shift) {
+        uint32_t off = (index >> node->shift) & PC_RADIX_MASK;
+        pc_node_t *child = (pc_node_t *)node->slots[off];
+        if (!child) {
+            child = node_alloc(node->shift - PC_RADIX_SHIFT);
+            if (!child) return NULL;
+            node->count++;
+            __atomic_store_n(&node->slots[off], child, __ATOMIC_RELEASE);
+        }
+        node = child;
+    }
+    return node;
+}
+
+#define PC_MAX_DEPTH    11      // ceil(64 / PC_RADIX_SHIFT)
+
+// Nodes from the root to the leaf holding index (tree lock held); 0 if absent
+static int radix_path(page_cache_mapping_t *m, uint64_t index, pc_node_t **path) {
+    pc_node_t *node = m->root;
+    if (!node || !node_covers(node, index)) return 0;
+
+    int depth = 0;
+    for (;;) {
+        path[depth++] = node;
+        if (node->shift == 0) {
+            return node->slots[index & PC_RADIX_MASK] ? depth : 0;
+        }
+        node = (pc_node_t *)node->slots[(index >> node->shift) & PC_RADIX_MASK];
+        if (!node) return 0;
+    }
+}
+
+static void tag_set(page_cache_mapping_t *m, uint64_t index, int tag) {
+    pc_node_t *path[PC_MAX_DEPTH];
+    int depth = radix_path(m, index, path);
+    for (int i = 0; i < depth; i++) {
+        path[i]->tags[tag] |= 1ull << ((index >> path[i]->shift) & PC_RADIX_MASK);
+    }
+}
+
+static void tag_clear_path(pc_node_t **path, int depth, uint64_t index, int tag) {
+    for (int i = depth - 1; i >= 0; i--) {
+        path[i]->tags[tag] &= ~(1ull << ((index >> path[i]->shift) & PC_RADIX_MASK));
+        // A tagged sibling keeps the bit set further up
+        if (path[i]->tags[tag]) break;
+    }
+}
+
+static void tag_clear(page_cache_mapping_t *m, uint64_t index, int tag) {
+    pc_node_t *path[PC_MAX_DEPTH];
+    int depth = radix_path(m, index, path);
+    if (depth) tag_clear_path(path, depth, index, tag);
+}
+
+// Tree lock held. Interior nodes stay in the tree: readers may be in them.
+// Only page_cache_evict_mapping() releases them, once the vnode is gone.
+static void radix_delete(page_cache_mapping_t *m, uint64_t index) {
+    pc_node_t *path[PC_MAX_DEPTH];
+    int depth = radix_path(m, index, path);
+    if (!depth) return;
+
+    for (int t = 0; t < PAGE_CACHE_NR_TAGS; t++) {
+        tag_clear_path(path, depth, index, t);
+    }
+
+    pc_node_t *leaf = path[depth - 1];
+    __atomic_store_n(&leaf->slots[index & PC_RADIX_MASK], NULL, __ATOMIC_RELEASE);
+    leaf->count--;
+}
+
+// Pages at index >= start in index order, optionally only those with tag
+// (tree lock held)
+static size_t radix_gang(pc_node_t *node, uint64_t base, uint64_t start, int tag,
+                         page_cache_page_t **out, size_t n, size_t max) {
+    for (uint32_t off = 0; off < PC_RADIX_SLOTS && n < max; off++) {
+        if (!node->slots[off]) continue;
+        if (tag >= 0 && !(node->tags[tag] & (1ull << off))) continue;
+
+        uint64_t first = base + ((uint64_t)off << node->shift);
+        uint64_t last = first + ((1ull << node->shift) - 1);
+        if (last < start) continue;
+
+        if (node->shift == 0) {
+            out[n++] = (page_cache_page_t *)node->slots[off];
+        } else {
+            n = radix_gang((pc_node_t *)node->slots[off], first, start, tag, out, n, max);
+        }
+    }
+    return n;
+}
+
+// Return a detached tree's nodes to the pool, emptied
+static void radix_free(pc_node_t *node) {
+    for (uint32_t off = 0; off < PC_RADIX_SLOTS; off++) {
+        void *slot = node->slots[off];
+        if (!slot) continue;
+        if (node->shift) radix_free((pc_node_t *)slot);
+        __atomic_store_n(&node->slots[off], NULL, __ATOMIC_RELEASE);
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&pc.pool_lock, &flags);
+    node->free_next = pc.free_nodes;
+    pc.free_nodes = node;
+    spin_unlock_irqrestore(&pc.pool_lock, flags);
+}
+
+// --- Mappings ---
+
+static inline uint32_t mapping_hash(vnode_t *vn) {
+    return (uint32_t)((uintptr_t)vn >> 4) & (PC_MAPPING_HASH - 1);
+}
+
+page_cache_mapping_t *page_cache_mapping(vnode_t *vn, bool create) {
+    if (!vn) return NULL;
+    pc_ensure_init();
+
+    // Mappings are never freed, only unlinked and reused, so the chain is
+    // walked without the lock; a walker on a released one may miss, not crash
+    uint32_t h = mapping_hash(vn);
+    page_cache_mapping_t *m = __atomic_load_n(&pc.mappings[h], __ATOMIC_ACQUIRE);
+    for (; m; m = m->hnext) {
+        if (m->vn == vn) return m;
+    }
+    if (!create) return NULL;
+
+    unsigned long flags;
+    spin_lock_irqsave(&pc.mapping_lock, &flags);
+
+    for (m = pc.mappings[h]; m; m = m->hnext) {
+        if (m->vn == vn) break;
+    }
+    if (!m) {
+        m = pc.free_mappings;
+        if (m) pc.free_mappings = m->free_next;
+        else m = (page_cache_mapping_t *)kmalloc(sizeof(page_cache_mapping_t));
+        if (m) {
+            memset(m, 0, sizeof(*m));
+            m->vn = vn;
+            spin_lock_init(&m->tree_lock);
+            m->hnext = pc.mappings[h];
+            __atomic_store_n(&pc.mappings[h], m, __ATOMIC_RELEASE);
+        }
+    }
+
+    spin_unlock_irqrestore(&pc.mapping_lock, flags);
+    return m;
+}
+
+// Lock-free lookup returning a referenced page
+static page_cache_page_t *mapping_find(page_cache_mapping_t *m, uint64_t index) {
+    for (;;) {
+        page_cache_page_t *pg = radix_lookup(m, index);
+        if (!pg) return NULL;
+
+        // Zero means it is being removed; the slot is about to change
+        if (!page_get_unless_zero(pg)) continue;
+
+        // The descriptor may have been freed and reused since the lookup
+        if (pg->mapping == m && pg->index == index) return pg;
+        page_cache_release(pg);
+    }
+}
+
+// --- LRU ---
+
+static void lru_del(pc_lru_list_t *list, page_cache_page_t *pg) {
+    if (pg->lru_prev) pg->lru_prev->lru_next = pg->lru_next;
+    else list->head = pg->lru_next;
+    if (pg->lru_next) pg->lru_next->lru_prev = pg->lru_prev;
+    else list->tail = pg->lru_prev;
+    pg->lru_prev = NULL;
+    pg->lru_next = NULL;
+    list->count--;
+}
+
+static void lru_add_head(pc_lru_list_t *list, page_cache_page_t *pg) {
+    pg->lru_prev = NULL;
+    pg->lru_next = list->head;
+    if (list->head) list->head->lru_prev = pg;
+    else list->tail = pg;
+    list->head = pg;
+    list->count++;
+}
+
+// Apply a CPU's pending batches under one LRU lock round trip
+static void lru_drain_cpu(uint32_t cpu) {
+    pc_batch_t *add = &lru_add_batch[cpu];
+    pc_batch_t *act = &lru_activate_batch[cpu];
+    if (!add->nr && !act->nr) return;
+
+    spin_lock(&pc.lru_lock);
+    for (uint32_t i = 0; i < add->nr; i++) {
+        page_cache_page_t *pg = add->pages[i];
+        // Detached while it waited: its last reference is the batch's
+        if (!__atomic_load_n(&pg->mapping, __ATOMIC_RELAXED)) continue;
+        uint32_t flags = __atomic_or_fetch(&pg->flags, PAGE_CACHE_LRU, __ATOMIC_RELAXED);
+        lru_add_head((flags & PAGE_CACHE_ACTIVE) ? &pc.active : &pc.inactive, pg);
+    }
+    for (uint32_t i = 0; i < act->nr; i++) {
+        page_cache_page_t *pg = act->pages[i];
+        uint32_t flags = __atomic_load_n(&pg->flags, __ATOMIC_RELAXED);
+        if ((flags & PAGE_CACHE_LRU) && !(flags & PAGE_CACHE_ACTIVE)) {
+            lru_del(&pc.inactive, pg);
+            __atomic_fetch_or(&pg->flags, PAGE_CACHE_ACTIVE, __ATOMIC_RELAXED);
+            lru_add_head(&pc.active, pg);
+            pc.stats.activations++;
+        }
+    }
+    spin_unlock(&pc.lru_lock);
+
+    // The batches held a reference so the pages could not go away meanwhile
+    for (uint32_t i = 0; i < add->nr; i++) page_cache_release(add->pages[i]);
+    for (uint32_t i = 0; i < act->nr; i++) page_cache_release(act->pages[i]);
+    add->nr = 0;
+    act->nr = 0;
+}
+
+static void lru_batch_add(pc_batch_t *batches, page_cache_page_t *pg) {
+    __atomic_add_fetch(&pg->refcnt, 1, __ATOMIC_RELAXED);
+
+    unsigned long flags;
+    local_irq_save(flags);
+
+    uint32_t cpu = smp_processor_id();
+    if (cpu >= MAX_CPUS) cpu = 0;
+
+    pc_batch_t *batch = &batches[cpu];
+    batch->pages[batch->nr++] = pg;
+    if (batch->nr == PC_LRU_BATCH) {
+        lru_drain_cpu(cpu);
+    }
+
+    local_irq_restore(flags);
+}
+
+static void lru_drain_local(void) {
+    unsigned long flags;
+    local_irq_save(flags);
+    uint32_t cpu = smp_processor_id();
+    lru_drain_cpu(cpu < MAX_CPUS ? cpu : 0);
+    local_irq_restore(flags);
+}
+
+void page_cache_mark_accessed(page_cache_page_t *pg) {
+    uint32_t flags = __atomic_load_n(&pg->flags, __ATOMIC_RELAXED);
+
+    // First touch only marks it; a second one while inactive promotes it
+    if (!(flags & PAGE_CACHE_REFERENCED)) {
+        __atomic_fetch_or(&pg->flags, PAGE_CACHE_REFERENCED, __ATOMIC_RELAXED);
+    } else if ((flags & PAGE_CACHE_LRU) && !(flags & PAGE_CACHE_ACTIVE)) {
+        __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_REFERENCED, __ATOMIC_RELAXED);
+        lru_batch_add(lru_activate_batch, pg);
+    }
+}
+
+// Move unreferenced pages from the active tail to the inactive list while
+// the inactive list is the shorter one (LRU lock held)
+static void lru_age_active(void) {
+    for (int n = 0; n < PC_AGE_BATCH && pc.active.tail && pc.inactive.count < pc.active.count; n++) {
+        page_cache_page_t *pg = pc.active.tail;
+        lru_del(&pc.active, pg);
+
+        uint32_t flags = __atomic_load_n(&pg->flags, __ATOMIC_RELAXED);
+        if (flags & PAGE_CACHE_REFERENCED) {
+            __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_REFERENCED, __ATOMIC_RELAXED);
+            lru_add_head(&pc.active, pg);
+            continue;
+        }
+
+        __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_ACTIVE, __ATOMIC_RELAXED);
+        lru_add_head(&pc.inactive, pg);
+        pc.stats.deactivations++;
+    }
+}
+
+// Take an unpinned, unmapped page out of its tree and free it. The caller
+// took it off the LRU and holds a reference besides the tree's; on false
+// it puts the page back and drops that reference.
+static bool page_remove(page_cache_page_t *pg) {
+    unsigned long flags;
+    page_cache_mapping_t *m = page_lock_tree(pg, &flags);
+    if (!m) {
+        // Its vnode was released meanwhile and the page is already out
+        page_cache_release(pg);
+        return true;
+    }
+
+    // Freeze the count at zero so lockless readers back off
+    uint32_t expected = 2;
+    if (!__atomic_compare_exchange_n(&pg->refcnt, &expected, 0, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        spin_unlock_irqrestore(&m->tree_lock, flags);
+        return false;
+    }
+
+    // Mapped after it was picked: it has to stay coherent with the mapping
+    if (pmm_page_refcount(pg->pa) > 1 ||
+        (__atomic_load_n(&pg->flags, __ATOMIC_RELAXED) & (PAGE_CACHE_DIRTY | PAGE_CACHE_WRITEBACK))) {
+        __atomic_store_n(&pg->refcnt, 2, __ATOMIC_RELEASE);
+        spin_unlock_irqrestore(&m->tree_lock, flags);
+        return false;
+    }
+
+    radix_delete(m, pg->index);
+    m->nr_pages--;
+    spin_unlock_irqrestore(&m->tree_lock, flags);
+
+    __atomic_sub_fetch(&pc.nr_pages, 1, __ATOMIC_RELAXED);
+    pc.stats.evictions++;
+    page_free(pg);
+    return true;
+}
+
+size_t page_cache_evict_some(size_t target) {
+    page_cache_page_t *victims[PC_RECLAIM_BATCH];
+    size_t evicted = 0;
+    size_t dirty_skipped = 0;
+
+    pc_ensure_init();
+    lru_drain_local();
+
+    while (evicted < target) {
+        size_t nr = 0;
+        size_t scan = PC_RECLAIM_BATCH * 4;
+        unsigned long flags;
+
+        spin_lock_irqsave(&pc.lru_lock, &flags);
+        lru_age_active();
+
+        while (nr < PC_RECLAIM_BATCH && nr < target - evicted && scan-- && pc.inactive.tail) {
+            page_cache_page_t *pg = pc.inactive.tail;
+            lru_del(&pc.inactive, pg);
+
+            uint32_t pg_flags = __atomic_load_n(&pg->flags, __ATOMIC_RELAXED);
+            if (pg_flags & PAGE_CACHE_REFERENCED) {
+                __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_REFERENCED, __ATOMIC_RELAXED);
+                __atomic_fetch_or(&pg->flags, PAGE_CACHE_ACTIVE, __ATOMIC_RELAXED);
+                lru_add_head(&pc.active, pg);
+                pc.stats.activations++;
+                continue;
+            }
+
+            if (pg_flags & (PAGE_CACHE_DIRTY | PAGE_CACHE_WRITEBACK)) dirty_skipped++;
+            if ((pg_flags & (PAGE_CACHE_DIRTY | PAGE_CACHE_WRITEBACK | PAGE_CACHE_LOCKED)) ||
+                __atomic_load_n(&pg->refcnt, __ATOMIC_RELAXED) != 1 ||
+                pmm_page_refcount(pg->pa) > 1) {
+                lru_add_head(&pc.inactive, pg);
+                continue;
+            }
+
+            __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_LRU, __ATOMIC_RELAXED);
+            page_cache_page_get(pg);
+            victims[nr++] = pg;
+        }
+
+        spin_unlock_irqrestore(&pc.lru_lock, flags);
+        if (nr == 0) break;
+
+        for (size_t i = 0; i < nr; i++) {
+            if (page_remove(victims[i])) {
+                evicted++;
+                continue;
+            }
+            // Pinned or mapped meanwhile: back to the inactive list
+            spin_lock_irqsave(&pc.lru_lock, &flags);
+            __atomic_fetch_or(&victims[i]->flags, PAGE_CACHE_LRU, __ATOMIC_RELAXED);
+            lru_add_head(&pc.inactive, victims[i]);
+            spin_unlock_irqrestore(&pc.lru_lock, flags);
+            page_cache_release(victims[i]);
+        }
+    }
+
+    // Clean pages ran out before the target; get the dirty ones written
+    if (evicted < target && dirty_skipped) writeback_wakeup_all();
+    return evicted;
+}
+
+// Reclaim limited to one mapping: drop its clean, unpinned, unmapped pages
+static size_t mapping_shrink(page_cache_mapping_t *m) {
+    page_cache_page_t *batch[PC_RECLAIM_BATCH];
+    size_t evicted = 0;
+    uint64_t next = 0;
+
+    lru_drain_local();
+    for (;;) {
+        unsigned long flags;
+        spin_lock_irqsave(&m->tree_lock, &flags);
+        size_t n = m->root ? radix_gang(m->root, 0, next, -1, batch, 0, PC_RECLAIM_BATCH) : 0;
+        spin_unlock_irqrestore(&m->tree_lock, flags);
+        if (n == 0) break;
+        next = batch[n - 1]->index + 1;
+
+        for (size_t i = 0; i < n; i++) {
+            page_cache_page_t *pg = batch[i];
+
+            // Same checks as the inactive scan; the descriptor may have been
+            // reused since the gang lookup, hence the mapping test
+            spin_lock_irqsave(&pc.lru_lock, &flags);
+            uint32_t pg_flags = __atomic_load_n(&pg->flags, __ATOMIC_RELAXED);
+            bool take = pg->mapping == m && (pg_flags & PAGE_CACHE_LRU) &&
+                        !(pg_flags & (PAGE_CACHE_DIRTY | PAGE_CACHE_WRITEBACK | PAGE_CACHE_LOCKED)) &&
+                        __atomic_load_n(&pg->refcnt, __ATOMIC_RELAXED) == 1 &&
+                        pmm_page_refcount(pg->pa) <= 1;
+            if (take) {
+                lru_del((pg_flags & PAGE_CACHE_ACTIVE) ? &pc.active : &pc.inactive, pg);
+                __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_LRU, __ATOMIC_RELAXED);
+                page_cache_page_get(pg);
+            }
+            spin_unlock_irqrestore(&pc.lru_lock, flags);
+            if (!take) continue;
+
+            if (page_remove(pg)) {
+                evicted++;
+                continue;
+            }
+            spin_lock_irqsave(&pc.lru_lock, &flags);
+            __atomic_fetch_or(&pg->flags, PAGE_CACHE_LRU, __ATOMIC_RELAXED);
+            lru_add_head((pg_flags & PAGE_CACHE_ACTIVE) ? &pc.active : &pc.inactive, pg);
+            spin_unlock_irqrestore(&pc.lru_lock, flags);
+            page_cache_release(pg);
+        }
+    }
+    return evicted;
+}
+
+void page_cache_evict_mapping(vnode_t *vn) {
+    // The flushers hold the vnode pointer too
+    writeback_forget_vnode(vn);
+
+    page_cache_mapping_t *m = page_cache_mapping(vn, false);
+    if (!m) return;
+
+    // Unlink it first so no new page can be added for vn. hnext stays
+    // valid for walkers already on the chain.
+    unsigned long flags;
+    spin_lock_irqsave(&pc.mapping_lock, &flags);
+    page_cache_mapping_t **link = &pc.mappings[mapping_hash(vn)];
+    while (*link && *link != m) link = &(*link)->hnext;
+    if (!*link) {
+        // Somebody else is releasing it
+        spin_unlock_irqrestore(&pc.mapping_lock, flags);
+        return;
+    }
+    __atomic_store_n(link, m->hnext, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&pc.mapping_lock, flags);
+
+    lru_drain_local();
+
+    page_cache_page_t *batch[PC_RECLAIM_BATCH];
+    for (;;) {
+        // Detach pages from the tree. Pinned ones stay valid for their users
+        // but are no longer reachable, dirty or on an LRU list.
+        spin_lock_irqsave(&m->tree_lock, &flags);
+        size_t n = m->root ? radix_gang(m->root, 0, 0, -1, batch, 0, PC_RECLAIM_BATCH) : 0;
+        for (size_t i = 0; i < n; i++) {
+            page_cache_page_t *pg = batch[i];
+            radix_delete(m, pg->index);
+            if (__atomic_fetch_and(&pg->flags, ~PAGE_CACHE_DIRTY, __ATOMIC_RELAXED) & PAGE_CACHE_DIRTY) {
+                pc.stats.nr_dirty--;
+            }
+            __atomic_store_n(&pg->mapping, NULL, __ATOMIC_RELEASE);
+        }
+        m->nr_pages -= n;
+        spin_unlock_irqrestore(&m->tree_lock, flags);
+        if (n == 0) break;
+        __atomic_sub_fetch(&pc.nr_pages, n, __ATOMIC_RELAXED);
+
+        // A page the inactive scan already picked is off the list with
+        // LRU clear; page_remove() sees it detached and lets it go
+        spin_lock_irqsave(&pc.lru_lock, &flags);
+        for (size_t i = 0; i < n; i++) {
+            page_cache_page_t *pg = batch[i];
+            uint32_t pg_flags = __atomic_fetch_and(&pg->flags, ~(PAGE_CACHE_LRU | PAGE_CACHE_ACTIVE),
+                                                   __ATOMIC_RELAXED);
+            if (pg_flags & PAGE_CACHE_LRU) {
+                lru_del((pg_flags & PAGE_CACHE_ACTIVE) ? &pc.active : &pc.inactive, pg);
+            }
+        }
+        spin_unlock_irqrestore(&pc.lru_lock, flags);
+
+        // The tree's references
+        for (size_t i = 0; i < n; i++) page_cache_release(batch[i]);
+    }
+
+    // Lookups that started before the unlink may still be inside the
+    // tree; radix_free() only recycles the nodes, and mapping_find()
+    // rejects whatever page such a lookup ends up on
+    pc_node_t *root = m->root;
+    __atomic_store_n(&m->root, NULL, __ATOMIC_RELEASE);
+    if (root) radix_free(root);
+    m->nr_dirty = 0;
+
+    spin_lock_irqsave(&pc.mapping_lock, &flags);
+    __atomic_store_n(&m->vn, NULL, __ATOMIC_RELEASE);
+    m->free_next = pc.free_mappings;
+    pc.free_mappings = m;
+    spin_unlock_irqrestore(&pc.mapping_lock, flags);
+}
+
+// --- Lookup and load ---
+
+static void pc_read_page(vnode_t *vn, uint64_t index, paddr_t pa) {
+    uint8_t *data = (uint8_t *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pa);
+    long rd = 0;
+
+    if (vn->type == VNODE_FILE && vn->ops && vn->ops->read) {
+        rd = vn->ops->read(vn, index * PAGE_SIZE, data, PAGE_SIZE);
+    }
+    // Zero page on error/EOF, zero the tail of a short read
+    if (rd < 0) rd = 0;
+    if (rd < (long)PAGE_SIZE) memset(data + rd, 0, PAGE_SIZE - (size_t)rd);
+}
+
+page_cache_page_t *page_cache_lookup(vnode_t *vn, u64 index) {
+    page_cache_mapping_t *m = page_cache_mapping(vn, false);
+    if (!m) return NULL;
+
+    page_cache_page_t *pg = mapping_find(m, index);
+    if (pg) wait_unlocked(pg);
+    return pg;
+}
+
+int page_cache_get(vnode_t *vn, u64 index, page_cache_page_t **out_pg, bool *newly_loaded) {
+    if (!vn || !out_pg) return K_EINVAL;
+
+    page_cache_mapping_t *m = page_cache_mapping(vn, true);
+    if (!m) return K_ENOMEM;
+    pc.stats.lookups++;
+
+    page_cache_page_t *pg = mapping_find(m, index);
+    if (!pg) {
+        // Miss: publish a locked page, then read it in outside the tree lock
+        page_cache_page_t *new_pg = desc_alloc();
+        paddr_t pa = new_pg ? pmm_alloc_page() : 0;
+        if (!pa) {
+            if (new_pg) desc_free(new_pg);
+            return K_ENOMEM;
+        }
+        new_pg->mapping = m;
+        new_pg->index = index;
+        new_pg->pa = pa;
+        new_pg->flags = PAGE_CACHE_LOCKED;
+        new_pg->lru_prev = NULL;
+        new_pg->lru_next = NULL;
+
+        unsigned long flags;
+        spin_lock_irqsave(&m->tree_lock, &flags);
+
+        // Somebody else may have loaded it meanwhile. Under the tree lock
+        // a published page always has a non-zero count.
+        pg = radix_lookup(m, index);
+        if (pg) {
+            __atomic_add_fetch(&pg->refcnt, 1, __ATOMIC_ACQUIRE);
+        } else {
+            pc_node_t *leaf = radix_extend(m, index);
+            if (!leaf) {
+                spin_unlock_irqrestore(&m->tree_lock, flags);
+                page_free(new_pg);
+                return K_ENOMEM;
+            }
+            // One reference for the tree, one for the caller
+            __atomic_store_n(&new_pg->refcnt, 2, __ATOMIC_RELEASE);
+            __atomic_store_n(&leaf->slots[index & PC_RADIX_MASK], new_pg, __ATOMIC_RELEASE);
+            leaf->count++;
+            m->nr_pages++;
+        }
+
+        spin_unlock_irqrestore(&m->tree_lock, flags);
+
+        if (!pg) {
+            __atomic_add_fetch(&pc.nr_pages, 1, __ATOMIC_RELAXED);
+            pc_read_page(vn, index, pa);
+            __atomic_fetch_or(&new_pg->flags, PAGE_CACHE_PRESENT, __ATOMIC_RELAXED);
+            __atomic_fetch_and(&new_pg->flags, ~PAGE_CACHE_LOCKED, __ATOMIC_RELEASE);
+            lru_batch_add(lru_add_batch, new_pg);
+            pc.stats.loads++;
+
+            if (__atomic_load_n(&pc.nr_pages, __ATOMIC_RELAXED) > pc.max_pages) {
+                page_cache_evict_some(PC_RECLAIM_BATCH);
+            }
+
+            if (newly_loaded) *newly_loaded = true;
+            *out_pg = new_pg;
+            return 0;
+        }
+
+        page_free(new_pg);
+    }
+
+    pc.stats.hits++;
+    wait_unlocked(pg);
+    page_cache_mark_accessed(pg);
+    if (newly_loaded) *newly_loaded = false;
+    *out_pg = pg;
+    return 0;
+}
+
+// --- Buffered I/O ---
+
+long page_cache_read(vnode_t *vn, u64 off, void *buf, size_t len) {
+    if (!vn || !buf) return K_EINVAL;
+    if (off >= vn->size) return 0;
+    if (len > vn->size - off) len = (size_t)(vn->size - off);
+
+    uint8_t *dst = (uint8_t *)buf;
+    size_t done = 0;
+    while (done < len) {
+        u64 pos = off + done;
+        size_t in_page = PAGE_SIZE - (size_t)(pos & (PAGE_SIZE - 1));
+        size_t chunk = (len - done < in_page) ? len - done : in_page;
+
+        page_cache_page_t *pg;
+        int err = page_cache_get(vn, pos / PAGE_SIZE, &pg, NULL);
+        if (err) return done ? (long)done : err;
+
+        memcpy(dst + done, (uint8_t *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pg->pa) + (pos & (PAGE_SIZE - 1)), chunk);
+        page_cache_release(pg);
+        done += chunk;
+    }
+    return (long)done;
+}
+
+long page_cache_write(vnode_t *vn, u64 off, const void *buf, size_t len) {
+    if (!vn || !buf) return K_EINVAL;
+
+    const uint8_t *src = (const uint8_t *)buf;
+    size_t done = 0;
+    while (done < len) {
+        u64 pos = off + done;
+        size_t in_page = PAGE_SIZE - (size_t)(pos & (PAGE_SIZE - 1));
+        size_t chunk = (len - done < in_page) ? len - done : in_page;
+
+        page_cache_page_t *pg;
+        int err = page_cache_get(vn, pos / PAGE_SIZE, &pg, NULL);
+        if (err) return done ? (long)done : err;
+
+        memcpy((uint8_t *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pg->pa) + (pos & (PAGE_SIZE - 1)), src + done, chunk);
+        page_cache_mark_dirty(pg);
+        page_cache_release(pg);
+
+        done += chunk;
+        if (pos + chunk > vn->size) vn->size = pos + chunk;
+    }
+
+    balance_dirty_pages(vn);
+    return (long)done;
+}
+
+// --- Dirty and writeback ---
+
+void page_cache_mark_dirty(page_cache_page_t *pg) {
+    if (__atomic_load_n(&pg->flags, __ATOMIC_RELAXED) & PAGE_CACHE_DIRTY) return;
+
+    // A detached page has no file left to be written to
+    unsigned long flags;
+    page_cache_mapping_t *m = page_lock_tree(pg, &flags);
+    if (!m) return;
+
+    bool first = false;
+    vnode_t *vn = m->vn;
+    if (!(pg->flags & PAGE_CACHE_DIRTY)) {
+        __atomic_fetch_or(&pg->flags, PAGE_CACHE_DIRTY, __ATOMIC_RELAXED);
+        tag_set(m, pg->index, PAGE_CACHE_TAG_DIRTY);
+        first = (m->nr_dirty++ == 0);
+        pc.stats.nr_dirty++;
+    }
+    spin_unlock_irqrestore(&m->tree_lock, flags);
+
+    // A clean file just became dirty: hand it to its device's flusher
+    if (first) writeback_inode_dirtied(vn, pg->index);
+}
+
+void page_cache_start_writeback(page_cache_page_t *pg) {
+    unsigned long flags;
+    page_cache_mapping_t *m = page_lock_tree(pg, &flags);
+    if (!m) return;
+    if (pg->flags & PAGE_CACHE_DIRTY) {
+        __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_DIRTY, __ATOMIC_RELAXED);
+        tag_clear(m, pg->index, PAGE_CACHE_TAG_DIRTY);
+        m->nr_dirty--;
+        pc.stats.nr_dirty--;
+    }
+    if (!(pg->flags & PAGE_CACHE_WRITEBACK)) {
+        __atomic_fetch_or(&pg->flags, PAGE_CACHE_WRITEBACK, __ATOMIC_RELAXED);
+        tag_set(m, pg->index, PAGE_CACHE_TAG_WRITEBACK);
+        pc.stats.nr_writeback++;
+    }
+    spin_unlock_irqrestore(&m->tree_lock, flags);
+}
+
+void page_cache_end_writeback(page_cache_page_t *pg) {
+    unsigned long flags;
+    page_cache_mapping_t *m = page_lock_tree(pg, &flags);
+    if (!m) {
+        // Detached mid-write: the tags went with the tree
+        if (__atomic_fetch_and(&pg->flags, ~PAGE_CACHE_WRITEBACK, __ATOMIC_RELAXED) & PAGE_CACHE_WRITEBACK) {
+            pc.stats.nr_writeback--;
+        }
+        return;
+    }
+    if (pg->flags & PAGE_CACHE_WRITEBACK) {
+        __atomic_fetch_and(&pg->flags, ~PAGE_CACHE_WRITEBACK, __ATOMIC_RELAXED);
+        tag_clear(m, pg->index, PAGE_CACHE_TAG_WRITEBACK);
+        pc.stats.nr_writeback--;
+    }
+    spin_unlock_irqrestore(&m->tree_lock, flags);
+}
+
+size_t page_cache_find_tagged(vnode_t *vn, u64 start, int tag, page_cache_page_t **pages, size_t max_pages) {
+    if (tag < 0 || tag >= PAGE_CACHE_NR_TAGS || !pages) return 0;
+    page_cache_mapping_t *m = page_cache_mapping(vn, false);
+    if (!m) return 0;
+
+    unsigned long flags;
+    spin_lock_irqsave(&m->tree_lock, &flags);
+    size_t n = m->root ? radix_gang(m->root, 0, start, tag, pages, 0, max_pages) : 0;
+    for (size_t i = 0; i < n; i++) {
+        __atomic_add_fetch(&pages[i]->refcnt, 1, __ATOMIC_ACQUIRE);
+    }
+    spin_unlock_irqrestore(&m->tree_lock, flags);
+    return n;
+}
+
+static int pc_write_page(vnode_t *vn, page_cache_page_t *pg) {
+    if (!vn->ops || !vn->ops->write) return K_EIO;
+
+    // Nothing past end of file goes to storage
+    u64 off = pg->index * PAGE_SIZE;
+    if (off >= vn->size) return 0;
+    size_t len = (vn->size - off < PAGE_SIZE) ? (size_t)(vn->size - off) : PAGE_SIZE;
+
+    void *data = (void *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pg->pa);
+    long wr = vn->ops->write(vn, off, data, len);
+    return wr == (long)len ? 0 : K_EIO;
+}
+
+int page_cache_flush_vnode(vnode_t *vn) {
+    page_cache_page_t *batch[PC_WRITE_BATCH];
+    u64 next = 0;
+    int ret = 0;
+
+    for (;;) {
+        size_t n = page_cache_find_tagged(vn, next, PAGE_CACHE_TAG_DIRTY, batch, PC_WRITE_BATCH);
+        if (n == 0) break;
+
+        for (size_t i = 0; i < n; i++) {
+            page_cache_page_t *pg = batch[i];
+            next = pg->index + 1;
+
+            page_cache_start_writeback(pg);
+            int err = pc_write_page(vn, pg);
+            page_cache_end_writeback(pg);
+            if (err) {
+                page_cache_mark_dirty(pg);
+                ret = err;
+            } else {
+                pc.stats.flushes++;
+            }
+            page_cache_release(pg);
+        }
+    }
+    return ret;
+}
+
+int page_cache_sync_all(void) {
+    int ret = 0;
+    pc_ensure_init();
+
+    for (uint32_t h = 0; h < PC_MAPPING_HASH; h++) {
+        page_cache_mapping_t *m = __atomic_load_n(&pc.mappings[h], __ATOMIC_ACQUIRE);
+        for (; m; m = m->hnext) {
+            if (m->nr_dirty && page_cache_flush_vnode(m->vn) != 0) ret = K_EIO;
+        }
+    }
+    return ret;
+}
+
+const struct page_cache_stats *page_cache_get_stats(void) {
+    pc.stats.nr_pages = __atomic_load_n(&pc.nr_pages, __ATOMIC_RELAXED);
+    pc.stats.nr_active = pc.active.count;
+    pc.stats.nr_inactive = pc.inactive.count;
+    return &pc.stats;
+}
+
+// --- Debug ---
+
+static void fill_info(page_cache_page_info_t *info, const page_cache_page_t *pg) {
+    info->index = pg->index;
+    info->pa = pg->pa;
+    info->refcnt = pg->refcnt;
+    info->flags = pg->flags;
+    info->present = (pg->flags & PAGE_CACHE_PRESENT) != 0;
+}
+
+int page_cache_debug_lookup(vnode_t *vn, u64 file_off, page_cache_page_info_t *out) {
+    if (!out) return K_EINVAL;
+    page_cache_mapping_t *m = page_cache_mapping(vn, false);
+    if (!m) return K_ENOENT;
+
+    unsigned long flags;
+    spin_lock_irqsave(&m->tree_lock, &flags);
+    page_cache_page_t *pg = radix_lookup(m, file_off / PAGE_SIZE);
+    if (pg) fill_info(out, pg);
+    spin_unlock_irqrestore(&m->tree_lock, flags);
+
+    return pg ? 0 : K_ENOENT;
+}
+
+size_t page_cache_debug_range(vnode_t *vn, u64 file_off, u64 length, page_cache_page_info_t *out_array,
+                              size_t max_entries, u32 flags_filter) {
+    page_cache_mapping_t *m = page_cache_mapping(vn, false);
+    if (!m || !out_array || !length) return 0;
+
+    // Dirty and writeback filters can use the tags
+    int tag = -1;
+    if (flags_filter == PAGE_CACHE_DIRTY) tag = PAGE_CACHE_TAG_DIRTY;
+    else if (flags_filter == PAGE_CACHE_WRITEBACK) tag = PAGE_CACHE_TAG_WRITEBACK;
+
+    u64 index = file_off / PAGE_SIZE;
+    u64 end = (file_off + length + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t filled = 0;
+
+    unsigned long flags;
+    spin_lock_irqsave(&m->tree_lock, &flags);
+    while (filled < max_entries && index < end && m->root) {
+        page_cache_page_t *batch[PC_WRITE_BATCH];
+        size_t n = radix_gang(m->root, 0, index, tag, batch, 0, PC_WRITE_BATCH);
+        if (n == 0) break;
+
+        for (size_t i = 0; i < n && filled < max_entries; i++) {
+            if (batch[i]->index >= end) {
+                n = 0;
+                break;
+            }
+            if (!flags_filter || (batch[i]->flags & flags_filter)) {
+                fill_info(&out_array[filled++], batch[i]);
+            }
+            index = batch[i]->index + 1;
+        }
+        if (n == 0) break;
+    }
+    spin_unlock_irqrestore(&m->tree_lock, flags);
+    return filled;
+}
+
+// --- Self-test ---
+
+static uint32_t selftest_writes;
+
+static long selftest_read(vnode_t *vn, u64 off, void *buf, size_t len) {
+    (void)vn;
+    memset(buf, (int)((off / PAGE_SIZE) & 0xFF), len);
+    return (long)len;
+}
+
+static long selftest_write(vnode_t *vn, u64 off, const void *buf, size_t len) {
+    (void)vn;
+    (void)off;
+    (void)buf;
+    selftest_writes++;
+    return (long)len;
+}
+
+int page_cache_selftest(void) {
+    static const vnode_ops_t ops = { .read = selftest_read, .write = selftest_write };
+    static vnode_t vn;
+    memset(&vn, 0, sizeof(vn));
+    vn.type = VNODE_FILE;
+    vn.size = 1ull << 40;
+    vn.ops = &ops;
+
+    // Miss, then hit; far-apart indices force the tree to grow
+    const u64 indices[] = { 0, 5, 63, 64, 4096, 1ull << 27 };
+    const size_t nr = sizeof(indices) / sizeof(indices[0]);
+    page_cache_page_t *pages[6];
+    bool fresh;
+
+    for (size_t i = 0; i < nr; i++) {
+        if (page_cache_get(&vn, indices[i], &pages[i], &fresh) != 0 || !fresh) return -1;
+        uint8_t *data = (uint8_t *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pages[i]->pa);
+        if (data[0] != (uint8_t)indices[i] || data[PAGE_SIZE - 1] != (uint8_t)indices[i]) return -2;
+    }
+    for (size_t i = 0; i < nr; i++) {
+        page_cache_page_t *pg = page_cache_lookup(&vn, indices[i]);
+        if (pg != pages[i]) return -3;
+        page_cache_release(pg);
+    }
+    if (page_cache_lookup(&vn, 6)) return -4;
+
+    // Dirty tags: only the tagged pages are found, in index order
+    page_cache_mark_dirty(pages[4]);
+    page_cache_mark_dirty(pages[1]);
+    page_cache_page_t *found[4];
+    size_t n = page_cache_find_tagged(&vn, 0, PAGE_CACHE_TAG_DIRTY, found, 4);
+    if (n != 2 || found[0] != pages[1] || found[1] != pages[4]) return -5;
+    for (size_t i = 0; i < n; i++) page_cache_release(found[i]);
+
+    selftest_writes = 0;
+    if (page_cache_flush_vnode(&vn) != 0 || selftest_writes != 2) return -6;
+    if (page_cache_find_tagged(&vn, 0, PAGE_CACHE_TAG_DIRTY, found, 4) != 0) return -7;
+
+    // Pinned pages survive reclaim, released ones go. Only this vnode's
+    // pages are reclaimed; the rest of the cache is left alone.
+    page_cache_mapping_t *m = page_cache_mapping(&vn, false);
+    page_cache_page_t *pinned = pages[2];
+    for (size_t i = 0; i < nr; i++) {
+        if (pages[i] != pinned) page_cache_release(pages[i]);
+    }
+    if (mapping_shrink(m) != nr - 1) return -8;
+    for (size_t i = 0; i < nr; i++) {
+        page_cache_page_t *pg = page_cache_lookup(&vn, indices[i]);
+        if ((pg != NULL) != (indices[i] == pinned->index)) return -8;
+        page_cache_release(pg);
+    }
+
+    // Releasing the vnode detaches even pinned, dirty pages; their data
+    // stays readable until the last reference goes
+    page_cache_mark_dirty(pinned);
+    u64 dirty = pc.stats.nr_dirty;
+    page_cache_evict_mapping(&vn);
+    if (page_cache_mapping(&vn, false) || pinned->mapping) return -9;
+    if (pc.stats.nr_dirty != dirty - 1) return -9;
+    uint8_t *data = (uint8_t *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pinned->pa);
+    if (data[0] != (uint8_t)indices[2]) return -9;
+    page_cache_mark_dirty(pinned);
+    if (pinned->flags & PAGE_CACHE_DIRTY) return -9;
+    page_cache_release(pinned);
+
+    return 0;
+}
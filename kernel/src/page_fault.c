@@ -15,6 +15,10 @@
 #include <string.h>
 #include "kernel.h"
 #include "vmm.h"
+#include "mm/huge_memory.h"
+
+// mmap.c: file-backed mappings (read-ahead and fault-around)
+int mmap_file_fault(vmm_aspace_t *space, vaddr_t vaddr);
 
 // Page fault error code bits
 #define PF_PRESENT  0x01  // Page not present
@@ -27,11 +31,27 @@
 static uint64_t page_faults_handled = 0;
 static uint64_t pages_allocated = 0;
 static uint64_t cow_pages_copied = 0;
+static uint64_t cow_pages_reused = 0;
 static uint64_t swap_ins = 0;
 static uint64_t swap_outs = 0;
 
-// Copy a page for COW
-static bool copy_page_cow(vmm_aspace_t *space, vaddr_t vaddr, paddr_t old_paddr) {
+// Handle COW page fault: copy the frame, or take it over when no other
+// address space maps it any more
+static bool handle_cow_fault(vmm_aspace_t *space, vaddr_t vaddr, u64 *pte) {
+    // mprotect() may have taken write access away since the fork
+    vmm_region_t *region = vmm_region_find(space, vaddr);
+    if (region && !(region->flags & VMM_REGION_WRITE)) return false;
+    
+    paddr_t old_paddr = *pte & PTE_ADDR_MASK;
+    u64 flags = (*pte & ~(PTE_ADDR_MASK | PTE_COW)) | PTE_WRITABLE | PTE_DIRTY;
+    
+    if (pmm_page_refcount(old_paddr) == 1) {
+        *pte = old_paddr | flags;
+        vmm_flush_tlb_page(vaddr);
+        cow_pages_reused++;
+        return true;
+    }
+    
     // Allocate new page
     paddr_t new_page = pmm_alloc_page();
     if (!new_page) return false;
@@ -41,31 +61,35 @@ static bool copy_page_cow(vmm_aspace_t *space, vaddr_t vaddr, paddr_t old_paddr)
     void *new_virt = (void *)PHYS_TO_VIRT_DIRECT(new_page);
     memcpy(new_virt, old_virt, PAGE_SIZE);
     
-    // Unmap old page
-    vmm_unmap_page(space, vaddr);
-    
-    // Map new page with write permission
-    uint32_t flags = PTE_PRESENT | PTE_WRITABLE | PTE_USER;
-    if (vmm_map_page(space, vaddr, new_page, flags) != 0) {
-        pmm_free_page(new_page);
-        return false;
-    }
+    *pte = new_page | flags;
+    vmm_flush_tlb_page(vaddr);
     
-    // Decrement reference count on old page
+    // Drop our reference on the shared page
     pmm_free_page(old_paddr);
     
     cow_pages_copied++;
     return true;
 }
 
-// Handle COW page fault
-static bool handle_cow_fault(vmm_aspace_t *space, vaddr_t vaddr, paddr_t paddr) {
-    // For now, always copy - reference counting would be added later
-    return copy_page_cow(space, vaddr, paddr);
-}
-
 // Handle demand paging fault (page not present)
 static bool handle_demand_paging(vmm_aspace_t *space, vaddr_t vaddr, bool user_mode) {
+    vmm_region_t *region = vmm_region_find(space, vaddr);
+
+    // File pages come from the page cache
+    if (region && (region->flags & VMM_REGION_FILE)) {
+        return mmap_file_fault(space, vaddr) == 0;
+    }
+
+    // khugepaged is replacing this page table; retry once it is done
+    u64 *pde = vmm_get_pde(space, vaddr);
+    if (pde && (*pde & PTE_COLLAPSE)) return true;
+
+    // Anonymous regions get a whole 2 MiB page when the range allows it
+    if (region && thp_handle_fault(space, region, vaddr) == 0) {
+        pages_allocated += HPAGE_NR_PAGES;
+        return true;
+    }
+
     // Allocate a new page
     paddr_t page = pmm_alloc_page();
     if (!page) return false;
@@ -76,7 +100,9 @@ static bool handle_demand_paging(vmm_aspace_t *space, vaddr_t vaddr, bool user_m
     
     // Determine flags
     uint32_t flags = PTE_PRESENT | PTE_WRITABLE;
-    if (user_mode) {
+    if (region) {
+        flags = vmm_region_pte_flags(region);
+    } else if (user_mode) {
         flags |= PTE_USER;
     }
     
@@ -123,10 +149,22 @@ void page_fault_handler(uint32_t error_code, uint32_t fault_addr) {
         return;
     }
     
-    // Case 2: Page present but write to COW page - would check PTE_COW flag
+    // Case 2: Page present but write to COW page
     if (present && write) {
-        // For now, just handle as protection violation
-        // Full COW would check the PTE_COW bit and handle accordingly
+        // Huge pages are shared whole across fork
+        u64 *pde = vmm_get_pde(space, page_addr);
+        if (pde && (*pde & PTE_PRESENT) && (*pde & PTE_HUGE)) {
+            thp_handle_cow_fault(space, page_addr);
+            return;
+        }
+        
+        u64 *pte = vmm_get_pte(space, page_addr);
+        if (pte && (*pte & PTE_PRESENT) && (*pte & PTE_COW)) {
+            if (handle_cow_fault(space, page_addr, pte)) {
+                return; // Success
+            }
+        }
+        // Otherwise a protection violation
         return;
     }
     
@@ -138,6 +176,7 @@ void page_fault_init(void) {
     page_faults_handled = 0;
     pages_allocated = 0;
     cow_pages_copied = 0;
+    cow_pages_reused = 0;
     swap_ins = 0;
     swap_outs = 0;
 }
@@ -149,12 +188,24 @@ void page_fault_get_stats(uint64_t *faults, uint64_t *allocs, uint64_t *cow_copi
     if (cow_copies) *cow_copies = cow_pages_copied;
 }
 
+// Get COW fault statistics: pages copied vs. taken over by the last sharer
+void page_fault_get_cow_stats(uint64_t *copied, uint64_t *reused) {
+    if (copied) *copied = cow_pages_copied;
+    if (reused) *reused = cow_pages_reused;
+}
+
 // Mark a page as copy-on-write
 bool vmm_mark_cow(vmm_aspace_t *space, vaddr_t vaddr) {
     if (!space) space = vmm_get_current_aspace();
+    if (!space) return false;
+    
+    u64 *pte = vmm_get_pte(space, vaddr);
+    if (!pte || !(*pte & PTE_PRESENT)) return false;
     
-    // This would mark the page with PTE_COW flag
-    // For now, this is a placeholder
+    if (*pte & PTE_WRITABLE) {
+        *pte = (*pte & ~(u64)PTE_WRITABLE) | PTE_COW;
+        vmm_flush_tlb_page(vaddr);
+    }
     return true;
 }
 
@@ -162,6 +213,12 @@ bool vmm_mark_cow(vmm_aspace_t *space, vaddr_t vaddr) {
 vmm_aspace_t *vmm_clone_cow(vmm_aspace_t *src) {
     if (!src) return NULL;
     
-    // This would use vmm_clone_address_space_cow from the main VMM
-    return vmm_create_aspace();
+    vmm_aspace_t *dst = vmm_create_aspace();
+    if (!dst) return NULL;
+    
+    if (vmm_clone_address_space_cow(dst, src) != 0) {
+        vmm_destroy_aspace(dst);
+        return NULL;
+    }
+    return dst;
 }
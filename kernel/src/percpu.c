@@ -0,0 +1,168 @@
+/*
+ * LimitlessOS - Per-CPU Data
+ *
+ * See percpu.h. On i386 the GS base comes from a segment descriptor, so
+ * each CPU runs on its own copy of the GDT (itself a per-CPU variable)
+ * whose GDT_ENTRY_PERCPU slot is a flat data segment based at that CPU's
+ * offset. The selector is the same on every CPU. Offsets are allowed to
+ * wrap: the segment covers 4 GiB, so a copy below the template works.
+ * On x86_64 the base is simply written to MSR_GS_BASE.
+ *
+ * The interrupt stubs reload GS from percpu_gs_selector on entry, since
+ * an interrupt from user mode arrives with the user's GS. It reads flat
+ * until the boot CPU has its copy.
+ */
+
+#include "percpu.h"
+#include "mm/pmm_simple.h"
+#include "vmm.h"
+#include <string.h>
+
+#define GDT_ENTRIES         16
+#define GDT_ENTRY_PERCPU    15
+#define PERCPU_SELECTOR     (GDT_ENTRY_PERCPU << 3)
+
+#define MSR_GS_BASE         0xC0000101
+
+#define PERCPU_PAGE_SIZE    4096
+
+uintptr_t __per_cpu_offset[PERCPU_MAX_CPUS];
+uint32_t percpu_nr_cpus = 1;
+
+DEFINE_PER_CPU(uint32_t, cpu_number);
+DEFINE_PER_CPU(uintptr_t, this_cpu_off);
+
+#ifndef __x86_64__
+static DEFINE_PER_CPU(uint64_t[GDT_ENTRIES], percpu_gdt) __attribute__((aligned(8)));
+
+/* Read by isr_asm.S; the same on every CPU */
+uint16_t percpu_gs_selector = 0x10;
+#endif
+
+static inline size_t percpu_size(void) {
+    return (size_t)(__per_cpu_end - __per_cpu_start);
+}
+
+static uint32_t percpu_order(void) {
+    uint32_t order = 0;
+    while (((size_t)PERCPU_PAGE_SIZE << order) < percpu_size()) {
+        order++;
+    }
+    return order;
+}
+
+#ifdef __x86_64__
+
+static void percpu_load_base(uint32_t cpu) {
+    uint64_t base = __per_cpu_offset[cpu];
+    __asm__ __volatile__("wrmsr" :: "c"(MSR_GS_BASE),
+                         "a"((uint32_t)base), "d"((uint32_t)(base >> 32)));
+}
+
+#else
+
+struct percpu_gdtr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+/* 4 GiB ring-0 read/write data segment at base */
+static uint64_t percpu_descriptor(uint32_t base) {
+    return 0xFFFFULL |
+           ((uint64_t)(base & 0xFFFFFF) << 16) |
+           (0x92ULL << 40) |            /* Present, ring 0, data, writable */
+           (0xFULL << 48) |             /* Limit 19:16 */
+           (0xCULL << 52) |             /* 4 KiB granularity, 32-bit */
+           ((uint64_t)(base >> 24) << 56);
+}
+
+static void percpu_load_base(uint32_t cpu) {
+    uint64_t *gdt = per_cpu(percpu_gdt, cpu);
+    struct percpu_gdtr gdtr;
+
+    /* Keep the descriptors of whatever GDT we were booted with */
+    __asm__ __volatile__("sgdt %0" : "=m"(gdtr));
+    size_t n = (gdtr.limit + 1u) / sizeof(uint64_t);
+    if (n > GDT_ENTRY_PERCPU) {
+        n = GDT_ENTRY_PERCPU;
+    }
+    memset(gdt, 0, GDT_ENTRIES * sizeof(uint64_t));
+    memcpy(gdt, (void *)gdtr.base, n * sizeof(uint64_t));
+    gdt[GDT_ENTRY_PERCPU] = percpu_descriptor((uint32_t)__per_cpu_offset[cpu]);
+
+    gdtr.limit = GDT_ENTRIES * sizeof(uint64_t) - 1;
+    gdtr.base = (uint32_t)(uintptr_t)gdt;
+    __asm__ __volatile__("lgdt %0\n\t"
+                         "movw %w1, %%gs"
+                         :: "m"(gdtr), "r"(PERCPU_SELECTOR) : "memory");
+    percpu_gs_selector = PERCPU_SELECTOR;
+}
+
+#endif
+
+/* Copies the template into cpu's area and switches this CPU to it */
+static void percpu_install(uint32_t cpu) {
+    uintptr_t offset = __per_cpu_offset[cpu];
+
+    memcpy(__per_cpu_start + offset, __per_cpu_start, percpu_size());
+    per_cpu(cpu_number, cpu) = cpu;
+    per_cpu(this_cpu_off, cpu) = offset;
+
+    percpu_load_base(cpu);
+}
+
+int percpu_alloc_cpu(uint32_t cpu) {
+    if (cpu >= PERCPU_MAX_CPUS) {
+        return -1;
+    }
+
+    uint64_t pa = pmm_alloc_pages(percpu_order());
+    if (!pa) {
+        return -1;
+    }
+
+    char *area = (char *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pa);
+    __per_cpu_offset[cpu] = (uintptr_t)area - (uintptr_t)__per_cpu_start;
+    return 0;
+}
+
+int percpu_setup_boot_cpu(void) {
+    if (percpu_alloc_cpu(0) < 0) {
+        return -1;
+    }
+
+    /* From here on the template is only ever copied */
+    percpu_install(0);
+    return 0;
+}
+
+void percpu_init_cpu(uint32_t cpu) {
+    percpu_install(cpu);
+
+    /* Publish only once the copy is complete, for per_cpu() walkers */
+    if (cpu >= percpu_nr_cpus) {
+        __atomic_store_n(&percpu_nr_cpus, cpu + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void percpu_sum_u64(const void *var, size_t size, void *out) {
+    uint64_t *sum = (uint64_t *)out;
+    size_t n = size / sizeof(uint64_t);
+    uint32_t cpu;
+
+    memset(out, 0, size);
+    for_each_percpu_cpu(cpu) {
+        const uint64_t *v = per_cpu_ptr((const uint64_t *)var, cpu);
+        for (size_t i = 0; i < n; i++) {
+            sum[i] += v[i];
+        }
+    }
+}
+
+void percpu_zero(void *var, size_t size) {
+    uint32_t cpu;
+
+    for_each_percpu_cpu(cpu) {
+        memset(per_cpu_ptr((char *)var, cpu), 0, size);
+    }
+}
@@ -16,6 +16,10 @@
 #include <string.h>
 #include "mm/mm.h"
 
+// mmap.c: per-address-space mapping records
+int mmap_fork(vmm_aspace_t *parent, vmm_aspace_t *child);
+void mmap_exit(vmm_aspace_t *space);
+
 // Simple process structure for basic implementation
 typedef struct simple_process {
     int pid;
@@ -24,7 +28,7 @@ typedef struct simple_process {
     uint32_t esp;
     uint32_t ebp;
     uint32_t eip;
-    void *page_directory;
+    void *page_directory;   // vmm_aspace_t of the process
     struct simple_process *next;
 } simple_process_t;
 
@@ -122,8 +126,23 @@ int sys_fork(void) {
     child->ebp = current_proc->ebp;
     child->eip = current_proc->eip;
     
-    // TODO: Copy page directory (for now, share with parent)
-    child->page_directory = current_proc->page_directory;
+    // Copy the address space; frames are shared copy-on-write, so the
+    // cost is the page tables, not the resident pages
+    vmm_aspace_t *parent_as = current_proc->page_directory;
+    if (!parent_as) parent_as = vmm_get_current_aspace();
+    
+    vmm_aspace_t *child_as = parent_as ? vmm_clone_cow(parent_as) : NULL;
+    if (!child_as) {
+        free_process(child);
+        return -1;
+    }
+    if (mmap_fork(parent_as, child_as) != 0) {
+        vmm_destroy_aspace(child_as);
+        free_process(child);
+        return -1;
+    }
+    current_proc->page_directory = parent_as;
+    child->page_directory = child_as;
     
     // Add to process list
     child->next = process_list;
@@ -188,6 +207,13 @@ int sys_waitpid(int pid, int *status, int options) {
                 curr = curr->next;
             }
             
+            // Release the child's address space and its page references
+            if (p->page_directory && p->page_directory != current_proc->page_directory) {
+                mmap_exit(p->page_directory);
+                vmm_destroy_aspace(p->page_directory);
+            }
+            p->page_directory = NULL;
+            
             free_process(p);
             return child_pid;
         }
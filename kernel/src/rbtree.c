@@ -0,0 +1,277 @@
+/*
+ * LimitlessOS - Intrusive Red-Black Trees
+ *
+ * Rebalancing follows the usual CLRS cases; see rbtree.h for the API.
+ */
+
+#include "rbtree.h"
+
+#define rb_color(r)     ((r)->rb_parent_color & 1)
+#define rb_is_red(r)    (!rb_color(r))
+#define rb_is_black(r)  rb_color(r)
+
+static inline void rb_set_parent(struct rb_node *rb, struct rb_node *p) {
+    rb->rb_parent_color = (rb->rb_parent_color & 3) | (unsigned long)p;
+}
+
+static inline void rb_set_color(struct rb_node *rb, int color) {
+    rb->rb_parent_color = (rb->rb_parent_color & ~1UL) | (unsigned long)color;
+}
+
+// Make 'child' take 'old's place under old's parent
+static inline void rb_change_child(struct rb_node *old, struct rb_node *child,
+                                   struct rb_node *parent, struct rb_root *root) {
+    if (!parent) root->rb_node = child;
+    else if (parent->rb_left == old) parent->rb_left = child;
+    else parent->rb_right = child;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *right = node->rb_right;
+    struct rb_node *parent = rb_parent(node);
+
+    node->rb_right = right->rb_left;
+    if (right->rb_left) rb_set_parent(right->rb_left, node);
+    right->rb_left = node;
+
+    rb_set_parent(right, parent);
+    rb_change_child(node, right, parent, root);
+    rb_set_parent(node, right);
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *left = node->rb_left;
+    struct rb_node *parent = rb_parent(node);
+
+    node->rb_left = left->rb_right;
+    if (left->rb_right) rb_set_parent(left->rb_right, node);
+    left->rb_right = node;
+
+    rb_set_parent(left, parent);
+    rb_change_child(node, left, parent, root);
+    rb_set_parent(node, left);
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *parent, *gparent;
+
+    while ((parent = rb_parent(node)) && rb_is_red(parent)) {
+        // A red parent is never the root, so the grandparent exists
+        gparent = rb_parent(parent);
+
+        if (parent == gparent->rb_left) {
+            struct rb_node *uncle = gparent->rb_right;
+            if (uncle && rb_is_red(uncle)) {
+                rb_set_color(uncle, RB_BLACK);
+                rb_set_color(parent, RB_BLACK);
+                rb_set_color(gparent, RB_RED);
+                node = gparent;
+                continue;
+            }
+            if (parent->rb_right == node) {
+                rb_rotate_left(parent, root);
+                struct rb_node *tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(gparent, RB_RED);
+            rb_rotate_right(gparent, root);
+        } else {
+            struct rb_node *uncle = gparent->rb_left;
+            if (uncle && rb_is_red(uncle)) {
+                rb_set_color(uncle, RB_BLACK);
+                rb_set_color(parent, RB_BLACK);
+                rb_set_color(gparent, RB_RED);
+                node = gparent;
+                continue;
+            }
+            if (parent->rb_left == node) {
+                rb_rotate_right(parent, root);
+                struct rb_node *tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(gparent, RB_RED);
+            rb_rotate_left(gparent, root);
+        }
+    }
+
+    rb_set_color(root->rb_node, RB_BLACK);
+}
+
+// Restore the black height after a black node was removed above 'node'
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root) {
+    struct rb_node *sibling;
+
+    while ((!node || rb_is_black(node)) && node != root->rb_node) {
+        if (parent->rb_left == node) {
+            sibling = parent->rb_right;
+            if (rb_is_red(sibling)) {
+                rb_set_color(sibling, RB_BLACK);
+                rb_set_color(parent, RB_RED);
+                rb_rotate_left(parent, root);
+                sibling = parent->rb_right;
+            }
+            if ((!sibling->rb_left || rb_is_black(sibling->rb_left)) &&
+                (!sibling->rb_right || rb_is_black(sibling->rb_right))) {
+                rb_set_color(sibling, RB_RED);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+            if (!sibling->rb_right || rb_is_black(sibling->rb_right)) {
+                rb_set_color(sibling->rb_left, RB_BLACK);
+                rb_set_color(sibling, RB_RED);
+                rb_rotate_right(sibling, root);
+                sibling = parent->rb_right;
+            }
+            rb_set_color(sibling, rb_color(parent));
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(sibling->rb_right, RB_BLACK);
+            rb_rotate_left(parent, root);
+        } else {
+            sibling = parent->rb_left;
+            if (rb_is_red(sibling)) {
+                rb_set_color(sibling, RB_BLACK);
+                rb_set_color(parent, RB_RED);
+                rb_rotate_right(parent, root);
+                sibling = parent->rb_left;
+            }
+            if ((!sibling->rb_left || rb_is_black(sibling->rb_left)) &&
+                (!sibling->rb_right || rb_is_black(sibling->rb_right))) {
+                rb_set_color(sibling, RB_RED);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+            if (!sibling->rb_left || rb_is_black(sibling->rb_left)) {
+                rb_set_color(sibling->rb_right, RB_BLACK);
+                rb_set_color(sibling, RB_RED);
+                rb_rotate_left(sibling, root);
+                sibling = parent->rb_left;
+            }
+            rb_set_color(sibling, rb_color(parent));
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(sibling->rb_left, RB_BLACK);
+            rb_rotate_right(parent, root);
+        }
+        node = root->rb_node;
+        break;
+    }
+
+    if (node) rb_set_color(node, RB_BLACK);
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *child, *parent;
+    int color;
+
+    if (!node->rb_left) {
+        child = node->rb_right;
+    } else if (!node->rb_right) {
+        child = node->rb_left;
+    } else {
+        // Two children: the in-order successor takes node's place
+        struct rb_node *old = node;
+        node = node->rb_right;
+        while (node->rb_left) node = node->rb_left;
+
+        rb_change_child(old, node, rb_parent(old), root);
+
+        child = node->rb_right;
+        parent = rb_parent(node);
+        color = rb_color(node);
+
+        if (parent == old) {
+            parent = node;
+        } else {
+            if (child) rb_set_parent(child, parent);
+            parent->rb_left = child;
+            node->rb_right = old->rb_right;
+            rb_set_parent(old->rb_right, node);
+        }
+
+        node->rb_parent_color = old->rb_parent_color;
+        node->rb_left = old->rb_left;
+        rb_set_parent(old->rb_left, node);
+
+        RB_CLEAR_NODE(old);
+        if (color == RB_BLACK) rb_erase_color(child, parent, root);
+        return;
+    }
+
+    parent = rb_parent(node);
+    color = rb_color(node);
+    if (child) rb_set_parent(child, parent);
+    rb_change_child(node, child, parent, root);
+
+    RB_CLEAR_NODE(node);
+    if (color == RB_BLACK) rb_erase_color(child, parent, root);
+}
+
+struct rb_node *rb_first(const struct rb_root *root) {
+    struct rb_node *n = root->rb_node;
+    if (!n) return NULL;
+    while (n->rb_left) n = n->rb_left;
+    return n;
+}
+
+struct rb_node *rb_last(const struct rb_root *root) {
+    struct rb_node *n = root->rb_node;
+    if (!n) return NULL;
+    while (n->rb_right) n = n->rb_right;
+    return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node) {
+    struct rb_node *parent;
+
+    if (RB_EMPTY_NODE(node)) return NULL;
+
+    // Leftmost node of the right subtree
+    if (node->rb_right) {
+        node = node->rb_right;
+        while (node->rb_left) node = node->rb_left;
+        return (struct rb_node *)node;
+    }
+
+    // Otherwise the first ancestor we reach from its left side
+    while ((parent = rb_parent(node)) && node == parent->rb_right) node = parent;
+    return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node) {
+    struct rb_node *parent;
+
+    if (RB_EMPTY_NODE(node)) return NULL;
+
+    if (node->rb_left) {
+        node = node->rb_left;
+        while (node->rb_right) node = node->rb_right;
+        return (struct rb_node *)node;
+    }
+
+    while ((parent = rb_parent(node)) && node == parent->rb_left) node = parent;
+    return parent;
+}
+
+static int rb_validate_node(const struct rb_node *node, const struct rb_node *parent) {
+    if (!node) return 0;
+    if (rb_parent(node) != parent) return -1;
+    if (rb_is_red(node) && ((node->rb_left && rb_is_red(node->rb_left)) ||
+                            (node->rb_right && rb_is_red(node->rb_right)))) {
+        return -1;
+    }
+
+    int left = rb_validate_node(node->rb_left, node);
+    int right = rb_validate_node(node->rb_right, node);
+    if (left < 0 || right < 0 || left != right) return -1;
+    return left + (rb_is_black(node) ? 1 : 0);
+}
+
+int rb_validate(const struct rb_root *root) {
+    if (root->rb_node && rb_is_red(root->rb_node)) return -1;
+    return rb_validate_node(root->rb_node, NULL);
+}
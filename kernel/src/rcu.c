@@ -0,0 +1,232 @@
+/*
+ * LimitlessOS - Read-Copy-Update
+ *
+ * See rcu.h. Every CPU owns a quiescent-state counter that it bumps in
+ * rcu_qs(). A CPU has passed a quiescent state since some point in time
+ * once its counter differs from a snapshot taken at that point, so a
+ * grace period is nothing more than a snapshot of all online counters
+ * followed by waiting for each of them to move.
+ *
+ * rcu_qs() advances the counter by two; the low bit is set while the CPU
+ * sits in dynticks idle. An odd snapshot means the CPU was idle when the
+ * grace period began, and any reader it runs later started after that,
+ * so it needs no waiting for. Interrupts taken from idle clear the bit
+ * for their duration, which also moves the counter; the common hardware
+ * interrupt entry and exit in isr.c call rcu_irq_enter()/rcu_irq_exit().
+ *
+ * synchronize_rcu() takes the snapshot itself and waits, yielding the
+ * CPU meanwhile. call_rcu() callbacks are batched per CPU and share one
+ * global grace period at a time, driven from the tick:
+ *
+ *   next  - queued since the current batch was formed
+ *   wait  - waiting for grace period number wait_gp to complete
+ *
+ * When wait expires its callbacks run and next becomes the new wait
+ * batch. A batch formed while a grace period is already running cannot
+ * use that one (its snapshot predates the callbacks), so it waits for
+ * the one after.
+ */
+
+#include "rcu.h"
+#include "smp.h"
+
+extern void schedule(void);
+
+struct rcu_data {
+    volatile uint32_t qs_ctr;       /* Written by the owning CPU only */
+    uint32_t irq_nesting;
+    bool irq_from_idle;             /* Outermost interrupt left idle */
+    struct rcu_head *next_list;
+    struct rcu_head **next_tail;    /* NULL until the first call_rcu() */
+    struct rcu_head *wait_list;
+    uint32_t wait_gp;
+    uint64_t invoked;
+} __attribute__((aligned(64)));
+
+/* Valid zero-initialised, so call_rcu() works before rcu_init() */
+static struct rcu_data rcu_data[MAX_CPUS];
+
+static struct {
+    spinlock_t lock;
+    volatile uint32_t gp_seq;       /* Grace periods completed */
+    volatile bool gp_active;
+    uint32_t snap[MAX_CPUS];        /* qs_ctr values when the current one began */
+} rcu_state;
+
+static inline uint32_t rcu_cpu(void) {
+    uint32_t cpu = smp_processor_id();
+    return cpu < MAX_CPUS ? cpu : 0;
+}
+
+static inline bool rcu_cpu_online(uint32_t cpu) {
+    return cpu == 0 || smp_cpu_online(cpu);
+}
+
+static inline uint32_t qs_read(uint32_t cpu) {
+    return __atomic_load_n(&rcu_data[cpu].qs_ctr, __ATOMIC_ACQUIRE);
+}
+
+/* Has cpu been quiescent since its counter read snap? */
+static inline bool qs_passed(uint32_t cpu, uint32_t snap) {
+    return (snap & 1) || qs_read(cpu) != snap;
+}
+
+void rcu_qs(uint32_t cpu) {
+    struct rcu_data *rdp = &rcu_data[cpu];
+
+    /* Orders the reader's earlier loads before the report */
+    __atomic_store_n(&rdp->qs_ctr, rdp->qs_ctr + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Entering and leaving the extended quiescent state must be full
+ * barriers: nothing the CPU read before idle may be ordered after the
+ * flag, and nothing it reads afterwards before it.
+ */
+void rcu_idle_enter(uint32_t cpu) {
+    __atomic_fetch_add(&rcu_data[cpu].qs_ctr, 1, __ATOMIC_SEQ_CST);
+}
+
+void rcu_idle_exit(uint32_t cpu) {
+    __atomic_fetch_add(&rcu_data[cpu].qs_ctr, 1, __ATOMIC_SEQ_CST);
+}
+
+void rcu_irq_enter(uint32_t cpu) {
+    struct rcu_data *rdp = &rcu_data[cpu];
+
+    if (rdp->irq_nesting++ == 0 && (rdp->qs_ctr & 1)) {
+        rdp->irq_from_idle = true;
+        __atomic_fetch_add(&rdp->qs_ctr, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void rcu_irq_exit(uint32_t cpu) {
+    struct rcu_data *rdp = &rcu_data[cpu];
+
+    if (--rdp->irq_nesting == 0 && rdp->irq_from_idle) {
+        rdp->irq_from_idle = false;
+        __atomic_fetch_add(&rdp->qs_ctr, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+bool rcu_needs_cpu(uint32_t cpu) {
+    return rcu_data[cpu].next_list || rcu_data[cpu].wait_list;
+}
+
+/* ==================== Grace Periods ==================== */
+
+/* Called with rcu_state.lock held */
+static void rcu_start_gp(void) {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (rcu_cpu_online(cpu)) {
+            rcu_state.snap[cpu] = qs_read(cpu);
+        }
+    }
+    rcu_state.gp_active = true;
+}
+
+/* Called with rcu_state.lock held */
+static void rcu_try_end_gp(void) {
+    if (!rcu_state.gp_active) {
+        return;
+    }
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (rcu_cpu_online(cpu) && !qs_passed(cpu, rcu_state.snap[cpu])) {
+            return;
+        }
+    }
+
+    rcu_state.gp_active = false;
+    __atomic_store_n(&rcu_state.gp_seq, rcu_state.gp_seq + 1, __ATOMIC_RELEASE);
+}
+
+void synchronize_rcu(void) {
+    uint32_t self = rcu_cpu();
+
+    /* The caller is not a reader, so its own CPU is already quiescent */
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu == self || !rcu_cpu_online(cpu)) {
+            continue;
+        }
+
+        uint32_t snap = qs_read(cpu);
+        while (!qs_passed(cpu, snap) && rcu_cpu_online(cpu)) {
+            schedule();
+        }
+    }
+}
+
+/* ==================== Callbacks ==================== */
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    struct rcu_data *rdp = &rcu_data[rcu_cpu()];
+    unsigned long flags;
+
+    head->func = func;
+    head->next = NULL;
+
+    /* Only the tick on this CPU touches these lists besides us */
+    local_irq_save(flags);
+    if (!rdp->next_tail) {
+        rdp->next_tail = &rdp->next_list;
+    }
+    *rdp->next_tail = head;
+    rdp->next_tail = &head->next;
+    local_irq_restore(flags);
+}
+
+static void rcu_invoke(struct rcu_data *rdp, struct rcu_head *list) {
+    while (list) {
+        struct rcu_head *next = list->next;
+        list->func(list);
+        rdp->invoked++;
+        list = next;
+    }
+}
+
+/* Tick context, interrupts off */
+void rcu_check_callbacks(uint32_t cpu) {
+    struct rcu_data *rdp = &rcu_data[cpu];
+
+    if (!rdp->wait_list && !rdp->next_list && !rcu_state.gp_active) {
+        return;
+    }
+
+    /* Someone else is advancing the state, catch up on the next tick */
+    if (spin_trylock(&rcu_state.lock)) {
+        rcu_try_end_gp();
+
+        if (!rdp->wait_list && rdp->next_list) {
+            rdp->wait_list = rdp->next_list;
+            rdp->next_list = NULL;
+            rdp->next_tail = &rdp->next_list;
+
+            if (rcu_state.gp_active) {
+                rdp->wait_gp = rcu_state.gp_seq + 2;
+            } else {
+                rcu_start_gp();
+                rdp->wait_gp = rcu_state.gp_seq + 1;
+            }
+        } else if (!rcu_state.gp_active && rdp->wait_list &&
+                   (int32_t)(rcu_state.gp_seq - rdp->wait_gp) < 0) {
+            /* Our batch needs the next grace period and nobody started it */
+            rcu_start_gp();
+        }
+
+        spin_unlock(&rcu_state.lock);
+    }
+
+    if (rdp->wait_list &&
+        (int32_t)(__atomic_load_n(&rcu_state.gp_seq, __ATOMIC_ACQUIRE) -
+                  rdp->wait_gp) >= 0) {
+        struct rcu_head *list = rdp->wait_list;
+        rdp->wait_list = NULL;
+        rcu_invoke(rdp, list);
+    }
+}
+
+/* The state is static and already usable; keep what early callers queued */
+void rcu_init(void) {
+    spin_lock_init(&rcu_state.lock);
+}
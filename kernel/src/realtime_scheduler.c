@@ -24,6 +24,7 @@
 #include <stddef.h>
 #include "hal.h"
 #include "hal_core.h"
+#include "sched_deadline.h"
 
 /* Scheduling Policies */
 typedef enum {
@@ -79,6 +80,15 @@ static struct {
     } stats;
 } realtime_scheduler_system;
 
+/*
+ * SCHED_DEADLINE tasks are run by the deadline class in the SMP scheduler
+ * (sched_deadline.c); this table only mirrors their parameters. That
+ * class is only linked into SMP scheduler builds, hence weak references.
+ */
+extern int sched_dl_set_pid(int pid, uint64_t runtime, uint64_t deadline, uint64_t period) __attribute__((weak));
+extern int sched_dl_clear_pid(int pid) __attribute__((weak));
+extern int sched_dl_get_stats(int pid, sched_dl_stats_t *stats) __attribute__((weak));
+
 /* Function Prototypes */
 static int scheduler_add(uint32_t pid, uint32_t tid, sched_policy_t policy, uint32_t priority, uint64_t deadline, uint64_t runtime, uint64_t period);
 static int scheduler_update(uint32_t pid, uint32_t tid, sched_params_t *params);
@@ -102,8 +112,15 @@ int realtime_scheduler_system_init(void) {
  */
 static int scheduler_add(uint32_t pid, uint32_t tid, sched_policy_t policy, uint32_t priority, uint64_t deadline, uint64_t runtime, uint64_t period) {
     if (realtime_scheduler_system.entry_count >= realtime_scheduler_system.max_entries) return -1;
+    /* Admission control: refused if the CPU cannot guarantee the bandwidth */
+    if (policy == SCHED_DEADLINE) {
+        if (!sched_dl_set_pid || sched_dl_set_pid((int)tid, runtime, deadline, period) != 0) return -1;
+    }
     scheduler_entry_t *entry = hal_allocate(sizeof(scheduler_entry_t));
-    if (!entry) return -1;
+    if (!entry) {
+        if (policy == SCHED_DEADLINE && sched_dl_clear_pid) sched_dl_clear_pid((int)tid);
+        return -1;
+    }
     memset(entry, 0, sizeof(scheduler_entry_t));
     entry->pid = pid;
     entry->tid = tid;
@@ -112,6 +129,7 @@ static int scheduler_add(uint32_t pid, uint32_t tid, sched_policy_t policy, uint
     entry->params.deadline = deadline;
     entry->params.runtime = runtime;
     entry->params.period = period;
+    if (policy == SCHED_DEADLINE) entry->params.bandwidth = (runtime << 20) / (period ? period : deadline);
     entry->params.created_time = hal_get_tick();
     entry->active = true;
     entry->next = realtime_scheduler_system.entries;
@@ -128,6 +146,11 @@ static int scheduler_update(uint32_t pid, uint32_t tid, sched_params_t *params)
     scheduler_entry_t *entry = realtime_scheduler_system.entries;
     while (entry) {
         if (entry->pid == pid && entry->tid == tid && entry->active) {
+            if (params->policy == SCHED_DEADLINE) {
+                if (!sched_dl_set_pid || sched_dl_set_pid((int)tid, params->runtime, params->deadline, params->period) != 0) return -1;
+            } else if (entry->params.policy == SCHED_DEADLINE && sched_dl_clear_pid) {
+                sched_dl_clear_pid((int)tid);
+            }
             entry->params = *params;
             return 0;
         }
@@ -145,6 +168,7 @@ static int scheduler_remove(uint32_t pid, uint32_t tid) {
         if ((*current)->pid == pid && (*current)->tid == tid) {
             scheduler_entry_t *entry = *current;
             *current = entry->next;
+            if (entry->params.policy == SCHED_DEADLINE && sched_dl_clear_pid) sched_dl_clear_pid((int)tid);
             hal_free(entry);
             realtime_scheduler_system.entry_count--;
             return 0;
@@ -158,6 +182,17 @@ static int scheduler_remove(uint32_t pid, uint32_t tid) {
  * Aggregate statistics for reporting
  */
 static void scheduler_aggregate_stats(void) {
+    uint64_t missed = 0;
+    for (scheduler_entry_t *entry = realtime_scheduler_system.entries; entry; entry = entry->next) {
+        sched_dl_stats_t dl;
+        if (entry->params.policy == SCHED_DEADLINE && sched_dl_get_stats &&
+            sched_dl_get_stats((int)entry->tid, &dl) == 0) {
+            entry->params.missed_deadlines = dl.nr_missed;
+        }
+        missed += entry->params.missed_deadlines;
+    }
+    realtime_scheduler_system.stats.total_missed_deadlines = missed;
+
     hal_print("\n=== Real-Time Scheduler Statistics ===\n");
     hal_print("Total Scheduled: %llu\n", realtime_scheduler_system.stats.total_scheduled);
     hal_print("Total Runtime: %llu\n", realtime_scheduler_system.stats.total_runtime);
@@ -0,0 +1,579 @@
+/*
+ * LimitlessOS - Scheduler Benchmarks
+ *
+ * See sched_bench.h. Each benchmark spawns its tasks parked on a gate,
+ * opens the gate, and blocks until they have all exited; the caller's
+ * task sleeps meanwhile and costs nothing. Tasks find their own slot in
+ * bench.tasks by their task pointer, since entry points take no argument.
+ *
+ * Times come from ktime_get_ns(). Task runtimes are the scheduler's own
+ * sum_exec_runtime, which is charged at tick granularity.
+ *
+ * Copyright (c) 2024 LimitlessOS Project
+ */
+
+#include "sched_bench.h"
+#include "smp_scheduler.h"
+#include "hrtimer.h"
+#include "kernel.h"
+#include <string.h>
+
+typedef struct bench_task {
+    task_t *task;
+    uint32_t peer;              // Other half of a pair
+    bool hog;                   // Runs until bench.stop, not counted in bench.left
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t count;             // Benchmark-specific
+
+    // Wakeup pairs, on the sleeper
+    volatile uint32_t ready;    // Sleeper is about to block
+    volatile uint32_t go;       // 0 wait, 1 woken, 2 quit
+    uint64_t stamp;             // When the waker called wake_up_process()
+
+    // Pipe pairs, the channel this task reads from
+    volatile uint32_t full;
+    uint32_t data;
+} bench_task_t;
+
+static struct {
+    bench_task_t tasks[SCHED_BENCH_MAX_TASKS];
+    uint32_t nr_tasks;
+    task_t *coordinator;
+    const sched_bench_params_t *params;
+
+    volatile uint32_t gate;
+    volatile uint32_t stop;
+    volatile uint32_t left;
+    volatile uint32_t hogs_left;
+
+    uint32_t *samples;
+    uint32_t max_samples;
+    volatile uint32_t nr_samples;
+    volatile uint32_t samples_done;
+
+    struct hrtimer timer;
+    volatile uint32_t timer_fired;
+} bench;
+
+/* ==================== Task Plumbing ==================== */
+
+/* Sleep until (*word == value) == equal */
+static void bench_block(volatile uint32_t *word, uint32_t value, bool equal) {
+    task_t *self = current;
+
+    for (;;) {
+        self->state = TASK_INTERRUPTIBLE;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) == equal) {
+            break;
+        }
+        schedule();
+    }
+    self->state = TASK_RUNNING;
+}
+
+static void spin_ns(uint64_t ns) {
+    uint64_t end = ktime_get_ns() + ns;
+
+    while (ktime_get_ns() < end) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+static uint32_t nr_online(void) {
+    uint32_t n = cpu_mask_weight(&cpu_online_mask);
+    return n ? n : 1;
+}
+
+/* Created but not started; cpu < 0 leaves it free to run anywhere */
+static bench_task_t *bench_spawn(void (*fn)(void), const char *name, int cpu, bool hog) {
+    bench_task_t *bt;
+    task_t *t;
+
+    if (bench.nr_tasks >= SCHED_BENCH_MAX_TASKS) {
+        return NULL;
+    }
+    t = sched_create_task(fn, name);
+    if (!t) {
+        return NULL;
+    }
+    if (cpu >= 0) {
+        cpu_mask_clear(&t->cpu_affinity);
+        cpu_mask_set_cpu(cpu, &t->cpu_affinity);
+        t->last_cpu = cpu;
+    }
+
+    bt = &bench.tasks[bench.nr_tasks++];
+    memset(bt, 0, sizeof(*bt));
+    bt->task = t;
+    bt->hog = hog;
+    __atomic_add_fetch(hog ? &bench.hogs_left : &bench.left, 1, __ATOMIC_RELAXED);
+    return bt;
+}
+
+/* First thing a benchmark task does: find its slot, wait for the gate */
+static bench_task_t *bench_enter(void) {
+    task_t *self = current;
+    bench_task_t *bt = NULL;
+
+    for (uint32_t i = 0; i < bench.nr_tasks; i++) {
+        if (bench.tasks[i].task == self) {
+            bt = &bench.tasks[i];
+            break;
+        }
+    }
+
+    bench_block(&bench.gate, 1, true);
+    bt->start_ns = ktime_get_ns();
+    return bt;
+}
+
+static void bench_exit(bench_task_t *bt) {
+    volatile uint32_t *left = bt->hog ? &bench.hogs_left : &bench.left;
+
+    bt->end_ns = ktime_get_ns();
+    if (__atomic_sub_fetch(left, 1, __ATOMIC_ACQ_REL) == 0) {
+        wake_up_process(bench.coordinator);
+    }
+    sched_exit(0);
+}
+
+/* Start everything spawned; returns when the gate opened */
+static uint64_t bench_start(void) {
+    uint64_t t0;
+
+    for (uint32_t i = 0; i < bench.nr_tasks; i++) {
+        wake_up_new_task(bench.tasks[i].task);
+    }
+
+    t0 = ktime_get_ns();
+    __atomic_store_n(&bench.gate, 1, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < bench.nr_tasks; i++) {
+        wake_up_process(bench.tasks[i].task);
+    }
+    return t0;
+}
+
+/* Wait for the measured tasks, then stop the hogs and wait for them */
+static void bench_finish(void) {
+    bench_block(&bench.left, 0, true);
+    __atomic_store_n(&bench.stop, 1, __ATOMIC_RELEASE);
+    bench_block(&bench.hogs_left, 0, true);
+}
+
+static void bench_reap(void) {
+    for (uint32_t i = 0; i < bench.nr_tasks; i++) {
+        sched_destroy_task(bench.tasks[i].task);
+    }
+    bench.nr_tasks = 0;
+    bench.gate = 0;
+    bench.stop = 0;
+    bench.left = 0;
+    bench.hogs_left = 0;
+}
+
+/* Abandon a benchmark whose tasks could not all be created */
+static int bench_abort(void) {
+    if (bench.nr_tasks) {
+        bench_start();
+        __atomic_store_n(&bench.stop, 1, __ATOMIC_RELEASE);
+        bench_finish();
+    }
+    bench_reap();
+    return -1;
+}
+
+static enum hrtimer_restart bench_timer_fn(struct hrtimer *timer) {
+    (void)timer;
+    __atomic_store_n(&bench.timer_fired, 1, __ATOMIC_RELEASE);
+    wake_up_process(bench.coordinator);
+    return HRTIMER_NORESTART;
+}
+
+static void bench_sleep_ms(uint32_t ms) {
+    bench.timer_fired = 0;
+    hrtimer_init(&bench.timer, bench_timer_fn);
+    hrtimer_start(&bench.timer, (uint64_t)ms * NSEC_PER_MSEC, HRTIMER_MODE_REL);
+    bench_block(&bench.timer_fired, 1, true);
+}
+
+/* Busy loop that gives way at the scheduler's request */
+static void hog_task(void) {
+    bench_task_t *self = bench_enter();
+    uint64_t runtime = self->task->se.sum_exec_runtime;
+
+    while (!__atomic_load_n(&bench.stop, __ATOMIC_ACQUIRE)) {
+        for (volatile uint32_t i = 0; i < 1000; i++) {
+        }
+        if (need_resched()) {
+            schedule();
+        }
+    }
+
+    self->count = self->task->se.sum_exec_runtime - runtime;
+    bench_exit(self);
+}
+
+// kprintf only takes 32-bit integers; buf needs room for 20 digits and a NUL
+static const char *u64_str(uint64_t v, char *buf) {
+    char *p = buf + 20;
+
+    *p = '\0';
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    return p;
+}
+
+static void print_line(const char *name, const char *k1, uint64_t v1, const char *k2, uint64_t v2) {
+    char b1[21], b2[21];
+
+    kprintf("SCHEDBENCH name=%s %s=%s %s=%s\n", name, k1, u64_str(v1, b1), k2, u64_str(v2, b2));
+}
+
+/* ==================== Context Switch ==================== */
+
+static void ctxsw_task(void) {
+    bench_task_t *self = bench_enter();
+    uint64_t switches = self->task->nvcsw;
+
+    for (uint32_t i = 0; i < bench.params->ctxsw_iters; i++) {
+        sched_yield();
+    }
+
+    self->count = self->task->nvcsw - switches;
+    bench_exit(self);
+}
+
+int sched_bench_ctxsw(const sched_bench_params_t *params, sched_bench_result_t *res) {
+    int cpu = (int)smp_processor_id();
+    uint64_t first = UINT64_MAX, last = 0;
+
+    bench.params = params;
+    for (int i = 0; i < 2; i++) {
+        if (!bench_spawn(ctxsw_task, "bench-ctxsw", cpu, false)) {
+            return bench_abort();
+        }
+    }
+
+    bench_start();
+    bench_finish();
+
+    res->ctxsw_switches = 0;
+    for (uint32_t i = 0; i < bench.nr_tasks; i++) {
+        res->ctxsw_switches += bench.tasks[i].count;
+        first = bench.tasks[i].start_ns < first ? bench.tasks[i].start_ns : first;
+        last = bench.tasks[i].end_ns > last ? bench.tasks[i].end_ns : last;
+    }
+    res->ctxsw_ns = res->ctxsw_switches ? (last - first) / res->ctxsw_switches : 0;
+    bench_reap();
+
+    print_line("ctxsw", "switches", res->ctxsw_switches, "ns_per_switch", res->ctxsw_ns);
+    return 0;
+}
+
+/* ==================== Wakeup Latency ==================== */
+
+static void wakeup_waker(void) {
+    bench_task_t *self = bench_enter();
+    bench_task_t *sleeper = &bench.tasks[self->peer];
+    uint32_t seed = (uint32_t)self->task->pid;
+
+    while (!__atomic_load_n(&bench.samples_done, __ATOMIC_ACQUIRE)) {
+        if (!__atomic_load_n(&sleeper->ready, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+            continue;
+        }
+        sleeper->ready = 0;
+
+        // Think for 0-63us, like a request being handled, then wake
+        seed = seed * 1103515245 + 12345;
+        spin_ns(((seed >> 16) & 63) * NSEC_PER_USEC);
+
+        sleeper->stamp = ktime_get_ns();
+        __atomic_store_n(&sleeper->go, 1, __ATOMIC_RELEASE);
+        wake_up_process(sleeper->task);
+    }
+
+    __atomic_store_n(&sleeper->go, 2, __ATOMIC_RELEASE);
+    wake_up_process(sleeper->task);
+    bench_exit(self);
+}
+
+static void wakeup_sleeper(void) {
+    bench_task_t *self = bench_enter();
+
+    for (;;) {
+        uint32_t woken = 1;
+        uint32_t idx;
+
+        // Consume the last wakeup; a quit stays put
+        __atomic_compare_exchange_n(&self->go, &woken, 0, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        if (self->go == 2) {
+            break;
+        }
+
+        __atomic_store_n(&self->ready, 1, __ATOMIC_RELEASE);
+        bench_block(&self->go, 0, false);
+        if (self->go == 2) {
+            break;
+        }
+
+        uint64_t lat = ktime_get_ns() - self->stamp;
+        idx = __atomic_fetch_add(&bench.nr_samples, 1, __ATOMIC_RELAXED);
+        if (idx >= bench.max_samples) {
+            __atomic_store_n(&bench.samples_done, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        bench.samples[idx] = lat > UINT32_MAX ? UINT32_MAX : (uint32_t)lat;
+        self->count++;
+    }
+
+    bench_exit(self);
+}
+
+static void sift_down(uint32_t *a, uint32_t root, uint32_t n) {
+    for (;;) {
+        uint32_t child = 2 * root + 1;
+        uint32_t tmp;
+
+        if (child >= n) {
+            return;
+        }
+        if (child + 1 < n && a[child + 1] > a[child]) {
+            child++;
+        }
+        if (a[root] >= a[child]) {
+            return;
+        }
+        tmp = a[root];
+        a[root] = a[child];
+        a[child] = tmp;
+        root = child;
+    }
+}
+
+static void sort_u32(uint32_t *a, uint32_t n) {
+    for (uint32_t i = n / 2; i-- > 0;) {
+        sift_down(a, i, n);
+    }
+    for (uint32_t end = n; end-- > 1;) {
+        uint32_t tmp = a[0];
+        a[0] = a[end];
+        a[end] = tmp;
+        sift_down(a, 0, end);
+    }
+}
+
+int sched_bench_wakeup(const sched_bench_params_t *params, sched_bench_result_t *res) {
+    uint32_t pairs = params->wakeup_pairs ? params->wakeup_pairs : nr_online();
+    uint32_t hogs = params->wakeup_hogs ? params->wakeup_hogs : nr_online();
+    uint32_t n;
+
+    if (2 * pairs + hogs > SCHED_BENCH_MAX_TASKS) {
+        pairs = (SCHED_BENCH_MAX_TASKS - hogs) / 2;
+    }
+
+    bench.params = params;
+    bench.max_samples = params->wakeup_samples < SCHED_BENCH_MAX_SAMPLES ?
+                        params->wakeup_samples : SCHED_BENCH_MAX_SAMPLES;
+    bench.samples = (uint32_t*)kmalloc(bench.max_samples * sizeof(uint32_t));
+    if (!bench.samples || !bench.max_samples) {
+        kfree(bench.samples);
+        return -1;
+    }
+    bench.nr_samples = 0;
+    bench.samples_done = 0;
+
+    for (uint32_t i = 0; i < pairs; i++) {
+        bench_task_t *waker = bench_spawn(wakeup_waker, "bench-waker", -1, false);
+        bench_task_t *sleeper = bench_spawn(wakeup_sleeper, "bench-sleeper", -1, false);
+        if (!waker || !sleeper) {
+            kfree(bench.samples);
+            return bench_abort();
+        }
+        waker->peer = (uint32_t)(sleeper - bench.tasks);
+        sleeper->peer = (uint32_t)(waker - bench.tasks);
+    }
+    for (uint32_t i = 0; i < hogs; i++) {
+        if (!bench_spawn(hog_task, "bench-hog", -1, true)) {
+            kfree(bench.samples);
+            return bench_abort();
+        }
+    }
+
+    bench_start();
+    bench_finish();
+    bench_reap();
+
+    n = bench.nr_samples < bench.max_samples ? bench.nr_samples : bench.max_samples;
+    sort_u32(bench.samples, n);
+    res->wakeup_samples = n;
+    res->wakeup_p50_ns = sched_bench_percentile(bench.samples, n, 500);
+    res->wakeup_p99_ns = sched_bench_percentile(bench.samples, n, 990);
+    res->wakeup_p999_ns = sched_bench_percentile(bench.samples, n, 999);
+    res->wakeup_max_ns = n ? bench.samples[n - 1] : 0;
+    kfree(bench.samples);
+    bench.samples = NULL;
+
+    kprintf("SCHEDBENCH name=wakeup samples=%u pairs=%u hogs=%u p50_ns=%u p99_ns=%u p999_ns=%u max_ns=%u\n",
+            n, pairs, hogs, (uint32_t)res->wakeup_p50_ns, (uint32_t)res->wakeup_p99_ns,
+            (uint32_t)res->wakeup_p999_ns, (uint32_t)res->wakeup_max_ns);
+    return 0;
+}
+
+/* ==================== Fairness ==================== */
+
+int sched_bench_fair(const sched_bench_params_t *params, sched_bench_result_t *res) {
+    uint32_t hogs = params->fair_hogs ? params->fair_hogs : 2 * nr_online();
+    uint64_t runtime[SCHED_BENCH_MAX_TASKS];
+    uint64_t min = UINT64_MAX, max = 0;
+
+    if (hogs > SCHED_BENCH_MAX_TASKS) {
+        hogs = SCHED_BENCH_MAX_TASKS;
+    }
+
+    bench.params = params;
+    for (uint32_t i = 0; i < hogs; i++) {
+        if (!bench_spawn(hog_task, "bench-fair", -1, true)) {
+            return bench_abort();
+        }
+    }
+
+    bench_start();
+    bench_sleep_ms(params->fair_ms);
+    bench_finish();
+
+    // 100us units keep Jain's index in 64 bits
+    for (uint32_t i = 0; i < bench.nr_tasks; i++) {
+        uint64_t x = bench.tasks[i].count / (100 * NSEC_PER_USEC);
+        runtime[i] = x;
+        min = x < min ? x : min;
+        max = x > max ? x : max;
+    }
+    res->fair_hogs = hogs;
+    res->fair_jain = sched_bench_jain(runtime, bench.nr_tasks);
+    res->fair_min_pct = max ? (uint32_t)(min * 100 / max) : 0;
+    bench_reap();
+
+    kprintf("SCHEDBENCH name=fair hogs=%u ms=%u jain_x1000=%u min_pct=%u\n",
+            hogs, params->fair_ms, res->fair_jain, res->fair_min_pct);
+    return 0;
+}
+
+/* ==================== Pipe Ping-Pong ==================== */
+
+/* One-slot pipe into 'to'; the writer sleeps while it is full */
+static void pipe_write(bench_task_t *to, uint32_t data) {
+    bench_block(&to->full, 0, true);
+    to->data = data;
+    __atomic_store_n(&to->full, 1, __ATOMIC_RELEASE);
+
+    // The writer goes on to wait for the reply, so the reader may have its CPU
+    wake_up_process_sync(to->task);
+}
+
+static uint32_t pipe_read(bench_task_t *self, bench_task_t *from) {
+    uint32_t data;
+
+    bench_block(&self->full, 1, true);
+    data = self->data;
+    __atomic_store_n(&self->full, 0, __ATOMIC_RELEASE);
+    wake_up_process(from->task);
+    return data;
+}
+
+static void pipe_ping(void) {
+    bench_task_t *self = bench_enter();
+    bench_task_t *peer = &bench.tasks[self->peer];
+
+    for (uint32_t i = 0; i < bench.params->pipe_msgs; i++) {
+        pipe_write(peer, i);
+        if (pipe_read(self, peer) == i) {
+            self->count++;
+        }
+    }
+    bench_exit(self);
+}
+
+static void pipe_pong(void) {
+    bench_task_t *self = bench_enter();
+    bench_task_t *peer = &bench.tasks[self->peer];
+
+    for (uint32_t i = 0; i < bench.params->pipe_msgs; i++) {
+        pipe_write(peer, pipe_read(self, peer));
+    }
+    bench_exit(self);
+}
+
+int sched_bench_pipe(const sched_bench_params_t *params, sched_bench_result_t *res) {
+    uint32_t pairs = params->pipe_pairs ? params->pipe_pairs : nr_online();
+    uint64_t t0, elapsed, rtt_sum = 0;
+    char b1[21], b2[21], b3[21];
+
+    if (2 * pairs > SCHED_BENCH_MAX_TASKS) {
+        pairs = SCHED_BENCH_MAX_TASKS / 2;
+    }
+
+    bench.params = params;
+    for (uint32_t i = 0; i < pairs; i++) {
+        bench_task_t *ping = bench_spawn(pipe_ping, "bench-ping", -1, false);
+        bench_task_t *pong = bench_spawn(pipe_pong, "bench-pong", -1, false);
+        if (!ping || !pong) {
+            return bench_abort();
+        }
+        ping->peer = (uint32_t)(pong - bench.tasks);
+        pong->peer = (uint32_t)(ping - bench.tasks);
+    }
+
+    t0 = bench_start();
+    bench_finish();
+    elapsed = ktime_get_ns() - t0;
+
+    res->pipe_round_trips = 0;
+    for (uint32_t i = 0; i < bench.nr_tasks; i += 2) {
+        bench_task_t *ping = &bench.tasks[i];
+        res->pipe_round_trips += ping->count;
+        if (ping->count) {
+            rtt_sum += (ping->end_ns - ping->start_ns) / ping->count;
+        }
+    }
+    res->pipe_rtt_ns = rtt_sum / pairs;
+    res->pipe_msgs_per_sec = elapsed ? 2 * res->pipe_round_trips * NSEC_PER_SEC / elapsed : 0;
+    bench_reap();
+
+    kprintf("SCHEDBENCH name=pipe pairs=%u round_trips=%s rtt_ns=%s msgs_per_sec=%s\n",
+            pairs, u64_str(res->pipe_round_trips, b1), u64_str(res->pipe_rtt_ns, b2),
+            u64_str(res->pipe_msgs_per_sec, b3));
+    return 0;
+}
+
+/* ==================== Suite ==================== */
+
+int sched_bench_run(const sched_bench_params_t *params, sched_bench_result_t *res) {
+    static const sched_bench_params_t defaults = SCHED_BENCH_PARAMS_DEFAULT;
+    int ret = 0;
+
+    if (!current || !res) {
+        return -1;
+    }
+    if (!params) {
+        params = &defaults;
+    }
+
+    memset(res, 0, sizeof(*res));
+    bench.coordinator = current;
+
+    kprintf("SCHEDBENCH name=start cpus=%u tsc_khz=%u\n", nr_online(), tsc_khz);
+
+    if (sched_bench_ctxsw(params, res) < 0) ret = -1;
+    if (sched_bench_wakeup(params, res) < 0) ret = -1;
+    if (sched_bench_fair(params, res) < 0) ret = -1;
+    if (sched_bench_pipe(params, res) < 0) ret = -1;
+
+    kprintf("SCHEDBENCH name=end status=%u\n", ret == 0 ? 0 : 1);
+    return ret;
+}
@@ -0,0 +1,102 @@
+/*
+ * LimitlessOS - scheduler.c API on the SMP scheduler
+ *
+ * The sched-bench kernel links smp_scheduler.c in place of scheduler.c,
+ * but the boot path, writeback and khugepaged still use the old task API.
+ * This file provides that API on top of the SMP scheduler and starts the
+ * benchmarks once the scheduler is up. Callers only ever hold task_t
+ * pointers, so handing them SMP task_structs is fine.
+ *
+ * Copyright (c) 2024 LimitlessOS Project
+ */
+
+#include "smp_scheduler.h"
+#include "smp.h"
+#include "apic.h"
+#include "acpi.h"
+#include "hrtimer.h"
+#include "sched_bench.h"
+#include "kernel.h"
+
+uint64_t hal_timer_get_frequency(void);
+
+/* On the sleeper's stack; the timer comes first so the callback can cast */
+struct compat_sleep {
+    struct hrtimer timer;
+    task_t *task;
+};
+
+static enum hrtimer_restart compat_sleep_fn(struct hrtimer *timer) {
+    struct compat_sleep *sleep = (struct compat_sleep *)timer;
+
+    wake_up_process(sleep->task);
+    return HRTIMER_NORESTART;
+}
+
+static void sched_bench_main(void) {
+    sched_bench_result_t res;
+
+    sched_bench_run(NULL, &res);
+    sched_exit(0);
+}
+
+int scheduler_init(void) {
+    task_t *bench;
+
+    /* smp_init() sizes the runqueues and needs the MADT and local APIC */
+    if (acpi_init() < 0) {
+        kprintf("[SCHED] ACPI unavailable, running on the boot CPU\n");
+    }
+    apic_init();
+    smp_init();
+
+    if (sched_init() < 0) {
+        return -1;
+    }
+
+    bench = sched_create_task(sched_bench_main, "sched_bench");
+    if (!bench) {
+        return -1;
+    }
+    wake_up_new_task(bench);
+    return 0;
+}
+
+task_t *create_task(void (*entry)(void)) {
+    task_t *task = sched_create_task(entry, NULL);
+
+    if (task) {
+        wake_up_new_task(task);
+    }
+    return task;
+}
+
+task_t *get_running_task(void) {
+    return current;
+}
+
+/* ticks are HAL timer ticks, 0 sleeps until task_wake() */
+void task_sleep(uint64_t ticks) {
+    struct compat_sleep sleep;
+    uint64_t freq = hal_timer_get_frequency();
+
+    sleep.task = current;
+    current->state = TASK_INTERRUPTIBLE;
+    if (ticks && freq) {
+        hrtimer_init(&sleep.timer, compat_sleep_fn);
+        hrtimer_start(&sleep.timer, ticks * NSEC_PER_SEC / freq, HRTIMER_MODE_REL);
+    }
+
+    schedule();
+
+    if (ticks && freq) {
+        hrtimer_cancel(&sleep.timer);
+    }
+    current->state = TASK_RUNNING;
+}
+
+void task_wake(task_t *task) {
+    if (task) {
+        wake_up_process(task);
+    }
+}
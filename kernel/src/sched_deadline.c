@@ -0,0 +1,416 @@
+/**
+ * Deadline Scheduling Class for LimitlessOS
+ *
+ * Earliest Deadline First over per-CPU trees, with each task confined
+ * to its reservation by a Constant Bandwidth Server:
+ *
+ *  - Running consumes the job's runtime. When it reaches zero the task
+ *    is throttled, off the tree, until its next period starts; then
+ *    the budget is refilled and the deadline pushed out by a period.
+ *    An overrun is paid back out of the following budgets.
+ *  - On wakeup a task keeps its old deadline and budget only if using
+ *    that budget before that deadline stays within its bandwidth;
+ *    otherwise it starts a fresh job with deadline now + dl_deadline.
+ *
+ * Admission control keeps the reserved bandwidth on every CPU under
+ * DL_MAX_BW, which is what lets EDF meet every deadline, and leaves the
+ * remainder for RT and CFS. Deadline tasks do not migrate: the load
+ * balancer only moves CFS tasks, so a reservation is per CPU and a task
+ * should be given its affinity before it asks for one.
+ *
+ * Budgets are enforced from the tick, so a task may overrun by up to a
+ * tick; the overrun comes out of its next period.
+ *
+ * Copyright (c) 2024 LimitlessOS Project
+ */
+
+#include "smp_scheduler.h"
+#include "kernel.h"
+#include <string.h>
+
+/* Share of each CPU that deadline tasks may reserve */
+#define DL_MAX_BW           ((95 * BW_UNIT) / 100)
+
+/* Shortest budget worth enforcing, and the longest that fits BW_SHIFT */
+#define DL_MIN_RUNTIME      (1ULL << 10)
+#define DL_MAX_RUNTIME      (1ULL << (63 - BW_SHIFT))
+
+/* Scale used to keep the CBS cross-multiplication in 64 bits */
+#define DL_SCALE            10
+
+static inline bool dl_time_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+static inline uint64_t to_ratio(uint64_t period, uint64_t runtime) {
+    return (runtime << BW_SHIFT) / period;
+}
+
+/* ==================== EDF Tree ==================== */
+
+static bool dl_entity_before(const struct rb_node *a, const struct rb_node *b) {
+    const task_t *ta = rb_entry(a, task_t, dl.rb_node);
+    const task_t *tb = rb_entry(b, task_t, dl.rb_node);
+    return dl_time_before(ta->dl.deadline, tb->dl.deadline);
+}
+
+static void __enqueue_dl(cpu_runqueue_t *rq, task_t *p) {
+    rb_add_cached(&p->dl.rb_node, &rq->dl.root, dl_entity_before);
+    rq->dl.nr_running++;
+}
+
+static void __dequeue_dl(cpu_runqueue_t *rq, task_t *p) {
+    if (RB_EMPTY_NODE(&p->dl.rb_node)) {
+        return;
+    }
+    rb_erase_cached(&p->dl.rb_node, &rq->dl.root);
+    RB_CLEAR_NODE(&p->dl.rb_node);
+    rq->dl.nr_running--;
+}
+
+/* ==================== CBS ==================== */
+
+/* A new job: full budget, deadline relative to now */
+static void replenish_dl_new(dl_sched_entity_t *dl, uint64_t now) {
+    dl->deadline = now + dl->dl_deadline;
+    dl->runtime = (int64_t)dl->dl_runtime;
+    dl->dl_missed = false;
+}
+
+/* Next period(s) of a throttled task; overruns carry over */
+static void replenish_dl(dl_sched_entity_t *dl) {
+    while (dl->runtime <= 0) {
+        dl->deadline += dl->dl_period;
+        dl->runtime += (int64_t)dl->dl_runtime;
+    }
+    dl->dl_missed = false;
+}
+
+/*
+ * Would running out the remaining budget before the current deadline
+ * exceed the reserved bandwidth, runtime / (deadline - now) >
+ * dl_runtime / dl_period? Cross-multiplied, after scaling both sides
+ * down so the products fit.
+ */
+static bool dl_entity_overflow(dl_sched_entity_t *dl, uint64_t now) {
+    uint64_t left, right;
+
+    if (!dl_time_before(now, dl->deadline) || dl->runtime <= 0) {
+        return true;
+    }
+
+    left = (dl->dl_period >> DL_SCALE) * ((uint64_t)dl->runtime >> DL_SCALE);
+    right = ((dl->deadline - now) >> DL_SCALE) * (dl->dl_runtime >> DL_SCALE);
+    return right < left;
+}
+
+/* Start of the period after the current job's */
+static inline uint64_t dl_next_period(dl_sched_entity_t *dl) {
+    return dl->deadline - dl->dl_deadline + dl->dl_period;
+}
+
+static void dl_throttle(cpu_runqueue_t *rq, task_t *p) {
+    dl_sched_entity_t *dl = &p->dl;
+
+    __dequeue_dl(rq, p);
+    dl->dl_throttled = true;
+    dl->nr_throttled++;
+    hrtimer_start(&dl->dl_timer, dl_next_period(dl), HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart dl_task_timer(struct hrtimer *timer) {
+    task_t *p = container_of(timer, task_t, dl.dl_timer);
+    cpu_runqueue_t *rq = task_rq(p);
+    dl_sched_entity_t *dl = &p->dl;
+
+    spin_lock(&rq->lock);
+
+    if (p->sched_class == SCHED_CLASS_DEADLINE && dl->dl_throttled) {
+        update_rq_clock(rq);
+        dl->dl_throttled = false;
+        replenish_dl(dl);
+
+        /* Throttled for longer than the overrun it was paying for */
+        if (!dl_time_before(rq->clock, dl->deadline)) {
+            replenish_dl_new(dl, rq->clock);
+        }
+
+        /* A running task is requeued by schedule(), a sleeper on wakeup */
+        if (p->state == TASK_READY && p != rq->curr) {
+            __enqueue_dl(rq, p);
+            if (dl_should_preempt(rq, p)) {
+                resched_curr(rq);
+            }
+        }
+    }
+
+    spin_unlock(&rq->lock);
+    return HRTIMER_NORESTART;
+}
+
+/* Account delta ns of execution to the current job */
+static void dl_charge(cpu_runqueue_t *rq, task_t *p, uint64_t delta) {
+    dl_sched_entity_t *dl = &p->dl;
+
+    dl->runtime -= (int64_t)delta;
+
+    if (!dl->dl_missed && !dl_time_before(rq->clock_task, dl->deadline)) {
+        dl->dl_missed = true;
+        dl->nr_missed++;
+    }
+
+    if (dl->runtime <= 0 && !dl->dl_throttled) {
+        dl_throttle(rq, p);
+    }
+}
+
+/* ==================== Class Hooks ==================== */
+
+void init_dl_rq(cpu_runqueue_t *rq) {
+    rq->dl.root = RB_ROOT_CACHED;
+    rq->dl.nr_running = 0;
+    rq->dl.total_bw = 0;
+}
+
+void init_dl_task(task_t *p) {
+    memset(&p->dl, 0, sizeof(p->dl));
+    RB_CLEAR_NODE(&p->dl.rb_node);
+    hrtimer_init(&p->dl.dl_timer, dl_task_timer);
+}
+
+void enqueue_task_dl(cpu_runqueue_t *rq, task_t *p, bool wakeup) {
+    if (wakeup) {
+        update_rq_clock(rq);
+        if (dl_entity_overflow(&p->dl, rq->clock)) {
+            replenish_dl_new(&p->dl, rq->clock);
+        }
+    }
+
+    /* dl_task_timer() queues it once the budget is back */
+    if (p->dl.dl_throttled) {
+        return;
+    }
+    __enqueue_dl(rq, p);
+}
+
+task_t *pick_next_task_dl(cpu_runqueue_t *rq) {
+    struct rb_node *left = rb_first_cached(&rq->dl.root);
+    task_t *p;
+
+    if (!left) {
+        return NULL;
+    }
+    p = rb_entry(left, task_t, dl.rb_node);
+    __dequeue_dl(rq, p);
+    return p;
+}
+
+/* Charge curr for the time since its exec_start, e.g. when it switches out */
+void update_curr_dl(cpu_runqueue_t *rq, task_t *curr) {
+    uint64_t now = rq->clock_task;
+    int64_t delta = (int64_t)(now - curr->se.exec_start);
+
+    if (delta <= 0) {
+        return;
+    }
+    curr->se.sum_exec_runtime += (uint64_t)delta;
+    curr->se.exec_start = now;
+    dl_charge(rq, curr, (uint64_t)delta);
+}
+
+void task_tick_dl(cpu_runqueue_t *rq, task_t *curr, uint64_t delta_exec) {
+    struct rb_node *left;
+
+    dl_charge(rq, curr, delta_exec);
+    if (curr->dl.dl_throttled) {
+        resched_curr(rq);
+        return;
+    }
+
+    /* Replenishment may have queued an earlier deadline */
+    left = rb_first_cached(&rq->dl.root);
+    if (left && dl_time_before(rb_entry(left, task_t, dl.rb_node)->dl.deadline,
+                               curr->dl.deadline)) {
+        resched_curr(rq);
+    }
+}
+
+/* Does p, just queued on rq, preempt what is running there? */
+bool dl_should_preempt(cpu_runqueue_t *rq, task_t *p) {
+    task_t *curr = rq->curr;
+
+    if (!curr || curr == rq->idle || curr->sched_class != SCHED_CLASS_DEADLINE) {
+        return true;
+    }
+    return dl_time_before(p->dl.deadline, curr->dl.deadline);
+}
+
+/* The job is complete: give up the rest of the budget until the next period */
+void yield_task_dl(task_t *curr) {
+    cpu_runqueue_t *rq = task_rq(curr);
+    unsigned long flags;
+
+    spin_lock_irqsave(&rq->lock, &flags);
+    update_rq_clock(rq);
+    update_curr_dl(rq, curr);
+    if (!curr->dl.dl_throttled) {
+        curr->dl.runtime = 0;
+        dl_throttle(rq, curr);
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+/* ==================== Admission and Parameters ==================== */
+
+/* Take p off whatever queue its class keeps it on; true if it was queued */
+static bool dequeue_task_any(cpu_runqueue_t *rq, task_t *p) {
+    if (p->state != TASK_READY || p == rq->curr) {
+        return false;
+    }
+
+    switch (p->sched_class) {
+    case SCHED_CLASS_DEADLINE:
+        if (RB_EMPTY_NODE(&p->dl.rb_node)) {
+            return false;   /* Throttled */
+        }
+        __dequeue_dl(rq, p);
+        return true;
+    case SCHED_CLASS_RT:
+        list_del(&p->rt.run_list);
+        rq->rt.nr_running--;
+        return true;
+    case SCHED_CLASS_NORMAL:
+        if (RB_EMPTY_NODE(&p->se.run_node)) {
+            return false;   /* Being woken, not queued yet */
+        }
+        dequeue_task_fair(rq, p);
+        return true;
+    default:
+        return false;
+    }
+}
+
+int sched_setattr_deadline(task_t *task, uint64_t runtime, uint64_t deadline, uint64_t period) {
+    cpu_runqueue_t *rq;
+    unsigned long flags;
+    uint64_t new_bw, old_bw;
+    bool queued;
+
+    if (!task) {
+        return -1;
+    }
+    if (period == 0) {
+        period = deadline;
+    }
+    if (runtime < DL_MIN_RUNTIME || runtime >= DL_MAX_RUNTIME ||
+        runtime > deadline || deadline > period) {
+        return -1;
+    }
+
+    new_bw = to_ratio(period, runtime);
+
+    /* New parameters replenish now; a pending replenishment is stale */
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        hrtimer_cancel(&task->dl.dl_timer);
+    }
+
+    rq = task_rq(task);
+    spin_lock_irqsave(&rq->lock, &flags);
+
+    old_bw = task->sched_class == SCHED_CLASS_DEADLINE ? task->dl.dl_bw : 0;
+    if (rq->dl.total_bw - old_bw + new_bw > DL_MAX_BW) {
+        /* Keep the old parameters, and the replenishment cancelled above */
+        if (old_bw && task->dl.dl_throttled) {
+            hrtimer_start(&task->dl.dl_timer, dl_next_period(&task->dl), HRTIMER_MODE_ABS);
+        }
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return -1;
+    }
+    rq->dl.total_bw = rq->dl.total_bw - old_bw + new_bw;
+
+    /* As in sched_clear_deadline(), a throttled task is runnable but on no queue */
+    queued = dequeue_task_any(rq, task) ||
+             (task->sched_class == SCHED_CLASS_DEADLINE && task->dl.dl_throttled &&
+              task->state == TASK_READY && task != rq->curr);
+
+    task->sched_class = SCHED_CLASS_DEADLINE;
+    task->dl.dl_runtime = runtime;
+    task->dl.dl_deadline = deadline;
+    task->dl.dl_period = period;
+    task->dl.dl_bw = new_bw;
+    task->dl.dl_throttled = false;
+
+    update_rq_clock(rq);
+    replenish_dl_new(&task->dl, rq->clock);
+
+    if (queued) {
+        __enqueue_dl(rq, task);
+    }
+    if (queued || task == rq->curr) {
+        resched_curr(rq);
+    }
+
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return 0;
+}
+
+void sched_clear_deadline(task_t *task) {
+    cpu_runqueue_t *rq;
+    unsigned long flags;
+    bool queued;
+
+    if (!task || task->sched_class != SCHED_CLASS_DEADLINE) {
+        return;
+    }
+
+    /* The timer takes the runqueue lock, so it cannot be waited for under it */
+    hrtimer_cancel(&task->dl.dl_timer);
+
+    rq = task_rq(task);
+    spin_lock_irqsave(&rq->lock, &flags);
+
+    rq->dl.total_bw -= task->dl.dl_bw;
+
+    /* A throttled task is runnable but on no queue */
+    queued = dequeue_task_any(rq, task) ||
+             (task->dl.dl_throttled && task->state == TASK_READY && task != rq->curr);
+
+    task->sched_class = SCHED_CLASS_NORMAL;
+    task->dl.dl_throttled = false;
+    task->dl.dl_bw = 0;
+    task->se.vruntime = rq->cfs.min_vruntime;
+
+    if (queued) {
+        enqueue_task_fair(rq, task);
+    }
+
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+int sched_dl_set_pid(pid_t pid, uint64_t runtime, uint64_t deadline, uint64_t period) {
+    return sched_setattr_deadline(find_task_by_pid(pid), runtime, deadline, period);
+}
+
+int sched_dl_clear_pid(pid_t pid) {
+    task_t *task = find_task_by_pid(pid);
+    if (!task) {
+        return -1;
+    }
+
+    sched_clear_deadline(task);
+    return 0;
+}
+
+int sched_dl_get_stats(pid_t pid, sched_dl_stats_t *stats) {
+    task_t *task = find_task_by_pid(pid);
+    if (!task || task->sched_class != SCHED_CLASS_DEADLINE) {
+        return -1;
+    }
+
+    stats->runtime = task->dl.dl_runtime;
+    stats->deadline = task->dl.dl_deadline;
+    stats->period = task->dl.dl_period;
+    stats->nr_throttled = task->dl.nr_throttled;
+    stats->nr_missed = task->dl.nr_missed;
+    return 0;
+}
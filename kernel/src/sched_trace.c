@@ -0,0 +1,210 @@
+/*
+ * LimitlessOS - Scheduler Trace Ring
+ *
+ * See sched_trace.h. A slot's seq is 0 while it is being written and
+ * index + 1 once the event at that ring index is complete. A reader
+ * copies the event and checks seq again; if it changed, a writer lapped
+ * the reader and the event is counted as lost.
+ *
+ * The rings are per-CPU variables, so there is one for every CPU that
+ * has a per-CPU area. Before percpu_setup_boot_cpu() CPU 0 would write
+ * into the template, which is why tracing stays off until asked for.
+ */
+
+#include "kernel.h"
+#include "device.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "sched_trace.h"
+#include <string.h>
+
+#define SCHED_TRACE_MASK        (SCHED_TRACE_RING_SIZE - 1)
+
+typedef struct sched_trace_slot {
+    volatile uint32_t seq;
+    sched_trace_event_t ev;
+} sched_trace_slot_t;
+
+typedef struct sched_trace_ring {
+    volatile uint32_t head;     // Next index to write, free running
+    uint32_t tail;              // Next index to read
+    uint64_t lost;
+    uint64_t read;
+    sched_trace_slot_t slots[SCHED_TRACE_RING_SIZE];
+} __attribute__((aligned(64))) sched_trace_ring_t;
+
+volatile uint32_t sched_trace_enabled = 0;
+
+static DEFINE_PER_CPU(sched_trace_ring_t, trace_ring);
+
+// Serialises readers only; writers never take it
+static spinlock_t trace_read_lock = SPINLOCK_INIT;
+
+static inline uint64_t trace_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void __sched_trace_record(uint16_t type, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+    uint32_t cpu = smp_processor_id();
+    sched_trace_ring_t* ring = &per_cpu(trace_ring, cpu);
+    uint32_t idx = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    sched_trace_slot_t* slot = &ring->slots[idx & SCHED_TRACE_MASK];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->ev.tsc = trace_rdtsc();
+    slot->ev.type = type;
+    slot->ev.cpu = (uint16_t)cpu;
+    slot->ev.arg0 = arg0;
+    slot->ev.arg1 = arg1;
+    slot->ev.arg2 = arg2;
+
+    __atomic_store_n(&slot->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Copy the oldest complete event of one ring into ev without consuming
+// it, skipping (and counting) whatever the writer has overwritten
+static bool trace_peek_ring(sched_trace_ring_t* ring, sched_trace_event_t* ev) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    // Everything older than one ring's worth has been overwritten
+    if (head - ring->tail > SCHED_TRACE_RING_SIZE) {
+        ring->lost += head - SCHED_TRACE_RING_SIZE - ring->tail;
+        ring->tail = head - SCHED_TRACE_RING_SIZE;
+    }
+
+    while (ring->tail != head) {
+        sched_trace_slot_t* slot = &ring->slots[ring->tail & SCHED_TRACE_MASK];
+        uint32_t want = ring->tail + 1;
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == 0 || (int32_t)(seq - want) < 0) {
+            return false;   // Still being written, pick it up next time
+        }
+        if (seq == want) {
+            *ev = slot->ev;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == want) {
+                return true;
+            }
+        }
+        ring->lost++;       // Lapped by the writer while we looked
+        ring->tail++;
+    }
+
+    return false;
+}
+
+// Each ring is in TSC order, so emitting the smallest head of all of
+// them at every step yields one ordered stream
+size_t sched_trace_read(void* buf, size_t len) {
+    sched_trace_event_t* out = (sched_trace_event_t*)buf;
+    size_t max = len / sizeof(sched_trace_event_t);
+    size_t n = 0;
+    uint32_t nr_cpus = __atomic_load_n(&percpu_nr_cpus, __ATOMIC_ACQUIRE);
+
+    if (!buf || max == 0) return 0;
+
+    spin_lock(&trace_read_lock);
+    while (n < max) {
+        sched_trace_ring_t* best = NULL;
+        sched_trace_event_t ev;
+
+        for (uint32_t cpu = 0; cpu < nr_cpus; cpu++) {
+            sched_trace_ring_t* ring = &per_cpu(trace_ring, cpu);
+            if (trace_peek_ring(ring, &ev) && (!best || ev.tsc < out[n].tsc)) {
+                out[n] = ev;
+                best = ring;
+            }
+        }
+        if (!best) break;
+
+        best->tail++;
+        best->read++;
+        n++;
+    }
+    spin_unlock(&trace_read_lock);
+
+    return n * sizeof(sched_trace_event_t);
+}
+
+void sched_trace_enable(bool on) {
+    __atomic_store_n(&sched_trace_enabled, on ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+// Drop whatever is buffered; writers may keep going
+void sched_trace_reset(void) {
+    uint32_t cpu;
+
+    spin_lock(&trace_read_lock);
+    for_each_percpu_cpu(cpu) {
+        sched_trace_ring_t* ring = &per_cpu(trace_ring, cpu);
+        ring->tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        ring->lost = 0;
+        ring->read = 0;
+    }
+    spin_unlock(&trace_read_lock);
+}
+
+void sched_trace_get_stats(sched_trace_stats_t* stats) {
+    uint32_t cpu;
+
+    if (!stats) return;
+    memset(stats, 0, sizeof(*stats));
+    for_each_percpu_cpu(cpu) {
+        sched_trace_ring_t* ring = &per_cpu(trace_ring, cpu);
+        stats->recorded += __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        stats->read += ring->read;
+        stats->lost += ring->lost;
+    }
+}
+
+// /dev/sched_trace
+
+static long sched_trace_dev_read(device_t* dev, u64 offset, void* buf, size_t len) {
+    (void)dev; (void)offset;    // Consuming read, like a pipe
+    return (long)sched_trace_read(buf, len);
+}
+
+static long sched_trace_dev_write(device_t* dev, u64 offset, const void* buf, size_t len) {
+    (void)dev; (void)offset;
+    if (!buf || len == 0) return 0;
+    switch (((const char*)buf)[0]) {
+    case '0': sched_trace_enable(false); break;
+    case '1': sched_trace_enable(true); break;
+    case 'r': sched_trace_reset(); break;
+    default: return -1;
+    }
+    return (long)len;
+}
+
+static int sched_trace_dev_ioctl(device_t* dev, u32 cmd, void* arg) {
+    (void)dev;
+    switch (cmd) {
+    case SCHED_TRACE_IOC_ENABLE:  sched_trace_enable(true); return 0;
+    case SCHED_TRACE_IOC_DISABLE: sched_trace_enable(false); return 0;
+    case SCHED_TRACE_IOC_RESET:   sched_trace_reset(); return 0;
+    case SCHED_TRACE_IOC_STATS:
+        if (!arg) return -1;
+        sched_trace_get_stats((sched_trace_stats_t*)arg);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static device_ops_t sched_trace_dev_ops = {
+    .read = sched_trace_dev_read,
+    .write = sched_trace_dev_write,
+    .ioctl = sched_trace_dev_ioctl,
+};
+
+void sched_trace_init(void) {
+    device_t* dev = char_device_create("sched_trace", 10, 240);
+    if (!dev) return;
+    dev->ops = &sched_trace_dev_ops;
+    device_register(dev);
+}
@@ -4,6 +4,8 @@
 #include <mm/mm.h>
 #include "debug.h"
 #include "mm/mm.h"
+#include "sched_trace.h"
+#include "spinlock.h"
 
 // --- Scheduler Internals ---
 
@@ -19,16 +21,22 @@ static int next_task_id = 1;
 // The idle task, runs when no other task is ready
 static task_t* idle_task;
 
+// Sleeping tasks, linked through next like the ready queues. Interrupt
+// handlers wake tasks, so the lock is always taken with interrupts off.
+static task_t* sleep_queue;
+static spinlock_t sleep_lock = SPINLOCK_INIT;
+
 // Assembly function for context switching
 extern void switch_context(cpu_state_t* old, cpu_state_t* new);
 
 // --- Idle Task ---
 
 void idle_task_entry() {
+    // Hand the CPU to whatever became ready, e.g. a sleeper whose time is
+    // up, then halt until the next interrupt
     while (1) {
-        terminal_writestring("\n[IDLE] Halting CPU.");
+        schedule();
         asm volatile("hlt");
-        for (volatile int i = 0; i < 10000000; i++); // Delay
     }
 }
 
@@ -69,6 +77,9 @@ task_t* create_task(void (*entry)(void)) {
     task->state = TASK_READY;
     task->priority = 0; // Highest priority by default
     task->quantum = 10; // Default time slice
+    if (current_task) {
+        task->mempolicy = current_task->mempolicy;
+    }
 
     // Initialize the CPU context for the new task.
     // The stack needs to be set up to look like it was in the middle
@@ -94,12 +105,42 @@ task_t* create_task(void (*entry)(void)) {
     // Add the task to the highest priority ready queue
     task->next = ready_queues[0];
     ready_queues[0] = task;
+    sched_trace(SCHED_TRACE_WAKEUP, task->id, 0, 0);
 
     return task;
 }
 
+static void enqueue_ready(task_t* task) {
+    task->state = TASK_READY;
+    task->next = ready_queues[task->priority];
+    ready_queues[task->priority] = task;
+}
+
+// Ready the sleepers whose deadline has passed
+static void wake_expired(void) {
+    if (!sleep_queue) return;
+
+    unsigned long flags;
+    spin_lock_irqsave(&sleep_lock, &flags);
+    uint64_t now = hal_timer_get_ticks();
+    task_t** link = &sleep_queue;
+    while (*link) {
+        task_t* task = *link;
+        if (!task->wake_tick || now < task->wake_tick) {
+            link = &task->next;
+            continue;
+        }
+        *link = task->next;
+        sched_trace(SCHED_TRACE_WAKEUP, task->id, 0, 0);
+        // Still on the CPU: it just keeps running
+        if (task == current_task) task->state = TASK_RUNNING;
+        else enqueue_ready(task);
+    }
+    spin_unlock_irqrestore(&sleep_lock, flags);
+}
+
 void schedule() {
-    terminal_writestring("\n--- schedule() called ---");
+    wake_expired();
 
     // 1. Find the highest-priority ready task
     task_t* next_task = NULL;
@@ -107,26 +148,20 @@ void schedule() {
         if (ready_queues[i]) {
             next_task = ready_queues[i];
             ready_queues[i] = next_task->next; // Dequeue
-            terminal_writestring("\n[SCHED] Found next task with ID: ");
-            print_dec(next_task->id);
             break;
         }
     }
 
-    // If no ready tasks, run the idle task
+    // If no ready tasks, keep the current one unless it is going to sleep
+    bool runnable = current_task && current_task != idle_task &&
+                    current_task->state != TASK_SLEEPING;
     if (!next_task) {
-        next_task = idle_task;
-        terminal_writestring("\n[SCHED] No ready tasks. Selecting idle task.");
+        next_task = runnable ? current_task : idle_task;
     }
 
-    // 2. Handle the previously running task (if it's not the idle task)
-    if (current_task && current_task != idle_task) {
-        // Re-queue the current task
-        current_task->state = TASK_READY;
-        current_task->next = ready_queues[current_task->priority];
-        ready_queues[current_task->priority] = current_task;
-        terminal_writestring("\n[SCHED] Re-queuing previous task ID: ");
-        print_dec(current_task->id);
+    // 2. Re-queue the previously running task (not idle, not sleeping)
+    if (runnable && next_task != current_task) {
+        enqueue_ready(current_task);
     }
     
     // 3. Switch to the new task
@@ -134,20 +169,54 @@ void schedule() {
         task_t* old_task = current_task;
         current_task = next_task;
         current_task->state = TASK_RUNNING;
-        
-        terminal_writestring("\n[SCHED] Switching context from task ");
-        if(old_task) print_dec(old_task->id); else terminal_writestring("NULL");
-        terminal_writestring(" to task ");
-        if(current_task) print_dec(current_task->id); else terminal_writestring("NULL");
-        terminal_writestring("\n--- End of schedule() ---");
 
+        sched_trace(SCHED_TRACE_SWITCH, old_task ? old_task->id : 0,
+                    current_task->id, old_task ? old_task->state : 0);
         switch_context(&old_task->context, &current_task->context);
-    } else {
-        terminal_writestring("\n[SCHED] No task switch needed.");
-        terminal_writestring("\n--- End of schedule() ---");
     }
 }
 
+task_t* get_running_task(void) {
+    return current_task;
+}
+
+void task_sleep(uint64_t ticks) {
+    if (!current_task || current_task == idle_task) return;
+
+    unsigned long flags;
+    spin_lock_irqsave(&sleep_lock, &flags);
+    current_task->state = TASK_SLEEPING;
+    current_task->wake_tick = ticks ? hal_timer_get_ticks() + ticks : 0;
+    current_task->next = sleep_queue;
+    sleep_queue = current_task;
+    spin_unlock_irqrestore(&sleep_lock, flags);
+    schedule();
+}
+
+void task_wake(task_t* task) {
+    if (!task) return;
+
+    unsigned long flags;
+    spin_lock_irqsave(&sleep_lock, &flags);
+    if (task->state == TASK_SLEEPING) {
+        for (task_t** link = &sleep_queue; *link; link = &(*link)->next) {
+            if (*link == task) {
+                *link = task->next;
+                sched_trace(SCHED_TRACE_WAKEUP, task->id, 0, 0);
+                // Woken before it got off the CPU
+                if (task == current_task) task->state = TASK_RUNNING;
+                else enqueue_ready(task);
+                break;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&sleep_lock, flags);
+}
+
+struct mempolicy* get_task_mempolicy(void) {
+    return current_task ? &current_task->mempolicy : NULL;
+}
+
 void switch_to_task(task_t* task) {
     if (!task || task == current_task) return;
 
@@ -157,5 +226,6 @@ void switch_to_task(task_t* task) {
     old_task->state = TASK_READY;
     current_task->state = TASK_RUNNING;
 
+    sched_trace(SCHED_TRACE_SWITCH, old_task->id, current_task->id, old_task->state);
     switch_context(&old_task->context, &current_task->context);
 }
@@ -22,17 +22,22 @@
 #include "../include/atomic.h"
 #include "../include/cpu.h"
 #include "../include/numa.h"
+#include "../include/rbtree.h"
 
-// Red-Black tree for CFS runqueue
-typedef struct rb_node {
-    struct rb_node *left, *right, *parent;
-    int color;
-} rb_node_t;
+// CPU topology from smp.c (CPUID leaves 0Bh and 04h)
+extern bool smp_cores_share_cache(uint32_t cpu1, uint32_t cpu2, int cache_level);
 
-typedef struct rb_tree {
-    rb_node_t *root;
-    rb_node_t *leftmost;  // For O(1) next task selection
-} rb_tree_t;
+/*
+ * Idle CPUs of one last-level cache. idle_cpus has a bit per CPU running
+ * its idle task; idle_cores the first thread of each core whose threads
+ * all are. Updated without locks on every switch to or from idle, so
+ * idle_cores is a hint that is rechecked against idle_cpus.
+ */
+struct sched_llc {
+    struct cpumask span;
+    struct cpumask idle_cpus;
+    struct cpumask idle_cores;
+};
 
 // Per-CPU runqueue structure
 typedef struct cpu_runqueue {
@@ -40,8 +45,8 @@ typedef struct cpu_runqueue {
     uint64_t clock;               // CPU-local clock
     uint64_t prev_clock_raw;      // Previous raw timestamp
     
-    // CFS runqueue
-    rb_tree_t cfs_tree;
+    // CFS runqueue, ordered by vruntime (running task is not in the tree)
+    struct rb_root_cached cfs_tree;
     uint32_t cfs_nr_running;      // Number of CFS tasks
     uint64_t min_vruntime;        // Minimum virtual runtime
     uint64_t cfs_load_weight;     // Total load weight
@@ -58,7 +63,7 @@ typedef struct cpu_runqueue {
     
     // Deadline runqueue
     struct dl_runqueue {
-        rb_tree_t dl_tree;
+        struct rb_root_cached dl_tree;
         uint32_t dl_nr_running;
         uint64_t earliest_dl;
     } dl;
@@ -73,6 +78,9 @@ typedef struct cpu_runqueue {
     uint32_t cpu_power;           // Current power state
     bool is_performance_core;     // P-core vs E-core
     uint32_t numa_node;           // NUMA node ID
+    struct sched_llc *llc;        // Shared with every CPU on this LLC
+    struct cpumask smt_mask;      // This CPU's core, itself included
+    uint32_t core_first;          // Lowest CPU of that core
     
     // Locks and synchronization
     spinlock_t lock;
@@ -121,7 +129,7 @@ typedef struct scheduler_state {
 
 // Task scheduling entity for CFS
 typedef struct sched_entity {
-    rb_node_t run_node;           // Red-black tree node
+    struct rb_node run_node;      // Red-black tree node
     uint64_t vruntime;            // Virtual runtime
     uint64_t prev_sum_exec_runtime; // Previous sum of execution time
     uint64_t sum_exec_runtime;    // Total execution time
@@ -129,6 +137,7 @@ typedef struct sched_entity {
     
     uint32_t load_weight;         // Load weight for this task
     uint32_t inv_weight;          // Inverse weight (cached)
+    int on_rq;                    // Runnable, in the tree or running
     
     struct sched_entity *parent;  // Parent in group scheduling
     struct cfs_runqueue *cfs_rq;  // CFS runqueue this entity is on
@@ -150,7 +159,7 @@ typedef struct sched_rt_entity {
 
 // Deadline scheduling entity
 typedef struct sched_dl_entity {
-    rb_node_t rb_node;
+    struct rb_node rb_node;
     uint64_t dl_runtime;          // Remaining runtime
     uint64_t dl_deadline;         // Absolute deadline
     uint64_t dl_period;           // Period length
@@ -219,6 +228,12 @@ static int numa_preferred_nid(struct task_struct *p);
 static void update_numa_stats(struct task_struct *p);
 static int task_numa_migrate(struct task_struct *p);
 
+// Wakeup placement
+static void build_llc_masks(void);
+static void update_idle_masks(cpu_runqueue_t *rq, bool idle);
+static int find_energy_efficient_cpu(struct task_struct *p, int prev_cpu);
+static int find_numa_cpu(struct task_struct *p, int prev_cpu);
+
 // Power management integration
 static void update_cpu_power_state(uint32_t cpu_id, uint32_t power_state);
 static bool should_park_cpu(uint32_t cpu_id);
@@ -261,8 +276,7 @@ int scheduler_init(void)
         rq->prev_clock_raw = 0;
         
         // Initialize CFS runqueue
-        rq->cfs_tree.root = NULL;
-        rq->cfs_tree.leftmost = NULL;
+        rq->cfs_tree = RB_ROOT_CACHED;
         rq->cfs_nr_running = 0;
         rq->min_vruntime = 0;
         rq->cfs_load_weight = 0;
@@ -279,8 +293,7 @@ int scheduler_init(void)
         }
         
         // Initialize deadline runqueue
-        rq->dl.dl_tree.root = NULL;
-        rq->dl.dl_tree.leftmost = NULL;
+        rq->dl.dl_tree = RB_ROOT_CACHED;
         rq->dl.dl_nr_running = 0;
         rq->dl.earliest_dl = 0;
         
@@ -311,6 +324,7 @@ int scheduler_init(void)
     
     // Detect CPU topology for heterogeneous scheduling
     detect_cpu_topology(&scheduler.topology);
+    build_llc_masks();
     
     // Initialize global counters
     atomic_set(&scheduler.total_forks, 0);
@@ -369,10 +383,20 @@ static void update_curr(cpu_runqueue_t *rq)
  */
 static uint64_t calc_delta_fair(uint64_t delta, struct sched_entity *se)
 {
-    if (unlikely(se->load_weight != NICE_0_LOAD))
-        return calc_delta_mine(delta, NICE_0_LOAD, &se->load);
+    uint64_t fact;
+    int shift = WMULT_SHIFT;
+    
+    if (likely(se->load_weight == NICE_0_LOAD) || !se->inv_weight)
+        return delta;
+    
+    // delta * NICE_0_LOAD / weight, using the cached 2^32 / weight
+    fact = (uint64_t)NICE_0_LOAD * se->inv_weight;
+    while (fact >> 32) {
+        fact >>= 1;
+        shift--;
+    }
     
-    return delta;
+    return mul_u64_u32_shr(delta, (uint32_t)fact, shift);
 }
 
 /*
@@ -410,7 +434,7 @@ static uint64_t calc_delta_mine(uint64_t delta_exec, unsigned long weight,
 static void update_min_vruntime(cpu_runqueue_t *rq)
 {
     struct task_struct *curr = rq->curr;
-    rb_node_t *leftmost = rq->cfs_tree.leftmost;
+    struct rb_node *leftmost = rb_first_cached(&rq->cfs_tree);
     uint64_t vruntime = rq->min_vruntime;
     
     if (curr && curr->sched_class == &fair_sched_class) {
@@ -430,6 +454,24 @@ static void update_min_vruntime(cpu_runqueue_t *rq)
     rq->min_vruntime = max(rq->min_vruntime, vruntime);
 }
 
+static bool entity_before(const struct rb_node *a, const struct rb_node *b)
+{
+    const struct sched_entity *sa = rb_entry(a, struct sched_entity, run_node);
+    const struct sched_entity *sb = rb_entry(b, struct sched_entity, run_node);
+    
+    return (int64_t)(sa->vruntime - sb->vruntime) < 0;
+}
+
+static void __enqueue_entity(cpu_runqueue_t *rq, struct sched_entity *se)
+{
+    rb_add_cached(&se->run_node, &rq->cfs_tree, entity_before);
+}
+
+static void __dequeue_entity(cpu_runqueue_t *rq, struct sched_entity *se)
+{
+    rb_erase_cached(&se->run_node, &rq->cfs_tree);
+}
+
 /*
  * Enqueue a task in the CFS runqueue
  */
@@ -445,6 +487,7 @@ static void enqueue_task_cfs(cpu_runqueue_t *rq, struct task_struct *p, int flag
     
     // Insert into red-black tree
     __enqueue_entity(rq, se);
+    se->on_rq = 1;
     rq->cfs_nr_running++;
     rq->nr_running++;
     
@@ -469,8 +512,10 @@ static void dequeue_task_cfs(cpu_runqueue_t *rq, struct task_struct *p, int flag
     
     update_curr(rq);
     
-    // Remove from red-black tree
-    __dequeue_entity(rq, se);
+    // Remove from red-black tree; the running task was taken out when picked
+    if (!RB_EMPTY_NODE(&se->run_node))
+        __dequeue_entity(rq, se);
+    se->on_rq = 0;
     rq->cfs_nr_running--;
     rq->nr_running--;
     
@@ -489,7 +534,7 @@ static struct task_struct *pick_next_task_cfs(cpu_runqueue_t *rq)
 {
     struct sched_entity *se;
     struct task_struct *p;
-    rb_node_t *left = rq->cfs_tree.leftmost;
+    struct rb_node *left = rb_first_cached(&rq->cfs_tree);
     
     if (!left)
         return NULL;
@@ -497,6 +542,9 @@ static struct task_struct *pick_next_task_cfs(cpu_runqueue_t *rq)
     se = rb_entry(left, struct sched_entity, run_node);
     p = task_of(se);
     
+    // The running entity stays out of the tree until put_prev_task_cfs()
+    __dequeue_entity(rq, se);
+    
     se->exec_start = rq->clock;
     
     return p;
@@ -509,7 +557,7 @@ static void put_prev_task_cfs(cpu_runqueue_t *rq, struct task_struct *p)
 {
     struct sched_entity *se = &p->se;
     
-    if (rq->cfs_nr_running) {
+    if (se->on_rq && RB_EMPTY_NODE(&se->run_node)) {
         update_curr(rq);
         
         // Place the task back in the tree
@@ -556,8 +604,8 @@ static void check_preempt_tick(cpu_runqueue_t *rq, struct task_struct *curr)
     }
     
     // Check against leftmost task
-    if (rq->cfs_tree.leftmost) {
-        struct sched_entity *left_se = rb_entry(rq->cfs_tree.leftmost,
+    if (rb_first_cached(&rq->cfs_tree)) {
+        struct sched_entity *left_se = rb_entry(rb_first_cached(&rq->cfs_tree),
                                                struct sched_entity, run_node);
         
         delta = curr->se.vruntime - left_se->vruntime;
@@ -629,6 +677,9 @@ void __schedule(bool preempt)
         }
     }
     
+    if (prev->sched_class == &fair_sched_class)
+        put_prev_task_cfs(rq, prev);
+    
     // Pick next task based on scheduling class priority
     if (rq->dl.dl_nr_running) {
         next = pick_next_task_dl(rq);
@@ -644,6 +695,11 @@ void __schedule(bool preempt)
         rq->nr_switches++;
         rq->curr = next;
         
+        if (next == rq->idle)
+            update_idle_masks(rq, true);
+        else if (prev == rq->idle)
+            update_idle_masks(rq, false);
+        
         // Perform context switch
         context_switch(rq, prev, next);
         
@@ -696,114 +752,260 @@ out:
 }
 
 /*
- * Load balancing - find best CPU for task placement
+ * Wakeup placement
+ *
+ * A waking task goes to an idle CPU that shares a last-level cache with
+ * its previous CPU or with the waker, so its working set, or whatever the
+ * waker just produced for it, is still in L3. Each step below is a test
+ * on the target LLC's masks, a fixed number of words whatever the CPU
+ * count; CPUs further away are left to the load balancer.
  */
-static int select_task_rq_fair(struct task_struct *p, int prev_cpu, int sd_flag, int wake_flags)
+
+static void build_llc_masks(void)
 {
-    int cpu, new_cpu = prev_cpu;
-    int want_affine = 0;
-    int sync = wake_flags & WF_SYNC;
-    
-    if (sd_flag & SD_BALANCE_WAKE) {
-        record_wakee(p);
-        want_affine = !wake_wide(p) && cpumask_test_cpu(cpu, &p->cpus_allowed);
-    }
+    uint32_t cpu, other;
     
-    rcu_read_lock();
-    for_each_domain(cpu, tmp) {
-        if (!(tmp->flags & SD_LOAD_BALANCE))
-            break;
+    for (cpu = 0; cpu < scheduler.nr_cpus; cpu++) {
+        cpu_runqueue_t *rq = &scheduler.cpu_rq[cpu];
+        struct sched_llc *llc = NULL;
         
-        // NUMA-aware placement
-        if (tmp->flags & SD_NUMA) {
-            int numa_cpu = find_numa_cpu(p, prev_cpu);
-            if (numa_cpu != -1) {
-                new_cpu = numa_cpu;
-                break;
-            }
-        }
+        cpumask_clear(&rq->smt_mask);
+        rq->core_first = cpu;
         
-        // Performance vs efficiency core placement
-        if (tmp->flags & SD_ASYM_CPUCAPACITY) {
-            new_cpu = find_energy_efficient_cpu(p, prev_cpu);
-            break;
+        for (other = 0; other < scheduler.nr_cpus; other++) {
+            if (smp_cores_share_cache(cpu, other, 1)) {
+                cpumask_set_cpu(other, &rq->smt_mask);
+                if (other < rq->core_first)
+                    rq->core_first = other;
+            }
+            if (other < cpu && !llc && smp_cores_share_cache(cpu, other, 3))
+                llc = scheduler.cpu_rq[other].llc;
         }
         
-        if (want_affine && (tmp->flags & SD_WAKE_AFFINE) &&
-            cpumask_test_cpu(prev_cpu, sched_domain_span(tmp))) {
-            if (wake_affine(tmp, p, cpu, prev_cpu, sync))
-                new_cpu = cpu;
-            break;
+        if (!llc) {
+            llc = kzalloc(sizeof(*llc), GFP_KERNEL);
+            if (!llc)
+                continue;
         }
         
-        if (tmp->flags & sd_flag)
-            new_cpu = find_idlest_cpu(tmp, p, cpu, prev_cpu, sd_flag);
+        // Every CPU starts on its idle task
+        cpumask_set_cpu(cpu, &llc->span);
+        cpumask_set_cpu(cpu, &llc->idle_cpus);
+        cpumask_set_cpu(rq->core_first, &llc->idle_cores);
+        rq->llc = llc;
     }
-    rcu_read_unlock();
+}
+
+static void update_idle_masks(cpu_runqueue_t *rq, bool idle)
+{
+    struct sched_llc *llc = rq->llc;
+    
+    if (!llc)
+        return;
+    
+    if (idle) {
+        set_bit(rq->cpu_id, cpumask_bits(&llc->idle_cpus));
+        if (cpumask_subset(&rq->smt_mask, &llc->idle_cpus))
+            set_bit(rq->core_first, cpumask_bits(&llc->idle_cores));
+    } else {
+        clear_bit(rq->cpu_id, cpumask_bits(&llc->idle_cpus));
+        clear_bit(rq->core_first, cpumask_bits(&llc->idle_cores));
+    }
+}
+
+static inline bool cpus_share_cache(int a, int b)
+{
+    struct sched_llc *llc = scheduler.cpu_rq[a].llc;
+    
+    return llc && llc == scheduler.cpu_rq[b].llc;
+}
+
+static bool cpu_is_idle(int cpu)
+{
+    cpu_runqueue_t *rq = &scheduler.cpu_rq[cpu];
+    
+    return rq->curr == rq->idle && !rq->nr_running;
+}
+
+/*
+ * Should the wakee follow the waker? An idle CPU wins, a sync waker is
+ * about to sleep and hands over its CPU, otherwise the lighter one does.
+ */
+static bool wake_affine(struct task_struct *p, int this_cpu, int prev_cpu, int sync)
+{
+    cpu_runqueue_t *this_rq = &scheduler.cpu_rq[this_cpu];
+    cpu_runqueue_t *prev_rq = &scheduler.cpu_rq[prev_cpu];
+    uint64_t this_load = this_rq->cfs_load_weight;
     
-    return new_cpu;
+    if (cpu_is_idle(this_cpu) && cpus_share_cache(this_cpu, prev_cpu))
+        return !cpu_is_idle(prev_cpu);
+    
+    if (sync && this_rq->nr_running == 1)
+        return true;
+    
+    if (cpu_is_idle(prev_cpu))
+        return false;
+    
+    if (sync && this_rq->curr != this_rq->idle)
+        this_load -= min(this_load, (uint64_t)this_rq->curr->se.load_weight);
+    
+    return this_load + p->se.load_weight <= prev_rq->cfs_load_weight;
+}
+
+/* Idle CPU sharing target's LLC, best first; target if there is none */
+static int select_idle_sibling(struct task_struct *p, int prev_cpu, int target)
+{
+    cpu_runqueue_t *rq = &scheduler.cpu_rq[target];
+    struct sched_llc *llc = rq->llc;
+    struct cpumask cand;
+    int cpu;
+    
+    if (cpu_is_idle(target))
+        return target;
+    
+    if (prev_cpu != target && cpus_share_cache(prev_cpu, target) &&
+        cpumask_test_cpu(prev_cpu, &p->cpus_allowed) && cpu_is_idle(prev_cpu))
+        return prev_cpu;
+    
+    if (!llc)
+        return target;
+    
+    // A sibling thread shares L1 and L2 with the target as well
+    cpumask_and(&cand, &rq->smt_mask, &llc->idle_cpus);
+    cpu = cpumask_first_and(&cand, &p->cpus_allowed);
+    if (cpu < nr_cpu_ids)
+        return cpu;
+    
+    // A whole idle core, so the wakee does not share one with a busy thread
+    while ((cpu = cpumask_first_and(&llc->idle_cores, &p->cpus_allowed)) < nr_cpu_ids) {
+        if (cpumask_subset(&scheduler.cpu_rq[cpu].smt_mask, &llc->idle_cpus))
+            return cpu;
+        clear_bit(cpu, cpumask_bits(&llc->idle_cores)); // Stale hint
+    }
+    
+    // Any idle thread
+    cpu = cpumask_first_and(&llc->idle_cpus, &p->cpus_allowed);
+    return cpu < nr_cpu_ids ? cpu : target;
+}
+
+/*
+ * Load balancing - find best CPU for task placement
+ */
+static int select_task_rq_fair(struct task_struct *p, int prev_cpu, int sd_flag, int wake_flags)
+{
+    int this_cpu = smp_processor_id();
+    int sync = wake_flags & WF_SYNC;
+    int target = prev_cpu;
+    int cpu;
+    
+    if (!(sd_flag & SD_BALANCE_WAKE))
+        return prev_cpu;
+    
+    // Hybrid parts: pick the core type first, then stay cache-local within it
+    if (scheduler.topology.nr_perf_cores && scheduler.topology.nr_eff_cores) {
+        target = find_energy_efficient_cpu(p, prev_cpu);
+    } else {
+        cpu = find_numa_cpu(p, prev_cpu);
+        if (cpu != -1 && !cpus_share_cache(cpu, prev_cpu))
+            return cpu;
+    }
+    
+    if (this_cpu != target && cpumask_test_cpu(this_cpu, &p->cpus_allowed) &&
+        wake_affine(p, this_cpu, target, sync))
+        target = this_cpu;
+    
+    if (!cpumask_test_cpu(target, &p->cpus_allowed))
+        target = cpumask_first(&p->cpus_allowed);
+    
+    return select_idle_sibling(p, prev_cpu, target);
 }
 
 /*
  * Find energy-efficient CPU for heterogeneous systems
+ *
+ * Busy tasks want a P-core and light ones an E-core. Within the wanted
+ * type an idle CPU on prev_cpu's LLC is cheapest to wake into, then any
+ * idle one, then the least loaded; the energy model breaks ties.
  */
 static int find_energy_efficient_cpu(struct task_struct *p, int prev_cpu)
 {
-    unsigned long cur_energy, prev_energy, best_energy = ULONG_MAX;
-    int cpu, best_cpu = prev_cpu;
-    
-    // For CPU-intensive tasks, prefer performance cores
-    if (p->se.avg.util_avg > 750) { // High utilization threshold
-        for_each_cpu(cpu, &scheduler.topology.performance_cores) {
-            if (!cpumask_test_cpu(cpu, &p->cpus_allowed))
-                continue;
-            
-            cur_energy = compute_energy(p, cpu);
-            if (cur_energy < best_energy) {
-                best_energy = cur_energy;
-                best_cpu = cpu;
-            }
+    bool want_perf = p->se.avg.util_avg > 750; // High utilization threshold
+    const uint32_t *cores = want_perf ? scheduler.topology.performance_cores :
+                                        scheduler.topology.efficiency_cores;
+    uint32_t nr = want_perf ? scheduler.topology.nr_perf_cores :
+                              scheduler.topology.nr_eff_cores;
+    unsigned long cur_energy, best_energy = ULONG_MAX;
+    uint64_t best_load = ULLONG_MAX;
+    int best_cpu = -1, best_rank = 3;
+    uint32_t i;
+    
+    for (i = 0; i < nr; i++) {
+        int cpu = cores[i];
+        int rank;
+        uint64_t load;
+        
+        if (!cpumask_test_cpu(cpu, &p->cpus_allowed) || scheduler.cpu_rq[cpu].parked)
+            continue;
+        
+        // Compare by (rank, load, energy); idle CPUs all count as unloaded
+        if (cpu_is_idle(cpu)) {
+            rank = cpus_share_cache(cpu, prev_cpu) ? 0 : 1;
+            load = 0;
+        } else {
+            rank = 2;
+            load = scheduler.cpu_rq[cpu].cfs_load_weight;
         }
-    } else {
-        // For light tasks, prefer efficiency cores
-        for_each_cpu(cpu, &scheduler.topology.efficiency_cores) {
-            if (!cpumask_test_cpu(cpu, &p->cpus_allowed))
-                continue;
-            
-            cur_energy = compute_energy(p, cpu);
-            if (cur_energy < best_energy) {
-                best_energy = cur_energy;
-                best_cpu = cpu;
-            }
+        
+        if (rank > best_rank || (rank == best_rank && load > best_load))
+            continue;
+        
+        cur_energy = compute_energy(p, cpu);
+        if (rank < best_rank || load < best_load || cur_energy < best_energy) {
+            best_rank = rank;
+            best_load = load;
+            best_energy = cur_energy;
+            best_cpu = cpu;
         }
     }
     
-    return best_cpu;
+    return best_cpu != -1 ? best_cpu : prev_cpu;
 }
 
 /*
  * NUMA-aware CPU selection
+ *
+ * Only moves a task whose memory lives on another node. An idle CPU
+ * there is taken, sharing a cache with prev_cpu if one does; otherwise
+ * the least loaded CPU of the node.
  */
 static int find_numa_cpu(struct task_struct *p, int prev_cpu)
 {
     int preferred_nid = numa_preferred_nid(p);
-    int cpu;
+    uint64_t load, best_load = ULLONG_MAX;
+    int cpu, best_cpu = -1;
     
-    if (preferred_nid == -1)
+    if (preferred_nid == -1 || preferred_nid == (int)scheduler.cpu_rq[prev_cpu].numa_node)
         return -1;
     
-    // Find idle CPU in preferred NUMA node
     for_each_cpu_and(cpu, cpumask_of_node(preferred_nid), &p->cpus_allowed) {
-        if (idle_cpu(cpu))
-            return cpu;
+        if (cpu_is_idle(cpu)) {
+            if (cpus_share_cache(cpu, prev_cpu))
+                return cpu;
+            if (best_load) {
+                best_load = 0;
+                best_cpu = cpu;
+            }
+            continue;
+        }
+        
+        load = scheduler.cpu_rq[cpu].cfs_load_weight;
+        if (load < best_load) {
+            best_load = load;
+            best_cpu = cpu;
+        }
     }
     
-    // Find least loaded CPU in preferred NUMA node
-    cpu = cpumask_first_and(cpumask_of_node(preferred_nid), &p->cpus_allowed);
-    if (cpu < nr_cpu_ids)
-        return cpu;
-    
-    return -1;
+    return best_cpu;
 }
 
 /*
@@ -909,12 +1111,12 @@ static struct task_struct *pick_next_task_dl(cpu_runqueue_t *rq)
 {
     struct sched_dl_entity *dl_se;
     struct task_struct *p;
-    rb_node_t *left;
+    struct rb_node *left;
     
     if (!rq->dl.dl_nr_running)
         return NULL;
     
-    left = rq->dl.dl_tree.leftmost;
+    left = rb_first_cached(&rq->dl.dl_tree);
     if (!left)
         return NULL;
     
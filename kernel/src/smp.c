@@ -10,6 +10,8 @@
 #include "smp.h"
 #include "mm/mm.h"
 #include "apic.h"
+#include "idt.h"
+#include "hrtimer.h"
 #include "acpi.h"
 #include "kernel.h"
 #include <string.h>
@@ -52,6 +54,12 @@ int smp_init(void) {
     memset(cpu_data, 0, sizeof(cpu_data));
     memset(cpu_capabilities, 0, sizeof(cpu_capabilities));
     
+    /* Move the boot CPU off the per-CPU template before anyone writes it */
+    if (percpu_setup_boot_cpu() < 0) {
+        kprintf("[SMP] Failed to allocate per-CPU area for boot CPU\n");
+        return -1;
+    }
+    
     /* Set up boot CPU */
     boot_cpu_id = 0;  /* Assume boot CPU is 0 */
     cpu_info_t *boot_cpu = &cpu_data[boot_cpu_id];
@@ -59,7 +67,7 @@ int smp_init(void) {
     boot_cpu->cpu_id = boot_cpu_id;
     boot_cpu->apic_id = apic_get_id();
     boot_cpu->state = CPU_ONLINE;
-    boot_cpu->boot_time = get_ticks();
+    boot_cpu->boot_time = ktime_get_ns();
     
     /* Allocate stacks for boot CPU */
     boot_cpu->kernel_stack = pmm_alloc_page();
@@ -169,6 +177,12 @@ int smp_boot_cpu(uint32_t cpu_id) {
         return -1;
     }
     
+    /* The AP fills its per-CPU area itself in smp_init_secondary() */
+    if (percpu_alloc_cpu(cpu_id) < 0) {
+        kprintf("[SMP] Failed to allocate per-CPU area for CPU %u\n", cpu_id);
+        return -1;
+    }
+    
     /* Set up trampoline target */
     smp_trampoline_target = (uint32_t)smp_init_secondary;
     
@@ -227,11 +241,18 @@ void smp_init_secondary(void) {
     uint32_t stack_top = (uint32_t)cpu->kernel_stack + PAGE_SIZE - 16;
     asm volatile("movl %0, %%esp" :: "r"(stack_top));
     
+    /* Own copy of the per-CPU data, on a per-CPU GDT; from here on
+     * smp_processor_id() is valid */
+    percpu_init_cpu(cpu->cpu_id);
+    
     /* Initialize local APIC */
     apic_init_secondary();
     
-    /* Load GDT and IDT */
-    /* TODO: Set up per-CPU GDT/IDT */
+    /* Our own hrtimer base and tick on the local APIC timer */
+    tick_setup_cpu(cpu->cpu_id);
+    
+    /* Load the shared IDT; the APIC timer vector drives our tick */
+    idt_load();
     
     /* Enable interrupts */
     asm volatile("sti");
@@ -241,7 +262,7 @@ void smp_init_secondary(void) {
     
     /* Mark as online */
     cpu->state = CPU_ONLINE;
-    cpu->boot_time = get_ticks();
+    cpu->boot_time = ktime_get_ns();
     
     /* Initialize per-CPU scheduler */
     /* TODO: Initialize per-CPU run queue */
@@ -252,26 +273,6 @@ void smp_init_secondary(void) {
     smp_enter_idle();
 }
 
-/**
- * Get current processor ID
- */
-uint32_t smp_processor_id(void) {
-    if (!smp_enabled()) {
-        return 0;
-    }
-    
-    uint32_t apic_id = apic_get_id();
-    
-    /* Find CPU by APIC ID */
-    for (uint32_t i = 0; i < MAX_CPUS; i++) {
-        if (cpu_data[i].apic_id == apic_id && cpu_data[i].state != CPU_OFFLINE) {
-            return i;
-        }
-    }
-    
-    return 0;  /* Default to boot CPU */
-}
-
 /**
  * Get CPU data for specific CPU
  */
@@ -426,92 +427,132 @@ bool cpu_mask_empty(const cpu_mask_t *mask) {
     return true;
 }
 
-/**
- * Spinlock implementation
- */
-void spin_lock_init(spinlock_t *lock) {
-    lock->slock = 0;
-    lock->owner_cpu = 0;
-    lock->owner_pc = NULL;
-}
-
-void spin_lock(spinlock_t *lock) {
-    while (1) {
-        /* Try to acquire lock */
-        if (!__sync_lock_test_and_set(&lock->slock, 1)) {
-            lock->owner_cpu = smp_processor_id();
-            lock->owner_pc = __builtin_return_address(0);
-            break;
-        }
-        
-        /* Spin with pause instruction for better performance */
-        while (lock->slock) {
-            asm volatile("pause");
+uint32_t cpu_mask_first_and(const cpu_mask_t *a, const cpu_mask_t *b) {
+    for (size_t i = 0; i < sizeof(a->bits) / sizeof(a->bits[0]); i++) {
+        unsigned long word = a->bits[i] & b->bits[i];
+        if (word) {
+            uint32_t cpu = i * sizeof(unsigned long) * 8 + __builtin_ctzl(word);
+            return cpu < MAX_CPUS ? cpu : MAX_CPUS;
         }
     }
+    return MAX_CPUS;
 }
 
-void spin_unlock(spinlock_t *lock) {
-    lock->owner_cpu = 0;
-    lock->owner_pc = NULL;
-    __sync_lock_release(&lock->slock);
+static inline void cpuid_count(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                               uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
 }
 
-bool spin_trylock(spinlock_t *lock) {
-    if (!__sync_lock_test_and_set(&lock->slock, 1)) {
-        lock->owner_cpu = smp_processor_id();
-        lock->owner_pc = __builtin_return_address(0);
-        return true;
+/* Bits needed to number n things */
+static uint32_t count_order(uint32_t n) {
+    uint32_t order = 0;
+    while ((1U << order) < n) {
+        order++;
     }
-    return false;
+    return order;
+}
+
+/*
+ * APIC ID shift that leaves the last-level cache, from the deterministic
+ * cache parameters (CPUID.04h). Returns 0 if the leaf is not there.
+ */
+static uint32_t llc_apic_shift(void) {
+    uint32_t eax, ebx, ecx, edx, shift = 0, level = 0;
+    
+    cpuid_count(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 4) {
+        return 0;
+    }
+    
+    for (uint32_t i = 0; ; i++) {
+        cpuid_count(4, i, &eax, &ebx, &ecx, &edx);
+        if ((eax & 0x1F) == 0) {
+            break;              /* No more caches */
+        }
+        if (((eax >> 5) & 0x7) > level) {
+            level = (eax >> 5) & 0x7;
+            shift = count_order(((eax >> 14) & 0xFFF) + 1);
+        }
+    }
+    return shift;
 }
 
 /**
  * Detect CPU topology from CPUID
+ *
+ * The field widths are the same on every CPU, so they are read once here
+ * and each CPU's IDs are cut out of its APIC ID: SMT bits at the bottom,
+ * then core bits, then the package. The LLC is every CPU whose APIC ID
+ * agrees above the cache's sharing width.
  */
 void smp_detect_topology(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t smt_shift = 0, core_shift = 0, llc_shift;
+    bool has_leaf_b = false;
+    
     kprintf("[SMP] Detecting CPU topology...\n");
     
+    cpuid_count(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x0B) {
+        /* CPUID.0Bh: level 0 is SMT, level 1 core; EBX is 0 past the end */
+        cpuid_count(0x0B, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx != 0) {
+            has_leaf_b = true;
+            smt_shift = eax & 0x1F;
+            cpuid_count(0x0B, 1, &eax, &ebx, &ecx, &edx);
+            core_shift = ebx != 0 ? eax & 0x1F : smt_shift;
+        }
+    }
+    
+    llc_shift = llc_apic_shift();
+    if (!llc_shift) {
+        llc_shift = core_shift;     /* Assume the package shares it */
+    }
+    
+    cpuid_count(1, 0, &eax, &ebx, &ecx, &edx);
+    bool smt = smt_shift > 0 && (edx & (1 << 28));
+    
     for (uint32_t cpu = 0; cpu < nr_cpus_possible; cpu++) {
         cpu_info_t *cpu_info = &cpu_data[cpu];
+        uint32_t apic = cpu_info->apic_id;
         
-        /* Use CPUID to detect topology */
-        uint32_t eax, ebx, ecx, edx;
-        
-        /* Get topology info from CPUID.0Bh */
-        eax = 0x0B;
-        ecx = 0;
-        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) 
-                     : "a"(eax), "c"(ecx));
-        
-        if (eax != 0) {
-            /* Extended topology enumeration supported */
-            cpu_info->topology.thread_id = cpu_info->apic_id & ((1 << (eax & 0x1F)) - 1);
-            
-            ecx = 1;
-            asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) 
-                         : "a"(0x0B), "c"(ecx));
-            
-            cpu_info->topology.core_id = (cpu_info->apic_id >> (eax & 0x1F)) & 
-                                        ((1 << ((eax & 0x1F) - (cpu_info->topology.thread_id ? 1 : 0))) - 1);
-            
-            cpu_info->topology.package_id = cpu_info->apic_id >> (eax & 0x1F);
+        if (has_leaf_b) {
+            cpu_info->topology.thread_id = apic & ((1U << smt_shift) - 1);
+            cpu_info->topology.core_id = (apic >> smt_shift) & ((1U << (core_shift - smt_shift)) - 1);
+            cpu_info->topology.package_id = apic >> core_shift;
+            cpu_info->topology.llc_id = apic >> llc_shift;
         } else {
-            /* Fall back to basic detection */
+            /* Fall back to one package of single-threaded cores */
             cpu_info->topology.thread_id = 0;
             cpu_info->topology.core_id = cpu;
             cpu_info->topology.package_id = 0;
+            cpu_info->topology.llc_id = 0;
         }
+        cpu_info->topology.is_smt = smt;
         
-        /* Detect if SMT is enabled */
-        eax = 1;
-        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(eax));
-        cpu_info->topology.is_smt = (edx & (1 << 28)) && (ebx >> 16) > 1;
-        
-        kprintf("[SMP] CPU %u: Package %u, Core %u, Thread %u, SMT %s\n",
+        kprintf("[SMP] CPU %u: Package %u, Core %u, Thread %u, LLC %u, SMT %s\n",
                 cpu, cpu_info->topology.package_id, cpu_info->topology.core_id,
-                cpu_info->topology.thread_id, cpu_info->topology.is_smt ? "yes" : "no");
+                cpu_info->topology.thread_id, cpu_info->topology.llc_id,
+                cpu_info->topology.is_smt ? "yes" : "no");
+    }
+}
+
+/**
+ * Do two CPUs share a cache? Levels 1 and 2 are private to a core, SMT
+ * siblings included; anything above is the LLC.
+ */
+bool smp_cores_share_cache(uint32_t cpu1, uint32_t cpu2, int cache_level) {
+    if (cpu1 >= MAX_CPUS || cpu2 >= MAX_CPUS) return false;
+    if (cpu1 == cpu2) return true;
+    
+    cpu_topology_t *a = &cpu_data[cpu1].topology;
+    cpu_topology_t *b = &cpu_data[cpu2].topology;
+    
+    if (cache_level <= 2) {
+        return a->package_id == b->package_id && a->core_id == b->core_id;
     }
+    return a->llc_id == b->llc_id;
 }
 
 /**
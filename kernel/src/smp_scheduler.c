@@ -10,6 +10,10 @@
 #include "smp.h"
 #include "apic.h"
 #include "kernel.h"
+#include "sched_trace.h"
+#include "rcu.h"
+#include "hrtimer.h"
+#include "timer.h"
 #include <string.h>
 
 /* Global scheduler state */
@@ -29,6 +33,18 @@ static const unsigned long prio_to_weight[40] = {
  /*  15 */     36,     29,     23,     18,     15,
 };
 
+/* 2^32 / prio_to_weight[], so vruntime scaling is a multiply and a shift */
+static const uint32_t prio_to_wmult[40] = {
+ /* -20 */     48388,     59856,     76040,     92818,    118348,
+ /* -15 */    147320,    184698,    229616,    287308,    360437,
+ /* -10 */    449829,    563644,    704093,    875809,   1099582,
+ /*  -5 */   1376151,   1717300,   2157191,   2708050,   3363326,
+ /*   0 */   4194304,   5237765,   6557202,   8165337,  10153587,
+ /*   5 */  12820798,  15790321,  19976592,  24970740,  31350126,
+ /*  10 */  39045157,  49367440,  61356676,  76695844,  95443717,
+ /*  15 */ 119304647, 148102320, 186737708, 238609294, 286331153,
+};
+
 /* PID allocation */
 static pid_t next_pid = 1;
 static spinlock_t pid_lock = SPINLOCK_INIT;
@@ -40,6 +56,44 @@ static spinlock_t task_list_lock = SPINLOCK_INIT;
 /* Per-CPU current task */
 DEFINE_PER_CPU(task_t *, current_task);
 
+/* Why a CPU is balancing; a CPU that is about to idle pulls a single task */
+enum lb_idle_type {
+    LB_NOT_IDLE,
+    LB_IDLE,
+    LB_NEWLY_IDLE,
+};
+
+static int idle_balance(uint32_t this_cpu, cpu_runqueue_t *this_rq);
+static uint64_t rq_load(cpu_runqueue_t *rq);
+uint64_t calc_delta_fair(uint64_t delta, task_t *se);
+bool should_preempt_curr(cpu_runqueue_t *rq, task_t *curr);
+
+/* Context switch in switch.S; saves ESP into *prev and resumes from *next */
+extern void switch_context(void *prev_context, void *next_context);
+
+static inline bool time_after_eq(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) >= 0;
+}
+
+/*
+ * Idle CPUs by last-level cache, for wakeup placement. idle_cpus has a
+ * bit per CPU running its idle task; idle_cores has the first thread of
+ * each core whose threads all are. Both are updated locklessly as CPUs
+ * switch to and from idle, so idle_cores is only a hint and is checked
+ * against idle_cpus before use.
+ */
+typedef struct sched_llc {
+    cpu_mask_t span;
+    cpu_mask_t idle_cpus;
+    cpu_mask_t idle_cores;
+} sched_llc_t;
+
+static sched_llc_t *sd_llc[MAX_CPUS];
+static cpu_mask_t cpu_smt_mask[MAX_CPUS];
+static uint32_t cpu_core_first[MAX_CPUS];
+
+static void update_idle_masks(uint32_t cpu, bool idle);
+
 /**
  * Initialize the SMP scheduler
  */
@@ -57,6 +111,13 @@ int sched_init(void) {
     /* Build scheduling domains */
     sched_build_domains();
     
+    /* Grace periods are detected from schedule(), idle and the tick */
+    rcu_init();
+    
+    /* TSC clock and the boot CPU's tick; APs start theirs at bring-up */
+    clocksource_init();
+    tick_setup_cpu(smp_processor_id());
+    
     /* Create init task */
     init_task = sched_create_task(NULL, "init");
     if (!init_task) {
@@ -70,6 +131,7 @@ int sched_init(void) {
     /* Set current task for boot CPU */
     per_cpu(current_task, 0) = init_task;
     cpu_runqueues[0].curr = init_task;
+    update_idle_masks(0, false);
     
     kprintf("[SCHED] SMP scheduler initialized\n");
     return 0;
@@ -86,7 +148,6 @@ void sched_init_cpu(uint32_t cpu) {
     
     /* Initialize CFS runqueue */
     rq->cfs.root = RB_ROOT_CACHED;
-    rq->cfs.leftmost = NULL;
     rq->cfs.min_vruntime = 0;
     rq->cfs.nr_running = 0;
     rq->cfs.load_weight = 0;
@@ -99,15 +160,22 @@ void sched_init_cpu(uint32_t cpu) {
     rq->rt.rt_nr_migratory = 0;
     rq->rt.rt_throttled = 0;
     
+    /* Initialize deadline runqueue */
+    init_dl_rq(rq);
+    
     /* Initialize pointers */
     rq->curr = NULL;
     rq->idle = NULL;
     rq->stop = NULL;
+    rq->need_resched = false;
     
     /* Initialize load balancing */
     rq->next_balance = 0;
     rq->balance_interval = 50;  /* 50ms default */
     rq->avg_load_per_task = 0;
+    rq->lb_count = 0;
+    rq->lb_failed = 0;
+    rq->nr_migrations = 0;
     
     /* Initialize statistics */
     memset(rq->cpu_load, 0, sizeof(rq->cpu_load));
@@ -116,6 +184,7 @@ void sched_init_cpu(uint32_t cpu) {
     rq->sched_goidle = 0;
     rq->ttwu_count = 0;
     rq->ttwu_local = 0;
+    rq->ttwu_affine = 0;
     
     /* Initialize clocks */
     rq->clock = 0;
@@ -124,30 +193,136 @@ void sched_init_cpu(uint32_t cpu) {
     kprintf("[SCHED] Initialized runqueue for CPU %u\n", cpu);
 }
 
+/* Domain levels, innermost first. Tighter levels balance more often and
+ * tolerate less imbalance because moving a task there is cheaper. */
+static const struct {
+    const char *name;
+    uint32_t flags;
+    uint32_t balance_interval;      /* ms */
+    uint32_t imbalance_pct;
+    uint32_t cache_nice_tries;
+} sched_domain_levels[] = {
+    { "SMT", SD_LOAD_BALANCE | SD_BALANCE_NEWIDLE | SD_SHARE_CPUCAPACITY,    2, 110, 0 },
+    { "MC",  SD_LOAD_BALANCE | SD_BALANCE_NEWIDLE | SD_SHARE_PKG_RESOURCES,  8, 117, 1 },
+    { "ALL", SD_LOAD_BALANCE | SD_BALANCE_NEWIDLE,                          50, 125, 2 },
+};
+
+#define SCHED_NR_LEVELS (sizeof(sched_domain_levels) / sizeof(sched_domain_levels[0]))
+
+static bool cpus_share_level(uint32_t a, uint32_t b, uint32_t level) {
+    cpu_info_t *ca = smp_cpu_data(a);
+    cpu_info_t *cb = smp_cpu_data(b);
+    
+    if (a == b) return true;
+    if (!ca || !cb) return level == SCHED_NR_LEVELS - 1;
+    
+    switch (level) {
+    case 0:
+        return ca->topology.package_id == cb->topology.package_id &&
+               ca->topology.core_id == cb->topology.core_id;
+    case 1:
+        return ca->topology.llc_id == cb->topology.llc_id;
+    default:
+        return true;
+    }
+}
+
+/* Group CPUs by core and by LLC; every CPU starts out idle */
+static void sched_build_llcs(void) {
+    for (uint32_t cpu = 0; cpu < nr_cpus_possible; cpu++) {
+        sched_llc_t *llc = NULL;
+        
+        cpu_mask_clear(&cpu_smt_mask[cpu]);
+        cpu_core_first[cpu] = cpu;
+        sd_llc[cpu] = NULL;
+        
+        for (uint32_t other = 0; other < nr_cpus_possible; other++) {
+            if (cpus_share_level(cpu, other, 0)) {
+                cpu_mask_set_cpu(other, &cpu_smt_mask[cpu]);
+                if (other < cpu_core_first[cpu]) {
+                    cpu_core_first[cpu] = other;
+                }
+            }
+            if (other < cpu && !llc && cpus_share_level(cpu, other, 1)) {
+                llc = sd_llc[other];
+            }
+        }
+        
+        if (!llc) {
+            llc = (sched_llc_t*)kmalloc(sizeof(sched_llc_t));
+            if (!llc) continue;
+            memset(llc, 0, sizeof(sched_llc_t));
+        }
+        
+        cpu_mask_set_cpu(cpu, &llc->span);
+        cpu_mask_set_cpu(cpu, &llc->idle_cpus);
+        cpu_mask_set_cpu(cpu_core_first[cpu], &llc->idle_cores);
+        sd_llc[cpu] = llc;
+    }
+}
+
 /**
  * Build scheduling domains for load balancing
+ *
+ * Each CPU gets a chain SMT -> MC -> ALL from its topology, MC being the
+ * CPUs that share its last-level cache. Levels that would span the same
+ * CPUs as their child are dropped, so a machine without SMT starts at MC
+ * and a single LLC has no separate ALL.
  */
 void sched_build_domains(void) {
     kprintf("[SCHED] Building scheduling domains...\n");
     
-    /* For now, create simple single-level domain covering all CPUs */
+    sched_build_llcs();
+    
     for (uint32_t cpu = 0; cpu < nr_cpus_possible; cpu++) {
-        sched_domain_t *sd = (sched_domain_t*)kmalloc(sizeof(sched_domain_t));
-        if (!sd) continue;
-        
-        memset(sd, 0, sizeof(sched_domain_t));
+        sched_domain_t *child = NULL;
+        uint32_t child_weight = 1;
         
-        /* Cover all possible CPUs */
-        sd->span = cpu_possible_mask;
-        sd->level = 0;
-        sd->flags = 0;
-        sd->balance_interval = 50;  /* 50ms */
-        sd->busy_factor = 32;
-        sd->imbalance_pct = 125;    /* 25% imbalance threshold */
-        sd->cache_nice_tries = 1;
-        strcpy(sd->name, "ALL");
+        sched_domains[cpu] = NULL;
         
-        sched_domains[cpu] = sd;
+        for (uint32_t level = 0; level < SCHED_NR_LEVELS; level++) {
+            cpu_mask_t span;
+            uint32_t other;
+            
+            cpu_mask_clear(&span);
+            for (other = 0; other < nr_cpus_possible; other++) {
+                if (cpu_mask_test_cpu(other, &cpu_possible_mask) &&
+                    cpus_share_level(cpu, other, level)) {
+                    cpu_mask_set_cpu(other, &span);
+                }
+            }
+            
+            uint32_t weight = cpu_mask_weight(&span);
+            if (weight <= child_weight) {
+                continue;   /* Degenerate, nothing new to balance against */
+            }
+            
+            sched_domain_t *sd = (sched_domain_t*)kmalloc(sizeof(sched_domain_t));
+            if (!sd) break;
+            
+            memset(sd, 0, sizeof(sched_domain_t));
+            
+            sd->span = span;
+            sd->level = level;
+            sd->flags = sched_domain_levels[level].flags;
+            if (level == SCHED_NR_LEVELS - 1 && nr_numa_nodes > 1) {
+                sd->flags |= SD_NUMA;
+            }
+            sd->balance_interval = sched_domain_levels[level].balance_interval;
+            sd->busy_factor = 32;
+            sd->imbalance_pct = sched_domain_levels[level].imbalance_pct;
+            sd->cache_nice_tries = sched_domain_levels[level].cache_nice_tries;
+            strcpy(sd->name, sched_domain_levels[level].name);
+            
+            sd->child = child;
+            if (child) {
+                child->parent = sd;
+            } else {
+                sched_domains[cpu] = sd;
+            }
+            child = sd;
+            child_weight = weight;
+        }
     }
     
     kprintf("[SCHED] Scheduling domains built\n");
@@ -187,6 +362,8 @@ task_t *sched_create_task(void (*entry_point)(void), const char *name) {
     task->se.prio = DEFAULT_PRIO;
     task->se.nice = 0;
     task->se.load_weight = prio_to_weight[20];  /* Nice 0 */
+    task->se.inv_weight = prio_to_wmult[20];
+    RB_CLEAR_NODE(&task->se.run_node);
     
     /* Initialize RT entity */
     INIT_LIST_HEAD(&task->rt.run_list);
@@ -194,6 +371,9 @@ task_t *sched_create_task(void (*entry_point)(void), const char *name) {
     task->rt.time_slice = 0;
     task->rt.nr_cpus_allowed = nr_cpus_possible;
     
+    /* Initialize deadline entity */
+    init_dl_task(task);
+    
     /* CPU affinity - can run on any CPU initially */
     task->cpu_affinity = cpu_possible_mask;
     task->preferred_cpu = 0;
@@ -212,9 +392,12 @@ task_t *sched_create_task(void (*entry_point)(void), const char *name) {
     if (entry_point) {
         uint32_t *stack_ptr = (uint32_t*)((uintptr_t)task->stack + PAGE_SIZE);
         
-        /* Set up return address */
+        /* The frame switch_context() pops: EBX, ESI, EDI, EBP, then ret */
         *--stack_ptr = (uint32_t)entry_point;
         *--stack_ptr = 0; /* EBP */
+        *--stack_ptr = 0; /* EDI */
+        *--stack_ptr = 0; /* ESI */
+        *--stack_ptr = 0; /* EBX */
         
         task->context.esp = (uint32_t)stack_ptr;
         task->context.ebp = 0;
@@ -245,7 +428,7 @@ task_t *sched_create_task(void (*entry_point)(void), const char *name) {
     task->last_ran = 0;
     
     /* Initialize reference count */
-    atomic_set(&task->usage, 1);
+    task->usage = 1;
     
     /* Add to global task list */
     spin_lock(&task_list_lock);
@@ -278,15 +461,24 @@ void schedule(void) {
     cpu_runqueue_t *rq = cpu_rq(cpu);
     task_t *prev, *next;
     
+    /* Nobody calls schedule() from an RCU read-side section */
+    rcu_qs(cpu);
+    
     /* Disable interrupts and acquire runqueue lock */
     unsigned long flags;
     spin_lock_irqsave(&rq->lock, &flags);
     
     prev = rq->curr;
+    rq->need_resched = false;
     
     /* Update runqueue clock */
     update_rq_clock(rq);
     
+    /* Charge a deadline task for the part of a tick it ran, runnable or not */
+    if (prev && prev->sched_class == SCHED_CLASS_DEADLINE) {
+        update_curr_dl(rq, prev);
+    }
+    
     /* Put previous task back on runqueue if still runnable */
     if (prev && prev->state == TASK_RUNNING) {
         prev->state = TASK_READY;
@@ -299,6 +491,11 @@ void schedule(void) {
     /* Pick next task to run */
     next = pick_next_task(rq);
     
+    /* About to idle: try to steal work from a busier CPU first */
+    if (!next && idle_balance(cpu, rq)) {
+        next = pick_next_task(rq);
+    }
+    
     if (!next) {
         /* No runnable tasks, use idle task */
         next = rq->idle;
@@ -314,14 +511,23 @@ void schedule(void) {
     rq->sched_count++;
     
     /* Update per-CPU current task pointer */
-    per_cpu(current_task, cpu) = next;
+    this_cpu_write(current_task, next);
     
     /* Context switch if necessary */
     if (prev != next) {
+        if (next == rq->idle) {
+            update_idle_masks(cpu, true);
+        } else if (prev == rq->idle) {
+            update_idle_masks(cpu, false);
+        }
+        
         next->state = TASK_RUNNING;
         next->last_ran = sched_clock_cpu(cpu);
         next->last_cpu = cpu;
+        next->se.exec_start = rq->clock_task;
         
+        sched_trace(SCHED_TRACE_SWITCH, prev ? prev->pid : 0, next->pid,
+                    prev ? prev->state : 0);
         context_switch(rq, prev, next);
     }
     
@@ -332,7 +538,12 @@ void schedule(void) {
  * Pick next task to run
  */
 task_t *pick_next_task(cpu_runqueue_t *rq) {
-    /* Check RT tasks first */
+    /* Earliest deadline first, ahead of every other class */
+    if (rq->dl.nr_running > 0) {
+        return pick_next_task_dl(rq);
+    }
+    
+    /* Then RT tasks */
     if (rq->rt.nr_running > 0) {
         /* Find highest priority RT task */
         for (int prio = 0; prio < MAX_RT_PRIO; prio++) {
@@ -346,15 +557,10 @@ task_t *pick_next_task(cpu_runqueue_t *rq) {
     }
     
     /* Check CFS tasks */
-    if (rq->cfs.nr_running > 0 && rq->cfs.leftmost) {
-        task_t *task = rb_entry(rq->cfs.leftmost, task_t, se.run_node);
-        rb_erase_cached(&task->se.run_node, &rq->cfs.root);
-        rq->cfs.nr_running--;
-        rq->cfs.load_weight -= task->se.load_weight;
-        
-        /* Update leftmost pointer */
-        rq->cfs.leftmost = rb_next(&task->se.run_node);
-        
+    struct rb_node *left = rb_first_cached(&rq->cfs.root);
+    if (left) {
+        task_t *task = rb_entry(left, task_t, se.run_node);
+        dequeue_task_fair(rq, task);
         return task;
     }
     
@@ -369,7 +575,10 @@ void put_prev_task(cpu_runqueue_t *rq, task_t *prev) {
         return;
     }
     
-    if (prev->sched_class == SCHED_CLASS_RT) {
+    if (prev->sched_class == SCHED_CLASS_DEADLINE) {
+        /* Stays off the tree while throttled */
+        enqueue_task_dl(rq, prev, false);
+    } else if (prev->sched_class == SCHED_CLASS_RT) {
         /* Add to RT queue */
         int prio = prev->se.prio;
         if (prio < MAX_RT_PRIO) {
@@ -382,36 +591,19 @@ void put_prev_task(cpu_runqueue_t *rq, task_t *prev) {
     }
 }
 
+/* vruntime order; equal keys queue behind each other */
+static bool entity_before(const struct rb_node *a, const struct rb_node *b) {
+    const task_t *ta = rb_entry(a, task_t, se.run_node);
+    const task_t *tb = rb_entry(b, task_t, se.run_node);
+    return (int64_t)(ta->se.vruntime - tb->se.vruntime) < 0;
+}
+
 /**
  * Enqueue task in CFS runqueue
  */
 void enqueue_task_fair(cpu_runqueue_t *rq, task_t *task) {
-    struct rb_node **link = &rq->cfs.root.rb_root.rb_node;
-    struct rb_node *parent = NULL;
-    task_t *entry;
-    bool leftmost = true;
-    
-    /* Find insertion point in RB-tree */
-    while (*link) {
-        parent = *link;
-        entry = rb_entry(parent, task_t, se.run_node);
-        
-        if (task->se.vruntime < entry->se.vruntime) {
-            link = &parent->rb_left;
-        } else {
-            link = &parent->rb_right;
-            leftmost = false;
-        }
-    }
-    
-    /* Insert into RB-tree */
-    rb_link_node(&task->se.run_node, parent, link);
-    rb_insert_color_cached(&task->se.run_node, &rq->cfs.root, leftmost);
-    
-    /* Update leftmost if this is the new leftmost */
-    if (leftmost) {
-        rq->cfs.leftmost = &task->se.run_node;
-    }
+    /* O(log n) insert; the leftmost (next to run) stays cached */
+    rb_add_cached(&task->se.run_node, &rq->cfs.root, entity_before);
     
     /* Update runqueue statistics */
     rq->cfs.nr_running++;
@@ -423,6 +615,17 @@ void enqueue_task_fair(cpu_runqueue_t *rq, task_t *task) {
     }
 }
 
+/**
+ * Dequeue task from CFS runqueue
+ */
+void dequeue_task_fair(cpu_runqueue_t *rq, task_t *task) {
+    rb_erase_cached(&task->se.run_node, &rq->cfs.root);
+    RB_CLEAR_NODE(&task->se.run_node);
+    
+    rq->cfs.nr_running--;
+    rq->cfs.load_weight -= task->se.load_weight;
+}
+
 /**
  * Create idle task for CPU
  */
@@ -436,6 +639,7 @@ task_t *sched_create_idle_task(uint32_t cpu) {
     idle->se.prio = MAX_PRIO;
     idle->se.nice = 20;
     idle->se.load_weight = prio_to_weight[39];  /* Minimum weight */
+    idle->se.inv_weight = prio_to_wmult[39];
     
     /* Set CPU affinity to only this CPU */
     cpu_mask_clear(&idle->cpu_affinity);
@@ -463,9 +667,21 @@ void cpu_idle_loop(void) {
             cpu_info->ipi_pending = 0;
         }
         
+        /* The idle loop holds no RCU-protected pointers */
+        rcu_qs(cpu);
+        
+        /* Stop the tick unless a timer or RCU needs it soon */
+        asm volatile("cli");
+        tick_nohz_idle_enter();
+        asm volatile("sti");
+        
         /* Enter low-power state */
         smp_enter_idle();
         
+        asm volatile("cli");
+        tick_nohz_idle_exit();
+        asm volatile("sti");
+        
         /* Re-enable interrupts and halt */
         asm volatile("sti; hlt");
         
@@ -488,6 +704,8 @@ void scheduler_tick(void) {
     
     spin_lock(&rq->lock);
     
+    sched_trace(SCHED_TRACE_TICK, curr->pid, 0, 0);
+    
     /* Update runqueue clock */
     update_rq_clock(rq);
     
@@ -498,6 +716,14 @@ void scheduler_tick(void) {
     curr->se.sum_exec_runtime += delta_exec;
     curr->se.exec_start = now;
     
+    if (curr->sched_class == SCHED_CLASS_DEADLINE) {
+        /* Budget accounting; throttles the task when it runs dry */
+        task_tick_dl(rq, curr, delta_exec);
+    } else if (rq->dl.nr_running > 0) {
+        /* A replenished deadline task is waiting */
+        resched_curr(rq);
+    }
+    
     /* Update vruntime for CFS tasks */
     if (curr->sched_class == SCHED_CLASS_NORMAL) {
         curr->se.vruntime += calc_delta_fair(delta_exec, curr);
@@ -508,23 +734,38 @@ void scheduler_tick(void) {
         }
     }
     
-    /* Update load balancing */
-    if (time_after_eq(jiffies, rq->next_balance)) {
-        rq->next_balance = jiffies + rq->balance_interval;
-        /* TODO: Trigger load balancing */
-    }
+    /* Periodic load balancing needs other runqueue locks, do it unlocked */
+    bool balance = time_after_eq(get_jiffies_64(), rq->next_balance);
     
     spin_unlock(&rq->lock);
+    
+    if (balance) {
+        rebalance_domains(cpu);
+    }
+    
+    rcu_check_callbacks(cpu);
 }
 
 /**
  * Calculate fair delta for vruntime
  */
 uint64_t calc_delta_fair(uint64_t delta, task_t *se) {
-    if (se->se.load_weight != NICE_0_LOAD) {
-        delta = (delta * NICE_0_LOAD) / se->se.load_weight;
+    if (se->se.load_weight == NICE_0_LOAD || !se->se.inv_weight) {
+        return delta;
     }
-    return delta;
+    
+    /* delta * NICE_0_LOAD / weight as delta * (NICE_0_LOAD * inv_weight) >> 32,
+     * with the factor kept to 32 bits so it is two 32x32 multiplies */
+    uint64_t fact = (uint64_t)NICE_0_LOAD * se->se.inv_weight;
+    int shift = 32;
+    while (fact >> 32) {
+        fact >>= 1;
+        shift--;
+    }
+    
+    uint64_t lo = (uint64_t)(uint32_t)delta * fact;
+    uint64_t hi = (delta >> 32) * fact;
+    return (lo >> shift) + (hi << (32 - shift));
 }
 
 /**
@@ -535,11 +776,12 @@ bool should_preempt_curr(cpu_runqueue_t *rq, task_t *curr) {
         return false;  /* No other tasks to run */
     }
     
-    if (!rq->cfs.leftmost) {
+    struct rb_node *left = rb_first_cached(&rq->cfs.root);
+    if (!left) {
         return false;  /* No leftmost task */
     }
     
-    task_t *se = rb_entry(rq->cfs.leftmost, task_t, se.run_node);
+    task_t *se = rb_entry(left, task_t, se.run_node);
     
     /* Preempt if leftmost task has significantly lower vruntime */
     return (se->se.vruntime + 1000000) < curr->se.vruntime;  /* 1ms threshold */
@@ -549,19 +791,14 @@ bool should_preempt_curr(cpu_runqueue_t *rq, task_t *curr) {
  * Request reschedule
  */
 void resched_curr(cpu_runqueue_t *rq) {
-    task_t *curr = rq->curr;
-    if (curr) {
-        /* Set need_resched flag */
-        /* TODO: Implement need_resched flag */
-    }
+    rq->need_resched = true;
 }
 
 /**
  * Check if reschedule is needed
  */
 bool need_resched(void) {
-    /* TODO: Check need_resched flag */
-    return false;
+    return this_rq()->need_resched;
 }
 
 /**
@@ -579,8 +816,9 @@ void context_switch(cpu_runqueue_t *rq, task_t *prev, task_t *next) {
         next->nvcsw++;
     }
     
-    /* Perform actual context switch */
-    switch_context(prev ? &prev->context : NULL, &next->context);
+    /* Perform actual context switch; the boot stack is never resumed */
+    uint32_t boot_esp;
+    switch_context(prev ? (void *)&prev->context : (void *)&boot_esp, &next->context);
 }
 
 /**
@@ -595,69 +833,665 @@ void switch_mm(task_t *prev, task_t *next) {
     }
 }
 
-/**
- * Assembly context switch function
+/*
+ * Wakeup placement
+ *
+ * A waking CFS task goes to an idle CPU sharing a last-level cache with
+ * either its previous CPU or the waker, so its working set, or the data
+ * the waker just produced for it, is still in L3. The search only looks
+ * at the target's LLC masks, a fixed number of words whatever the CPU
+ * count; CPUs further away are left to the load balancer.
  */
-void switch_context(void *prev_context, void *next_context) {
-    if (!next_context) return;
+
+static inline void cpu_mask_set_atomic(uint32_t cpu, cpu_mask_t *mask) {
+    __atomic_fetch_or(&mask->bits[cpu / (sizeof(unsigned long) * 8)],
+                      1UL << (cpu % (sizeof(unsigned long) * 8)), __ATOMIC_RELAXED);
+}
+
+static inline void cpu_mask_clear_atomic(uint32_t cpu, cpu_mask_t *mask) {
+    __atomic_fetch_and(&mask->bits[cpu / (sizeof(unsigned long) * 8)],
+                       ~(1UL << (cpu % (sizeof(unsigned long) * 8))), __ATOMIC_RELAXED);
+}
+
+static bool cpu_mask_subset(const cpu_mask_t *sub, const cpu_mask_t *mask) {
+    for (size_t i = 0; i < sizeof(sub->bits) / sizeof(sub->bits[0]); i++) {
+        if (sub->bits[i] & ~__atomic_load_n(&mask->bits[i], __ATOMIC_RELAXED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void update_idle_masks(uint32_t cpu, bool idle) {
+    sched_llc_t *llc = sd_llc[cpu];
     
-    /* This is a simplified version - real implementation would be in assembly */
-    struct context {
-        uint32_t esp, ebp, eip, eflags, cr3;
-    } *next = (struct context *)next_context;
+    if (!llc) return;
     
-    /* Load new context */
-    asm volatile(
-        "movl %0, %%esp\n"
-        "movl %1, %%ebp\n"
-        "pushl %3\n"         /* Push EFLAGS */
-        "popfl\n"            /* Pop EFLAGS */
-        "jmp *%2"
-        :
-        : "m"(next->esp), "m"(next->ebp), "m"(next->eip), "m"(next->eflags)
-        : "memory"
-    );
+    if (idle) {
+        cpu_mask_set_atomic(cpu, &llc->idle_cpus);
+        if (cpu_mask_subset(&cpu_smt_mask[cpu], &llc->idle_cpus)) {
+            cpu_mask_set_atomic(cpu_core_first[cpu], &llc->idle_cores);
+        }
+    } else {
+        cpu_mask_clear_atomic(cpu, &llc->idle_cpus);
+        cpu_mask_clear_atomic(cpu_core_first[cpu], &llc->idle_cores);
+    }
+}
+
+static inline bool cpus_share_cache(uint32_t a, uint32_t b) {
+    return sd_llc[a] && sd_llc[a] == sd_llc[b];
 }
 
 /**
- * Wake up a process
+ * Is a CPU idle: only its idle task, nothing queued. Lockless.
  */
-void wake_up_process(task_t *task) {
-    if (!task) return;
+bool idle_cpu(uint32_t cpu) {
+    cpu_runqueue_t *rq = cpu_rq(cpu);
     
+    return rq->curr == rq->idle && !rq->cfs.nr_running &&
+           !rq->rt.nr_running && !rq->dl.nr_running;
+}
+
+/*
+ * Should the wakee follow the waker rather than stay near prev_cpu? An
+ * idle CPU wins; a sync waker is about to sleep and hands over its CPU;
+ * otherwise go wherever leaves the less load.
+ */
+static bool wake_affine(task_t *p, uint32_t this_cpu, uint32_t prev_cpu, bool sync) {
+    uint64_t this_load, prev_load;
+    
+    if (idle_cpu(this_cpu) && cpus_share_cache(this_cpu, prev_cpu)) {
+        return !idle_cpu(prev_cpu);
+    }
+    if (sync && cpu_rq(this_cpu)->cfs.nr_running == 0) {
+        return true;
+    }
+    if (idle_cpu(prev_cpu)) {
+        return false;
+    }
+    
+    this_load = rq_load(cpu_rq(this_cpu));
+    prev_load = rq_load(cpu_rq(prev_cpu));
+    if (sync) {
+        task_t *curr = cpu_rq(this_cpu)->curr;
+        if (curr && this_load >= curr->se.load_weight) {
+            this_load -= curr->se.load_weight;
+        }
+    }
+    return this_load + p->se.load_weight <= prev_load;
+}
+
+/* Idle CPU sharing target's LLC, best first; target if there is none */
+static uint32_t select_idle_sibling(uint32_t prev_cpu, uint32_t target, const cpu_mask_t *allowed) {
+    sched_llc_t *llc = sd_llc[target];
+    cpu_mask_t cand;
+    uint32_t cpu;
+    
+    if (idle_cpu(target)) {
+        return target;
+    }
+    if (prev_cpu != target && cpus_share_cache(prev_cpu, target) &&
+        cpu_mask_test_cpu(prev_cpu, allowed) && idle_cpu(prev_cpu)) {
+        return prev_cpu;
+    }
+    if (!llc) {
+        return target;
+    }
+    
+    /* A sibling thread shares L1 and L2 with the target as well */
+    for (size_t i = 0; i < sizeof(cand.bits) / sizeof(cand.bits[0]); i++) {
+        cand.bits[i] = cpu_smt_mask[target].bits[i] & allowed->bits[i];
+    }
+    cpu = cpu_mask_first_and(&cand, &llc->idle_cpus);
+    if (cpu < MAX_CPUS) {
+        return cpu;
+    }
+    
+    /* A whole idle core, so the wakee does not share one with a busy thread */
+    while ((cpu = cpu_mask_first_and(&llc->idle_cores, allowed)) < MAX_CPUS) {
+        uint32_t t = cpu_mask_first_and(&cpu_smt_mask[cpu], allowed);
+        if (cpu_mask_subset(&cpu_smt_mask[cpu], &llc->idle_cpus)) {
+            return t < MAX_CPUS ? t : cpu;
+        }
+        cpu_mask_clear_atomic(cpu, &llc->idle_cores);     /* Stale hint */
+    }
+    
+    /* Any idle thread */
+    cpu = cpu_mask_first_and(&llc->idle_cpus, allowed);
+    return cpu < MAX_CPUS ? cpu : target;
+}
+
+/* Pick the CPU a waking CFS task should be queued on */
+static uint32_t select_task_rq_fair(task_t *p, uint32_t prev_cpu, int wake_flags) {
+    uint32_t this_cpu = smp_processor_id();
+    uint32_t target = prev_cpu;
+    cpu_mask_t allowed;
+    
+    for (size_t i = 0; i < sizeof(allowed.bits) / sizeof(allowed.bits[0]); i++) {
+        allowed.bits[i] = p->cpu_affinity.bits[i] & cpu_online_mask.bits[i];
+    }
+    if (cpu_mask_empty(&allowed)) {
+        return prev_cpu;
+    }
+    
+    if (this_cpu != prev_cpu && cpu_mask_test_cpu(this_cpu, &allowed) &&
+        wake_affine(p, this_cpu, prev_cpu, wake_flags & WF_SYNC)) {
+        target = this_cpu;
+        cpu_rq(this_cpu)->ttwu_affine++;
+    }
+    if (!cpu_mask_test_cpu(target, &allowed)) {
+        target = cpu_mask_first(&allowed);
+    }
+    
+    return select_idle_sibling(prev_cpu, target, &allowed);
+}
+
+static inline bool task_sleeping(task_t *task) {
+    return task->state != TASK_RUNNING && task->state != TASK_READY &&
+           task->state != TASK_DEAD && task->state != TASK_ZOMBIE;
+}
+
+/*
+ * The wakeup is claimed under the lock of the runqueue the task last ran
+ * on. A task that has set itself sleeping but not yet got through
+ * schedule() is still that runqueue's curr: it is only marked running
+ * again and schedule() keeps it. Otherwise it is on no queue, and making
+ * it TASK_READY there turns away other wakers while this one picks a CPU
+ * and queues it.
+ */
+static void try_to_wake_up(task_t *task, int wake_flags) {
     unsigned long flags;
     cpu_runqueue_t *rq;
+    uint32_t prev_cpu = task->last_cpu;
+    uint32_t cpu;
     
-    /* Find the CPU this task was last on */
-    uint32_t cpu = task->last_cpu;
-    if (cpu >= nr_cpus_online) {
-        cpu = 0;  /* Default to boot CPU */
+    if (prev_cpu >= nr_cpus_online) {
+        prev_cpu = 0;  /* Default to boot CPU */
+    }
+    
+    rq = cpu_rq(prev_cpu);
+    spin_lock_irqsave(&rq->lock, &flags);
+    if (!task_sleeping(task)) {
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+    if (rq->curr == task) {
+        task->state = TASK_RUNNING;
+        rq->ttwu_count++;
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+    task->state = TASK_READY;
+    spin_unlock_irqrestore(&rq->lock, flags);
+    
+    /* Deadline and RT tasks keep their CPU, their bandwidth is booked there */
+    cpu = prev_cpu;
+    if (task->sched_class == SCHED_CLASS_NORMAL) {
+        cpu = select_task_rq_fair(task, prev_cpu, wake_flags);
     }
     
     rq = cpu_rq(cpu);
     spin_lock_irqsave(&rq->lock, &flags);
     
-    if (task->state != TASK_RUNNING && task->state != TASK_READY) {
-        task->state = TASK_READY;
+    sched_trace(SCHED_TRACE_WAKEUP, task->pid, cpu, 0);
+    
+    rq->ttwu_count++;
+    if (cpu == smp_processor_id()) {
+        rq->ttwu_local++;
+    }
+    
+    if (wake_flags & WF_FORK) {
+        /* Start level with the queue rather than ahead of it */
+        task->se.vruntime = rq->cfs.min_vruntime;
+        task->last_cpu = cpu;
+    } else if (cpu != prev_cpu) {
+        /* Keep its lag relative to the new queue */
+        cpu_runqueue_t *src = cpu_rq(prev_cpu);
+        task->se.vruntime = task->se.vruntime - src->cfs.min_vruntime +
+                            rq->cfs.min_vruntime;
+        sched_trace(SCHED_TRACE_MIGRATE, task->pid, prev_cpu, cpu);
+        task->last_cpu = cpu;
+    }
+    
+    /* Claim an idle CPU now so the next wakeup looks elsewhere */
+    if (rq->curr == rq->idle) {
+        update_idle_masks(cpu, false);
+        resched_curr(rq);
+    }
+    
+    /* Add to appropriate runqueue */
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        enqueue_task_dl(rq, task, true);
+        if (dl_should_preempt(rq, task)) {
+            resched_curr(rq);
+        }
+    } else if (task->sched_class == SCHED_CLASS_RT) {
+        int prio = task->se.prio;
+        if (prio < MAX_RT_PRIO) {
+            list_add_tail(&task->rt.run_list, &rq->rt.queue[prio]);
+            rq->rt.nr_running++;
+        }
+    } else {
+        enqueue_task_fair(rq, task);
+    }
+    
+    /* Send reschedule IPI if on different CPU */
+    if (cpu != smp_processor_id()) {
+        smp_send_ipi(cpu, IPI_RESCHEDULE);
+    }
+    
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+/**
+ * Wake up a process
+ */
+void wake_up_process(task_t *task) {
+    if (!task) return;
+    try_to_wake_up(task, 0);
+}
+
+/**
+ * Wake up a process from a waker that is about to block, e.g. a producer
+ * handing work to its consumer; the wakee may take the waker's CPU.
+ */
+void wake_up_process_sync(task_t *task) {
+    if (!task) return;
+    try_to_wake_up(task, WF_SYNC);
+}
+
+/**
+ * Make a task from sched_create_task() runnable for the first time
+ */
+void wake_up_new_task(task_t *task) {
+    if (!task) return;
+    task->state = TASK_STOPPED;
+    try_to_wake_up(task, WF_FORK);
+}
+
+/**
+ * End the current task. It stays on the task list as TASK_DEAD until
+ * sched_destroy_task() reaps it.
+ */
+void sched_exit(int code) {
+    task_t *curr = current;
+    
+    if (curr->sched_class == SCHED_CLASS_DEADLINE) {
+        sched_clear_deadline(curr);
+    }
+    curr->exit_code = code;
+    curr->state = TASK_DEAD;
+    schedule();
+    
+    for (;;) {
+        asm volatile("hlt");    /* Not reached */
+    }
+}
+
+/**
+ * Free a dead task. Its stack may still be in use by the schedule() that
+ * switched away from it, so wait until no CPU has it as curr.
+ */
+void sched_destroy_task(task_t *task) {
+    if (!task || task->state != TASK_DEAD) return;
+    
+    while (__atomic_load_n(&task_rq(task)->curr, __ATOMIC_ACQUIRE) == task) {
+        asm volatile("pause");
+    }
+    
+    spin_lock(&task_list_lock);
+    list_del(&task->task_list);
+    spin_unlock(&task_list_lock);
+    
+    pmm_free_page((paddr_t)(uintptr_t)task->stack);
+    kfree(task);
+}
+
+/*
+ * Load balancing
+ *
+ * Balancing is pull-only: a CPU looks for the busiest runqueue in each of
+ * its domains and takes queued CFS tasks from it. Running tasks are never
+ * in the tree, so anything found there can be moved without stopping its
+ * CPU. Tasks are taken from the right of the busiest tree; they have the
+ * longest wait ahead of them there.
+ */
+
+/* Take both locks in address order */
+static void double_rq_lock(cpu_runqueue_t *a, cpu_runqueue_t *b) {
+    if (a < b) {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
+    } else {
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
+    }
+}
+
+static void double_rq_unlock(cpu_runqueue_t *a, cpu_runqueue_t *b) {
+    spin_unlock(&a->lock);
+    spin_unlock(&b->lock);
+}
+
+/* this_rq is locked; may drop and retake it to keep the lock order */
+static void double_lock_balance(cpu_runqueue_t *this_rq, cpu_runqueue_t *busiest) {
+    if (spin_trylock(&busiest->lock)) {
+        return;
+    }
+    if (busiest < this_rq) {
+        spin_unlock(&this_rq->lock);
+        spin_lock(&busiest->lock);
+        spin_lock(&this_rq->lock);
+    } else {
+        spin_lock(&busiest->lock);
+    }
+}
+
+/* CFS load including the running task, which is not in the tree */
+static uint64_t rq_load(cpu_runqueue_t *rq) {
+    uint64_t load = rq->cfs.load_weight;
+    task_t *curr = rq->curr;
+    
+    if (curr && curr != rq->idle && curr->sched_class == SCHED_CLASS_NORMAL) {
+        load += curr->se.load_weight;
+    }
+    return load;
+}
+
+/*
+ * Cache-hot model: SMT siblings share every cache level, so moving between
+ * them is free. Inside a package only the private caches are lost; across
+ * packages the working set has to come over the interconnect, which costs
+ * several times more.
+ */
+static bool task_hot(task_t *task, sched_domain_t *sd) {
+    uint64_t cost = SCHED_MIGRATION_COST_NS;
+    
+    if (sd->flags & SD_SHARE_CPUCAPACITY) {
+        return false;
+    }
+    if (!(sd->flags & SD_SHARE_PKG_RESOURCES)) {
+        cost *= (sd->flags & SD_NUMA) ? 8 : 4;
+    }
+    return (int64_t)(sched_clock() - task->se.exec_start) < (int64_t)cost;
+}
+
+/**
+ * Check whether a task may run on dest_cpu at all
+ */
+int can_migrate_task(task_t *task, uint32_t dest_cpu) {
+    if (task->sched_class != SCHED_CLASS_NORMAL) {
+        return 0;
+    }
+    if (!cpu_mask_test_cpu(dest_cpu, &task->cpu_affinity)) {
+        return 0;
+    }
+    /* Running tasks are off the tree and stay where they are */
+    if (RB_EMPTY_NODE(&task->se.run_node)) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Both runqueue locks held */
+static void move_queued_task(cpu_runqueue_t *src, cpu_runqueue_t *dst,
+                             task_t *task, uint32_t dest_cpu) {
+    rb_erase_cached(&task->se.run_node, &src->cfs.root);
+    src->cfs.nr_running--;
+    src->cfs.load_weight -= task->se.load_weight;
+    
+    /* Keep its lag relative to the new queue */
+    task->se.vruntime = task->se.vruntime - src->cfs.min_vruntime +
+                        dst->cfs.min_vruntime;
+    sched_trace(SCHED_TRACE_MIGRATE, task->pid, task->last_cpu, dest_cpu);
+    task->last_cpu = dest_cpu;
+    
+    enqueue_task_fair(dst, task);
+    dst->nr_migrations++;
+}
+
+/**
+ * Move a queued task to another CPU
+ */
+void migrate_task(task_t *task, uint32_t dest_cpu) {
+    cpu_runqueue_t *src = task_rq(task);
+    cpu_runqueue_t *dst = cpu_rq(dest_cpu);
+    
+    if (src == dst) {
+        return;
+    }
+    
+    double_rq_lock(src, dst);
+    if (task_rq(task) == src && can_migrate_task(task, dest_cpu)) {
+        move_queued_task(src, dst, task, dest_cpu);
+        if (dst->curr == dst->idle) {
+            resched_curr(dst);
+        }
+    }
+    double_rq_unlock(src, dst);
+}
+
+static cpu_runqueue_t *find_busiest_queue(sched_domain_t *sd, uint32_t this_cpu,
+                                          uint64_t *busiest_load) {
+    cpu_runqueue_t *busiest = NULL;
+    uint64_t max_load = 0;
+    uint32_t cpu;
+    
+    for_each_cpu_in_mask(cpu, &sd->span) {
+        if (cpu == this_cpu || !cpu_mask_test_cpu(cpu, &cpu_online_mask)) {
+            continue;
+        }
         
-        /* Add to appropriate runqueue */
-        if (task->sched_class == SCHED_CLASS_RT) {
-            int prio = task->se.prio;
-            if (prio < MAX_RT_PRIO) {
-                list_add_tail(&task->rt.run_list, &rq->rt.queue[prio]);
-                rq->rt.nr_running++;
+        cpu_runqueue_t *rq = cpu_rq(cpu);
+        uint64_t load = rq_load(rq);
+        
+        /* Only queued tasks can be pulled */
+        if (rq->cfs.nr_running == 0) {
+            continue;
+        }
+        if (load > max_load) {
+            max_load = load;
+            busiest = rq;
+        }
+    }
+    
+    *busiest_load = max_load;
+    return busiest;
+}
+
+/*
+ * Pull up to imbalance worth of load from busiest. Both locks held.
+ * Returns the number of tasks moved.
+ */
+static int move_tasks(cpu_runqueue_t *this_rq, uint32_t this_cpu,
+                      cpu_runqueue_t *busiest, sched_domain_t *sd,
+                      enum lb_idle_type idle, int64_t imbalance) {
+    struct rb_node *node = rb_last(&busiest->cfs.root.rb_root);
+    int moved = 0;
+    int loops = 0;
+    
+    while (node && imbalance > 0 && loops++ < 32) {
+        task_t *task = rb_entry(node, task_t, se.run_node);
+        node = rb_prev(node);
+        
+        if (!can_migrate_task(task, this_cpu)) {
+            continue;
+        }
+        /* Cache-hot tasks only move once balancing keeps failing */
+        if (task_hot(task, sd) && sd->nr_balance_failed <= sd->cache_nice_tries) {
+            continue;
+        }
+        /* Don't overshoot and just move the imbalance the other way */
+        if (moved && (int64_t)task->se.load_weight / 2 > imbalance) {
+            continue;
+        }
+        
+        move_queued_task(busiest, this_rq, task, this_cpu);
+        imbalance -= task->se.load_weight;
+        moved++;
+        
+        /* A newly idle CPU only needs something to run */
+        if (idle == LB_NEWLY_IDLE) {
+            break;
+        }
+    }
+    
+    return moved;
+}
+
+/*
+ * Work out the imbalance between this CPU and the busiest one in sd.
+ * Returns the busiest runqueue and the load to move, or NULL if balanced.
+ */
+static cpu_runqueue_t *find_imbalance(sched_domain_t *sd, uint32_t this_cpu,
+                                      cpu_runqueue_t *this_rq,
+                                      enum lb_idle_type idle,
+                                      int64_t *imbalance) {
+    uint64_t busiest_load;
+    cpu_runqueue_t *busiest = find_busiest_queue(sd, this_cpu, &busiest_load);
+    uint64_t this_load = (idle == LB_NOT_IDLE) ? rq_load(this_rq) : 0;
+    
+    if (!busiest) {
+        return NULL;
+    }
+    
+    /* An idle CPU steals any queued task; otherwise the gap has to be
+     * above the domain's threshold */
+    if (idle == LB_NOT_IDLE &&
+        busiest_load * 100 <= this_load * sd->imbalance_pct) {
+        return NULL;
+    }
+    
+    *imbalance = (int64_t)(busiest_load - this_load) / 2;
+    if (*imbalance < NICE_0_LOAD / 2 && idle != LB_NOT_IDLE) {
+        *imbalance = NICE_0_LOAD / 2;
+    }
+    return *imbalance > 0 ? busiest : NULL;
+}
+
+static void balance_done(sched_domain_t *sd, cpu_runqueue_t *this_rq, int moved) {
+    this_rq->lb_count++;
+    if (moved) {
+        sd->nr_balance_failed = 0;
+    } else {
+        sd->nr_balance_failed++;
+        this_rq->lb_failed++;
+    }
+}
+
+static int load_balance_domain(uint32_t this_cpu, cpu_runqueue_t *this_rq,
+                               sched_domain_t *sd, enum lb_idle_type idle) {
+    int64_t imbalance;
+    cpu_runqueue_t *busiest = find_imbalance(sd, this_cpu, this_rq, idle, &imbalance);
+    int moved = 0;
+    
+    if (!busiest) {
+        sd->nr_balance_failed = 0;
+        return 0;
+    }
+    
+    double_rq_lock(this_rq, busiest);
+    if (busiest->cfs.nr_running > 0) {
+        moved = move_tasks(this_rq, this_cpu, busiest, sd, idle, imbalance);
+    }
+    if (moved && this_rq->curr == this_rq->idle) {
+        resched_curr(this_rq);
+    }
+    double_rq_unlock(this_rq, busiest);
+    
+    balance_done(sd, this_rq, moved);
+    return moved;
+}
+
+/**
+ * Balance this CPU against every domain it belongs to, innermost first
+ */
+void load_balance(uint32_t this_cpu, cpu_runqueue_t *this_rq) {
+    enum lb_idle_type idle = (this_rq->curr == this_rq->idle || !this_rq->curr)
+                              ? LB_IDLE : LB_NOT_IDLE;
+    
+    for (sched_domain_t *sd = sched_domains[this_cpu]; sd; sd = sd->parent) {
+        if (sd->flags & SD_LOAD_BALANCE) {
+            load_balance_domain(this_cpu, this_rq, sd, idle);
+        }
+    }
+}
+
+/**
+ * Periodic balancing, from scheduler_tick() without the runqueue lock.
+ * Each domain has its own interval; busy CPUs stretch it by busy_factor
+ * since they have work and only balance to even things out.
+ */
+void rebalance_domains(uint32_t cpu) {
+    cpu_runqueue_t *rq = cpu_rq(cpu);
+    enum lb_idle_type idle = (rq->curr == rq->idle || !rq->curr)
+                              ? LB_IDLE : LB_NOT_IDLE;
+    uint64_t now = get_jiffies_64();
+    uint64_t next_balance = now + rq->balance_interval;
+    
+    for (sched_domain_t *sd = sched_domains[cpu]; sd; sd = sd->parent) {
+        if (!(sd->flags & SD_LOAD_BALANCE)) {
+            continue;
+        }
+        
+        uint64_t interval = sd->balance_interval;
+        if (idle == LB_NOT_IDLE) {
+            interval *= sd->busy_factor;
+        }
+        
+        if (time_after_eq(now, sd->last_balance + interval)) {
+            if (load_balance_domain(cpu, rq, sd, idle)) {
+                /* Got work, the outer domains can see us as busy now */
+                idle = LB_NOT_IDLE;
             }
-        } else {
-            enqueue_task_fair(rq, task);
+            sd->last_balance = now;
         }
         
-        /* Send reschedule IPI if on different CPU */
-        if (cpu != smp_processor_id()) {
-            smp_send_ipi(cpu, IPI_RESCHEDULE);
+        if ((int64_t)(sd->last_balance + interval - next_balance) < 0) {
+            next_balance = sd->last_balance + interval;
         }
     }
     
-    spin_unlock_irqrestore(&rq->lock, flags);
+    rq->next_balance = next_balance;
+}
+
+/*
+ * Newidle balancing, from schedule() with this_rq locked and nothing left
+ * to run. Pulls one task from the nearest domain that has one, which is
+ * what turns a burst of wakeups on one CPU into work for the idle ones.
+ */
+static int idle_balance(uint32_t this_cpu, cpu_runqueue_t *this_rq) {
+    int pulled = 0;
+    
+    for (sched_domain_t *sd = sched_domains[this_cpu]; sd && !pulled; sd = sd->parent) {
+        int64_t imbalance;
+        cpu_runqueue_t *busiest;
+        
+        if (!(sd->flags & SD_BALANCE_NEWIDLE)) {
+            continue;
+        }
+        
+        busiest = find_imbalance(sd, this_cpu, this_rq, LB_NEWLY_IDLE, &imbalance);
+        if (!busiest) {
+            continue;
+        }
+        
+        double_lock_balance(this_rq, busiest);
+        /* this_rq may have been unlocked; something may have arrived */
+        if (this_rq->cfs.nr_running > 0) {
+            spin_unlock(&busiest->lock);
+            return 1;
+        }
+        if (busiest->cfs.nr_running > 0) {
+            pulled = move_tasks(this_rq, this_cpu, busiest, sd,
+                                LB_NEWLY_IDLE, imbalance);
+        }
+        spin_unlock(&busiest->lock);
+        
+        balance_done(sd, this_rq, pulled);
+    }
+    
+    return pulled;
 }
 
 /**
@@ -672,8 +1506,9 @@ void update_rq_clock(cpu_runqueue_t *rq) {
  * Get scheduling clock for CPU
  */
 uint64_t sched_clock_cpu(uint32_t cpu) {
-    /* TODO: Implement proper per-CPU clock */
-    return get_ticks() * 1000000ULL;  /* Convert ticks to nanoseconds */
+    /* The TSC clock is synchronised across CPUs */
+    (void)cpu;
+    return ktime_get_ns();
 }
 
 /**
@@ -705,6 +1540,12 @@ task_t *find_task_by_pid(pid_t pid) {
  * Yield CPU voluntarily
  */
 void sched_yield(void) {
+    task_t *curr = current;
+    
+    /* A deadline task yielding is done with this job */
+    if (curr && curr->sched_class == SCHED_CLASS_DEADLINE) {
+        yield_task_dl(curr);
+    }
     schedule();
 }
 
@@ -743,101 +1584,3 @@ int sched_get_affinity(pid_t pid, cpu_mask_t *mask) {
     *mask = task->cpu_affinity;
     return 0;
 }
-
-/**
- * Simple stub implementations for missing functions
- */
-
-/* List operations */
-void INIT_LIST_HEAD(struct list_head *list) {
-    list->next = list;
-    list->prev = list;
-}
-
-bool list_empty(const struct list_head *head) {
-    return head->next == head;
-}
-
-void list_add_tail(struct list_head *new_entry, struct list_head *head) {
-    new_entry->next = head;
-    new_entry->prev = head->prev;
-    head->prev->next = new_entry;
-    head->prev = new_entry;
-}
-
-void list_del(struct list_head *entry) {
-    entry->next->prev = entry->prev;
-    entry->prev->next = entry->next;
-}
-
-/* Red-black tree stubs */
-#define RB_ROOT_CACHED { { NULL }, NULL }
-
-void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **rb_link) {
-    /* Simplified implementation */
-    node->rb_parent_color = (unsigned long)parent;
-    node->rb_left = node->rb_right = NULL;
-    *rb_link = node;
-}
-
-void rb_insert_color_cached(struct rb_node *node, struct rb_root_cached *root, bool leftmost) {
-    /* Simplified implementation */
-    if (leftmost) {
-        root->rb_leftmost = node;
-    }
-}
-
-void rb_erase_cached(struct rb_node *node, struct rb_root_cached *root) {
-    /* Simplified implementation */
-    if (root->rb_leftmost == node) {
-        root->rb_leftmost = NULL;  /* Should find next node */
-    }
-}
-
-struct rb_node *rb_next(struct rb_node *node) {
-    /* Simplified implementation */
-    return NULL;
-}
-
-/* Atomic operations */
-void atomic_set(atomic_t *v, int i) {
-    v->counter = i;
-}
-
-int atomic_read(atomic_t *v) {
-    return v->counter;
-}
-
-void atomic_inc(atomic_t *v) {
-    __sync_fetch_and_add(&v->counter, 1);
-}
-
-void atomic_dec(atomic_t *v) {
-    __sync_fetch_and_sub(&v->counter, 1);
-}
-
-int atomic_inc_return(atomic_t *v) {
-    return __sync_add_and_fetch(&v->counter, 1);
-}
-
-int atomic_dec_return(atomic_t *v) {
-    return __sync_sub_and_fetch(&v->counter, 1);
-}
-
-/* Utility functions */
-bool time_after_eq(uint64_t a, uint64_t b) {
-    return (int64_t)(a - b) >= 0;
-}
-
-uint64_t jiffies = 0;  /* Global jiffy counter */
-
-#define rb_entry(ptr, type, member) \
-    ((type *)((char *)(ptr) - (unsigned long)(&((type *)0)->member)))
-
-#define list_first_entry(ptr, type, member) \
-    rb_entry((ptr)->next, type, member)
-
-#define list_for_each_entry(pos, head, member) \
-    for (pos = list_first_entry(head, typeof(*pos), member); \
-         &pos->member != (head); \
-         pos = list_first_entry(&pos->member, typeof(*pos), member))
\ No newline at end of file
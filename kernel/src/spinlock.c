@@ -0,0 +1,530 @@
+/*
+ * LimitlessOS - Queued Spinlocks and Reader-Writer Locks
+ *
+ * See spinlock.h. The spinlock is the qspinlock scheme without the
+ * pending bit: bit 0-7 of the word is the locked byte, bits 16-31 name
+ * the last waiter's queue node. A CPU that finds the lock taken appends
+ * its node with one xchg on the tail and spins on its own node until the
+ * waiter ahead of it makes it the head. Only the head watches the lock
+ * word, and it passes headship on once it owns the lock.
+ *
+ * Each CPU has four queue nodes, enough for a lock taken in task
+ * context to be interrupted by one taken in an IRQ, and so on.
+ */
+
+#include "smp.h"
+#include "isr.h"
+#include "device.h"
+#include <string.h>
+
+#define Q_NODES_PER_CPU     4
+
+#define Q_LOCKED_MASK       0x000000ffU
+#define Q_TAIL_SHIFT        16
+
+struct qnode {
+    struct qnode *volatile next;
+    volatile uint32_t locked;       /* Set when this waiter becomes the head */
+    uint32_t count;                 /* Nesting depth, first node of a CPU only */
+} __attribute__((aligned(16)));
+
+static struct qnode qnodes[MAX_CPUS][Q_NODES_PER_CPU] __attribute__((aligned(64)));
+
+static inline uint32_t lock_cpu(void) {
+    uint32_t cpu = smp_processor_id();
+    return cpu < MAX_CPUS ? cpu : 0;
+}
+
+static inline uint16_t encode_tail(uint32_t cpu, uint32_t idx) {
+    return (uint16_t)(((cpu + 1) << 2) | idx);
+}
+
+static inline struct qnode *decode_tail(uint16_t tail) {
+    return &qnodes[(tail >> 2) - 1][tail & 3];
+}
+
+static inline void cpu_relax(void) {
+    __asm__ __volatile__("pause" ::: "memory");
+}
+
+static inline bool queued_trylock(spinlock_t *lock) {
+    uint32_t val = __atomic_load_n(&lock->val, __ATOMIC_RELAXED);
+    return val == 0 &&
+           __atomic_compare_exchange_n(&lock->val, &val, 1, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void queued_lock_slowpath(spinlock_t *lock) {
+    uint32_t cpu = lock_cpu();
+    struct qnode *node = &qnodes[cpu][0];
+    uint32_t idx = node->count++;
+    struct qnode *next;
+    uint16_t tail, old_tail;
+    uint32_t val;
+
+    /* Out of nodes (should not happen), fall back to plain spinning */
+    if (idx >= Q_NODES_PER_CPU) {
+        while (!queued_trylock(lock)) {
+            cpu_relax();
+        }
+        goto release;
+    }
+
+    node += idx;
+    tail = encode_tail(cpu, idx);
+    node->next = NULL;
+    node->locked = 0;
+
+    /* The owner may have let go while we set up */
+    if (queued_trylock(lock)) {
+        goto release;
+    }
+
+    /* Publish our node; the xchg leaves the locked byte alone */
+    old_tail = __atomic_exchange_n(&lock->tail, tail, __ATOMIC_ACQ_REL);
+    if (old_tail) {
+        __atomic_store_n(&decode_tail(old_tail)->next, node, __ATOMIC_RELEASE);
+        while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+            cpu_relax();
+        }
+    }
+
+    /* Head of the queue: wait for the owner */
+    while ((val = __atomic_load_n(&lock->val, __ATOMIC_ACQUIRE)) & Q_LOCKED_MASK) {
+        cpu_relax();
+    }
+
+    /* Last in the queue: take the lock and clear the tail in one go */
+    if ((val >> Q_TAIL_SHIFT) == tail &&
+        __atomic_compare_exchange_n(&lock->val, &val, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        goto release;
+    }
+
+    /* Others queued behind us. The tail is non-zero, so nobody else can
+     * take the lock from under us; set the locked byte and hand the head
+     * of the queue to the next waiter. */
+    __atomic_store_n(&lock->locked, 1, __ATOMIC_RELAXED);
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+        cpu_relax();
+    }
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+
+release:
+    qnodes[cpu][0].count--;
+}
+
+static inline void queued_lock(spinlock_t *lock) {
+    uint32_t zero = 0;
+    if (!__atomic_compare_exchange_n(&lock->val, &zero, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        queued_lock_slowpath(lock);
+    }
+}
+
+static inline void queued_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Lock statistics
+ */
+
+#ifdef CONFIG_LOCK_STAT
+
+static DEFINE_LOCK_CLASS(unnamed_class, "<unnamed>");
+static struct lock_class *volatile lock_classes = NULL;
+
+static inline uint64_t lock_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void lock_class_register(struct lock_class *lc) {
+    struct lock_class *head;
+
+    if (__atomic_exchange_n(&lc->registered, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    head = __atomic_load_n(&lock_classes, __ATOMIC_RELAXED);
+    do {
+        lc->next = head;
+    } while (!__atomic_compare_exchange_n(&lock_classes, &head, lc, false,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void stat_max(uint64_t *max, uint64_t v) {
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (v > cur &&
+           !__atomic_compare_exchange_n(max, &cur, v, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static struct lock_class *lock_stat_acquired(struct lock_class *lc, uint64_t wait) {
+    if (!lc) {
+        lc = &unnamed_class;
+    }
+    if (!lc->registered) {
+        lock_class_register(lc);
+    }
+    __atomic_fetch_add(&lc->acquisitions, 1, __ATOMIC_RELAXED);
+    if (wait) {
+        __atomic_fetch_add(&lc->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&lc->wait_cycles, wait, __ATOMIC_RELAXED);
+        stat_max(&lc->wait_max, wait);
+    }
+    return lc;
+}
+
+static void lock_stat_released(struct lock_class *lc, uint64_t acquired_at) {
+    uint64_t hold = lock_rdtsc() - acquired_at;
+
+    if (!lc) {
+        lc = &unnamed_class;
+    }
+    __atomic_fetch_add(&lc->hold_cycles, hold, __ATOMIC_RELAXED);
+    stat_max(&lc->hold_max, hold);
+}
+
+#endif /* CONFIG_LOCK_STAT */
+
+/*
+ * Spinlocks
+ */
+
+void spin_lock_init(spinlock_t *lock) {
+    lock->val = 0;
+#ifdef CONFIG_LOCK_STAT
+    lock->lc = NULL;
+    lock->acquired_at = 0;
+#endif
+}
+
+void spin_lock_init_class(spinlock_t *lock, struct lock_class *lc) {
+    spin_lock_init(lock);
+#ifdef CONFIG_LOCK_STAT
+    lock->lc = lc;
+#else
+    (void)lc;
+#endif
+}
+
+void spin_lock(spinlock_t *lock) {
+#ifdef CONFIG_LOCK_STAT
+    uint32_t zero = 0;
+    uint64_t wait = 0;
+
+    if (!__atomic_compare_exchange_n(&lock->val, &zero, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        uint64_t start = lock_rdtsc();
+        queued_lock_slowpath(lock);
+        wait = lock_rdtsc() - start + 1;
+    }
+    lock_stat_acquired(lock->lc, wait);
+    lock->acquired_at = lock_rdtsc();
+#else
+    queued_lock(lock);
+#endif
+}
+
+void spin_unlock(spinlock_t *lock) {
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_released(lock->lc, lock->acquired_at);
+#endif
+    queued_unlock(lock);
+}
+
+bool spin_trylock(spinlock_t *lock) {
+    if (!queued_trylock(lock)) {
+        return false;
+    }
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_acquired(lock->lc, 0);
+    lock->acquired_at = lock_rdtsc();
+#endif
+    return true;
+}
+
+void spin_lock_irqsave(spinlock_t *lock, unsigned long *flags) {
+    unsigned long f;
+    local_irq_save(f);
+    *flags = f;
+    spin_lock(lock);
+}
+
+void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags) {
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+/*
+ * Reader-writer locks (qrwlock): the low byte of cnts is the writer,
+ * bit 8 marks a writer waiting for readers to drain, readers count from
+ * bit 9. A writer waits holding wait_lock, so new readers queue behind it,
+ * except in interrupt context: the interrupt may have landed in a reader
+ * on this CPU that the writer is waiting for, so such readers only wait
+ * out a writer that actually holds the lock.
+ */
+
+#define QW_LOCKED   0x0ffU
+#define QW_WAITING  0x100U
+#define QW_WMASK    0x1ffU
+#define QR_BIAS     0x200U
+
+void rwlock_init(rwlock_t *lock) {
+    lock->cnts = 0;
+    spin_lock_init(&lock->wait_lock);
+#ifdef CONFIG_LOCK_STAT
+    lock->lc = NULL;
+    lock->acquired_at = 0;
+#endif
+}
+
+void rwlock_init_class(rwlock_t *lock, struct lock_class *lc) {
+    rwlock_init(lock);
+#ifdef CONFIG_LOCK_STAT
+    lock->lc = lc;
+#else
+    (void)lc;
+#endif
+}
+
+static void read_lock_slowpath(rwlock_t *lock) {
+    if (in_interrupt()) {
+        /* Keep our reader count; a waiting writer cannot take the lock */
+        while (__atomic_load_n(&lock->cnts, __ATOMIC_ACQUIRE) & QW_LOCKED) {
+            cpu_relax();
+        }
+        return;
+    }
+
+    __atomic_sub_fetch(&lock->cnts, QR_BIAS, __ATOMIC_RELAXED);
+
+    queued_lock(&lock->wait_lock);
+    __atomic_add_fetch(&lock->cnts, QR_BIAS, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&lock->cnts, __ATOMIC_ACQUIRE) & QW_LOCKED) {
+        cpu_relax();
+    }
+    queued_unlock(&lock->wait_lock);
+}
+
+void read_lock(rwlock_t *lock) {
+    uint32_t cnts = __atomic_add_fetch(&lock->cnts, QR_BIAS, __ATOMIC_ACQUIRE);
+#ifdef CONFIG_LOCK_STAT
+    uint64_t wait = 0;
+
+    if (cnts & QW_WMASK) {
+        uint64_t start = lock_rdtsc();
+        read_lock_slowpath(lock);
+        wait = lock_rdtsc() - start + 1;
+    }
+    lock_stat_acquired(lock->lc, wait);
+#else
+    if (cnts & QW_WMASK) {
+        read_lock_slowpath(lock);
+    }
+#endif
+}
+
+void read_unlock(rwlock_t *lock) {
+    __atomic_sub_fetch(&lock->cnts, QR_BIAS, __ATOMIC_RELEASE);
+}
+
+bool read_trylock(rwlock_t *lock) {
+    uint32_t cnts = __atomic_load_n(&lock->cnts, __ATOMIC_RELAXED);
+
+    while (!(cnts & QW_WMASK)) {
+        if (__atomic_compare_exchange_n(&lock->cnts, &cnts, cnts + QR_BIAS, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+#ifdef CONFIG_LOCK_STAT
+            lock_stat_acquired(lock->lc, 0);
+#endif
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool write_trylock_raw(rwlock_t *lock) {
+    uint32_t zero = 0;
+    return __atomic_compare_exchange_n(&lock->cnts, &zero, QW_LOCKED, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void write_lock_slowpath(rwlock_t *lock) {
+    queued_lock(&lock->wait_lock);
+
+    if (!write_trylock_raw(lock)) {
+        /* Stop new readers, then wait for the current ones to leave */
+        __atomic_or_fetch(&lock->cnts, QW_WAITING, __ATOMIC_RELAXED);
+        for (;;) {
+            uint32_t cnts = QW_WAITING;
+            if (__atomic_load_n(&lock->cnts, __ATOMIC_RELAXED) == QW_WAITING &&
+                __atomic_compare_exchange_n(&lock->cnts, &cnts, QW_LOCKED, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+            cpu_relax();
+        }
+    }
+
+    queued_unlock(&lock->wait_lock);
+}
+
+void write_lock(rwlock_t *lock) {
+#ifdef CONFIG_LOCK_STAT
+    uint64_t wait = 0;
+
+    if (!write_trylock_raw(lock)) {
+        uint64_t start = lock_rdtsc();
+        write_lock_slowpath(lock);
+        wait = lock_rdtsc() - start + 1;
+    }
+    lock_stat_acquired(lock->lc, wait);
+    lock->acquired_at = lock_rdtsc();
+#else
+    if (!write_trylock_raw(lock)) {
+        write_lock_slowpath(lock);
+    }
+#endif
+}
+
+void write_unlock(rwlock_t *lock) {
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_released(lock->lc, lock->acquired_at);
+#endif
+    __atomic_sub_fetch(&lock->cnts, QW_LOCKED, __ATOMIC_RELEASE);
+}
+
+bool write_trylock(rwlock_t *lock) {
+    if (!write_trylock_raw(lock)) {
+        return false;
+    }
+#ifdef CONFIG_LOCK_STAT
+    lock_stat_acquired(lock->lc, 0);
+    lock->acquired_at = lock_rdtsc();
+#endif
+    return true;
+}
+
+/*
+ * /dev/lock_stat
+ */
+
+#ifdef CONFIG_LOCK_STAT
+
+static size_t put_str(char *buf, size_t pos, size_t len, const char *s, size_t width) {
+    size_t n = 0;
+    while (s[n] && pos < len) {
+        buf[pos++] = s[n++];
+    }
+    while (n++ < width && pos < len) {
+        buf[pos++] = ' ';
+    }
+    return pos;
+}
+
+static size_t put_u64(char *buf, size_t pos, size_t len, uint64_t v, size_t width) {
+    char tmp[21];
+    int i = 20;
+
+    tmp[i] = '\0';
+    do {
+        tmp[--i] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    for (size_t n = 20 - i; n < width && pos < len; n++) {
+        buf[pos++] = ' ';
+    }
+    return put_str(buf, pos, len, &tmp[i], 0);
+}
+
+size_t lock_stat_show(char *buf, size_t len) {
+    static const char header[] =
+        "class                     acquisitions    contended     wait-total"
+        "       wait-max     hold-total       hold-max\n";
+    size_t pos = 0;
+
+    if (!buf || len == 0) return 0;
+
+    pos = put_str(buf, pos, len, header, 0);
+    for (struct lock_class *lc = lock_classes; lc; lc = lc->next) {
+        pos = put_str(buf, pos, len, lc->name, 24);
+        pos = put_u64(buf, pos, len, lc->acquisitions, 14);
+        pos = put_u64(buf, pos, len, lc->contended, 13);
+        pos = put_u64(buf, pos, len, lc->wait_cycles, 15);
+        pos = put_u64(buf, pos, len, lc->wait_max, 15);
+        pos = put_u64(buf, pos, len, lc->hold_cycles, 15);
+        pos = put_u64(buf, pos, len, lc->hold_max, 15);
+        pos = put_str(buf, pos, len, "\n", 0);
+    }
+    return pos;
+}
+
+void lock_stat_reset(void) {
+    for (struct lock_class *lc = lock_classes; lc; lc = lc->next) {
+        lc->acquisitions = 0;
+        lc->contended = 0;
+        lc->wait_cycles = 0;
+        lc->wait_max = 0;
+        lc->hold_cycles = 0;
+        lc->hold_max = 0;
+    }
+}
+
+static char lock_stat_buf[8192];
+static spinlock_t lock_stat_buf_lock = SPINLOCK_INIT;
+
+static long lock_stat_dev_read(device_t* dev, u64 offset, void* buf, size_t len) {
+    size_t total, n = 0;
+    (void)dev;
+
+    /* Raw lock, so reading the report does not show up in it */
+    queued_lock(&lock_stat_buf_lock);
+    total = lock_stat_show(lock_stat_buf, sizeof(lock_stat_buf));
+    if (offset < total) {
+        n = total - (size_t)offset;
+        if (n > len) n = len;
+        memcpy(buf, lock_stat_buf + offset, n);
+    }
+    queued_unlock(&lock_stat_buf_lock);
+
+    return (long)n;
+}
+
+static long lock_stat_dev_write(device_t* dev, u64 offset, const void* buf, size_t len) {
+    (void)dev; (void)offset;
+    if (!buf || len == 0) return 0;
+    if (((const char*)buf)[0] != '0') return -1;
+    lock_stat_reset();
+    return (long)len;
+}
+
+static device_ops_t lock_stat_dev_ops = {
+    .read = lock_stat_dev_read,
+    .write = lock_stat_dev_write,
+};
+
+void lock_stat_init(void) {
+    device_t* dev = char_device_create("lock_stat", 10, 241);
+    if (!dev) return;
+    dev->ops = &lock_stat_dev_ops;
+    device_register(dev);
+}
+
+#else
+
+void lock_stat_init(void) {
+}
+
+void lock_stat_reset(void) {
+}
+
+size_t lock_stat_show(char *buf, size_t len) {
+    (void)buf; (void)len;
+    return 0;
+}
+
+#endif /* CONFIG_LOCK_STAT */
@@ -8,6 +8,10 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+/* No <sys/types.h> in the kernel; same definitions as net.h */
+typedef long ssize_t;
+typedef long off_t;
+
 // =====================================================================
 // ATOMIC OPERATIONS FOR STORAGE CONCURRENCY
 // =====================================================================
@@ -1041,4 +1045,21 @@ struct storage_stats* limitless_get_storage_stats() {
         (double)global_storage_stats.used_capacity / global_storage_stats.total_capacity;
     
     return &global_storage_stats;
-}
\ No newline at end of file
+}
+
+/**
+ * Send a file range to a socket without copying - Real Implementation
+ * 
+ * Goes through the socket layer's sendfile(), which hands page cache
+ * pages to TCP as skb fragments. The file position is not moved.
+ */
+ssize_t limitless_sendfile_optimized(int out_fd, int in_fd, off_t offset, size_t count) {
+    extern ssize_t sendfile(int out_fd, int in_fd, uint64_t *offset, size_t count);
+    
+    if (offset < 0) {
+        return -1;
+    }
+    
+    uint64_t pos = (uint64_t)offset;
+    return sendfile(out_fd, in_fd, &pos, count);
+}
@@ -21,6 +21,8 @@ extern void slab_init(void);
 extern void vfs_init(void);
 extern void device_init(void);
 extern void devfs_init(void);
+extern void sched_trace_init(void);
+extern void lock_stat_init(void);
 extern void serial_driver_init(void);
 extern void keyboard_driver_init(void);
 
@@ -53,6 +55,8 @@ static int init_devices(void) {
     kprintf("[INIT] Initializing device subsystem...\n");
     device_init();
     devfs_init();
+    sched_trace_init();
+    lock_stat_init();
     kprintf("[INIT] Device subsystem initialized\n");
     return 1;
 }
@@ -0,0 +1,199 @@
+/*
+ * LimitlessOS - Tick and Dynticks Idle
+ *
+ * See hrtimer.h. Every CPU runs its own tick hrtimer on a common
+ * TICK_NSEC grid. jiffies is global and advanced by whichever CPU's
+ * tick crosses a jiffy boundary first, so a CPU whose tick is stopped
+ * does not hold time back for the others, and one that wakes up after
+ * a long sleep catches jiffies up in a single step.
+ *
+ * Going idle, the only periodic work a CPU still owes is its timer
+ * wheel and its RCU callbacks. If RCU has nothing queued here and the
+ * first wheel timer is more than a jiffy out, the tick hrtimer is moved
+ * to that jiffy, or cancelled if the wheel is empty. Other hrtimers
+ * keep the APIC armed by themselves and need nothing from the tick.
+ */
+
+#include "hrtimer.h"
+#include "timer.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "rcu.h"
+
+extern void scheduler_tick(void);
+
+struct tick_sched {
+    struct hrtimer sched_timer;     /* First, see tick_sched_timer() */
+    bool inidle;
+    bool tick_stopped;
+    uint64_t idle_entry;
+    tick_stats_t stats;
+};
+
+static DEFINE_PER_CPU(struct tick_sched, tick_cpu_sched);
+
+bool tick_nohz_enabled = true;
+
+uint64_t jiffies;
+
+static spinlock_t jiffies_lock = SPINLOCK_INIT;
+static uint64_t last_jiffies_update;    /* Clock time of the boundary jiffies was advanced to */
+
+/* ==================== Jiffies ==================== */
+
+static void tick_do_update_jiffies(uint64_t now) {
+    unsigned long flags;
+    uint64_t delta, ticks;
+
+    spin_lock_irqsave(&jiffies_lock, &flags);
+
+    if (now < last_jiffies_update + TICK_NSEC) {
+        spin_unlock_irqrestore(&jiffies_lock, flags);
+        return;
+    }
+
+    /* Usually one jiffy; only a CPU coming out of a long idle divides */
+    delta = now - last_jiffies_update - TICK_NSEC;
+    ticks = 1;
+    if (delta >= TICK_NSEC) {
+        ticks += delta / TICK_NSEC;
+    }
+    last_jiffies_update += ticks * TICK_NSEC;
+    __atomic_store_n(&jiffies, jiffies + ticks, __ATOMIC_RELAXED);
+
+    spin_unlock_irqrestore(&jiffies_lock, flags);
+}
+
+static uint64_t tick_last_update(uint64_t *basej) {
+    unsigned long flags;
+    uint64_t last;
+
+    spin_lock_irqsave(&jiffies_lock, &flags);
+    last = last_jiffies_update;
+    if (basej) {
+        *basej = jiffies;
+    }
+    spin_unlock_irqrestore(&jiffies_lock, flags);
+
+    return last;
+}
+
+/* ==================== Tick ==================== */
+
+static enum hrtimer_restart tick_sched_timer(struct hrtimer *timer) {
+    struct tick_sched *ts = (struct tick_sched *)timer;
+    uint64_t now = ktime_get_ns();
+
+    ts->stats.ticks++;
+    tick_do_update_jiffies(now);
+    run_local_timers();
+    scheduler_tick();
+
+    /* A stopped tick fired for the wheel; tick_nohz_irq_exit() re-aims it */
+    if (ts->tick_stopped) {
+        return HRTIMER_NORESTART;
+    }
+
+    hrtimer_forward(timer, now, TICK_NSEC);
+    return HRTIMER_RESTART;
+}
+
+static void tick_nohz_restart(struct tick_sched *ts) {
+    ts->tick_stopped = false;
+    hrtimer_start(&ts->sched_timer, tick_last_update(NULL) + TICK_NSEC, HRTIMER_MODE_ABS);
+}
+
+static void tick_nohz_stop_tick(struct tick_sched *ts, uint32_t cpu, uint64_t now) {
+    uint64_t basej, basemono, next, expires;
+
+    if (!tick_nohz_enabled || rcu_needs_cpu(cpu)) {
+        if (ts->tick_stopped) {
+            tick_nohz_restart(ts);
+        }
+        return;
+    }
+
+    tick_do_update_jiffies(now);
+    basemono = tick_last_update(&basej);
+
+    next = timer_next_expiry();
+    if (next != TIMER_NEXT_NONE && (int64_t)(next - basej) <= 1) {
+        if (ts->tick_stopped) {
+            tick_nohz_restart(ts);
+        }
+        return;
+    }
+
+    expires = next == TIMER_NEXT_NONE ? KTIME_MAX : basemono + (next - basej) * TICK_NSEC;
+
+    if (!ts->tick_stopped) {
+        ts->tick_stopped = true;
+        ts->stats.idle_sleeps++;
+    } else if (hrtimer_is_queued(&ts->sched_timer) && ts->sched_timer.expires == expires) {
+        return;
+    }
+
+    if (expires == KTIME_MAX) {
+        hrtimer_cancel(&ts->sched_timer);
+    } else {
+        hrtimer_start(&ts->sched_timer, expires, HRTIMER_MODE_ABS);
+    }
+}
+
+void tick_nohz_idle_enter(void) {
+    struct tick_sched *ts = this_cpu_ptr(&tick_cpu_sched);
+    uint32_t cpu = this_cpu_read(cpu_number);
+    uint64_t now = ktime_get_ns();
+
+    ts->inidle = true;
+    ts->idle_entry = now;
+    ts->stats.idle_calls++;
+
+    tick_nohz_stop_tick(ts, cpu, now);
+    rcu_idle_enter(cpu);
+}
+
+void tick_nohz_idle_exit(void) {
+    struct tick_sched *ts = this_cpu_ptr(&tick_cpu_sched);
+    uint32_t cpu = this_cpu_read(cpu_number);
+    uint64_t now;
+
+    rcu_idle_exit(cpu);
+
+    now = ktime_get_ns();
+    ts->inidle = false;
+    ts->stats.idle_sleeptime_ns += now - ts->idle_entry;
+
+    if (ts->tick_stopped) {
+        tick_do_update_jiffies(now);
+        tick_nohz_restart(ts);
+    }
+}
+
+/* The interrupt may have queued a timer, or RCU work, the stopped tick does not know of */
+void tick_nohz_irq_exit(void) {
+    struct tick_sched *ts = this_cpu_ptr(&tick_cpu_sched);
+
+    if (ts->inidle) {
+        tick_nohz_stop_tick(ts, this_cpu_read(cpu_number), ktime_get_ns());
+    }
+}
+
+void tick_setup_cpu(uint32_t cpu) {
+    struct tick_sched *ts = this_cpu_ptr(&tick_cpu_sched);
+
+    hrtimers_init_cpu(cpu);
+    timers_init_cpu(cpu);
+
+    hrtimer_init(&ts->sched_timer, tick_sched_timer);
+    ts->inidle = false;
+    ts->tick_stopped = false;
+    ts->idle_entry = 0;
+    ts->stats = (tick_stats_t){ 0 };
+
+    tick_nohz_restart(ts);
+}
+
+void tick_get_stats(uint32_t cpu, tick_stats_t *stats) {
+    *stats = per_cpu_ptr(&tick_cpu_sched, cpu)->stats;
+}
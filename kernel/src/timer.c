@@ -0,0 +1,429 @@
+/*
+ * LimitlessOS - Timer Wheel
+ *
+ * See timer.h. The wheel has LVL_DEPTH levels of 64 buckets. Level n
+ * has a granularity of 8^n jiffies and holds timers due between
+ * LVL_START(n) and LVL_START(n + 1) jiffies from now. Timers are never
+ * cascaded down: a timer stays in the bucket it was queued in and
+ * expires when the wheel clock reaches that bucket, rounded up to the
+ * level granularity. At HZ=1000 that is
+ *
+ *   level  granularity    range
+ *     0        1 ms       0 ms  -     63 ms
+ *     1        8 ms      64 ms  -    511 ms
+ *     2       64 ms     512 ms  -   4095 ms
+ *     3      512 ms       4 s   -     32 s
+ *     4      4.1 s       32 s   -    262 s
+ *     5     32.8 s      262 s   -     35 min
+ *     6      262 s       35 min -    4.6 h
+ *
+ * and longer timeouts are clamped to the end of the last level.
+ *
+ * A bitmap with one 64-bit word per level records the non-empty
+ * buckets, so finding the next expiry for the nohz code is a rotate and
+ * a count-trailing-zeros per level. base->clk is the next jiffy the
+ * wheel has to look at; when the tick has been stopped it is moved
+ * straight to next_expiry instead of stepping over empty jiffies.
+ */
+
+#include "timer.h"
+#include "percpu.h"
+#include "spinlock.h"
+
+#define LVL_CLK_SHIFT   3
+#define LVL_CLK_DIV     (1U << LVL_CLK_SHIFT)
+#define LVL_CLK_MASK    (LVL_CLK_DIV - 1)
+#define LVL_SHIFT(n)    ((n) * LVL_CLK_SHIFT)
+#define LVL_GRAN(n)     (1ULL << LVL_SHIFT(n))
+
+#define LVL_BITS        6
+#define LVL_SIZE        (1U << LVL_BITS)
+#define LVL_MASK        (LVL_SIZE - 1)
+#define LVL_OFFS(n)     ((n) * LVL_SIZE)
+#define LVL_DEPTH       7
+
+/* First jiffy delta that no longer fits below level n */
+#define LVL_START(n)    ((uint64_t)(LVL_SIZE - 1) << (((n) - 1) * LVL_CLK_SHIFT))
+
+#define WHEEL_SIZE              (LVL_SIZE * LVL_DEPTH)
+#define WHEEL_TIMEOUT_CUTOFF    LVL_START(LVL_DEPTH)
+#define WHEEL_TIMEOUT_MAX       (WHEEL_TIMEOUT_CUTOFF - LVL_GRAN(LVL_DEPTH - 1))
+
+#define NEXT_TIMER_MAX_DELTA    ((1ULL << 30) - 1)
+
+struct timer_base {
+    spinlock_t lock;
+    struct timer_list *running_timer;
+    uint64_t clk;
+    uint64_t next_expiry;
+    bool next_expiry_recalc;        /* A dequeue may have emptied the earliest bucket */
+    bool timers_pending;
+    uint32_t cpu;
+    uint64_t pending_map[LVL_DEPTH];
+    struct timer_list *vectors[WHEEL_SIZE];
+};
+
+static DEFINE_PER_CPU(struct timer_base, timer_bases);
+
+static inline bool jiffies_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+static inline struct timer_base *timer_base_of(uint32_t cpu) {
+    return per_cpu_ptr(&timer_bases, cpu);
+}
+
+/* ==================== Bucket Arithmetic ==================== */
+
+/*
+ * Bucket for expires on level lvl. Rounding up by one granule keeps a
+ * timer armed just before a tick edge, or truncated on an outer level,
+ * from firing early.
+ */
+static inline uint32_t calc_index(uint64_t expires, uint32_t lvl, uint64_t *bucket_expiry) {
+    expires = (expires >> LVL_SHIFT(lvl)) + 1;
+    *bucket_expiry = expires << LVL_SHIFT(lvl);
+    return LVL_OFFS(lvl) + (uint32_t)(expires & LVL_MASK);
+}
+
+static uint32_t calc_wheel_index(uint64_t expires, uint64_t clk, uint64_t *bucket_expiry) {
+    uint64_t delta = expires - clk;
+
+    if ((int64_t)delta < 0) {
+        /* Already due: the bucket the wheel looks at next */
+        *bucket_expiry = clk;
+        return (uint32_t)(clk & LVL_MASK);
+    }
+
+    uint32_t lvl = 0;
+    while (lvl < LVL_DEPTH - 1 && delta >= LVL_START(lvl + 1)) {
+        lvl++;
+    }
+
+    if (delta >= WHEEL_TIMEOUT_CUTOFF) {
+        expires = clk + WHEEL_TIMEOUT_MAX;
+    }
+    return calc_index(expires, lvl, bucket_expiry);
+}
+
+/* ==================== Queueing ==================== */
+
+/* Called with base->lock held */
+static void enqueue_timer(struct timer_base *base, struct timer_list *timer,
+                          uint32_t idx, uint64_t bucket_expiry) {
+    struct timer_list **head = &base->vectors[idx];
+
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->idx = idx;
+    timer->cpu = base->cpu;
+    base->pending_map[idx / LVL_SIZE] |= 1ULL << (idx % LVL_SIZE);
+
+    if (jiffies_before(bucket_expiry, base->next_expiry)) {
+        base->next_expiry = bucket_expiry;
+        base->timers_pending = true;
+        base->next_expiry_recalc = false;
+    }
+}
+
+/* Called with base->lock held */
+static int detach_if_pending(struct timer_base *base, struct timer_list *timer) {
+    if (!timer_pending(timer)) {
+        return 0;
+    }
+
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (!base->vectors[timer->idx]) {
+        base->pending_map[timer->idx / LVL_SIZE] &= ~(1ULL << (timer->idx % LVL_SIZE));
+        base->next_expiry_recalc = true;
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    return 1;
+}
+
+/*
+ * Lock the base timer is on. timer->cpu only changes under the lock of
+ * the base it points to, so recheck it once the lock is held.
+ */
+static struct timer_base *lock_timer_base(struct timer_list *timer, unsigned long *flags) {
+    for (;;) {
+        struct timer_base *base = timer_base_of(__atomic_load_n(&timer->cpu, __ATOMIC_RELAXED));
+
+        spin_lock_irqsave(&base->lock, flags);
+        if (timer->cpu == base->cpu) {
+            return base;
+        }
+        spin_unlock_irqrestore(&base->lock, *flags);
+    }
+}
+
+/*
+ * Catch an idle base up with jiffies before queueing on it, so that a
+ * new timer is placed relative to now and not to when the CPU went idle.
+ */
+static void forward_timer_base(struct timer_base *base) {
+    uint64_t jnow = get_jiffies_64();
+
+    if (!jiffies_before(base->clk, jnow)) {
+        return;
+    }
+
+    if (jiffies_before(jnow, base->next_expiry)) {
+        base->clk = jnow;
+    } else if (!jiffies_before(base->next_expiry, base->clk)) {
+        base->clk = base->next_expiry;
+    }
+}
+
+void timer_setup(struct timer_list *timer, void (*function)(struct timer_list *timer)) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->function = function;
+    timer->cpu = this_cpu_read(cpu_number);
+    timer->idx = 0;
+}
+
+int mod_timer(struct timer_list *timer, uint64_t expires) {
+    struct timer_base *base, *new_base;
+    unsigned long flags;
+    uint64_t bucket_expiry = 0;
+    int ret;
+
+    /* Re-arming to the same jiffy is common for timeouts pushed out per packet */
+    if (timer_pending(timer) && timer->expires == expires) {
+        return 1;
+    }
+
+    base = lock_timer_base(timer, &flags);
+    ret = detach_if_pending(base, timer);
+
+    new_base = this_cpu_ptr(&timer_bases);
+
+    /*
+     * Move to the local wheel, unless the callback is running on the old
+     * one: del_timer_sync() waits on that base and must keep seeing it.
+     */
+    if (base != new_base && base->running_timer != timer) {
+        timer->cpu = new_base->cpu;
+        spin_unlock(&base->lock);
+        base = new_base;
+        spin_lock(&base->lock);
+        /* A racing mod_timer() may have queued it here in the meantime */
+        detach_if_pending(base, timer);
+    }
+
+    forward_timer_base(base);
+    timer->expires = expires;
+    enqueue_timer(base, timer, calc_wheel_index(expires, base->clk, &bucket_expiry),
+                  bucket_expiry);
+
+    spin_unlock_irqrestore(&base->lock, flags);
+    return ret;
+}
+
+void add_timer(struct timer_list *timer) {
+    mod_timer(timer, timer->expires);
+}
+
+int del_timer(struct timer_list *timer) {
+    struct timer_base *base;
+    unsigned long flags;
+    int ret;
+
+    if (!timer_pending(timer)) {
+        return 0;
+    }
+
+    base = lock_timer_base(timer, &flags);
+    ret = detach_if_pending(base, timer);
+    spin_unlock_irqrestore(&base->lock, flags);
+    return ret;
+}
+
+int del_timer_sync(struct timer_list *timer) {
+    for (;;) {
+        struct timer_base *base;
+        unsigned long flags;
+        int ret;
+
+        base = lock_timer_base(timer, &flags);
+        ret = detach_if_pending(base, timer);
+        if (base->running_timer != timer) {
+            spin_unlock_irqrestore(&base->lock, flags);
+            return ret;
+        }
+        spin_unlock_irqrestore(&base->lock, flags);
+        __asm__ __volatile__("pause" ::: "memory");
+    }
+}
+
+/* ==================== Expiry ==================== */
+
+/* Offset of the first set bucket at or after clk on level lvl, or -1 */
+static inline int next_pending_bucket(struct timer_base *base, uint32_t lvl, uint32_t clk) {
+    uint64_t map = base->pending_map[lvl];
+
+    if (!map) {
+        return -1;
+    }
+    clk &= LVL_MASK;
+    map = (map >> clk) | (clk ? map << (LVL_SIZE - clk) : 0);
+    return __builtin_ctzll(map);
+}
+
+/*
+ * Earliest bucket expiry. Walking up, each level's clock is the one the
+ * level below carries into: if the lower level is not at a boundary
+ * its next bucket here is one further on. Once a hit on some level
+ * comes before that level would carry, no higher level can beat it.
+ */
+static uint64_t next_timer_interrupt(struct timer_base *base) {
+    uint64_t clk = base->clk;
+    uint64_t next = base->clk + NEXT_TIMER_MAX_DELTA;
+
+    for (uint32_t lvl = 0; lvl < LVL_DEPTH; lvl++) {
+        int pos = next_pending_bucket(base, lvl, (uint32_t)clk);
+        uint64_t lvl_clk = clk & LVL_CLK_MASK;
+
+        if (pos >= 0) {
+            uint64_t tmp = (clk + (uint64_t)pos) << LVL_SHIFT(lvl);
+
+            if (jiffies_before(tmp, next)) {
+                next = tmp;
+            }
+            if ((uint64_t)pos <= ((LVL_CLK_DIV - lvl_clk) & LVL_CLK_MASK)) {
+                break;
+            }
+        }
+
+        clk = (clk >> LVL_CLK_SHIFT) + (lvl_clk ? 1 : 0);
+    }
+
+    base->next_expiry_recalc = false;
+    base->timers_pending = next != base->clk + NEXT_TIMER_MAX_DELTA;
+    return next;
+}
+
+/*
+ * Move the buckets due at base->clk onto heads[]. Level n is only due
+ * when the low n * LVL_CLK_SHIFT bits of clk are zero.
+ */
+static uint32_t collect_expired_timers(struct timer_base *base, struct timer_list **heads) {
+    uint64_t clk = base->clk;
+    uint32_t levels = 0;
+
+    for (uint32_t lvl = 0; lvl < LVL_DEPTH; lvl++) {
+        uint32_t idx = (uint32_t)(clk & LVL_MASK);
+        uint64_t bit = 1ULL << idx;
+
+        if (base->pending_map[lvl] & bit) {
+            struct timer_list **vec = &base->vectors[LVL_OFFS(lvl) + idx];
+
+            base->pending_map[lvl] &= ~bit;
+            heads[levels] = *vec;
+            heads[levels]->pprev = &heads[levels];
+            *vec = NULL;
+            levels++;
+        }
+
+        if (clk & LVL_CLK_MASK) {
+            break;
+        }
+        clk >>= LVL_CLK_SHIFT;
+    }
+
+    return levels;
+}
+
+/* Called with base->lock held; drops it around each callback */
+static void expire_timers(struct timer_base *base, struct timer_list **head) {
+    while (*head) {
+        struct timer_list *timer = *head;
+        void (*fn)(struct timer_list *) = timer->function;
+
+        base->running_timer = timer;
+        detach_if_pending(base, timer);
+
+        spin_unlock(&base->lock);
+        fn(timer);
+        spin_lock(&base->lock);
+
+        base->running_timer = NULL;
+    }
+}
+
+/* Tick context, interrupts off */
+void run_local_timers(void) {
+    struct timer_base *base = this_cpu_ptr(&timer_bases);
+    struct timer_list *heads[LVL_DEPTH];
+    uint64_t jnow = get_jiffies_64();
+
+    if (jiffies_before(jnow, base->next_expiry) && !base->next_expiry_recalc) {
+        return;
+    }
+
+    spin_lock(&base->lock);
+
+    if (base->next_expiry_recalc) {
+        base->next_expiry = next_timer_interrupt(base);
+    }
+
+    while (!jiffies_before(jnow, base->clk) && !jiffies_before(jnow, base->next_expiry)) {
+        uint32_t levels;
+
+        /* Skip the empty jiffies a stopped tick left behind */
+        base->clk = base->next_expiry;
+        levels = collect_expired_timers(base, heads);
+        base->clk++;
+        base->next_expiry = next_timer_interrupt(base);
+
+        while (levels--) {
+            expire_timers(base, &heads[levels]);
+        }
+    }
+
+    spin_unlock(&base->lock);
+}
+
+uint64_t timer_next_expiry(void) {
+    struct timer_base *base = this_cpu_ptr(&timer_bases);
+    unsigned long flags;
+    uint64_t next;
+
+    spin_lock_irqsave(&base->lock, &flags);
+    if (base->next_expiry_recalc) {
+        base->next_expiry = next_timer_interrupt(base);
+    }
+    next = base->timers_pending ? base->next_expiry : TIMER_NEXT_NONE;
+    spin_unlock_irqrestore(&base->lock, flags);
+
+    return next;
+}
+
+void timers_init_cpu(uint32_t cpu) {
+    struct timer_base *base = timer_base_of(cpu);
+
+    spin_lock_init(&base->lock);
+    base->running_timer = NULL;
+    base->cpu = cpu;
+    base->clk = jiffies;
+    base->next_expiry = base->clk + NEXT_TIMER_MAX_DELTA;
+    base->next_expiry_recalc = false;
+    base->timers_pending = false;
+    for (uint32_t lvl = 0; lvl < LVL_DEPTH; lvl++) {
+        base->pending_map[lvl] = 0;
+    }
+    for (uint32_t idx = 0; idx < WHEEL_SIZE; idx++) {
+        base->vectors[idx] = NULL;
+    }
+}
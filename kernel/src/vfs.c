@@ -12,6 +12,7 @@
 
 #include "kernel.h"
 #include "vfs.h"
+#include "page_cache.h"
 #include <string.h>
 
 // Forward declare kmalloc/kfree from slab allocator
@@ -129,6 +130,14 @@ int vfs_open(const char* path, int flags, file_t** out) {
     return 0;
 }
 
+// Free a kmalloc'd vnode. The page cache keys mappings by vnode address,
+// so its pages must go before the address can be reused.
+void vfs_vnode_free(vnode_t* vn) {
+    if (!vn) return;
+    page_cache_evict_mapping(vn);
+    kfree(vn);
+}
+
 // Close a file
 int vfs_close(file_t* f) {
     if (!f) return -1;
@@ -144,7 +153,9 @@ int vfs_read(file_t* f, void* buf, u64 len, u64* out_rd) {
     
     if (!f->vn->ops || !f->vn->ops->read) return -1;
     
-    long result = f->vn->ops->read(f->vn, f->offset, buf, len);
+    // Block-backed files go through the page cache
+    long result = f->vn->ops->bmap ? page_cache_read(f->vn, f->offset, buf, len)
+                                   : f->vn->ops->read(f->vn, f->offset, buf, len);
     if (result < 0) return (int)result;
     
     *out_rd = (u64)result;
@@ -157,7 +168,9 @@ int vfs_write(file_t* f, const void* buf, u64 len, u64* out_wr) {
     
     if (!f->vn->ops || !f->vn->ops->write) return -1;
     
-    long result = f->vn->ops->write(f->vn, f->offset, buf, len);
+    // Cached writes are written back later by the device's flusher
+    long result = f->vn->ops->bmap ? page_cache_write(f->vn, f->offset, buf, len)
+                                   : f->vn->ops->write(f->vn, f->offset, buf, len);
     if (result < 0) return (int)result;
     
     *out_wr = (u64)result;
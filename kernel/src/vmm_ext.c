@@ -6,8 +6,11 @@
 #include "kernel.h"
 #include "vmm.h"
 #include <mm/mm.h>
+#include <mm/huge_memory.h>
 #include <string.h>
 
+#define PT_ENTRIES 512
+
 // Global current address space pointer (simple implementation)
 static vmm_aspace_t *current_aspace = NULL;
 
@@ -56,25 +59,347 @@ vmm_aspace_t *vmm_create_aspace(void) {
         return NULL;
     }
     
-    as->arch_pml = (void *)(uintptr_t)pml;
+    // Private user half; the kernel half shares the kernel's tables
+    u64 *pml4 = (u64 *)(uintptr_t)pml;
+    u64 *kernel_pml4 = vmm_get_kernel_pml4();
+    memset(pml4, 0, VMM_KERNEL_PML4_FIRST * sizeof(u64));
+    if (kernel_pml4) {
+        memcpy(&pml4[VMM_KERNEL_PML4_FIRST], &kernel_pml4[VMM_KERNEL_PML4_FIRST],
+               (PT_ENTRIES - VMM_KERNEL_PML4_FIRST) * sizeof(u64));
+    } else {
+        memset(&pml4[VMM_KERNEL_PML4_FIRST], 0, (PT_ENTRIES - VMM_KERNEL_PML4_FIRST) * sizeof(u64));
+    }
+    as->arch_pml = pml4;
     as->regions = NULL;
     as->pages = NULL;
     
     return as;
 }
 
-// Unmap a page (stub for now)
+// Unmap a 4 KiB page; a huge mapping covering it is split first
 status_t vmm_unmap_page(vmm_aspace_t *aspace, vaddr_t vaddr) {
-    // Simplified - would actually walk page tables and unmap
-    return 0;
+    if (!aspace) return K_ERR;
+    
+    u64 *pde = vmm_get_pde(aspace, vaddr);
+    if (pde && (*pde & PTE_PRESENT) && (*pde & PTE_HUGE)) {
+        if (thp_split_huge_pmd(aspace, vaddr) != 0) return K_ERR;
+    }
+    
+    u64 *pte = vmm_get_pte(aspace, vaddr);
+    if (!pte || !(*pte & PTE_PRESENT)) return K_ERR;
+    
+    *pte = 0;
+    vmm_flush_tlb_page(vaddr);
+    return K_OK;
 }
 
 // Get physical address from virtual
 int vmm_get_physical(vmm_aspace_t *as, vaddr_t va, paddr_t *out_pa) {
     if (!as || !out_pa) return -1;
     
-    // Simplified - would walk page tables in real implementation
-    *out_pa = (paddr_t)va; // Identity mapping for now
+    u64 *pde = vmm_get_pde(as, va);
+    if (pde && (*pde & PTE_PRESENT) && (*pde & PTE_HUGE)) {
+        *out_pa = (*pde & PTE_ADDR_MASK & HPAGE_MASK) + (va & (HPAGE_SIZE - 1));
+        return 0;
+    }
+    
+    u64 *pte = vmm_get_pte(as, va);
+    if (!pte || !(*pte & PTE_PRESENT)) return -1;
+    
+    *out_pa = (*pte & PTE_ADDR_MASK) + (va & (PAGE_SIZE - 1));
+    return 0;
+}
+
+// --- Regions ---
+
+// Every region owns its file mapping: the copy describing length bytes
+// starting skip bytes into fm
+static vmm_file_mapping_t *file_map_slice(const vmm_file_mapping_t *fm, u64 skip, u64 length) {
+    vmm_file_mapping_t *copy = (vmm_file_mapping_t *)kmalloc(sizeof(vmm_file_mapping_t));
+    if (!copy) return NULL;
+    
+    *copy = *fm;
+    copy->file_off = fm->file_off + skip;
+    copy->length = length;
+    return copy;
+}
+
+static void region_free(vmm_region_t *r) {
+    if (r->file_map) kfree(r->file_map);
+    kfree(r);
+}
+
+// Split a region in two at addr; returns the upper half
+static vmm_region_t *region_split(vmm_region_t *r, virt_addr_t addr) {
+    if (addr <= r->start || addr >= r->start + r->length) return r;
+    
+    vmm_region_t *upper = (vmm_region_t *)kmalloc(sizeof(vmm_region_t));
+    if (!upper) return NULL;
+    
+    *upper = *r;
+    upper->start = addr;
+    upper->length = r->start + r->length - addr;
+    
+    // The upper half maps the file from further in
+    if (r->file_map) {
+        upper->file_map = file_map_slice(r->file_map, addr - r->start, upper->length);
+        if (!upper->file_map) {
+            kfree(upper);
+            return NULL;
+        }
+        r->file_map->length = addr - r->start;
+    }
+    
+    r->length = addr - r->start;
+    r->next = upper;
+    return upper;
+}
+
+// Make region boundaries fall on start and start + length
+static int region_isolate(vmm_aspace_t *as, virt_addr_t start, size_t length) {
+    for (vmm_region_t *r = as->regions; r; r = r->next) {
+        if (!region_split(r, start) || !region_split(r, start + length)) return -1;
+    }
+    return 0;
+}
+
+// Add a region; fails if it overlaps an existing one
+int vmm_region_add(vmm_aspace_t *as, virt_addr_t start, size_t length, u32 flags) {
+    if (!as || length == 0) return -1;
+    
+    vmm_region_t **link = &as->regions;
+    while (*link && (*link)->start < start) {
+        if ((*link)->start + (*link)->length > start) return -1;
+        link = &(*link)->next;
+    }
+    if (*link && start + length > (*link)->start) return -1;
+    
+    vmm_region_t *r = (vmm_region_t *)kmalloc(sizeof(vmm_region_t));
+    if (!r) return -1;
+    
+    r->start = start;
+    r->length = length;
+    r->flags = flags;
+    r->file_map = NULL;
+    r->next = *link;
+    *link = r;
+    return 0;
+}
+
+// Find the region containing addr
+vmm_region_t *vmm_region_find(vmm_aspace_t *as, virt_addr_t addr) {
+    if (!as) return NULL;
+    
+    for (vmm_region_t *r = as->regions; r && r->start <= addr; r = r->next) {
+        if (addr < r->start + r->length) return r;
+    }
+    return NULL;
+}
+
+// Find the first region overlapping [start, start + length)
+vmm_region_t *vmm_region_find_range(vmm_aspace_t *as, virt_addr_t start, size_t length) {
+    if (!as) return NULL;
+    
+    for (vmm_region_t *r = as->regions; r && r->start < start + length; r = r->next) {
+        if (start < r->start + r->length) return r;
+    }
+    return NULL;
+}
+
+// Drop [start, start + length) from the region list (page tables untouched)
+int vmm_region_remove(vmm_aspace_t *as, virt_addr_t start, size_t length) {
+    if (!as || region_isolate(as, start, length) != 0) return -1;
+    
+    vmm_region_t **link = &as->regions;
+    while (*link) {
+        vmm_region_t *r = *link;
+        if (r->start >= start && r->start + r->length <= start + length) {
+            *link = r->next;
+            region_free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+    return 0;
+}
+
+// Replace the flags of every region inside [start, start + length)
+int vmm_region_set_flags(vmm_aspace_t *as, virt_addr_t start, size_t length, u32 flags) {
+    if (!as || region_isolate(as, start, length) != 0) return -1;
+    
+    for (vmm_region_t *r = as->regions; r && r->start < start + length; r = r->next) {
+        if (r->start >= start) r->flags = flags;
+    }
+    return 0;
+}
+
+// --- Fork (copy-on-write) ---
+
+static u64 *alloc_table(void) {
+    paddr_t page = pmm_alloc_page();
+    if (!page) return NULL;
+    memset((void *)(uintptr_t)page, 0, PAGE_SIZE);
+    return (u64 *)(uintptr_t)page;
+}
+
+// Share one page table's user frames; writable ones turn read-only + COW
+static void cow_share_pt(u64 *src, u64 *dst) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        u64 e = src[i];
+        if (!(e & PTE_PRESENT)) continue;
+        
+        if (e & PTE_USER) {
+            if (e & PTE_WRITABLE) {
+                e = (e & ~(u64)PTE_WRITABLE) | PTE_COW;
+                src[i] = e;
+            }
+            pmm_page_ref(e & PTE_ADDR_MASK);
+        }
+        dst[i] = e;
+    }
+}
+
+static int cow_clone_pd(u64 *src, u64 *dst) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        if (!(src[i] & PTE_PRESENT)) continue;
+        
+        // A user huge page is shared whole, with one reference on its
+        // block; a write fault copies it (thp_handle_cow_fault)
+        if (src[i] & PTE_HUGE) {
+            u64 e = src[i];
+            if (e & PTE_USER) {
+                if (e & PTE_WRITABLE) {
+                    e = (e & ~(u64)PTE_WRITABLE) | PTE_COW;
+                    src[i] = e;
+                }
+                pmm_page_ref(e & PTE_ADDR_MASK & HPAGE_MASK);
+            }
+            dst[i] = e;
+            continue;
+        }
+        
+        u64 *pt = alloc_table();
+        if (!pt) return -1;
+        dst[i] = (paddr_t)(uintptr_t)pt | (src[i] & ~PTE_ADDR_MASK);
+        cow_share_pt(VMM_TABLE(src[i]), pt);
+    }
     return 0;
 }
 
+static int cow_clone_pdpt(u64 *src, u64 *dst) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        if (!(src[i] & PTE_PRESENT)) continue;
+        
+        // 1 GiB leaves only exist in kernel mappings
+        if (src[i] & PTE_HUGE) {
+            dst[i] = src[i];
+            continue;
+        }
+        
+        u64 *pd = alloc_table();
+        if (!pd) return -1;
+        dst[i] = (paddr_t)(uintptr_t)pd | (src[i] & ~PTE_ADDR_MASK);
+        if (cow_clone_pd(VMM_TABLE(src[i]), pd) != 0) return -1;
+    }
+    return 0;
+}
+
+// Copy src's page tables and regions into an empty dst. Page tables are
+// copied, frames are not; on failure the caller destroys dst.
+int vmm_clone_address_space_cow(vmm_aspace_t *dst, vmm_aspace_t *src) {
+    if (!dst || !src || !dst->arch_pml || !src->arch_pml) return -1;
+    
+    u64 *src_pml4 = (u64 *)src->arch_pml;
+    u64 *dst_pml4 = (u64 *)dst->arch_pml;
+    int ret = 0;
+    
+    // The kernel half is shared, not copied
+    for (int i = VMM_KERNEL_PML4_FIRST; i < PT_ENTRIES; i++) {
+        dst_pml4[i] = src_pml4[i];
+    }
+    
+    for (int i = 0; i < VMM_KERNEL_PML4_FIRST && ret == 0; i++) {
+        if (!(src_pml4[i] & PTE_PRESENT)) continue;
+        
+        u64 *pdpt = alloc_table();
+        if (!pdpt) {
+            ret = -1;
+            break;
+        }
+        dst_pml4[i] = (paddr_t)(uintptr_t)pdpt | (src_pml4[i] & ~PTE_ADDR_MASK);
+        ret = cow_clone_pdpt(VMM_TABLE(src_pml4[i]), pdpt);
+    }
+    
+    // The parent lost write access to its private pages
+    if (src == current_aspace) {
+        hal_arch_switch_aspace(src->arch_pml);
+    }
+    if (ret != 0) return ret;
+    
+    for (vmm_region_t *r = src->regions; r; r = r->next) {
+        if (vmm_region_add(dst, r->start, r->length, r->flags) != 0) return -1;
+        if (r->file_map) {
+            vmm_file_mapping_t *fm = file_map_slice(r->file_map, 0, r->file_map->length);
+            if (!fm) return -1;
+            vmm_region_find(dst, r->start)->file_map = fm;
+        }
+    }
+    return 0;
+}
+
+// Drop this address space's reference on every user frame of a page table
+static void release_pt(u64 *pt) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        if ((pt[i] & PTE_PRESENT) && (pt[i] & PTE_USER)) {
+            pmm_free_page(pt[i] & PTE_ADDR_MASK);
+        }
+    }
+    pmm_free_page((paddr_t)(uintptr_t)pt);
+}
+
+static void release_pd(u64 *pd) {
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        u64 e = pd[i];
+        if (!(e & PTE_PRESENT)) continue;
+        
+        if (e & PTE_HUGE) {
+            if (e & PTE_USER) pmm_free_pages(e & PTE_ADDR_MASK & HPAGE_MASK, HPAGE_ORDER);
+            continue;
+        }
+        release_pt(VMM_TABLE(e));
+    }
+    pmm_free_page((paddr_t)(uintptr_t)pd);
+}
+
+// Destroy an address space that is not in use on any CPU
+void vmm_destroy_aspace(vmm_aspace_t *as) {
+    if (!as) return;
+    
+    khugepaged_remove(as);
+    
+    u64 *pml4 = (u64 *)as->arch_pml;
+    if (pml4) {
+        // The kernel half belongs to the kernel's address space
+        for (int i4 = 0; i4 < VMM_KERNEL_PML4_FIRST; i4++) {
+            if (!(pml4[i4] & PTE_PRESENT)) continue;
+            
+            u64 *pdpt = VMM_TABLE(pml4[i4]);
+            for (int i3 = 0; i3 < PT_ENTRIES; i3++) {
+                if ((pdpt[i3] & PTE_PRESENT) && !(pdpt[i3] & PTE_HUGE)) {
+                    release_pd(VMM_TABLE(pdpt[i3]));
+                }
+            }
+            pmm_free_page((paddr_t)(uintptr_t)pdpt);
+        }
+        pmm_free_page((paddr_t)(uintptr_t)pml4);
+    }
+    
+    while (as->regions) {
+        vmm_region_t *r = as->regions;
+        as->regions = r->next;
+        region_free(r);
+    }
+    
+    if (current_aspace == as) current_aspace = NULL;
+    simple_kfree(as, sizeof(vmm_aspace_t));
+}
@@ -0,0 +1,497 @@
+/*
+ * LimitlessOS - Page Cache Writeback
+ *
+ * Per-device flusher tasks, age-based expiry and dirty throttling; see
+ * writeback.h.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "kernel.h"
+#include "vfs.h"
+#include "vmm.h"
+#include "page_cache.h"
+#include "writeback.h"
+#include "mm/mm.h"
+#include "mm/pmm_simple.h"
+#include "spinlock.h"
+#include "scheduler.h"
+#include "hal/hal_kernel.h"
+
+#define WB_GATHER           32      // Dirty pages looked up at a time
+#define WB_NODEV            WB_MAX_DEVICES  // Queue of vnodes without bmap
+#define WB_MAX_PAUSES       8       // Yields before a throttled writer flushes itself
+#define WB_SECTOR_SIZE      512     // bmap LBAs and request sizes are in sectors
+#define WB_RUN_ORDER        6       // Buddy order of the bounce buffer
+
+_Static_assert((1u << WB_RUN_ORDER) == WB_MAX_RUN, "bounce buffer order must match WB_MAX_RUN");
+
+// Vnode waiting on a device's dirty list
+typedef struct wb_inode {
+    vnode_t *vn;
+    uint64_t dirtied_when;              // Ticks when it went from clean to dirty
+    struct wb_inode *next;
+} wb_inode_t;
+
+typedef struct {
+    bool in_use;
+    u64 dev;                            // HAL storage device
+    spinlock_t lock;                    // Dirty list
+    wb_inode_t *head;                   // Oldest first
+    wb_inode_t *tail;
+    bool io_busy;                       // Bounce buffer owned by a writer
+    uint8_t *bounce;                    // WB_MAX_RUN contiguous pages
+    vnode_t *writing;                   // Vnode the flusher is writing (lock)
+    bool has_flusher;
+    task_t *flusher;
+    bool wake_pending;
+} bdi_writeback_t;
+
+static struct {
+    bool initialized;
+    unsigned int dirty_ratio;
+    unsigned int background_ratio;
+    unsigned int expire_ms;
+    unsigned int interval_ms;
+    spinlock_t register_lock;
+    uint32_t nr_devices;
+    // Slot WB_NODEV serves vnodes without bmap
+    bdi_writeback_t devices[WB_MAX_DEVICES + 1];
+    writeback_stats_t stats;
+} wb;
+
+static void wb_thread_main(void);
+
+static void wb_init(void) {
+    if (wb.initialized) return;
+    wb.dirty_ratio = 20;
+    wb.background_ratio = 10;
+    wb.expire_ms = 30000;
+    wb.interval_ms = 5000;
+    spin_lock_init(&wb.register_lock);
+    for (int i = 0; i <= WB_MAX_DEVICES; i++) {
+        spin_lock_init(&wb.devices[i].lock);
+    }
+    wb.initialized = true;
+}
+
+static inline uint64_t ms_to_ticks(unsigned int ms) {
+    // Timers run at 1 kHz or faster; a 32-bit divide keeps libgcc out
+    uint32_t per_ms = (uint32_t)hal_timer_get_frequency() / 1000;
+    return (uint64_t)ms * (per_ms ? per_ms : 1);
+}
+
+// Give a slot that was just put in use its flusher. Called without the
+// register lock: creating a task allocates.
+static void bdi_start(void) {
+    if (!create_task(wb_thread_main)) {
+        kprintf("[WB] Failed to start flusher\n");
+    }
+}
+
+// Writeback state of a storage device, set up on first use
+static bdi_writeback_t *bdi_get(bool has_dev, u64 dev) {
+    unsigned long flags;
+    wb_init();
+
+    if (!has_dev) {
+        bdi_writeback_t *bdi = &wb.devices[WB_NODEV];
+        if (!__atomic_load_n(&bdi->in_use, __ATOMIC_ACQUIRE)) {
+            spin_lock_irqsave(&wb.register_lock, &flags);
+            bool start = !bdi->in_use;
+            __atomic_store_n(&bdi->in_use, true, __ATOMIC_RELEASE);
+            spin_unlock_irqrestore(&wb.register_lock, flags);
+            if (start) bdi_start();
+        }
+        return bdi;
+    }
+
+    uint32_t nr = __atomic_load_n(&wb.nr_devices, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < nr; i++) {
+        if (wb.devices[i].dev == dev) return &wb.devices[i];
+    }
+
+    bdi_writeback_t *bdi = NULL;
+    bool start = false;
+    spin_lock_irqsave(&wb.register_lock, &flags);
+
+    for (uint32_t i = 0; i < wb.nr_devices; i++) {
+        if (wb.devices[i].dev == dev) bdi = &wb.devices[i];
+    }
+    if (!bdi && wb.nr_devices < WB_MAX_DEVICES) {
+        // The bounce buffer is filled in below; until then the device's
+        // pages go through the per-page fallback
+        bdi = &wb.devices[wb.nr_devices];
+        bdi->dev = dev;
+        __atomic_store_n(&bdi->in_use, true, __ATOMIC_RELEASE);
+        __atomic_store_n(&wb.nr_devices, wb.nr_devices + 1, __ATOMIC_RELEASE);
+        start = true;
+    }
+
+    spin_unlock_irqrestore(&wb.register_lock, flags);
+
+    if (start) {
+        paddr_t bounce = pmm_alloc_pages(WB_RUN_ORDER);
+        if (bounce) {
+            __atomic_store_n(&bdi->bounce, (uint8_t *)(uintptr_t)PHYS_TO_VIRT_DIRECT(bounce),
+                             __ATOMIC_RELEASE);
+        }
+        bdi_start();
+    }
+    return bdi ? bdi : &wb.devices[WB_NODEV];
+}
+
+static bdi_writeback_t *bdi_for_vnode(vnode_t *vn, u64 index) {
+    u64 dev, lba;
+    if (vn->ops && vn->ops->bmap && vn->ops->bmap(vn, index, &dev, &lba) == 0) {
+        return bdi_get(true, dev);
+    }
+    return bdi_get(false, 0);
+}
+
+static void bdi_queue(bdi_writeback_t *bdi, vnode_t *vn, uint64_t dirtied_when) {
+    unsigned long flags;
+    spin_lock_irqsave(&bdi->lock, &flags);
+
+    wb_inode_t *wi;
+    for (wi = bdi->head; wi; wi = wi->next) {
+        if (wi->vn == vn) break;
+    }
+    if (!wi) {
+        wi = (wb_inode_t *)kmalloc(sizeof(wb_inode_t));
+        if (wi) {
+            wi->vn = vn;
+            wi->dirtied_when = dirtied_when;
+            wi->next = NULL;
+            if (bdi->tail) bdi->tail->next = wi;
+            else bdi->head = wi;
+            bdi->tail = wi;
+        }
+    }
+
+    spin_unlock_irqrestore(&bdi->lock, flags);
+}
+
+void writeback_inode_dirtied(vnode_t *vn, u64 index) {
+    if (!vn) return;
+    bdi_queue(bdi_for_vnode(vn, index), vn, hal_timer_get_ticks());
+}
+
+void writeback_wakeup_all(void) {
+    wb_init();
+    for (int i = 0; i <= WB_MAX_DEVICES; i++) {
+        bdi_writeback_t *bdi = &wb.devices[i];
+        __atomic_store_n(&bdi->wake_pending, true, __ATOMIC_RELEASE);
+        task_wake(__atomic_load_n(&bdi->flusher, __ATOMIC_ACQUIRE));
+    }
+}
+
+void writeback_forget_vnode(vnode_t *vn) {
+    if (!vn || !wb.initialized) return;
+
+    for (int i = 0; i <= WB_MAX_DEVICES; i++) {
+        bdi_writeback_t *bdi = &wb.devices[i];
+        if (!__atomic_load_n(&bdi->in_use, __ATOMIC_ACQUIRE)) continue;
+
+        unsigned long flags;
+        spin_lock_irqsave(&bdi->lock, &flags);
+        // The flusher requeues a vnode before it lets go of it, so wait
+        // for it to finish before unlinking
+        while (bdi->writing == vn) {
+            spin_unlock_irqrestore(&bdi->lock, flags);
+            __asm__ __volatile__("pause");
+            spin_lock_irqsave(&bdi->lock, &flags);
+        }
+
+        wb_inode_t **link = &bdi->head;
+        bdi->tail = NULL;
+        while (*link) {
+            wb_inode_t *wi = *link;
+            if (wi->vn == vn) {
+                *link = wi->next;
+                kfree(wi);
+            } else {
+                bdi->tail = wi;
+                link = &wi->next;
+            }
+        }
+        spin_unlock_irqrestore(&bdi->lock, flags);
+    }
+}
+
+// --- Writing pages ---
+
+// Per-page fallback through the filesystem
+static int wb_write_page_op(vnode_t *vn, page_cache_page_t *pg) {
+    if (!vn->ops || !vn->ops->write) return K_EIO;
+
+    u64 off = pg->index * PAGE_SIZE;
+    if (off >= vn->size) return 0;
+    size_t len = (vn->size - off < PAGE_SIZE) ? (size_t)(vn->size - off) : PAGE_SIZE;
+
+    long wr = vn->ops->write(vn, off, (void *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pg->pa), len);
+    return wr == (long)len ? 0 : K_EIO;
+}
+
+static void wb_finish(page_cache_page_t *pg, int err) {
+    page_cache_end_writeback(pg);
+    if (err) page_cache_mark_dirty(pg);
+    page_cache_release(pg);
+}
+
+// The storage write is synchronous, so the bounce buffer is claimed with
+// a flag rather than held under a spinlock; other writers yield meanwhile
+static void wb_bounce_get(bdi_writeback_t *bdi) {
+    while (__atomic_exchange_n(&bdi->io_busy, true, __ATOMIC_ACQUIRE)) {
+        schedule();
+    }
+}
+
+static void wb_bounce_put(bdi_writeback_t *bdi) {
+    __atomic_store_n(&bdi->io_busy, false, __ATOMIC_RELEASE);
+}
+
+// Write pages[0..n) as one request; the caller checked that they are
+// contiguous in the file and on disk
+static int wb_submit_run(bdi_writeback_t *bdi, page_cache_page_t **pages, size_t n, u64 lba) {
+    wb_bounce_get(bdi);
+    for (size_t i = 0; i < n; i++) {
+        page_cache_start_writeback(pages[i]);
+        memcpy(bdi->bounce + i * PAGE_SIZE, (void *)(uintptr_t)PHYS_TO_VIRT_DIRECT(pages[i]->pa), PAGE_SIZE);
+    }
+    int st = hal_storage_write_sectors((int)bdi->dev, lba, (uint32_t)(n * (PAGE_SIZE / WB_SECTOR_SIZE)),
+                                       bdi->bounce);
+    wb_bounce_put(bdi);
+
+    int err = (st == STATUS_OK) ? 0 : K_EIO;
+    for (size_t i = 0; i < n; i++) wb_finish(pages[i], err);
+
+    __atomic_add_fetch(&wb.stats.requests, 1, __ATOMIC_RELAXED);
+    if (err) __atomic_add_fetch(&wb.stats.errors, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&wb.stats.pages_written, n, __ATOMIC_RELAXED);
+    return err;
+}
+
+// Write back up to max_pages dirty pages of vn; returns pages handled
+static size_t wb_write_vnode(vnode_t *vn, size_t max_pages, int *errp) {
+    page_cache_page_t *batch[WB_GATHER];
+    u64 next = 0;
+    size_t done = 0;
+
+    while (done < max_pages) {
+        size_t want = max_pages - done < WB_GATHER ? max_pages - done : WB_GATHER;
+        size_t n = page_cache_find_tagged(vn, next, PAGE_CACHE_TAG_DIRTY, batch, want);
+        if (n == 0) break;
+        next = batch[n - 1]->index + 1;
+
+        size_t i = 0;
+        while (i < n) {
+            u64 dev, lba;
+            bdi_writeback_t *bdi = NULL;
+            if (vn->ops && vn->ops->bmap && vn->ops->bmap(vn, batch[i]->index, &dev, &lba) == 0) {
+                bdi = bdi_get(true, dev);
+            }
+
+            if (!bdi || !__atomic_load_n(&bdi->bounce, __ATOMIC_ACQUIRE) || bdi == &wb.devices[WB_NODEV]) {
+                page_cache_start_writeback(batch[i]);
+                int err = wb_write_page_op(vn, batch[i]);
+                wb_finish(batch[i], err);
+                if (err) {
+                    *errp = err;
+                    __atomic_add_fetch(&wb.stats.errors, 1, __ATOMIC_RELAXED);
+                } else {
+                    __atomic_add_fetch(&wb.stats.fallback_pages, 1, __ATOMIC_RELAXED);
+                }
+                i++;
+                done++;
+                continue;
+            }
+
+            // Extend the run while the next page follows on disk as well
+            size_t j = i + 1;
+            while (j < n && j - i < WB_MAX_RUN && batch[j]->index == batch[j - 1]->index + 1) {
+                u64 ndev, nlba;
+                if (vn->ops->bmap(vn, batch[j]->index, &ndev, &nlba) != 0 || ndev != dev ||
+                    nlba != lba + (j - i) * (PAGE_SIZE / WB_SECTOR_SIZE)) {
+                    break;
+                }
+                j++;
+            }
+
+            int err = wb_submit_run(bdi, &batch[i], j - i, lba);
+            if (err) *errp = err;
+            done += j - i;
+            i = j;
+        }
+    }
+    return done;
+}
+
+static bool vnode_has_dirty(vnode_t *vn) {
+    page_cache_page_t *pg;
+    if (page_cache_find_tagged(vn, 0, PAGE_CACHE_TAG_DIRTY, &pg, 1) == 0) return false;
+    page_cache_release(pg);
+    return true;
+}
+
+// --- Dirty limits ---
+
+static void wb_thresholds(uint64_t *background, uint64_t *limit) {
+    const struct page_cache_stats *st = page_cache_get_stats();
+    uint64_t free = 0;
+    pmm_get_stats(NULL, &free);
+
+    // Memory that could hold dirty pages: free plus what the cache has
+    uint64_t dirtyable = free + st->nr_pages;
+    if (background) *background = dirtyable * wb.background_ratio / 100;
+    if (limit) *limit = dirtyable * wb.dirty_ratio / 100;
+}
+
+static uint64_t nr_dirty_pages(void) {
+    const struct page_cache_stats *st = page_cache_get_stats();
+    return st->nr_dirty + st->nr_writeback;
+}
+
+// --- Flusher ---
+
+// One pass over a device's dirty list. Expired vnodes are always written;
+// everything goes, oldest first, while over the background threshold.
+static void wb_do_writeback(bdi_writeback_t *bdi, bool sync) {
+    uint64_t now = hal_timer_get_ticks();
+    uint64_t expire = ms_to_ticks(wb.expire_ms);
+    uint64_t background;
+    wb_thresholds(&background, NULL);
+
+    bool over = nr_dirty_pages() > background;
+    if (over) __atomic_add_fetch(&wb.stats.background_runs, 1, __ATOMIC_RELAXED);
+
+    // Only the vnodes queued now; ones dirtied or requeued during the
+    // pass wait for the next one
+    unsigned long flags;
+    size_t nr = 0;
+    spin_lock_irqsave(&bdi->lock, &flags);
+    for (wb_inode_t *wi = bdi->head; wi; wi = wi->next) nr++;
+    spin_unlock_irqrestore(&bdi->lock, flags);
+
+    while (nr--) {
+        spin_lock_irqsave(&bdi->lock, &flags);
+        wb_inode_t *wi = bdi->head;
+        bool expired = wi && now - wi->dirtied_when >= expire;
+        if (!wi || (!sync && !expired && !over)) {
+            spin_unlock_irqrestore(&bdi->lock, flags);
+            break;
+        }
+        bdi->head = wi->next;
+        if (!bdi->head) bdi->tail = NULL;
+        bdi->writing = wi->vn;
+        spin_unlock_irqrestore(&bdi->lock, flags);
+
+        if (expired) __atomic_add_fetch(&wb.stats.expired, 1, __ATOMIC_RELAXED);
+
+        int err = 0;
+        wb_write_vnode(wi->vn, (size_t)-1, &err);
+
+        // Redirtied while we wrote it, or the write failed: queue it again
+        if (vnode_has_dirty(wi->vn)) {
+            bdi_queue(bdi, wi->vn, err ? wi->dirtied_when : hal_timer_get_ticks());
+        }
+        spin_lock_irqsave(&bdi->lock, &flags);
+        bdi->writing = NULL;
+        spin_unlock_irqrestore(&bdi->lock, flags);
+        kfree(wi);
+
+        if (!sync && over) over = nr_dirty_pages() > background;
+    }
+}
+
+static void wb_thread_main(void) {
+    // Every flusher is started for a slot that has none yet
+    bdi_writeback_t *bdi = &wb.devices[WB_NODEV];
+    for (int i = 0; i <= WB_MAX_DEVICES; i++) {
+        bdi_writeback_t *d = &wb.devices[i];
+        if (__atomic_load_n(&d->in_use, __ATOMIC_ACQUIRE) &&
+            !__atomic_exchange_n(&d->has_flusher, true, __ATOMIC_ACQ_REL)) {
+            bdi = d;
+            break;
+        }
+    }
+
+    __atomic_store_n(&bdi->flusher, get_running_task(), __ATOMIC_RELEASE);
+
+    for (;;) {
+        wb_do_writeback(bdi, false);
+
+        // Sleep out the interval; writeback_wakeup_all() cuts it short
+        if (!__atomic_exchange_n(&bdi->wake_pending, false, __ATOMIC_ACQ_REL)) {
+            task_sleep(ms_to_ticks(wb.interval_ms));
+            __atomic_store_n(&bdi->wake_pending, false, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// --- Throttling ---
+
+void balance_dirty_pages(vnode_t *vn) {
+    wb_init();
+
+    uint64_t background, limit;
+    wb_thresholds(&background, &limit);
+
+    uint64_t dirty = nr_dirty_pages();
+    if (dirty <= background) return;
+    writeback_wakeup_all();
+    if (dirty <= limit) return;
+
+    // Over the limit: let the flushers catch up, and write our own pages
+    // if they do not
+    __atomic_add_fetch(&wb.stats.throttled, 1, __ATOMIC_RELAXED);
+    for (int pause = 0; pause < WB_MAX_PAUSES; pause++) {
+        schedule();
+        if (nr_dirty_pages() <= limit) return;
+    }
+
+    __atomic_add_fetch(&wb.stats.direct_flushes, 1, __ATOMIC_RELAXED);
+    if (vn) {
+        int err = 0;
+        wb_write_vnode(vn, WB_MAX_RUN, &err);
+    }
+}
+
+// --- Sync ---
+
+int writeback_sync_vnode(vnode_t *vn) {
+    if (!vn) return K_EINVAL;
+    wb_init();
+
+    int err = 0;
+    wb_write_vnode(vn, (size_t)-1, &err);
+    return err;
+}
+
+int writeback_sync_all(void) {
+    wb_init();
+
+    for (int i = 0; i <= WB_MAX_DEVICES; i++) {
+        if (wb.devices[i].in_use) wb_do_writeback(&wb.devices[i], true);
+    }
+    // Pages of vnodes that are not on any list (e.g. failed earlier).
+    // Sector writes complete synchronously, so there is no device cache
+    // left to flush afterwards.
+    return page_cache_sync_all();
+}
+
+void writeback_set_params(unsigned int dirty_ratio, unsigned int background_ratio,
+                          unsigned int expire_ms, unsigned int interval_ms) {
+    wb_init();
+    if (dirty_ratio > 100) dirty_ratio = 100;
+    if (background_ratio > dirty_ratio) background_ratio = dirty_ratio;
+    wb.dirty_ratio = dirty_ratio;
+    wb.background_ratio = background_ratio;
+    wb.expire_ms = expire_ms;
+    wb.interval_ms = interval_ms ? interval_ms : 1;
+}
+
+void writeback_get_stats(writeback_stats_t *stats) {
+    if (stats) *stats = wb.stats;
+}